@@ -239,6 +239,37 @@ if %errorLevel% neq 0 (
     exit /b 1
 )
 
+echo Compiling compression module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_compress.obj" "%SRC_DIR%\core\temp_compress.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile compression module.
+    pause
+    exit /b 1
+)
+echo Compiling encryption module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_crypto.obj" "%SRC_DIR%\core\temp_crypto.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile encryption module.
+    pause
+    exit /b 1
+)
+
+echo Compiling histogram module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_histogram.obj" "%SRC_DIR%\core\temp_histogram.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile histogram module.
+    pause
+    exit /b 1
+)
+
+echo Compiling trace module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_trace.obj" "%SRC_DIR%\core\temp_trace.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile trace module.
+    pause
+    exit /b 1
+)
+
 echo Compiling driver module...
 "%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_driver.obj" "%SRC_DIR%\driver\temp_driver.c"
 if %errorLevel% neq 0 (
@@ -247,9 +278,57 @@ if %errorLevel% neq 0 (
     exit /b 1
 )
 
+echo Compiling memory pressure module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_pressure.obj" "%SRC_DIR%\driver\temp_pressure.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile memory pressure module.
+    pause
+    exit /b 1
+)
+
+echo Compiling shared statistics module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_shared.obj" "%SRC_DIR%\driver\temp_shared.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile shared statistics module.
+    pause
+    exit /b 1
+)
+
+echo Compiling history module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_history.obj" "%SRC_DIR%\driver\temp_history.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile history module.
+    pause
+    exit /b 1
+)
+
+echo Compiling image module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_image.obj" "%SRC_DIR%\driver\temp_image.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile image module.
+    pause
+    exit /b 1
+)
+
+echo Compiling QoS module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_qos.obj" "%SRC_DIR%\driver\temp_qos.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile QoS module.
+    pause
+    exit /b 1
+)
+
+echo Compiling retire module...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /Gz /D "_WIN64" /D "_AMD64_" /D "AMD64" /D "_KERNEL_MODE" /D "POOL_NX_OPTIN=1" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\km" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\km\crt" /Fo"%BUILD_DIR%\temp_retire.obj" "%SRC_DIR%\driver\temp_retire.c"
+if %errorLevel% neq 0 (
+    echo ERROR: Failed to compile retire module.
+    pause
+    exit /b 1
+)
+
 REM Link driver
 echo Linking driver...
-"%CL_PATH%\link.exe" /nologo /DRIVER /NODEFAULTLIB /SUBSYSTEM:NATIVE /MACHINE:%ARCH% /ENTRY:DriverEntry /OUT:"%BIN_DIR%\temp.sys" /LIBPATH:"%LIB_PATH%" "%BUILD_DIR%\temp_memory.obj" "%BUILD_DIR%\temp_driver.obj" ntoskrnl.lib hal.lib BufferOverflowK.lib
+"%CL_PATH%\link.exe" /nologo /DRIVER /NODEFAULTLIB /SUBSYSTEM:NATIVE /MACHINE:%ARCH% /ENTRY:DriverEntry /OUT:"%BIN_DIR%\temp.sys" /LIBPATH:"%LIB_PATH%" "%BUILD_DIR%\temp_memory.obj" "%BUILD_DIR%\temp_compress.obj" "%BUILD_DIR%\temp_crypto.obj" "%BUILD_DIR%\temp_histogram.obj" "%BUILD_DIR%\temp_trace.obj" "%BUILD_DIR%\temp_driver.obj" "%BUILD_DIR%\temp_pressure.obj" "%BUILD_DIR%\temp_shared.obj" "%BUILD_DIR%\temp_history.obj" "%BUILD_DIR%\temp_image.obj" "%BUILD_DIR%\temp_qos.obj" "%BUILD_DIR%\temp_retire.obj" ntoskrnl.lib hal.lib ksecdd.lib BufferOverflowK.lib
 if %errorLevel% neq 0 (
     echo ERROR: Failed to link driver.
     pause
@@ -266,12 +345,12 @@ echo.
 
 REM Compile CLI tool (USER MODE ONLY - no kernel headers)
 echo Compiling command line interface...
-"%CL_PATH%\cl.exe" /nologo /W3 /O2 /D "WIN32" /D "_WIN64" /D "_CONSOLE" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\um" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\ucrt" /I "%VS_PATH%\include" /Fe"%BIN_DIR%\temp.exe" "%SRC_DIR%\cli\temp_cli.c" /link /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\um\%ARCH%" /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\ucrt\%ARCH%" kernel32.lib user32.lib
+"%CL_PATH%\cl.exe" /nologo /W3 /O2 /D "WIN32" /D "_WIN64" /D "_CONSOLE" /I "%SRC_DIR%\core" /I "%WDK_PATH%\Include\%SDK_VERSION%\um" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\ucrt" /I "%VS_PATH%\include" /Fe"%BIN_DIR%\temp.exe" "%SRC_DIR%\cli\temp_cli.c" /link /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\um\%ARCH%" /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\ucrt\%ARCH%" kernel32.lib user32.lib advapi32.lib ws2_32.lib
 if %errorLevel% neq 0 (
     echo WARNING: Driver-based CLI failed. Trying simplified version...
     
     REM Try to compile a simplified version without driver dependencies
-    "%CL_PATH%\cl.exe" /nologo /W3 /O2 /D "WIN32" /D "_WIN64" /D "_CONSOLE" /D "SIMPLIFIED_BUILD" /I "%WDK_PATH%\Include\%SDK_VERSION%\um" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\ucrt" /I "%VS_PATH%\include" /Fe"%BIN_DIR%\temp.exe" "%SRC_DIR%\cli\temp_cli.c" /link /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\um\%ARCH%" /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\ucrt\%ARCH%" kernel32.lib user32.lib
+    "%CL_PATH%\cl.exe" /nologo /W3 /O2 /D "WIN32" /D "_WIN64" /D "_CONSOLE" /D "SIMPLIFIED_BUILD" /I "%WDK_PATH%\Include\%SDK_VERSION%\um" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\ucrt" /I "%VS_PATH%\include" /Fe"%BIN_DIR%\temp.exe" "%SRC_DIR%\cli\temp_cli.c" /link /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\um\%ARCH%" /LIBPATH:"%WDK_PATH%\Lib\%SDK_VERSION%\ucrt\%ARCH%" kernel32.lib user32.lib advapi32.lib ws2_32.lib
     if !errorLevel! neq 0 (
         echo ERROR: Failed to compile command line tool.
         pause
@@ -285,6 +364,31 @@ if %errorLevel% neq 0 (
 
 echo.
 
+echo ================================================================
+echo Building Block Store Library
+echo ================================================================
+echo.
+
+REM The memory manager built for user mode against temp_portable.h (no driver needed)
+set "STORE_BUILT=0"
+if not exist "%BUILD_DIR%\lib" mkdir "%BUILD_DIR%\lib"
+echo Compiling block store library...
+"%CL_PATH%\cl.exe" /c /nologo /W3 /O2 /D "WIN32" /D "_WIN64" /D "TEMP_PORTABLE" /D "TEMP_STORE_BUILD" /I "%SRC_DIR%\core" /I "%SRC_DIR%\lib" /I "%WDK_PATH%\Include\%SDK_VERSION%\um" /I "%WDK_PATH%\Include\%SDK_VERSION%\shared" /I "%WDK_PATH%\Include\%SDK_VERSION%\ucrt" /I "%VS_PATH%\include" /Fo"%BUILD_DIR%\lib\\" "%SRC_DIR%\core\temp_memory.c" "%SRC_DIR%\core\temp_compress.c" "%SRC_DIR%\core\temp_crypto.c" "%SRC_DIR%\lib\temp_store.c"
+if %errorLevel% neq 0 (
+    echo WARNING: Failed to compile block store library. Continuing without it.
+) else (
+    "%CL_PATH%\lib.exe" /nologo /OUT:"%BIN_DIR%\tempstore.lib" "%BUILD_DIR%\lib\temp_memory.obj" "%BUILD_DIR%\lib\temp_compress.obj" "%BUILD_DIR%\lib\temp_crypto.obj" "%BUILD_DIR%\lib\temp_store.obj"
+    if !errorLevel! neq 0 (
+        echo WARNING: Failed to create block store library.
+    ) else (
+        copy "%SRC_DIR%\lib\temp_store.h" "%BIN_DIR%\" >nul
+        set "STORE_BUILT=1"
+        echo Block store library built successfully: %BIN_DIR%\tempstore.lib
+    )
+)
+
+echo.
+
 echo ================================================================
 echo Building GUI Application
 echo ================================================================
@@ -387,6 +491,7 @@ echo.
 REM Clean up build directory
 echo Cleaning up temporary files...
 del /q "%BUILD_DIR%\*.obj" 2>nul
+del /q "%BUILD_DIR%\lib\*.obj" 2>nul
 
 echo ================================================================
 echo Build Complete!
@@ -395,6 +500,7 @@ echo.
 echo Built files:
 echo   Driver: %BIN_DIR%\temp.sys
 echo   CLI Tool: %BIN_DIR%\temp.exe
+if "%STORE_BUILT%"=="1" echo   Library: %BIN_DIR%\tempstore.lib, %BIN_DIR%\temp_store.h
 echo   Installation: %BIN_DIR%\temp.inf
 echo.
 echo Next steps:
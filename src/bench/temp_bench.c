@@ -0,0 +1,469 @@
+// User-mode benchmark for the TEMP memory manager.
+// Builds temp_memory.c against temp_portable.h and drives TempReadSectors /
+// TempWriteSectors directly from several threads with fio-like workloads:
+// sequential or random access, any read/write mix, 512B to 4MB blocks and a
+// per-thread queue depth, optionally with the disk encrypted. Results come out as
+// text or JSON.
+
+#include "../core/temp_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_BLOCK_SIZE 512
+#define BENCH_MAX_BLOCK_SIZE (4 * 1024 * 1024)
+#define BENCH_MAX_THREADS 256
+#define BENCH_MAX_QUEUE_DEPTH 256
+
+typedef enum
+{
+    PATTERN_SEQUENTIAL,
+    PATTERN_RANDOM
+} BENCH_PATTERN;
+
+typedef struct
+{
+    ULONG64 DiskSize;
+    ULONG ChunkSize;
+    ULONG SectorSize;
+    ULONG BlockSize;
+    ULONG Threads;
+    ULONG QueueDepth;
+    double Seconds;
+    BENCH_PATTERN Pattern;
+    ULONG ReadPercent; // 100 reads only, 0 writes only
+    BOOLEAN Encrypt;   // AES-XTS under a random key, as TEMP_ENCRYPTION_AES_XTS
+    BOOLEAN Json;
+} BENCH_OPTIONS;
+
+typedef struct
+{
+    const BENCH_OPTIONS *Options;
+    PTEMP_MEMORY_MANAGER MemoryManager;
+    PTEMP_IO_HISTOGRAMS Histograms;
+    ULONG Index;
+    NTSTATUS Status;
+} BENCH_THREAD;
+
+static ULONG64 BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONG64)ts.tv_sec * 1000000000ULL + (ULONG64)ts.tv_nsec;
+}
+
+// xorshift64* keeps the generator out of the measured path's cache lines
+static ULONG64 BenchRandom(ULONG64 *State)
+{
+    ULONG64 x = *State;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static ULONG64 BenchParseSize(const char *Text)
+{
+    char *end;
+    ULONG64 value = strtoull(Text, &end, 10);
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value <<= 10;
+        break;
+    case 'm':
+    case 'M':
+        value <<= 20;
+        break;
+    case 'g':
+    case 'G':
+        value <<= 30;
+        break;
+    }
+
+    return value;
+}
+
+static const char *BenchRwName(const BENCH_OPTIONS *Options)
+{
+    return Options->ReadPercent == 100 ? "read" : Options->ReadPercent == 0 ? "write" : "mix";
+}
+
+// The memory manager completes every request before returning, so a queue depth
+// is modelled the way a single-lane device sees it: each thread submits QueueDepth
+// requests at once and services them in order, and a request's latency runs from
+// the submission of its batch to its own completion, queueing included.
+static void *BenchWorker(void *Context)
+{
+    BENCH_THREAD *thread = (BENCH_THREAD *)Context;
+    const BENCH_OPTIONS *options = thread->Options;
+    ULONG sectorsPerBlock = options->BlockSize / options->SectorSize;
+    ULONG64 blocks = options->DiskSize / options->BlockSize;
+    ULONG64 blocksPerThread = blocks / options->Threads;
+    ULONG64 firstBlock = blocksPerThread * thread->Index;
+    ULONG64 cursor = 0;
+    ULONG64 seed = 0x9e3779b97f4a7c15ULL * (thread->Index + 1);
+    PUCHAR buffer = (PUCHAR)malloc(options->BlockSize);
+
+    if (!buffer || blocksPerThread == 0)
+    {
+        free(buffer);
+        thread->Status = STATUS_INSUFFICIENT_RESOURCES;
+        return NULL;
+    }
+
+    memset(buffer, 0xA5, options->BlockSize);
+
+    ULONG64 deadline = BenchNow() + (ULONG64)(options->Seconds * 1e9);
+    ULONG64 submitted;
+
+    while ((submitted = BenchNow()) < deadline)
+    {
+        for (ULONG i = 0; i < options->QueueDepth; i++)
+        {
+            ULONG64 block;
+
+            if (options->Pattern == PATTERN_SEQUENTIAL)
+            {
+                // Each thread streams through its own slice of the disk
+                block = firstBlock + cursor;
+                cursor = (cursor + 1) % blocksPerThread;
+            }
+            else
+            {
+                block = BenchRandom(&seed) % blocks;
+            }
+
+            BOOLEAN write = options->ReadPercent == 0 ||
+                            (options->ReadPercent < 100 && BenchRandom(&seed) % 100 >= options->ReadPercent);
+
+            ULONG64 sector = block * sectorsPerBlock;
+            NTSTATUS status = write
+                                  ? TempWriteSectors(thread->MemoryManager, sector, sectorsPerBlock, buffer, options->SectorSize)
+                                  : TempReadSectors(thread->MemoryManager, sector, sectorsPerBlock, buffer, options->SectorSize);
+
+            if (!NT_SUCCESS(status))
+            {
+                thread->Status = status;
+                free(buffer);
+                return NULL;
+            }
+
+            TempRecordOperation(thread->Histograms, thread->Index,
+                                write ? TEMP_OPERATION_WRITE : TEMP_OPERATION_READ,
+                                BenchNow() - submitted, options->BlockSize);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static NTSTATUS BenchPrefill(PTEMP_MEMORY_MANAGER MemoryManager, const BENCH_OPTIONS *Options)
+{
+    ULONG fillSize = 1024 * 1024;
+    PUCHAR buffer = (PUCHAR)malloc(fillSize);
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!buffer)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(buffer, 0x5A, fillSize);
+
+    for (ULONG64 offset = 0; offset < Options->DiskSize && NT_SUCCESS(status); offset += fillSize)
+    {
+        ULONG length = (ULONG)((Options->DiskSize - offset < fillSize) ? Options->DiskSize - offset : fillSize);
+        status = TempWriteSectors(MemoryManager, offset / Options->SectorSize, length / Options->SectorSize,
+                                  buffer, Options->SectorSize);
+    }
+
+    free(buffer);
+    return status;
+}
+
+static void BenchPrintText(const char *Name, const TEMP_OPERATION_LATENCY *Operation, double Elapsed)
+{
+    if (Operation->Count == 0)
+    {
+        return;
+    }
+
+    printf("  %-5s %10.0f IOPS %9.1f MB/s  lat us: mean %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+           Name, Operation->Count / Elapsed, Operation->TotalBytes / Elapsed / (1024.0 * 1024.0),
+           Operation->TotalLatency / 1e3 / Operation->Count,
+           Operation->LatencyPercentiles[0] / 1e3, Operation->LatencyPercentiles[1] / 1e3,
+           Operation->LatencyPercentiles[2] / 1e3, Operation->LatencyPercentiles[3] / 1e3,
+           Operation->MaxLatency / 1e3);
+}
+
+static void BenchPrintJsonOperation(const char *Name, const TEMP_OPERATION_LATENCY *Operation, double Elapsed)
+{
+    printf("  \"%s\": {\n", Name);
+    printf("    \"ops\": %llu,\n", (unsigned long long)Operation->Count);
+    printf("    \"bytes\": %llu,\n", (unsigned long long)Operation->TotalBytes);
+    printf("    \"iops\": %.1f,\n", Operation->Count / Elapsed);
+    printf("    \"bw_bytes_per_s\": %.0f,\n", Operation->TotalBytes / Elapsed);
+    printf("    \"lat_ns\": {\n");
+    printf("      \"mean\": %.1f,\n", Operation->Count ? (double)Operation->TotalLatency / Operation->Count : 0.0);
+    printf("      \"max\": %llu,\n", (unsigned long long)Operation->MaxLatency);
+    printf("      \"percentiles\": {\"50\": %llu, \"90\": %llu, \"99\": %llu, \"99.9\": %llu}\n",
+           (unsigned long long)Operation->LatencyPercentiles[0], (unsigned long long)Operation->LatencyPercentiles[1],
+           (unsigned long long)Operation->LatencyPercentiles[2], (unsigned long long)Operation->LatencyPercentiles[3]);
+    printf("    }\n");
+    printf("  },\n");
+}
+
+static void BenchPrintJson(const BENCH_OPTIONS *Options, const TEMP_LATENCY_STATISTICS *Latency, double Elapsed, NTSTATUS Status)
+{
+    const TEMP_OPERATION_LATENCY *reads = &Latency->Operations[TEMP_OPERATION_READ];
+    const TEMP_OPERATION_LATENCY *writes = &Latency->Operations[TEMP_OPERATION_WRITE];
+
+    printf("{\n");
+    printf("  \"job\": {\n");
+    printf("    \"size\": %llu,\n", (unsigned long long)Options->DiskSize);
+    printf("    \"chunk_size\": %u,\n", Options->ChunkSize);
+    printf("    \"sector_size\": %u,\n", Options->SectorSize);
+    printf("    \"bs\": %u,\n", Options->BlockSize);
+    printf("    \"threads\": %u,\n", Options->Threads);
+    printf("    \"iodepth\": %u,\n", Options->QueueDepth);
+    printf("    \"pattern\": \"%s\",\n", Options->Pattern == PATTERN_SEQUENTIAL ? "seq" : "rand");
+    printf("    \"rw\": \"%s\",\n", BenchRwName(Options));
+    printf("    \"rwmixread\": %u,\n", Options->ReadPercent);
+    printf("    \"encrypt\": %s,\n", Options->Encrypt ? "true" : "false");
+    printf("    \"seconds\": %.3f\n", Options->Seconds);
+    printf("  },\n");
+    printf("  \"elapsed_s\": %.6f,\n", Elapsed);
+    BenchPrintJsonOperation("read", reads, Elapsed);
+    BenchPrintJsonOperation("write", writes, Elapsed);
+    printf("  \"total\": {\"ops\": %llu, \"iops\": %.1f, \"bw_bytes_per_s\": %.0f},\n",
+           (unsigned long long)(reads->Count + writes->Count), (reads->Count + writes->Count) / Elapsed,
+           (reads->TotalBytes + writes->TotalBytes) / Elapsed);
+    printf("  \"status\": \"%s\"\n", NT_SUCCESS(Status) ? "ok" : "failed");
+    printf("}\n");
+}
+
+static void BenchUsage(const char *Program)
+{
+    printf("Usage: %s [options]\n", Program);
+    printf("  --size <size>          Disk size (default: 1G)\n");
+    printf("  --chunk-size <size>    Chunk size (default: 64K)\n");
+    printf("  --sector-size <n>      Sector size (default: 512)\n");
+    printf("  --bs <size>            Block size per request, 512 to 4M (default: 4K)\n");
+    printf("  --threads <n>          Worker threads, 1 to %d (default: 1)\n", BENCH_MAX_THREADS);
+    printf("  --iodepth <n>          Requests each thread submits at once, 1 to %d (default: 1)\n", BENCH_MAX_QUEUE_DEPTH);
+    printf("  --seconds <n>          Run time (default: 5)\n");
+    printf("  --pattern seq|rand     Access pattern (default: rand)\n");
+    printf("  --rw read|write|mix    Operation (default: read)\n");
+    printf("  --rwmixread <percent>  Share of reads in a mix (default: 50)\n");
+    printf("  --encrypt              Keep the disk encrypted with AES-256-XTS\n");
+    printf("  --output-format text|json\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BENCH_OPTIONS options = {0};
+    options.DiskSize = 1ULL << 30;
+    options.ChunkSize = TEMP_DEFAULT_CHUNK_SIZE;
+    options.SectorSize = TEMP_DEFAULT_SECTOR_SIZE;
+    options.BlockSize = 4096;
+    options.Threads = 1;
+    options.QueueDepth = 1;
+    options.Seconds = 5.0;
+    options.Pattern = PATTERN_RANDOM;
+    options.ReadPercent = 100;
+
+    ULONG mixReadPercent = 50;
+    BOOLEAN mix = FALSE;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            options.DiskSize = BenchParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc)
+        {
+            options.ChunkSize = (ULONG)BenchParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sector-size") == 0 && i + 1 < argc)
+        {
+            options.SectorSize = (ULONG)BenchParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bs") == 0 && i + 1 < argc)
+        {
+            options.BlockSize = (ULONG)BenchParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options.Threads = (ULONG)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--iodepth") == 0 && i + 1 < argc)
+        {
+            options.QueueDepth = (ULONG)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+        {
+            options.Seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc)
+        {
+            options.Pattern = strcmp(argv[++i], "seq") == 0 ? PATTERN_SEQUENTIAL : PATTERN_RANDOM;
+        }
+        else if (strcmp(argv[i], "--rw") == 0 && i + 1 < argc)
+        {
+            i++;
+            mix = strcmp(argv[i], "mix") == 0;
+            options.ReadPercent = strcmp(argv[i], "write") == 0 ? 0 : 100;
+        }
+        else if (strcmp(argv[i], "--rwmixread") == 0 && i + 1 < argc)
+        {
+            mixReadPercent = (ULONG)atoi(argv[++i]);
+            mix = TRUE;
+        }
+        else if (strcmp(argv[i], "--encrypt") == 0)
+        {
+            options.Encrypt = TRUE;
+        }
+        else if (strcmp(argv[i], "--output-format") == 0 && i + 1 < argc)
+        {
+            options.Json = strcmp(argv[++i], "json") == 0;
+        }
+        else
+        {
+            BenchUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (mix)
+    {
+        options.ReadPercent = mixReadPercent;
+    }
+
+    if (options.Threads == 0 || options.Threads > BENCH_MAX_THREADS ||
+        options.QueueDepth == 0 || options.QueueDepth > BENCH_MAX_QUEUE_DEPTH ||
+        options.ReadPercent > 100 ||
+        options.BlockSize < BENCH_MIN_BLOCK_SIZE || options.BlockSize > BENCH_MAX_BLOCK_SIZE ||
+        options.BlockSize < options.SectorSize || options.BlockSize % options.SectorSize != 0 ||
+        options.DiskSize < (ULONG64)options.BlockSize * options.Threads)
+    {
+        printf("Invalid combination of size, block size, thread count, queue depth and mix\n");
+        return 1;
+    }
+
+    PTEMP_MEMORY_MANAGER memoryManager = (PTEMP_MEMORY_MANAGER)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED, sizeof(TEMP_MEMORY_MANAGER), 0);
+
+    if (!memoryManager ||
+        !NT_SUCCESS(TempInitializeMemoryManager(memoryManager, options.DiskSize, options.ChunkSize)))
+    {
+        printf("Failed to initialize memory manager\n");
+        return 1;
+    }
+
+    if (options.Encrypt)
+    {
+        UCHAR key[TEMP_XTS_KEY_SIZE];
+        ULONG64 state = BenchNow() | 1;
+
+        for (ULONG i = 0; i < sizeof(key); i++)
+        {
+            key[i] = (UCHAR)BenchRandom(&state);
+        }
+
+        if (!NT_SUCCESS(TempSetEncryption(memoryManager, key)))
+        {
+            printf("Failed to set up encryption\n");
+            return 1;
+        }
+    }
+
+    // Reads of never written chunks only zero the buffer; measure real copies
+    if (options.ReadPercent > 0 && !NT_SUCCESS(BenchPrefill(memoryManager, &options)))
+    {
+        printf("Failed to prefill disk\n");
+        return 1;
+    }
+
+    TEMP_IO_HISTOGRAMS histograms;
+    if (!NT_SUCCESS(TempInitializeIoHistograms(&histograms, options.Threads)))
+    {
+        printf("Failed to allocate histograms\n");
+        return 1;
+    }
+
+    BENCH_THREAD *threads = (BENCH_THREAD *)calloc(options.Threads, sizeof(BENCH_THREAD));
+    pthread_t *handles = (pthread_t *)calloc(options.Threads, sizeof(pthread_t));
+    TEMP_LATENCY_STATISTICS *latency = (TEMP_LATENCY_STATISTICS *)malloc(sizeof(TEMP_LATENCY_STATISTICS));
+
+    if (!threads || !handles || !latency)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    ULONG64 start = BenchNow();
+
+    for (ULONG i = 0; i < options.Threads; i++)
+    {
+        threads[i].Options = &options;
+        threads[i].MemoryManager = memoryManager;
+        threads[i].Histograms = &histograms;
+        threads[i].Index = i;
+        pthread_create(&handles[i], NULL, BenchWorker, &threads[i]);
+    }
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (ULONG i = 0; i < options.Threads; i++)
+    {
+        pthread_join(handles[i], NULL);
+        if (!NT_SUCCESS(threads[i].Status))
+        {
+            status = threads[i].Status;
+        }
+    }
+
+    double elapsed = (BenchNow() - start) / 1e9;
+
+    TempQueryIoHistograms(&histograms, latency);
+
+    if (options.Json)
+    {
+        BenchPrintJson(&options, latency, elapsed, status);
+    }
+    else
+    {
+        const TEMP_OPERATION_LATENCY *reads = &latency->Operations[TEMP_OPERATION_READ];
+        const TEMP_OPERATION_LATENCY *writes = &latency->Operations[TEMP_OPERATION_WRITE];
+
+        printf("pattern=%s rw=%s", options.Pattern == PATTERN_SEQUENTIAL ? "seq" : "rand", BenchRwName(&options));
+        if (options.ReadPercent != 0 && options.ReadPercent != 100)
+        {
+            printf(" rwmixread=%u", options.ReadPercent);
+        }
+        printf(" bs=%u threads=%u iodepth=%u chunk=%u%s: %.0f IOPS, %.1f MB/s\n",
+               options.BlockSize, options.Threads, options.QueueDepth, options.ChunkSize,
+               options.Encrypt ? " encrypted" : "",
+               (reads->Count + writes->Count) / elapsed,
+               (reads->TotalBytes + writes->TotalBytes) / elapsed / (1024.0 * 1024.0));
+        BenchPrintText("read", reads, elapsed);
+        BenchPrintText("write", writes, elapsed);
+    }
+
+    TempCleanupIoHistograms(&histograms);
+    TempCleanupMemoryManager(memoryManager);
+    ExFreePool(memoryManager);
+    free(latency);
+    free(threads);
+    free(handles);
+
+    return NT_SUCCESS(status) ? 0 : 1;
+}
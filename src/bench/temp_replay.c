@@ -0,0 +1,438 @@
+// Replays a trace recorded with "temp trace" against the TEMP memory manager in
+// user mode. Requests are spread over threads by the processor that served them
+// and issued either on the original schedule or back to back.
+
+#include "../core/temp_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct
+{
+    const char *TraceFile;
+    ULONG64 DiskSize;  // 0 takes the size from the trace
+    ULONG ChunkSize;   // 0 takes the chunk size from the trace
+    ULONG Threads;     // 0 uses one per traced processor
+    BOOLEAN MaxSpeed;
+} REPLAY_OPTIONS;
+
+typedef struct
+{
+    PTEMP_MEMORY_MANAGER MemoryManager;
+    PTEMP_IO_HISTOGRAMS Replayed;
+    const TEMP_TRACE_RECORD *Records;
+    ULONG64 *Indexes;  // This thread's records, in timestamp order
+    ULONG64 Count;
+    ULONG Index;
+    ULONG SectorSize;
+    ULONG64 DiskSize;
+    BOOLEAN MaxSpeed;
+    ULONG64 StartTime;
+    ULONG64 Issued;
+    ULONG64 Skipped;
+    ULONG64 MaxLag;    // Nanoseconds a request was issued behind its schedule
+    NTSTATUS Status;
+} REPLAY_THREAD;
+
+static ULONG64 ReplayNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONG64)ts.tv_sec * 1000000000ULL + (ULONG64)ts.tv_nsec;
+}
+
+static ULONG64 ReplayParseSize(const char *Text)
+{
+    char *end;
+    ULONG64 value = strtoull(Text, &end, 10);
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value <<= 10;
+        break;
+    case 'm':
+    case 'M':
+        value <<= 20;
+        break;
+    case 'g':
+    case 'G':
+        value <<= 30;
+        break;
+    }
+
+    return value;
+}
+
+// Sleeps through most of the wait and spins the last stretch for accuracy
+static void ReplayWaitUntil(ULONG64 Deadline)
+{
+    for (;;)
+    {
+        ULONG64 now = ReplayNow();
+        if (now >= Deadline)
+        {
+            return;
+        }
+
+        if (Deadline - now > 200000)
+        {
+            struct timespec ts;
+            ULONG64 wait = Deadline - now - 100000;
+            ts.tv_sec = (time_t)(wait / 1000000000ULL);
+            ts.tv_nsec = (long)(wait % 1000000000ULL);
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+static void *ReplayWorker(void *Context)
+{
+    REPLAY_THREAD *thread = (REPLAY_THREAD *)Context;
+    PUCHAR buffer = (PUCHAR)malloc(TEMP_MAX_TRANSFER_LENGTH);
+
+    if (!buffer)
+    {
+        thread->Status = STATUS_INSUFFICIENT_RESOURCES;
+        return NULL;
+    }
+
+    memset(buffer, 0xA5, TEMP_MAX_TRANSFER_LENGTH);
+
+    for (ULONG64 i = 0; i < thread->Count; i++)
+    {
+        const TEMP_TRACE_RECORD *record = &thread->Records[thread->Indexes[i]];
+        ULONG64 offset = (ULONG64)record->Offset << TEMP_TRACE_OFFSET_SHIFT;
+        ULONG sectorMask = thread->SectorSize - 1;
+
+        // Failed requests changed nothing, IOCTLs other than trims carry no range
+        if ((record->Flags & TEMP_TRACE_FLAG_FAILED) ||
+            record->Operation == TEMP_OPERATION_IOCTL ||
+            record->Length == 0 ||
+            (offset & sectorMask) != 0 ||
+            (record->Length & sectorMask) != 0 ||
+            offset + record->Length > thread->DiskSize ||
+            (record->Operation != TEMP_TRACE_OPERATION_TRIM && record->Length > TEMP_MAX_TRANSFER_LENGTH))
+        {
+            thread->Skipped++;
+            continue;
+        }
+
+        if (!thread->MaxSpeed)
+        {
+            ULONG64 due = thread->StartTime + record->Timestamp;
+            ReplayWaitUntil(due);
+
+            ULONG64 lag = ReplayNow() - due;
+            if (lag > thread->MaxLag)
+            {
+                thread->MaxLag = lag;
+            }
+        }
+
+        ULONG64 sector = offset / thread->SectorSize;
+        ULONG sectorCount = record->Length / thread->SectorSize;
+        ULONG64 start = ReplayNow();
+        NTSTATUS status;
+
+        switch (record->Operation)
+        {
+        case TEMP_OPERATION_READ:
+            status = TempReadSectors(thread->MemoryManager, sector, sectorCount, buffer, thread->SectorSize);
+            break;
+        case TEMP_OPERATION_WRITE:
+            status = TempWriteSectors(thread->MemoryManager, sector, sectorCount, buffer, thread->SectorSize);
+            break;
+        default:
+            status = TempTrimSectors(thread->MemoryManager, sector, sectorCount, thread->SectorSize);
+            break;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            thread->Status = status;
+            break;
+        }
+
+        // Trims are reported in the IOCTL slot, which a replay has no other use for
+        TempRecordOperation(thread->Replayed, thread->Index,
+                            record->Operation < TEMP_OPERATION_COUNT ? record->Operation : TEMP_OPERATION_IOCTL,
+                            ReplayNow() - start, record->Length);
+        thread->Issued++;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static int ReplayCompareTimestamps(const void *Left, const void *Right)
+{
+    const TEMP_TRACE_RECORD *left = (const TEMP_TRACE_RECORD *)Left;
+    const TEMP_TRACE_RECORD *right = (const TEMP_TRACE_RECORD *)Right;
+
+    return left->Timestamp < right->Timestamp ? -1 : left->Timestamp > right->Timestamp;
+}
+
+static TEMP_TRACE_RECORD *ReplayLoadTrace(const char *FileName, PTEMP_TRACE_FILE_HEADER Header)
+{
+    FILE *file = fopen(FileName, "rb");
+    TEMP_TRACE_RECORD *records = NULL;
+
+    if (!file)
+    {
+        printf("Cannot open %s\n", FileName);
+        return NULL;
+    }
+
+    if (fread(Header, sizeof(TEMP_TRACE_FILE_HEADER), 1, file) != 1 ||
+        Header->Magic != TEMP_TRACE_FILE_MAGIC ||
+        Header->Version != TEMP_TRACE_FILE_VERSION ||
+        Header->RecordSize != sizeof(TEMP_TRACE_RECORD))
+    {
+        printf("%s is not a TEMP trace file of a supported version\n", FileName);
+        fclose(file);
+        return NULL;
+    }
+
+    records = (TEMP_TRACE_RECORD *)malloc((Header->RecordCount ? Header->RecordCount : 1) * sizeof(TEMP_TRACE_RECORD));
+    if (!records || fread(records, sizeof(TEMP_TRACE_RECORD), Header->RecordCount, file) != Header->RecordCount)
+    {
+        printf("%s is truncated\n", FileName);
+        free(records);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+
+    // The driver hands records over per processor; restore arrival order
+    qsort(records, Header->RecordCount, sizeof(TEMP_TRACE_RECORD), ReplayCompareTimestamps);
+
+    return records;
+}
+
+static void ReplayPrintLatency(const char *Name, const TEMP_OPERATION_LATENCY *Traced, const TEMP_OPERATION_LATENCY *Replayed)
+{
+    if (Traced->Count == 0 && Replayed->Count == 0)
+    {
+        return;
+    }
+
+    printf("%-6s traced   %10llu ops  mean %9.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", Name,
+           (unsigned long long)Traced->Count,
+           Traced->Count ? Traced->TotalLatency / 1000.0 / Traced->Count : 0.0,
+           Traced->LatencyPercentiles[0] / 1000.0, Traced->LatencyPercentiles[2] / 1000.0, Traced->MaxLatency / 1000.0);
+    printf("%-6s replayed %10llu ops  mean %9.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", "",
+           (unsigned long long)Replayed->Count,
+           Replayed->Count ? Replayed->TotalLatency / 1000.0 / Replayed->Count : 0.0,
+           Replayed->LatencyPercentiles[0] / 1000.0, Replayed->LatencyPercentiles[2] / 1000.0, Replayed->MaxLatency / 1000.0);
+}
+
+static void ReplayUsage(const char *Program)
+{
+    printf("Usage: %s <trace file> [options]\n", Program);
+    printf("  --speed original|max Keep the traced arrival times or issue back to back (default: original)\n");
+    printf("  --threads <n>        Replay threads (default: one per traced processor)\n");
+    printf("  --size <size>        Disk size (default: from the trace)\n");
+    printf("  --chunk-size <size>  Chunk size (default: from the trace)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    REPLAY_OPTIONS options = {0};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+        {
+            options.MaxSpeed = strcmp(argv[++i], "max") == 0;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options.Threads = (ULONG)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            options.DiskSize = ReplayParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc)
+        {
+            options.ChunkSize = (ULONG)ReplayParseSize(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && !options.TraceFile)
+        {
+            options.TraceFile = argv[i];
+        }
+        else
+        {
+            ReplayUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!options.TraceFile)
+    {
+        ReplayUsage(argv[0]);
+        return 1;
+    }
+
+    TEMP_TRACE_FILE_HEADER header;
+    TEMP_TRACE_RECORD *records = ReplayLoadTrace(options.TraceFile, &header);
+    if (!records)
+    {
+        return 1;
+    }
+
+    ULONG64 diskSize = options.DiskSize ? options.DiskSize : header.DiskSize;
+    ULONG chunkSize = options.ChunkSize ? options.ChunkSize : (header.ChunkSize ? header.ChunkSize : TEMP_DEFAULT_CHUNK_SIZE);
+    ULONG sectorSize = header.SectorSize ? header.SectorSize : TEMP_DEFAULT_SECTOR_SIZE;
+    ULONG processors = 1;
+
+    for (ULONG64 i = 0; i < header.RecordCount; i++)
+    {
+        if (records[i].Processor + 1U > processors)
+        {
+            processors = records[i].Processor + 1U;
+        }
+    }
+
+    ULONG threadCount = options.Threads ? options.Threads : processors;
+
+    PTEMP_MEMORY_MANAGER memoryManager = (PTEMP_MEMORY_MANAGER)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED, sizeof(TEMP_MEMORY_MANAGER), 0);
+
+    if (!memoryManager || diskSize < sectorSize ||
+        !NT_SUCCESS(TempInitializeMemoryManager(memoryManager, diskSize, chunkSize)))
+    {
+        printf("Failed to initialize memory manager for a %llu byte disk\n", (unsigned long long)diskSize);
+        return 1;
+    }
+
+    TEMP_IO_HISTOGRAMS traced = {0};
+    TEMP_IO_HISTOGRAMS replayed = {0};
+    REPLAY_THREAD *threads = (REPLAY_THREAD *)calloc(threadCount, sizeof(REPLAY_THREAD));
+    pthread_t *handles = (pthread_t *)calloc(threadCount, sizeof(pthread_t));
+
+    if (!threads || !handles ||
+        !NT_SUCCESS(TempInitializeIoHistograms(&traced, 1)) ||
+        !NT_SUCCESS(TempInitializeIoHistograms(&replayed, threadCount)))
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    // Each thread keeps the records of the processors mapped to it, in order
+    for (ULONG64 i = 0; i < header.RecordCount; i++)
+    {
+        threads[records[i].Processor % threadCount].Count++;
+
+        if (!(records[i].Flags & TEMP_TRACE_FLAG_FAILED) && records[i].Operation != TEMP_OPERATION_IOCTL)
+        {
+            TempRecordOperation(&traced, 0,
+                                records[i].Operation < TEMP_OPERATION_COUNT ? records[i].Operation : TEMP_OPERATION_IOCTL,
+                                records[i].Latency, records[i].Length);
+        }
+    }
+
+    for (ULONG t = 0; t < threadCount; t++)
+    {
+        threads[t].Indexes = (ULONG64 *)malloc((threads[t].Count ? threads[t].Count : 1) * sizeof(ULONG64));
+        if (!threads[t].Indexes)
+        {
+            printf("Out of memory\n");
+            return 1;
+        }
+        threads[t].Count = 0;
+    }
+
+    for (ULONG64 i = 0; i < header.RecordCount; i++)
+    {
+        REPLAY_THREAD *thread = &threads[records[i].Processor % threadCount];
+        thread->Indexes[thread->Count++] = i;
+    }
+
+    printf("Replaying %llu requests (%llu dropped while tracing) on %u threads, disk %llu bytes, chunk %u, %s speed\n",
+           (unsigned long long)header.RecordCount, (unsigned long long)header.DroppedRecords, threadCount,
+           (unsigned long long)diskSize, chunkSize, options.MaxSpeed ? "max" : "original");
+
+    ULONG64 start = ReplayNow();
+
+    for (ULONG t = 0; t < threadCount; t++)
+    {
+        threads[t].MemoryManager = memoryManager;
+        threads[t].Replayed = &replayed;
+        threads[t].Records = records;
+        threads[t].Index = t;
+        threads[t].SectorSize = sectorSize;
+        threads[t].DiskSize = diskSize;
+        threads[t].MaxSpeed = options.MaxSpeed;
+        threads[t].StartTime = start;
+        pthread_create(&handles[t], NULL, ReplayWorker, &threads[t]);
+    }
+
+    ULONG64 issued = 0;
+    ULONG64 skipped = 0;
+    ULONG64 maxLag = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (ULONG t = 0; t < threadCount; t++)
+    {
+        pthread_join(handles[t], NULL);
+        issued += threads[t].Issued;
+        skipped += threads[t].Skipped;
+        if (threads[t].MaxLag > maxLag)
+        {
+            maxLag = threads[t].MaxLag;
+        }
+        if (!NT_SUCCESS(threads[t].Status))
+        {
+            status = threads[t].Status;
+        }
+        free(threads[t].Indexes);
+    }
+
+    double elapsed = (ReplayNow() - start) / 1e9;
+    double traceSpan = header.RecordCount ? records[header.RecordCount - 1].Timestamp / 1e9 : 0.0;
+
+    printf("Issued %llu, skipped %llu in %.3f s (trace spans %.3f s): %.0f IOPS\n",
+           (unsigned long long)issued, (unsigned long long)skipped, elapsed, traceSpan,
+           elapsed > 0 ? issued / elapsed : 0.0);
+
+    if (!options.MaxSpeed)
+    {
+        printf("Worst schedule lag: %.1f us\n", maxLag / 1000.0);
+    }
+
+    TEMP_LATENCY_STATISTICS *tracedLatency = (TEMP_LATENCY_STATISTICS *)malloc(sizeof(TEMP_LATENCY_STATISTICS));
+    TEMP_LATENCY_STATISTICS *replayedLatency = (TEMP_LATENCY_STATISTICS *)malloc(sizeof(TEMP_LATENCY_STATISTICS));
+
+    if (tracedLatency && replayedLatency)
+    {
+        TempQueryIoHistograms(&traced, tracedLatency);
+        TempQueryIoHistograms(&replayed, replayedLatency);
+
+        ReplayPrintLatency("Read", &tracedLatency->Operations[TEMP_OPERATION_READ], &replayedLatency->Operations[TEMP_OPERATION_READ]);
+        ReplayPrintLatency("Write", &tracedLatency->Operations[TEMP_OPERATION_WRITE], &replayedLatency->Operations[TEMP_OPERATION_WRITE]);
+        ReplayPrintLatency("Trim", &tracedLatency->Operations[TEMP_OPERATION_IOCTL], &replayedLatency->Operations[TEMP_OPERATION_IOCTL]);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        printf("Replay stopped on error 0x%08X\n", (unsigned)status);
+    }
+
+    free(tracedLatency);
+    free(replayedLatency);
+    TempCleanupIoHistograms(&traced);
+    TempCleanupIoHistograms(&replayed);
+    TempCleanupMemoryManager(memoryManager);
+    ExFreePool(memoryManager);
+    free(threads);
+    free(handles);
+    free(records);
+
+    return NT_SUCCESS(status) ? 0 : 1;
+}
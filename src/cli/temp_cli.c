@@ -1,10 +1,17 @@
+// Winsock 2 must come before windows.h, which otherwise pulls in winsock 1
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <math.h>
 #include <winioctl.h>
 #ifndef SIMPLIFIED_BUILD
 #include "../core/temp_core.h"
+#else
+#include "../core/temp_ioctl.h"
 #endif
 
 // Command line options
@@ -12,8 +19,21 @@ typedef enum
 {
     CMD_CREATE,
     CMD_REMOVE,
+    CMD_RESET,
+    CMD_CLONE,
     CMD_LIST,
     CMD_STATS,
+    CMD_RESIZE,
+    CMD_TRACE,
+    CMD_LOCKS,
+    CMD_HEATMAP,
+    CMD_BENCH,
+    CMD_EXPORTER,
+    CMD_SHARED_STATS,
+    CMD_HISTORY,
+    CMD_SAVE,
+    CMD_BUDGET,
+    CMD_QOS,
     CMD_VERSION,
     CMD_HELP,
     CMD_INVALID
@@ -23,14 +43,91 @@ typedef struct
 {
     COMMAND_TYPE Command;
     ULONG DeviceNumber;
+    ULONG TargetDevice; // clone target
     ULONG64 DiskSize;
     ULONG SectorSize;
+    ULONG ChunkSize;
+    ULONG PressurePolicy;
+    WCHAR SpillFileName[MAX_PATH];
+    char ImageFile[MAX_PATH]; // create --image or --mount, as a full Win32 path
+    ULONG ImageMode;          // TEMP_IMAGE_*
+    BOOLEAN SizeSpecified;
+    ULONG64 MemoryMinimum;    // create --min-memory, budget --min
+    ULONG64 MemoryMaximum;    // create --max-memory, budget --max
+    ULONG64 PoolLimit;        // budget --limit
+    ULONG BudgetFlags;        // TEMP_BUDGET_SET_* the budget command applies
+    BOOLEAN MinimumSpecified;
+    BOOLEAN MaximumSpecified;
+    ULONG64 IopsLimit;        // create --iops, qos --iops
+    ULONG64 BandwidthLimit;   // create --bandwidth, qos --bandwidth
+    ULONG QosWeight;          // create --weight, qos --weight
+    ULONG64 TotalIops;        // qos --total-iops
+    ULONG64 TotalBandwidth;   // qos --total-bandwidth
+    ULONG IdleIntervalMs;     // qos --idle
+    ULONG QosFlags;           // TEMP_QOS_SET_* the qos command applies
+    ULONG QosFields;          // QOS_FIELD_* given on the qos command line
+    ULONG Encryption;
     WCHAR DriveLetter;
     BOOLEAN RemovableMedia;
     BOOLEAN CdRomType;
+    BOOLEAN Force;
+    BOOLEAN Latency;
     BOOLEAN ShowHelp;
+    char OutputFile[MAX_PATH];
+    ULONG Seconds;      // 0 runs until Ctrl+C
+    ULONG TraceRecords; // Per processor ring size, 0 for the driver default
+    ULONG LockAction;   // LOCK_ACTION_*, also used by shared-stats
+    ULONG TopCount;     // Buckets listed by the locks command
+    BOOLEAN Csv;
+    ULONG64 RegionSize; // Heatmap bytes per region, 0 picks one to fit the map
+    ULONG Width;        // Heatmap cells per row
+    ULONG BlockSize;    // Bench bytes per request
+    ULONG QueueDepth;   // Bench requests in flight per thread
+    ULONG Threads;      // Bench threads, each with its own handle and completion port
+    ULONG ReadPercent;  // Bench share of reads, 100 reads only, 0 writes only
+    BOOLEAN Random;     // Bench random offsets instead of a sequential stream per thread
+    BOOLEAN Watch;      // Stats sampled every IntervalMs until Ctrl+C or Seconds
+    BOOLEAN Json;       // Watch rows as JSON lines
+    ULONG IntervalMs;
+    char ListenAddress[64]; // Exporter address:port
 } COMMAND_OPTIONS;
 
+// qos settings given on the command line; the others keep their current values
+#define QOS_FIELD_IOPS 0x01
+#define QOS_FIELD_BANDWIDTH 0x02
+#define QOS_FIELD_WEIGHT 0x04
+#define QOS_FIELD_TOTAL_IOPS 0x08
+#define QOS_FIELD_TOTAL_BANDWIDTH 0x10
+#define QOS_FIELD_IDLE 0x20
+#define QOS_FIELDS_DEVICE (QOS_FIELD_IOPS | QOS_FIELD_BANDWIDTH | QOS_FIELD_WEIGHT)
+
+#define LOCK_ACTION_SHOW 0
+#define LOCK_ACTION_ENABLE 1
+#define LOCK_ACTION_DISABLE 2
+
+#define HEATMAP_DEFAULT_WIDTH 64
+#define HEATMAP_MAX_ROWS 32
+#define HEATMAP_PAGE_REGIONS 8192 // Regions fetched per IOCTL
+
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_MAX_BLOCK_SIZE (4 * 1024 * 1024)
+#define BENCH_MAX_QUEUE_DEPTH 256
+#define BENCH_MAX_THREADS MAXIMUM_WAIT_OBJECTS
+#define BENCH_COMPLETION_BATCH 64
+
+#define WATCH_DEFAULT_INTERVAL_MS 1000
+#define WATCH_HEADER_ROWS 20 // Table rows between repeated headers
+
+#define HISTORY_DEFAULT_SECONDS 60
+
+#define SAVE_BLOCK_SIZE (1024 * 1024) // Bytes read from the device per request
+
+#define CLONE_STEP_SIZE (1024ULL * 1024 * 1024) // Bytes per copy request, between progress updates
+
+#define EXPORTER_DEFAULT_LISTEN "127.0.0.1:9477"
+#define EXPORTER_REQUEST_SIZE 4096
+#define EXPORTER_TIMEOUT_MS 5000 // Per client, so a stalled scraper cannot block the others
+
 // Version information
 #define TEMP_CLI_VERSION "1.0.0"
 
@@ -45,6 +142,16 @@ typedef struct
     BOOLEAN RemovableMedia;
     BOOLEAN CdRomType;
     WCHAR FileName[MAX_PATH];
+    ULONG ChunkSize;
+    ULONG PressurePolicy;
+    WCHAR SpillFileName[MAX_PATH];
+    ULONG Encryption;
+    ULONG ImageMode;
+    ULONG64 MemoryMinimum;
+    ULONG64 MemoryMaximum;
+    ULONG64 IopsLimit;
+    ULONG64 BandwidthLimit;
+    ULONG QosWeight;
 } TEMP_CREATE_DATA_SIMPLE;
 
 typedef struct
@@ -59,19 +166,379 @@ typedef struct
     ULONG64 CacheHits;
     ULONG64 CacheMisses;
     ULONG64 EvictionCount;
+    ULONG64 PressureEvents;
+    ULONG64 BytesReclaimed;
+    ULONG64 CompressedChunks;
+    ULONG64 CompressedBytes;
+    ULONG64 SpilledChunks;
 } TEMP_STATISTICS_SIMPLE;
 
+typedef struct
+{
+    ULONG DeviceNumber;
+    ULONG64 NewSize;
+} TEMP_RESIZE_DATA;
+
+#define TEMP_OCCUPANCY_BINS 10
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG DeviceNumber;
+    ULONG ChunkSize;
+    ULONG BucketCount;
+    ULONG SegmentSize;
+    ULONG64 DiskSize;
+    ULONG64 ChunkCapacity;
+    ULONG64 AllocatedChunks;
+    ULONG64 ResidentChunks;
+    ULONG64 CompressedChunks;
+    ULONG64 SpilledChunks;
+    ULONG64 PartialChunks;
+    ULONG64 ResidentDataBytes;
+    ULONG64 CompressedDataBytes;
+    ULONG64 InUseDataBytes;
+    ULONG64 MetadataBytes;
+    ULONG64 AllocationFailures;
+    ULONG64 EvictionCount;
+    ULONG MinBucketChunks;
+    ULONG MaxBucketChunks;
+    ULONG BucketOccupancy[TEMP_OCCUPANCY_BINS];
+    ULONG64 ImagePendingChunks;
+    ULONG64 ImageDemandLoads;
+    ULONG64 BudgetCharged;
+    ULONG64 BudgetMinimum;
+    ULONG64 BudgetMaximum;
+    ULONG64 BudgetDenials;
+    ULONG64 SharedChunks;
+} TEMP_MEMORY_STATISTICS;
+
+#define TEMP_HISTOGRAM_SUB_BITS 3
+#define TEMP_HISTOGRAM_BUCKETS 256
+#define TEMP_OPERATION_COUNT 3
+#define TEMP_PERCENTILE_COUNT 4
+
+typedef struct
+{
+    ULONG64 Count;
+    ULONG64 TotalLatency;
+    ULONG64 MaxLatency;
+    ULONG64 LatencyPercentiles[TEMP_PERCENTILE_COUNT];
+    ULONG64 TotalBytes;
+    ULONG64 SizePercentiles[TEMP_PERCENTILE_COUNT];
+    ULONG64 LatencyHistogram[TEMP_HISTOGRAM_BUCKETS];
+    ULONG64 SizeHistogram[TEMP_HISTOGRAM_BUCKETS];
+} TEMP_OPERATION_LATENCY;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG DeviceNumber;
+    ULONG SubBucketBits;
+    TEMP_OPERATION_LATENCY Operations[TEMP_OPERATION_COUNT];
+} TEMP_LATENCY_STATISTICS;
+
 #define TEMP_CREATE_DATA TEMP_CREATE_DATA_SIMPLE
 #define TEMP_STATISTICS TEMP_STATISTICS_SIMPLE
 #define PTEMP_CREATE_DATA TEMP_CREATE_DATA_SIMPLE *
 #define PTEMP_STATISTICS TEMP_STATISTICS_SIMPLE *
 
-// IOCTLs for simplified build
-#define TEMP_IOCTL_CREATE_DEVICE 0x83000800
-#define TEMP_IOCTL_REMOVE_DEVICE 0x83000801
-#define TEMP_IOCTL_LIST_DEVICES 0x83000802
-#define TEMP_IOCTL_GET_VERSION 0x83000803
-#define TEMP_IOCTL_GET_STATISTICS 0x83000804
+#define TEMP_TRACE_DEFAULT_RECORDS 8192
+#define TEMP_LOCK_CONTENTION_DEFAULT_TOP 16
+#define TEMP_LOCK_CONTENTION_MAX_TOP 64
+#define TEMP_HEATMAP_MAX_REGION_SHIFT 20
+
+typedef struct
+{
+    ULONG FirstRegion;
+    ULONG RegionShift;
+} TEMP_HEATMAP_QUERY;
+
+typedef struct
+{
+    ULONG64 Reads;
+    ULONG64 Writes;
+} TEMP_HEATMAP_REGION;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG DeviceNumber;
+    ULONG StripeSize;
+    ULONG64 RegionSize;
+    ULONG RegionCount;
+    ULONG FirstRegion;
+    ULONG RegionsReturned;
+    ULONG HotStripeHeat;
+    ULONG64 TotalReads;
+    ULONG64 TotalWrites;
+    ULONG64 DiskSize;
+    TEMP_HEATMAP_REGION Regions[1];
+} TEMP_HEATMAP;
+
+typedef struct
+{
+    ULONG Bucket;
+    ULONG ChunkCount;
+    ULONG64 Acquisitions;
+    ULONG64 ContendedAcquisitions;
+    ULONG64 SpinTime;
+    ULONG64 HoldTime;
+    ULONG64 MaxHoldTime;
+} TEMP_BUCKET_CONTENTION;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG DeviceNumber;
+    ULONG Enabled;
+    ULONG BucketCount;
+    ULONG StripeSize;
+    ULONG BucketsReturned;
+    ULONG Reserved;
+    ULONG64 Acquisitions;
+    ULONG64 ContendedAcquisitions;
+    ULONG64 SpinTime;
+    ULONG64 HoldTime;
+    TEMP_BUCKET_CONTENTION Buckets[TEMP_LOCK_CONTENTION_MAX_TOP];
+} TEMP_LOCK_CONTENTION;
+
+#define TEMP_TRACE_FILE_MAGIC 0x43525454
+#define TEMP_TRACE_FILE_VERSION 1
+
+typedef struct
+{
+    ULONG64 Timestamp;
+    ULONG Offset;
+    ULONG Length;
+    ULONG Latency;
+    UCHAR Operation;
+    UCHAR Flags;
+    USHORT Processor;
+} TEMP_TRACE_RECORD;
+
+typedef struct
+{
+    ULONG Enable;
+    ULONG RecordsPerProcessor;
+} TEMP_TRACE_CONTROL;
+
+typedef struct
+{
+    ULONG RecordCount;
+    ULONG Active;
+    ULONG64 DroppedRecords;
+    TEMP_TRACE_RECORD Records[ANYSIZE_ARRAY];
+} TEMP_TRACE_DATA;
+
+typedef struct
+{
+    ULONG Magic;
+    USHORT Version;
+    USHORT RecordSize;
+    ULONG SectorSize;
+    ULONG ChunkSize;
+    ULONG64 DiskSize;
+    ULONG64 RecordCount;
+    ULONG64 DroppedRecords;
+} TEMP_TRACE_FILE_HEADER;
+
+#define TEMP_IMAGE_FILE_MAGIC 0x474D4954
+#define TEMP_IMAGE_FILE_VERSION 1
+#define TEMP_IMAGE_DATA_ALIGNMENT (64 * 1024)
+#define TEMP_IMAGE_RESTORE 0
+#define TEMP_IMAGE_MAPPED 1
+
+typedef struct
+{
+    ULONG Magic;
+    USHORT Version;
+    USHORT HeaderSize;
+    ULONG SectorSize;
+    ULONG StripeSize;
+    ULONG64 DiskSize;
+    ULONG64 StripeCount;
+    ULONG64 DataOffset;
+} TEMP_IMAGE_FILE_HEADER;
+
+#define TEMP_DEVICE_LIST_VERSION 1
+#define TEMP_SHARED_STATS_VERSION 1
+#define TEMP_SHARED_STATS_DEFAULT_INTERVAL_MS 100
+#define TEMP_SHARED_STATS_MIN_INTERVAL_MS 10
+#define TEMP_SHARED_STATS_MAX_INTERVAL_MS 60000
+#define TEMP_SHARED_STATS_USER_NAME L"Global\\TempRamDiskStats"
+#define TEMP_HISTORY_VERSION 1
+#define TEMP_HISTORY_SECONDS 600
+#define TEMP_ENCRYPTION_NONE 0
+#define TEMP_ENCRYPTION_AES_XTS 1
+
+typedef struct
+{
+    ULONG DeviceNumber;
+    ULONG SectorSize;
+    ULONG ChunkSize;
+    ULONG PressurePolicy;
+    WCHAR DriveLetter;
+    BOOLEAN RemovableMedia;
+    BOOLEAN CdRomType;
+    ULONG Encryption;
+    TEMP_STATISTICS Statistics;
+} TEMP_DEVICE_INFO;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG EntrySize;
+    ULONG DeviceCount;
+    ULONG DevicesReturned;
+    ULONG Reserved;
+    TEMP_DEVICE_INFO Devices[ANYSIZE_ARRAY];
+} TEMP_DEVICE_LIST;
+
+typedef struct
+{
+    volatile LONG Sequence;
+    ULONG Present;
+    TEMP_DEVICE_INFO Info;
+} TEMP_SHARED_DEVICE_STATS;
+
+typedef struct
+{
+    ULONG64 Time;
+    ULONG ElapsedMs;
+    ULONG Reserved;
+    ULONG64 Reads;
+    ULONG64 Writes;
+    ULONG64 BytesRead;
+    ULONG64 BytesWritten;
+    ULONG64 CacheHits;
+    ULONG64 CacheMisses;
+    ULONG64 ReadLatencyP99;
+    ULONG64 WriteLatencyP99;
+    ULONG64 MemoryUsed;
+} TEMP_HISTORY_SAMPLE;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG SampleSize;
+    ULONG SamplesReturned;
+    ULONG Capacity;
+    ULONG IntervalMs;
+    ULONG64 TotalSamples;
+    TEMP_HISTORY_SAMPLE Samples[ANYSIZE_ARRAY];
+} TEMP_HISTORY;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG EntrySize;
+    ULONG DeviceSlots;
+    ULONG IntervalMs;
+    ULONG Reserved;
+    volatile LONG64 UpdateCount;
+    volatile LONG64 UpdateTime;
+    TEMP_SHARED_DEVICE_STATS Devices[TEMP_MAX_DEVICES];
+} TEMP_SHARED_STATS;
+
+#define TEMP_MEMORY_BUDGET_VERSION 1
+#define TEMP_BUDGET_SET_POOL 0x00000001
+#define TEMP_BUDGET_SET_DEVICE 0x00000002
+
+typedef struct
+{
+    ULONG Flags;
+    ULONG DeviceNumber;
+    ULONG64 PoolLimit;
+    ULONG64 Minimum;
+    ULONG64 Maximum;
+} TEMP_BUDGET_CONTROL;
+
+typedef struct
+{
+    ULONG DeviceNumber;
+    ULONG PressurePolicy;
+    ULONG64 Minimum;
+    ULONG64 Maximum;
+    ULONG64 Charged;
+    ULONG64 Denials;
+} TEMP_DEVICE_BUDGET;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG DevicesReturned;
+    ULONG Reserved;
+    ULONG64 PoolLimit;
+    ULONG64 Guaranteed;
+    ULONG64 Charged;
+    ULONG64 Burst;
+    ULONG64 Denials;
+    TEMP_DEVICE_BUDGET Devices[TEMP_MAX_DEVICES];
+} TEMP_MEMORY_BUDGET;
+
+#define TEMP_QOS_VERSION 1
+#define TEMP_QOS_SET_DRIVER 0x00000001
+#define TEMP_QOS_SET_DEVICE 0x00000002
+#define TEMP_QOS_DEFAULT_WEIGHT 100
+#define TEMP_QOS_MAX_WEIGHT 10000
+#define TEMP_QOS_IDLE_INTERVAL_MS 10
+#define TEMP_QOS_MAX_IDLE_INTERVAL_MS 1000
+
+typedef struct
+{
+    ULONG Flags;
+    ULONG DeviceNumber;
+    ULONG64 TotalIops;
+    ULONG64 TotalBandwidth;
+    ULONG IdleIntervalMs;
+    ULONG Weight;
+    ULONG64 IopsLimit;
+    ULONG64 BandwidthLimit;
+} TEMP_QOS_CONTROL;
+
+typedef struct
+{
+    ULONG DeviceNumber;
+    ULONG Weight;
+    ULONG64 IopsLimit;
+    ULONG64 BandwidthLimit;
+    ULONG64 IopsRate;
+    ULONG64 BandwidthRate;
+    ULONG64 ThrottledRequests;
+    ULONG64 ThrottledTime;
+    ULONG64 DeferredRequests;
+    ULONG64 DeferredTime;
+} TEMP_DEVICE_QOS;
+
+typedef struct
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG DevicesReturned;
+    ULONG IdleIntervalMs;
+    ULONG64 TotalIops;
+    ULONG64 TotalBandwidth;
+    TEMP_DEVICE_QOS Devices[TEMP_MAX_DEVICES];
+} TEMP_QOS_REPORT;
+
+typedef struct
+{
+    ULONG SourceDevice;
+    ULONG TargetDevice;
+    ULONG64 SourceOffset;
+    ULONG64 TargetOffset;
+    ULONG64 Length;
+    ULONG64 SharedLength;
+} TEMP_COPY_DATA;
 #endif
 
 // Function prototypes
@@ -80,9 +547,31 @@ void ShowHelp(const char *programName);
 void ShowVersion(void);
 NTSTATUS CreateRamDisk(const COMMAND_OPTIONS *options);
 NTSTATUS RemoveRamDisk(ULONG deviceNumber);
+NTSTATUS ResetRamDisk(const COMMAND_OPTIONS *options);
+NTSTATUS CloneRamDisk(const COMMAND_OPTIONS *options);
 NTSTATUS ListRamDisks(void);
 NTSTATUS ShowStatistics(ULONG deviceNumber);
+void ShowMemoryUsage(HANDLE hDevice);
+NTSTATUS ShowLatency(ULONG deviceNumber);
+void FormatLatency(ULONG64 nanoseconds, char *buffer, size_t bufferSize);
+void FormatBytes(ULONG64 bytes, char *buffer, size_t bufferSize);
+NTSTATUS ResizeRamDisk(const COMMAND_OPTIONS *options);
+NTSTATUS TraceRamDisk(const COMMAND_OPTIONS *options);
+NTSTATUS ShowLockContention(const COMMAND_OPTIONS *options);
+NTSTATUS ShowHeatmap(const COMMAND_OPTIONS *options);
+NTSTATUS BenchRamDisk(const COMMAND_OPTIONS *options);
+NTSTATUS WatchStatistics(const COMMAND_OPTIONS *options);
+NTSTATUS ShowHistory(const COMMAND_OPTIONS *options);
+NTSTATUS RunExporter(const COMMAND_OPTIONS *options);
+NTSTATUS SharedStatistics(const COMMAND_OPTIONS *options);
+NTSTATUS SaveRamDisk(const COMMAND_OPTIONS *options);
+NTSTATUS MemoryBudget(const COMMAND_OPTIONS *options);
+NTSTATUS IoQos(const COMMAND_OPTIONS *options);
+WCHAR FindDriveLetter(ULONG deviceNumber);
+BOOL ExtendFileSystem(WCHAR driveLetter, ULONG64 diskSize);
 ULONG64 ParseSize(const char *sizeStr);
+ULONG ParseInterval(const char *intervalStr);
+ULONG ParsePressurePolicy(const char *policyStr);
 HANDLE OpenControlDevice(void);
 
 int main(int argc, char *argv[])
@@ -103,12 +592,71 @@ int main(int argc, char *argv[])
         status = RemoveRamDisk(options.DeviceNumber);
         break;
 
+    case CMD_RESET:
+        status = ResetRamDisk(&options);
+        break;
+
+    case CMD_CLONE:
+        status = CloneRamDisk(&options);
+        break;
+
     case CMD_LIST:
         status = ListRamDisks();
         break;
 
     case CMD_STATS:
-        status = ShowStatistics(options.DeviceNumber);
+        if (options.Watch)
+        {
+            status = WatchStatistics(&options);
+        }
+        else
+        {
+            status = options.Latency ? ShowLatency(options.DeviceNumber) : ShowStatistics(options.DeviceNumber);
+        }
+        break;
+
+    case CMD_RESIZE:
+        status = ResizeRamDisk(&options);
+        break;
+
+    case CMD_TRACE:
+        status = TraceRamDisk(&options);
+        break;
+
+    case CMD_LOCKS:
+        status = ShowLockContention(&options);
+        break;
+
+    case CMD_HEATMAP:
+        status = ShowHeatmap(&options);
+        break;
+
+    case CMD_BENCH:
+        status = BenchRamDisk(&options);
+        break;
+
+    case CMD_EXPORTER:
+        status = RunExporter(&options);
+        break;
+
+    case CMD_SHARED_STATS:
+        status = SharedStatistics(&options);
+        break;
+
+    case CMD_HISTORY:
+        status = ShowHistory(&options);
+        break;
+
+    case CMD_SAVE:
+        status = SaveRamDisk(&options);
+        break;
+
+    case CMD_BUDGET:
+        status = MemoryBudget(&options);
+        break;
+
+    case CMD_QOS:
+        status = IoQos(&options);
         break;
 
     case CMD_VERSION:
@@ -145,6 +693,11 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
     options->DeviceNumber = 0;
     options->DiskSize = 64 * 1024 * 1024; // 64MB default
     options->SectorSize = TEMP_DEFAULT_SECTOR_SIZE;
+    options->ChunkSize = 0; // Driver default
+    options->PressurePolicy = 0;
+    options->SpillFileName[0] = L'\0';
+    options->Encryption = TEMP_ENCRYPTION_NONE;
+    options->ImageMode = TEMP_IMAGE_RESTORE;
     options->DriveLetter = 0;
     options->RemovableMedia = FALSE;
     options->CdRomType = FALSE;
@@ -161,6 +714,7 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
             if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
             {
                 options->DiskSize = ParseSize(argv[++i]);
+                options->SizeSpecified = TRUE;
             }
             else if (strcmp(argv[i], "--drive") == 0 && i + 1 < argc)
             {
@@ -182,6 +736,71 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
             {
                 options->SectorSize = atoi(argv[++i]);
             }
+            else if (strcmp(argv[i], "--4kn") == 0)
+            {
+                options->SectorSize = TEMP_NATIVE_4K_SECTOR_SIZE;
+            }
+            else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc)
+            {
+                options->ChunkSize = (ULONG)ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--on-pressure") == 0 && i + 1 < argc)
+            {
+                options->PressurePolicy = ParsePressurePolicy(argv[++i]);
+                if (options->PressurePolicy == MAXULONG)
+                {
+                    printf("Error: Pressure policy must be a comma-separated list of release-zero, compress and spill, or none\n");
+                    return CMD_INVALID;
+                }
+            }
+            else if (strcmp(argv[i], "--spill-file") == 0 && i + 1 < argc)
+            {
+                // The driver opens the file by its NT path
+                char fullPath[MAX_PATH];
+                DWORD length = GetFullPathNameA(argv[++i], MAX_PATH, fullPath, NULL);
+                if (length == 0 || length >= MAX_PATH - 4)
+                {
+                    printf("Error: Invalid spill file path\n");
+                    return CMD_INVALID;
+                }
+                swprintf_s(options->SpillFileName, MAX_PATH, L"\\??\\%S", fullPath);
+            }
+            else if ((strcmp(argv[i], "--image") == 0 || strcmp(argv[i], "--mount") == 0) && i + 1 < argc)
+            {
+                options->ImageMode = strcmp(argv[i], "--mount") == 0 ? TEMP_IMAGE_MAPPED : TEMP_IMAGE_RESTORE;
+
+                // Kept as a Win32 path to read the size from; the driver gets the NT path
+                DWORD length = GetFullPathNameA(argv[++i], MAX_PATH, options->ImageFile, NULL);
+                if (length == 0 || length >= MAX_PATH - 4)
+                {
+                    printf("Error: Invalid image file path\n");
+                    return CMD_INVALID;
+                }
+            }
+            else if (strcmp(argv[i], "--encrypt") == 0)
+            {
+                options->Encryption = TEMP_ENCRYPTION_AES_XTS;
+            }
+            else if (strcmp(argv[i], "--min-memory") == 0 && i + 1 < argc)
+            {
+                options->MemoryMinimum = ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc)
+            {
+                options->MemoryMaximum = ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--iops") == 0 && i + 1 < argc)
+            {
+                options->IopsLimit = _strtoui64(argv[++i], NULL, 10);
+            }
+            else if (strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc)
+            {
+                options->BandwidthLimit = ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--weight") == 0 && i + 1 < argc)
+            {
+                options->QosWeight = atoi(argv[++i]);
+            }
             else if (strcmp(argv[i], "--removable") == 0)
             {
                 options->RemovableMedia = TRUE;
@@ -198,6 +817,47 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
             return CMD_INVALID;
         }
 
+        if (options->SectorSize < TEMP_MIN_SECTOR_SIZE || options->SectorSize > TEMP_MAX_SECTOR_SIZE ||
+            (options->SectorSize & (options->SectorSize - 1)) != 0)
+        {
+            printf("Error: Sector size must be a power of two between %d and %d\n",
+                   TEMP_MIN_SECTOR_SIZE, TEMP_MAX_SECTOR_SIZE);
+            return CMD_INVALID;
+        }
+
+        if (options->ChunkSize != 0 &&
+            (options->ChunkSize < TEMP_MIN_CHUNK_SIZE || options->ChunkSize > TEMP_MAX_CHUNK_SIZE ||
+             (options->ChunkSize & (options->ChunkSize - 1)) != 0))
+        {
+            printf("Error: Chunk size must be a power of two between %dK and %dK\n",
+                   TEMP_MIN_CHUNK_SIZE / 1024, TEMP_MAX_CHUNK_SIZE / 1024);
+            return CMD_INVALID;
+        }
+
+        if ((options->PressurePolicy & TEMP_PRESSURE_SPILL) && options->SpillFileName[0] == L'\0')
+        {
+            printf("Error: --on-pressure spill requires --spill-file <path>\n");
+            return CMD_INVALID;
+        }
+
+        if (options->ImageMode == TEMP_IMAGE_MAPPED && (options->PressurePolicy || options->Encryption))
+        {
+            printf("Error: A mounted image keeps nothing in memory; drop --on-pressure and --encrypt\n");
+            return CMD_INVALID;
+        }
+
+        if (options->MemoryMaximum && options->MemoryMaximum < options->MemoryMinimum)
+        {
+            printf("Error: --max-memory must not be below --min-memory\n");
+            return CMD_INVALID;
+        }
+
+        if (options->QosWeight > TEMP_QOS_MAX_WEIGHT)
+        {
+            printf("Error: --weight must be between 1 and %d\n", TEMP_QOS_MAX_WEIGHT);
+            return CMD_INVALID;
+        }
+
         return CMD_CREATE;
     }
     else if (strcmp(argv[1], "remove") == 0)
@@ -216,6 +876,61 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
 
         return CMD_REMOVE;
     }
+    else if (strcmp(argv[1], "reset") == 0)
+    {
+        options->Command = CMD_RESET;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for reset command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--force") == 0)
+            {
+                options->Force = TRUE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        return CMD_RESET;
+    }
+    else if (strcmp(argv[1], "clone") == 0)
+    {
+        options->Command = CMD_CLONE;
+
+        if (argc < 4)
+        {
+            printf("Error: Source and target device numbers required for clone command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+        options->TargetDevice = atoi(argv[3]);
+
+        for (int i = 4; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--force") == 0)
+            {
+                options->Force = TRUE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        return CMD_CLONE;
+    }
     else if (strcmp(argv[1], "list") == 0)
     {
         return CMD_LIST;
@@ -223,6 +938,7 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
     else if (strcmp(argv[1], "stats") == 0)
     {
         options->Command = CMD_STATS;
+        options->IntervalMs = WATCH_DEFAULT_INTERVAL_MS;
 
         if (argc >= 3)
         {
@@ -234,327 +950,4195 @@ COMMAND_TYPE ParseCommand(int argc, char *argv[], COMMAND_OPTIONS *options)
             return CMD_INVALID;
         }
 
-        return CMD_STATS;
-    }
-    else if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0)
-    {
-        return CMD_VERSION;
-    }
-    else if (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)
-    {
-        return CMD_HELP;
-    }
-    else
-    {
-        return CMD_INVALID;
-    }
-}
-
-void ShowHelp(const char *programName)
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--latency") == 0)
+            {
+                options->Latency = TRUE;
+            }
+            else if (strcmp(argv[i], "--watch") == 0)
+            {
+                options->Watch = TRUE;
+            }
+            else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+            {
+                options->IntervalMs = ParseInterval(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            {
+                options->Seconds = (ULONG)atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--csv") == 0)
+            {
+                options->Csv = TRUE;
+            }
+            else if (strcmp(argv[i], "--json") == 0)
+            {
+                options->Json = TRUE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (!options->Watch && (options->Csv || options->Json || options->Seconds))
+        {
+            printf("Error: --csv, --json and --seconds need --watch\n");
+            return CMD_INVALID;
+        }
+
+        if (options->Watch && (options->Latency || (options->Csv && options->Json)))
+        {
+            printf("Error: --watch takes one of --csv or --json and no --latency\n");
+            return CMD_INVALID;
+        }
+
+        if (options->IntervalMs < 100 || options->IntervalMs > 3600 * 1000)
+        {
+            printf("Error: --interval must be from 100ms to 1h (e.g., 1s, 500ms, 5m)\n");
+            return CMD_INVALID;
+        }
+
+        return CMD_STATS;
+    }
+    else if (strcmp(argv[1], "resize") == 0)
+    {
+        options->Command = CMD_RESIZE;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for resize command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+            {
+                options->DiskSize = ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--force") == 0)
+            {
+                options->Force = TRUE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (options->DiskSize == 0)
+        {
+            printf("Error: New size required (--size)\n");
+            return CMD_INVALID;
+        }
+
+        return CMD_RESIZE;
+    }
+    else if (strcmp(argv[1], "trace") == 0)
+    {
+        options->Command = CMD_TRACE;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for trace command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            {
+                strcpy_s(options->OutputFile, MAX_PATH, argv[++i]);
+            }
+            else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            {
+                options->Seconds = (ULONG)atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc)
+            {
+                options->TraceRecords = (ULONG)atoi(argv[++i]);
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (options->OutputFile[0] == '\0')
+        {
+            printf("Error: Output file required (--out)\n");
+            return CMD_INVALID;
+        }
+
+        return CMD_TRACE;
+    }
+    else if (strcmp(argv[1], "locks") == 0)
+    {
+        options->Command = CMD_LOCKS;
+        options->TopCount = TEMP_LOCK_CONTENTION_DEFAULT_TOP;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for locks command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--enable") == 0)
+            {
+                options->LockAction = LOCK_ACTION_ENABLE;
+            }
+            else if (strcmp(argv[i], "--disable") == 0)
+            {
+                options->LockAction = LOCK_ACTION_DISABLE;
+            }
+            else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+            {
+                options->TopCount = (ULONG)atoi(argv[++i]);
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (options->TopCount == 0 || options->TopCount > TEMP_LOCK_CONTENTION_MAX_TOP)
+        {
+            printf("Error: --top must be between 1 and %d\n", TEMP_LOCK_CONTENTION_MAX_TOP);
+            return CMD_INVALID;
+        }
+
+        return CMD_LOCKS;
+    }
+    else if (strcmp(argv[1], "heatmap") == 0)
+    {
+        options->Command = CMD_HEATMAP;
+        options->Width = HEATMAP_DEFAULT_WIDTH;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for heatmap command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--csv") == 0)
+            {
+                options->Csv = TRUE;
+            }
+            else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            {
+                strcpy_s(options->OutputFile, MAX_PATH, argv[++i]);
+                options->Csv = TRUE;
+            }
+            else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc)
+            {
+                options->RegionSize = ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+            {
+                options->Width = (ULONG)atoi(argv[++i]);
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        // Regions are whole 1MB stripes, merged in powers of two
+        if (options->RegionSize != 0 &&
+            (options->RegionSize < 1024 * 1024 || (options->RegionSize & (options->RegionSize - 1)) != 0 ||
+             options->RegionSize > (1024ULL * 1024) << TEMP_HEATMAP_MAX_REGION_SHIFT))
+        {
+            printf("Error: Region size must be a power of two from 1M to 1T\n");
+            return CMD_INVALID;
+        }
+
+        if (options->Width == 0 || options->Width > 256)
+        {
+            printf("Error: --width must be between 1 and 256\n");
+            return CMD_INVALID;
+        }
+
+        return CMD_HEATMAP;
+    }
+    else if (strcmp(argv[1], "bench") == 0)
+    {
+        options->Command = CMD_BENCH;
+        options->Seconds = BENCH_DEFAULT_SECONDS;
+        options->BlockSize = 4096;
+        options->QueueDepth = 32;
+        options->Threads = 1;
+        options->ReadPercent = 100;
+        options->Random = TRUE;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for bench command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        ULONG mixReadPercent = 50;
+        BOOLEAN mix = FALSE;
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--rw") == 0 && i + 1 < argc)
+            {
+                i++;
+                if (strcmp(argv[i], "read") == 0)
+                {
+                    options->ReadPercent = 100;
+                }
+                else if (strcmp(argv[i], "write") == 0)
+                {
+                    options->ReadPercent = 0;
+                }
+                else if (strcmp(argv[i], "mix") == 0)
+                {
+                    mix = TRUE;
+                }
+                else
+                {
+                    printf("Error: --rw must be read, write or mix\n");
+                    return CMD_INVALID;
+                }
+            }
+            else if (strcmp(argv[i], "--rwmixread") == 0 && i + 1 < argc)
+            {
+                mixReadPercent = (ULONG)atoi(argv[++i]);
+                mix = TRUE;
+            }
+            else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc)
+            {
+                i++;
+                if (strcmp(argv[i], "seq") != 0 && strcmp(argv[i], "rand") != 0)
+                {
+                    printf("Error: --pattern must be seq or rand\n");
+                    return CMD_INVALID;
+                }
+                options->Random = strcmp(argv[i], "rand") == 0;
+            }
+            else if (strcmp(argv[i], "--bs") == 0 && i + 1 < argc)
+            {
+                options->BlockSize = (ULONG)ParseSize(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--iodepth") == 0 && i + 1 < argc)
+            {
+                options->QueueDepth = (ULONG)atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            {
+                options->Threads = (ULONG)atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            {
+                options->Seconds = (ULONG)atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--force") == 0)
+            {
+                options->Force = TRUE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (mix)
+        {
+            options->ReadPercent = mixReadPercent;
+        }
+
+        if (options->ReadPercent > 100 || options->Seconds == 0 ||
+            options->BlockSize < 512 || options->BlockSize > BENCH_MAX_BLOCK_SIZE ||
+            options->QueueDepth == 0 || options->QueueDepth > BENCH_MAX_QUEUE_DEPTH ||
+            options->Threads == 0 || options->Threads > BENCH_MAX_THREADS)
+        {
+            printf("Error: --bs must be 512 to 4M, --iodepth 1-%d, --threads 1-%d, --rwmixread 0-100, --seconds above 0\n",
+                   BENCH_MAX_QUEUE_DEPTH, BENCH_MAX_THREADS);
+            return CMD_INVALID;
+        }
+
+        // Writes go straight to the raw device, under any file system on it
+        if (options->ReadPercent < 100 && !options->Force)
+        {
+            printf("Error: Write workloads overwrite the data on RAM disk %d. Use --force to proceed.\n",
+                   options->DeviceNumber);
+            return CMD_INVALID;
+        }
+
+        return CMD_BENCH;
+    }
+    else if (strcmp(argv[1], "exporter") == 0)
+    {
+        options->Command = CMD_EXPORTER;
+        strcpy_s(options->ListenAddress, sizeof(options->ListenAddress), EXPORTER_DEFAULT_LISTEN);
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc && strlen(argv[i + 1]) < sizeof(options->ListenAddress))
+            {
+                strcpy_s(options->ListenAddress, sizeof(options->ListenAddress), argv[++i]);
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        return CMD_EXPORTER;
+    }
+    else if (strcmp(argv[1], "history") == 0)
+    {
+        options->Command = CMD_HISTORY;
+        options->Seconds = HISTORY_DEFAULT_SECONDS;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for history command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            {
+                options->Seconds = (ULONG)atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--csv") == 0)
+            {
+                options->Csv = TRUE;
+            }
+            else if (strcmp(argv[i], "--json") == 0)
+            {
+                options->Json = TRUE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (options->Seconds == 0 || options->Seconds > TEMP_HISTORY_SECONDS || (options->Csv && options->Json))
+        {
+            printf("Error: history takes --seconds from 1 to %d and one of --csv or --json\n", TEMP_HISTORY_SECONDS);
+            return CMD_INVALID;
+        }
+
+        return CMD_HISTORY;
+    }
+    else if (strcmp(argv[1], "save") == 0)
+    {
+        options->Command = CMD_SAVE;
+
+        if (argc < 3)
+        {
+            printf("Error: Device number required for save command\n");
+            return CMD_INVALID;
+        }
+
+        options->DeviceNumber = atoi(argv[2]);
+
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            {
+                strcpy_s(options->OutputFile, MAX_PATH, argv[++i]);
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        if (options->OutputFile[0] == '\0')
+        {
+            printf("Error: Output file required (--out)\n");
+            return CMD_INVALID;
+        }
+
+        return CMD_SAVE;
+    }
+    else if (strcmp(argv[1], "budget") == 0)
+    {
+        options->Command = CMD_BUDGET;
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+            {
+                // "none" parses as 0, no limit
+                options->PoolLimit = ParseSize(argv[++i]);
+                options->BudgetFlags |= TEMP_BUDGET_SET_POOL;
+            }
+            else if (strcmp(argv[i], "--min") == 0 && i + 1 < argc)
+            {
+                options->MemoryMinimum = ParseSize(argv[++i]);
+                options->MinimumSpecified = TRUE;
+            }
+            else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc)
+            {
+                options->MemoryMaximum = ParseSize(argv[++i]);
+                options->MaximumSpecified = TRUE;
+            }
+            else if (argv[i][0] >= '0' && argv[i][0] <= '9' && !(options->BudgetFlags & TEMP_BUDGET_SET_DEVICE))
+            {
+                options->DeviceNumber = atoi(argv[i]);
+                options->BudgetFlags |= TEMP_BUDGET_SET_DEVICE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        BOOLEAN deviceOptions = options->MinimumSpecified || options->MaximumSpecified;
+
+        if (deviceOptions != ((options->BudgetFlags & TEMP_BUDGET_SET_DEVICE) != 0))
+        {
+            printf("Error: --min and --max apply to a device: budget <num> --min <size> --max <size>\n");
+            return CMD_INVALID;
+        }
+
+        if (options->DeviceNumber >= TEMP_MAX_DEVICES)
+        {
+            printf("Error: Device number must be between 0 and %d\n", TEMP_MAX_DEVICES - 1);
+            return CMD_INVALID;
+        }
+
+        return CMD_BUDGET;
+    }
+    else if (strcmp(argv[1], "qos") == 0)
+    {
+        options->Command = CMD_QOS;
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--iops") == 0 && i + 1 < argc)
+            {
+                options->IopsLimit = _strtoui64(argv[++i], NULL, 10);
+                options->QosFields |= QOS_FIELD_IOPS;
+            }
+            else if (strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc)
+            {
+                options->BandwidthLimit = ParseSize(argv[++i]);
+                options->QosFields |= QOS_FIELD_BANDWIDTH;
+            }
+            else if (strcmp(argv[i], "--weight") == 0 && i + 1 < argc)
+            {
+                options->QosWeight = atoi(argv[++i]);
+                options->QosFields |= QOS_FIELD_WEIGHT;
+            }
+            else if (strcmp(argv[i], "--total-iops") == 0 && i + 1 < argc)
+            {
+                options->TotalIops = _strtoui64(argv[++i], NULL, 10);
+                options->QosFields |= QOS_FIELD_TOTAL_IOPS;
+            }
+            else if (strcmp(argv[i], "--total-bandwidth") == 0 && i + 1 < argc)
+            {
+                options->TotalBandwidth = ParseSize(argv[++i]);
+                options->QosFields |= QOS_FIELD_TOTAL_BANDWIDTH;
+            }
+            else if (strcmp(argv[i], "--idle") == 0 && i + 1 < argc)
+            {
+                // "off" and "0" both parse as 0, which lets low-priority requests run at once
+                options->IdleIntervalMs = ParseInterval(argv[++i]);
+                options->QosFields |= QOS_FIELD_IDLE;
+            }
+            else if (argv[i][0] >= '0' && argv[i][0] <= '9' && !(options->QosFlags & TEMP_QOS_SET_DEVICE))
+            {
+                options->DeviceNumber = atoi(argv[i]);
+                options->QosFlags |= TEMP_QOS_SET_DEVICE;
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        BOOLEAN deviceOptions = (options->QosFields & QOS_FIELDS_DEVICE) != 0;
+
+        if (deviceOptions != ((options->QosFlags & TEMP_QOS_SET_DEVICE) != 0))
+        {
+            printf("Error: --iops, --bandwidth and --weight apply to a device: qos <num> --iops <n>\n");
+            return CMD_INVALID;
+        }
+
+        if (options->QosFields & ~QOS_FIELDS_DEVICE)
+        {
+            options->QosFlags |= TEMP_QOS_SET_DRIVER;
+        }
+
+        if (options->DeviceNumber >= TEMP_MAX_DEVICES)
+        {
+            printf("Error: Device number must be between 0 and %d\n", TEMP_MAX_DEVICES - 1);
+            return CMD_INVALID;
+        }
+
+        if (options->QosWeight > TEMP_QOS_MAX_WEIGHT)
+        {
+            printf("Error: --weight must be between 1 and %d\n", TEMP_QOS_MAX_WEIGHT);
+            return CMD_INVALID;
+        }
+
+        if (options->IdleIntervalMs > TEMP_QOS_MAX_IDLE_INTERVAL_MS)
+        {
+            printf("Error: --idle must not exceed %dms\n", TEMP_QOS_MAX_IDLE_INTERVAL_MS);
+            return CMD_INVALID;
+        }
+
+        return CMD_QOS;
+    }
+    else if (strcmp(argv[1], "shared-stats") == 0)
+    {
+        options->Command = CMD_SHARED_STATS;
+        options->IntervalMs = TEMP_SHARED_STATS_DEFAULT_INTERVAL_MS;
+
+        for (int i = 2; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--enable") == 0)
+            {
+                options->LockAction = LOCK_ACTION_ENABLE;
+            }
+            else if (strcmp(argv[i], "--disable") == 0)
+            {
+                options->LockAction = LOCK_ACTION_DISABLE;
+            }
+            else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+            {
+                options->IntervalMs = ParseInterval(argv[++i]);
+                if (options->IntervalMs < TEMP_SHARED_STATS_MIN_INTERVAL_MS ||
+                    options->IntervalMs > TEMP_SHARED_STATS_MAX_INTERVAL_MS)
+                {
+                    printf("Error: --interval must be between %dms and %ds\n", TEMP_SHARED_STATS_MIN_INTERVAL_MS,
+                           TEMP_SHARED_STATS_MAX_INTERVAL_MS / 1000);
+                    return CMD_INVALID;
+                }
+            }
+            else
+            {
+                printf("Error: Unknown option %s\n", argv[i]);
+                return CMD_INVALID;
+            }
+        }
+
+        return CMD_SHARED_STATS;
+    }
+    else if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0)
+    {
+        return CMD_VERSION;
+    }
+    else if (strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)
+    {
+        return CMD_HELP;
+    }
+    else
+    {
+        return CMD_INVALID;
+    }
+}
+
+void ShowHelp(const char *programName)
+{
+    printf("TEMP - High-Performance RAM Disk for Windows\n");
+    printf("Version %d.%d.%d\n\n", TEMP_VERSION_MAJOR, TEMP_VERSION_MINOR, TEMP_VERSION_BUILD);
+
+    printf("Usage: %s <command> [options]\n\n", programName);
+
+    printf("Commands:\n");
+    printf("  create          Create a new RAM disk\n");
+    printf("  remove <num>    Remove RAM disk by device number\n");
+    printf("  reset <num>     Discard everything on a RAM disk at once; it reads back as zeros\n");
+    printf("  clone <src> <dst>  Copy a whole RAM disk onto another inside the driver\n");
+    printf("  list            List all RAM disks\n");
+    printf("  stats <num>     Show statistics for device number (--latency for percentiles,\n");
+    printf("                  --watch for rates every interval)\n");
+    printf("  resize <num>    Grow or shrink a RAM disk while it is in use\n");
+    printf("  trace <num>     Record every request to a trace file for temp_replay\n");
+    printf("  locks <num>     Profile bucket lock contention and list the hottest buckets\n");
+    printf("  heatmap <num>   Show which regions of a RAM disk are read and written most\n");
+    printf("  bench <num>     Measure IOPS, bandwidth and latency with overlapped I/O\n");
+    printf("  exporter        Serve every RAM disk's metrics over HTTP for Prometheus\n");
+    printf("  shared-stats    Publish statistics in shared memory, or show what is published\n");
+    printf("  history <num>   Show the driver's per-second record of the last %d seconds\n", TEMP_HISTORY_SECONDS);
+    printf("  save <num>      Write a RAM disk's contents to an image for create --image\n");
+    printf("  budget [num]    Show or change the memory budget the RAM disks share\n");
+    printf("  qos [num]       Show or change I/O limits, weights and priority handling\n");
+    printf("  version         Show version information\n");
+    printf("  help            Show this help message\n\n");
+
+    printf("Create Options:\n");
+    printf("  --size <size>        Disk size (e.g., 128M, 1G, 2048K)\n");
+    printf("  --drive <letter>     Drive letter (A-Z)\n");
+    printf("  --device <num>       Device number (0-%d)\n", TEMP_MAX_DEVICES - 1);
+    printf("  --sector-size <size> Sector size in bytes, 512 or 4096 (default: 512)\n");
+    printf("  --4kn                4K native sectors (same as --sector-size 4096)\n");
+    printf("  --chunk-size <size>  Allocation chunk size, 16K to 2M (default: 64K)\n");
+    printf("  --on-pressure <list> Under low memory: release-zero, compress, spill (comma-separated)\n");
+    printf("  --spill-file <path>  File that receives cold chunks for --on-pressure spill\n");
+    printf("  --encrypt            Keep the data encrypted in memory (AES-256-XTS, key per device)\n");
+    printf("  --image <path>       Restore from an image; usable at once, loaded in the background\n");
+    printf("                       (default size: the image's)\n");
+    printf("  --mount <path>       Serve an ISO or image read-only straight from the file, without\n");
+    printf("                       copying it into memory (default size: the image's)\n");
+    printf("  --min-memory <size>  Memory guaranteed to the disk from the shared budget\n");
+    printf("  --max-memory <size>  Most memory the disk may hold (default: no maximum)\n");
+    printf("  --iops <n>           Most reads and writes per second (default: no limit)\n");
+    printf("  --bandwidth <size>   Most bytes read and written per second (default: no limit)\n");
+    printf("  --weight <n>         Share of the qos --total limits, 1-%d (default: %d)\n",
+           TEMP_QOS_MAX_WEIGHT, TEMP_QOS_DEFAULT_WEIGHT);
+    printf("  --removable          Mark as removable media\n");
+    printf("  --cdrom              Emulate CD-ROM drive\n\n");
+
+    printf("Stats Options:\n");
+    printf("  --latency            Latency and request size percentiles\n");
+    printf("  --watch              Print rates and memory growth every interval until Ctrl+C\n");
+    printf("  --interval <time>    Watch interval, 100ms to 1h (default: 1s)\n");
+    printf("  --seconds <n>        Stop watching after n seconds\n");
+    printf("  --csv                Watch rows as CSV\n");
+    printf("  --json               Watch rows as one JSON object per line\n\n");
+
+    printf("Resize Options:\n");
+    printf("  --size <size>        New disk size; a mounted volume is extended to fill it\n");
+    printf("  --force              Allow shrinking, which discards data past the new end\n\n");
+
+    printf("Reset Options:\n");
+    printf("  --force              Dismount the volume even if files on it are open\n\n");
+
+    printf("Clone Options:\n");
+    printf("  --force              Copy and dismount volumes even if files on them are open\n\n");
+
+    printf("Trace Options:\n");
+    printf("  --out <file>         Trace file to write\n");
+    printf("  --seconds <n>        Stop after n seconds (default: until Ctrl+C)\n");
+    printf("  --buffer <records>   Records buffered per processor (default: %d)\n\n", TEMP_TRACE_DEFAULT_RECORDS);
+
+    printf("Locks Options:\n");
+    printf("  --enable             Start profiling from zeroed counters\n");
+    printf("  --disable            Stop profiling; the counters are kept\n");
+    printf("  --top <n>            Buckets to list, 1-%d (default: %d)\n\n", TEMP_LOCK_CONTENTION_MAX_TOP,
+           TEMP_LOCK_CONTENTION_DEFAULT_TOP);
+
+    printf("Heatmap Options:\n");
+    printf("  --csv                Print one line per region instead of the map\n");
+    printf("  --out <file>         Write the CSV to a file\n");
+    printf("  --region <size>      Bytes per region, a power of two from 1M (default: 1M for CSV,\n");
+    printf("                       whatever fits %d rows for the map)\n", HEATMAP_MAX_ROWS);
+    printf("  --width <cells>      Map cells per row (default: %d)\n\n", HEATMAP_DEFAULT_WIDTH);
+
+    printf("Bench Options:\n");
+    printf("  --rw read|write|mix  Operation (default: read)\n");
+    printf("  --rwmixread <pct>    Share of reads in a mix (default: 50)\n");
+    printf("  --pattern seq|rand   Access pattern (default: rand)\n");
+    printf("  --bs <size>          Bytes per request, 512 to 4M (default: 4K)\n");
+    printf("  --iodepth <n>        Requests in flight per thread, 1-%d (default: 32)\n", BENCH_MAX_QUEUE_DEPTH);
+    printf("  --threads <n>        Threads, 1-%d (default: 1)\n", BENCH_MAX_THREADS);
+    printf("  --seconds <n>        Run time (default: %d)\n", BENCH_DEFAULT_SECONDS);
+    printf("  --force              Allow writes, which destroy the data on the disk\n\n");
+
+    printf("Exporter Options:\n");
+    printf("  --listen <ip:port>   Address to serve /metrics on (default: %s)\n\n", EXPORTER_DEFAULT_LISTEN);
+
+    printf("History Options:\n");
+    printf("  --seconds <n>        Seconds to show, newest last, 1-%d (default: %d)\n", TEMP_HISTORY_SECONDS,
+           HISTORY_DEFAULT_SECONDS);
+    printf("  --csv                One CSV row per second\n");
+    printf("  --json               One JSON object per second\n\n");
+
+    printf("Save Options:\n");
+    printf("  --out <file>         Image file to write, sparse where the disk holds zeros;\n");
+    printf("                       dismount the volume first for a consistent image\n\n");
+
+    printf("Budget Options:\n");
+    printf("  --limit <size>       Memory all RAM disks may hold together, 0 for no limit; it cannot\n");
+    printf("                       go below the sum of the guaranteed minimums\n");
+    printf("  --min <size>         Memory guaranteed to device <num>\n");
+    printf("  --max <size>         Most memory device <num> may hold, 0 for no maximum\n");
+    printf("  (no option)          Show the budget and every device's share of it\n\n");
+
+    printf("QoS Options:\n");
+    printf("  --iops <n>           Most reads and writes per second for device <num>, 0 for none\n");
+    printf("  --bandwidth <size>   Most bytes per second for device <num>, 0 for none\n");
+    printf("  --weight <n>         Device <num>'s share of the totals below, 1-%d\n", TEMP_QOS_MAX_WEIGHT);
+    printf("  --total-iops <n>     Requests per second all busy disks share by weight, 0 for none\n");
+    printf("  --total-bandwidth <size>\n");
+    printf("                       Bytes per second all busy disks share by weight, 0 for none\n");
+    printf("  --idle <interval>    Quiet time low-priority I/O waits for, up to %dms (default: %dms,\n",
+           TEMP_QOS_MAX_IDLE_INTERVAL_MS, TEMP_QOS_IDLE_INTERVAL_MS);
+    printf("                       off to run it at once)\n");
+    printf("  (no option)          Show the settings and how often requests were held back\n\n");
+
+    printf("Shared Stats Options:\n");
+    printf("  --enable             Have the driver refresh the shared page every interval\n");
+    printf("  --interval <time>    Refresh interval, %dms to %ds (default: %dms)\n", TEMP_SHARED_STATS_MIN_INTERVAL_MS,
+           TEMP_SHARED_STATS_MAX_INTERVAL_MS / 1000, TEMP_SHARED_STATS_DEFAULT_INTERVAL_MS);
+    printf("  --disable            Stop refreshing and remove the page\n");
+    printf("  (no option)          Print the devices as the page shows them\n\n");
+
+    printf("Size Examples:\n");
+    printf("  64M     64 megabytes\n");
+    printf("  1G      1 gigabyte\n");
+    printf("  512K    512 kilobytes\n");
+    printf("  1048576 1048576 bytes\n\n");
+
+    printf("Examples:\n");
+    printf("  %s create --size 256M --drive R\n", programName);
+    printf("  %s create --size 1G --device 1 --removable\n", programName);
+    printf("  %s create --size 4G --drive S --encrypt\n", programName);
+    printf("  %s create --size 8G --drive T --on-pressure release-zero,compress,spill --spill-file D:\\temp.spill\n", programName);
+    printf("  %s remove 0\n", programName);
+    printf("  %s reset 0\n", programName);
+    printf("  %s clone 0 1\n", programName);
+    printf("  %s list\n", programName);
+    printf("  %s stats 0\n", programName);
+    printf("  %s stats 0 --latency\n", programName);
+    printf("  %s stats 0 --watch --interval 1s\n", programName);
+    printf("  %s stats 0 --watch --interval 10s --csv > disk0.csv\n", programName);
+    printf("  %s resize 0 --size 2G\n", programName);
+    printf("  %s trace 0 --out disk0.trace --seconds 60\n", programName);
+    printf("  %s locks 0 --enable\n", programName);
+    printf("  %s locks 0 --top 8\n", programName);
+    printf("  %s heatmap 0\n", programName);
+    printf("  %s heatmap 0 --out disk0-heat.csv --region 16M\n", programName);
+    printf("  %s bench 0 --bs 4K --iodepth 32 --threads 4\n", programName);
+    printf("  %s bench 0 --rw mix --rwmixread 70 --pattern seq --bs 1M --force\n", programName);
+    printf("  %s exporter --listen 127.0.0.1:9477\n", programName);
+    printf("  %s history 0 --seconds 120\n", programName);
+    printf("  %s history 0 --seconds 600 --csv > disk0-history.csv\n", programName);
+    printf("  %s save 0 --out D:\\disk0.img\n", programName);
+    printf("  %s create --drive R --image D:\\disk0.img\n", programName);
+    printf("  %s create --drive E --cdrom --mount D:\\setup.iso\n", programName);
+    printf("  %s budget --limit 16G\n", programName);
+    printf("  %s create --size 32G --drive R --min-memory 2G --max-memory 12G --on-pressure compress\n", programName);
+    printf("  %s budget 0 --min 4G\n", programName);
+    printf("  %s create --size 4G --drive S --iops 20000 --bandwidth 200M\n", programName);
+    printf("  %s qos --total-bandwidth 2G\n", programName);
+    printf("  %s qos 1 --weight 400\n", programName);
+    printf("  %s shared-stats --enable --interval 250ms\n", programName);
+    printf("  %s shared-stats\n", programName);
+}
+
+void ShowVersion(void)
+{
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice != INVALID_HANDLE_VALUE)
+    {
+        ULONG version = 0;
+        DWORD bytesReturned = 0;
+
+        if (DeviceIoControl(hDevice, TEMP_IOCTL_GET_VERSION, NULL, 0,
+                            &version, sizeof(version), &bytesReturned, NULL))
+        {
+            ULONG major = (version >> 16) & 0xFF;
+            ULONG minor = (version >> 8) & 0xFF;
+            ULONG build = version & 0xFF;
+
+            printf("TEMP RAM Disk Driver Version: %d.%d.%d\n", major, minor, build);
+        }
+        else
+        {
+            printf("TEMP RAM Disk Driver: Version information unavailable\n");
+        }
+
+        CloseHandle(hDevice);
+    }
+    else
+    {
+        printf("TEMP RAM Disk Driver: Not installed or not running\n");
+    }
+
+    printf("Command Line Tool Version: %d.%d.%d\n",
+           TEMP_VERSION_MAJOR, TEMP_VERSION_MINOR, TEMP_VERSION_BUILD);
+}
+
+// Size of the disk an image restores: the saved disk's for an image written by
+// save, the whole file for a raw one
+static BOOL ReadImageSize(const char *path, ULONG64 *diskSize)
+{
+    TEMP_IMAGE_FILE_HEADER header = {0};
+    LARGE_INTEGER fileSize;
+    DWORD bytesRead = 0;
+
+    HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    BOOL success = GetFileSizeEx(hFile, &fileSize) && ReadFile(hFile, &header, sizeof(header), &bytesRead, NULL);
+    CloseHandle(hFile);
+
+    if (!success)
+    {
+        return FALSE;
+    }
+
+    *diskSize = bytesRead == sizeof(header) && header.Magic == TEMP_IMAGE_FILE_MAGIC ? header.DiskSize
+                                                                                       : (ULONG64)fileSize.QuadPart;
+    return TRUE;
+}
+
+NTSTATUS CreateRamDisk(const COMMAND_OPTIONS *options)
+{
+    ULONG64 diskSize = options->DiskSize;
+
+    if (options->ImageFile[0] && !options->SizeSpecified && !ReadImageSize(options->ImageFile, &diskSize))
+    {
+        printf("Error: Cannot read %s. Windows error: %d\n", options->ImageFile, GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    TEMP_CREATE_DATA createData = {0};
+    createData.DeviceNumber = options->DeviceNumber;
+    createData.DiskSize = diskSize;
+    createData.SectorSize = options->SectorSize;
+    createData.ChunkSize = options->ChunkSize;
+    createData.PressurePolicy = options->PressurePolicy;
+    memcpy(createData.SpillFileName, options->SpillFileName, sizeof(createData.SpillFileName));
+    if (options->ImageFile[0])
+    {
+        swprintf_s(createData.FileName, MAX_PATH, L"\\??\\%S", options->ImageFile);
+    }
+    createData.Encryption = options->Encryption;
+    createData.ImageMode = options->ImageMode;
+    createData.MemoryMinimum = options->MemoryMinimum;
+    createData.MemoryMaximum = options->MemoryMaximum;
+    createData.IopsLimit = options->IopsLimit;
+    createData.BandwidthLimit = options->BandwidthLimit;
+    createData.QosWeight = options->QosWeight;
+    createData.DriveLetter = options->DriveLetter;
+    createData.RemovableMedia = options->RemovableMedia;
+    createData.CdRomType = options->CdRomType;
+
+    DWORD bytesReturned = 0;
+    BOOL success = DeviceIoControl(
+        hDevice,
+        TEMP_IOCTL_CREATE_DEVICE,
+        &createData,
+        sizeof(createData),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL);
+
+    CloseHandle(hDevice);
+
+    if (success)
+    {
+        printf("RAM disk created successfully:\n");
+        printf("  Device Number: %d\n", options->DeviceNumber);
+        printf("  Size: %llu bytes (%.2f MB)\n", diskSize, (double)diskSize / (1024.0 * 1024.0));
+        printf("  Sector Size: %d bytes\n", options->SectorSize);
+        printf("  Chunk Size: %d KB\n", (options->ChunkSize ? options->ChunkSize : TEMP_DEFAULT_CHUNK_SIZE) / 1024);
+
+        if (options->PressurePolicy)
+        {
+            printf("  Under Memory Pressure:%s%s%s\n",
+                   (options->PressurePolicy & TEMP_PRESSURE_RELEASE_ZERO) ? " release-zero" : "",
+                   (options->PressurePolicy & TEMP_PRESSURE_COMPRESS) ? " compress" : "",
+                   (options->PressurePolicy & TEMP_PRESSURE_SPILL) ? " spill" : "");
+        }
+
+        if (options->Encryption == TEMP_ENCRYPTION_AES_XTS)
+        {
+            printf("  Encryption: AES-256-XTS\n");
+        }
+
+        if (options->ImageFile[0])
+        {
+            printf("  Image: %s (%s)\n", options->ImageFile,
+                   options->ImageMode == TEMP_IMAGE_MAPPED ? "mapped read-only" : "loading in the background");
+        }
+
+        if (options->MemoryMinimum || options->MemoryMaximum)
+        {
+            char maximum[32] = "no maximum";
+            if (options->MemoryMaximum)
+            {
+                sprintf_s(maximum, sizeof(maximum), "%.2f MB", (double)options->MemoryMaximum / (1024.0 * 1024.0));
+            }
+            printf("  Memory Budget: %.2f MB guaranteed, %s\n",
+                   (double)options->MemoryMinimum / (1024.0 * 1024.0), maximum);
+        }
+
+        if (options->IopsLimit || options->BandwidthLimit)
+        {
+            char iops[32] = "no IOPS limit";
+            char bandwidth[32] = "no bandwidth limit";
+            if (options->IopsLimit)
+            {
+                sprintf_s(iops, sizeof(iops), "%llu IOPS", options->IopsLimit);
+            }
+            if (options->BandwidthLimit)
+            {
+                sprintf_s(bandwidth, sizeof(bandwidth), "%.2f MB/s", (double)options->BandwidthLimit / (1024.0 * 1024.0));
+            }
+            printf("  I/O Limits: %s, %s\n", iops, bandwidth);
+        }
+
+        if (options->DriveLetter)
+        {
+            printf("  Drive Letter: %C:\n", options->DriveLetter);
+        }
+
+        if (options->RemovableMedia)
+        {
+            printf("  Type: Removable Media\n");
+        }
+        else if (options->CdRomType)
+        {
+            printf("  Type: CD-ROM\n");
+        }
+        else
+        {
+            printf("  Type: Fixed Disk\n");
+        }
+
+        return STATUS_SUCCESS;
+    }
+    else
+    {
+        DWORD error = GetLastError();
+        printf("Failed to create RAM disk. Windows error: %d\n", error);
+        return STATUS_UNSUCCESSFUL;
+    }
+}
+
+NTSTATUS RemoveRamDisk(ULONG deviceNumber)
+{
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    DWORD bytesReturned = 0;
+    BOOL success = DeviceIoControl(
+        hDevice,
+        TEMP_IOCTL_REMOVE_DEVICE,
+        &deviceNumber,
+        sizeof(deviceNumber),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL);
+
+    CloseHandle(hDevice);
+
+    if (success)
+    {
+        printf("RAM disk %d removed successfully.\n", deviceNumber);
+        return STATUS_SUCCESS;
+    }
+    else
+    {
+        DWORD error = GetLastError();
+        printf("Failed to remove RAM disk %d. Windows error: %d\n", deviceNumber, error);
+        return STATUS_UNSUCCESSFUL;
+    }
+}
+
+// Locks the volume on a RAM disk, if it has a drive letter, until *volume is closed:
+// its file system flushes and stops writing. With dismount set the file system is
+// also taken off the disk. A volume with files open cannot be locked, which is an
+// error unless force is set. Prints the reason and returns FALSE on failure.
+static BOOL LockRamDiskVolume(ULONG deviceNumber, BOOLEAN dismount, BOOLEAN force, WCHAR *driveLetter, HANDLE *volume)
+{
+    DWORD bytesReturned = 0;
+
+    *volume = INVALID_HANDLE_VALUE;
+    *driveLetter = FindDriveLetter(deviceNumber);
+
+    if (!*driveLetter)
+    {
+        return TRUE;
+    }
+
+    WCHAR volumePath[8];
+    swprintf_s(volumePath, ARRAYSIZE(volumePath), L"\\\\.\\%c:", *driveLetter);
+
+    HANDLE hVolume = CreateFileW(volumePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open volume %C: (error %d)\n", *driveLetter, GetLastError());
+        return FALSE;
+    }
+
+    if (!DeviceIoControl(hVolume, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL) && !force)
+    {
+        printf("Error: Volume %C: is in use. Close the files open on it or use --force.\n", *driveLetter);
+        CloseHandle(hVolume);
+        return FALSE;
+    }
+
+    if (dismount)
+    {
+        DeviceIoControl(hVolume, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL);
+    }
+
+    *volume = hVolume;
+    return TRUE;
+}
+
+// Empties a RAM disk in place. The driver only marks the data as gone, so this takes
+// the same time whatever the disk holds; the memory is freed in the background. A
+// volume on the disk is dismounted first, since its file system would no longer
+// match the disk, and is left for the caller to format again.
+NTSTATUS ResetRamDisk(const COMMAND_OPTIONS *options)
+{
+    HANDLE hVolume;
+    WCHAR driveLetter;
+    DWORD bytesReturned = 0;
+
+    // The lock is released when the handle closes, after the reset
+    if (!LockRamDiskVolume(options->DeviceNumber, TRUE, options->Force, &driveLetter, &hVolume))
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        if (hVolume != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hVolume);
+        }
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    ULONG deviceNumber = options->DeviceNumber;
+    BOOL success = DeviceIoControl(hDevice, TEMP_IOCTL_FORMAT_DEVICE, &deviceNumber, sizeof(deviceNumber),
+                                   NULL, 0, &bytesReturned, NULL);
+    DWORD error = GetLastError();
+
+    CloseHandle(hDevice);
+    if (hVolume != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hVolume);
+    }
+
+    if (!success)
+    {
+        printf("Failed to reset RAM disk %d. Windows error: %d\n", deviceNumber, error);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("RAM disk %d reset; it reads back as zeros.\n", deviceNumber);
+    if (driveLetter)
+    {
+        printf("  Volume %C: was dismounted. Format it before use, e.g. format %C: /FS:NTFS /Q /Y\n",
+               driveLetter, driveLetter);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Every device's configuration and statistics from one TEMP_IOCTL_LIST_DEVICES
+// request on the control device. Entries are copied out at the driver's EntrySize
+// so a driver with a shorter TEMP_DEVICE_INFO leaves the remaining fields zero.
+static BOOL FetchDeviceList(TEMP_DEVICE_INFO *devices, ULONG *count)
+{
+    DWORD bufferSize = FIELD_OFFSET(TEMP_DEVICE_LIST, Devices) + TEMP_MAX_DEVICES * sizeof(TEMP_DEVICE_INFO);
+    TEMP_DEVICE_LIST *list = (TEMP_DEVICE_LIST *)calloc(1, bufferSize);
+    DWORD bytesReturned = 0;
+    BOOL success = FALSE;
+
+    *count = 0;
+
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice == INVALID_HANDLE_VALUE || !list)
+    {
+        if (hDevice != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hDevice);
+        }
+        free(list);
+        return FALSE;
+    }
+
+    if (DeviceIoControl(hDevice, TEMP_IOCTL_LIST_DEVICES, NULL, 0, list, bufferSize, &bytesReturned, NULL) &&
+        bytesReturned >= FIELD_OFFSET(TEMP_DEVICE_LIST, Devices) && list->Version == TEMP_DEVICE_LIST_VERSION &&
+        list->EntrySize > 0 && (ULONG64)list->Size + (ULONG64)list->DevicesReturned * list->EntrySize <= bytesReturned)
+    {
+        ULONG entrySize = list->EntrySize < sizeof(TEMP_DEVICE_INFO) ? list->EntrySize : sizeof(TEMP_DEVICE_INFO);
+
+        for (ULONG i = 0; i < list->DevicesReturned && i < TEMP_MAX_DEVICES; i++)
+        {
+            memset(&devices[i], 0, sizeof(devices[i]));
+            memcpy(&devices[i], (const BYTE *)list + list->Size + (SIZE_T)i * list->EntrySize, entrySize);
+        }
+
+        *count = list->DevicesReturned < TEMP_MAX_DEVICES ? list->DevicesReturned : TEMP_MAX_DEVICES;
+        success = TRUE;
+    }
+
+    CloseHandle(hDevice);
+    free(list);
+    return success;
+}
+
+// One decimal place, as the list has always shown sizes
+static void FormatListSize(ULONG64 bytes, char *buffer, size_t bufferSize)
+{
+    if (bytes >= 1024 * 1024 * 1024)
+    {
+        sprintf_s(buffer, bufferSize, "%.1f GB", (double)bytes / (1024.0 * 1024.0 * 1024.0));
+    }
+    else if (bytes >= 1024 * 1024)
+    {
+        sprintf_s(buffer, bufferSize, "%.1f MB", (double)bytes / (1024.0 * 1024.0));
+    }
+    else
+    {
+        sprintf_s(buffer, bufferSize, "%.1f KB", (double)bytes / 1024.0);
+    }
+}
+
+// Enables a privilege the process token holds but has disabled, as elevated tokens
+// have most of theirs. FALSE if the token does not hold it at all.
+static BOOL EnableTokenPrivilege(LPCWSTR name)
+{
+    TOKEN_PRIVILEGES privileges = {0};
+    HANDLE token;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token))
+    {
+        return FALSE;
+    }
+
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    // Adjusting succeeds with ERROR_NOT_ALL_ASSIGNED when the privilege is missing
+    BOOL enabled = LookupPrivilegeValueW(NULL, name, &privileges.Privileges[0].Luid) &&
+                   AdjustTokenPrivileges(token, FALSE, &privileges, sizeof(privileges), NULL, NULL) &&
+                   GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle(token);
+    return enabled;
+}
+
+// Copies a whole RAM disk onto another inside the driver, a step at a time for
+// progress. Chunks that line up are shared copy-on-write rather than copied. The
+// source volume is locked so its file system is flushed and stays consistent for
+// the copy; the target volume is dismounted, since its file system is replaced.
+NTSTATUS CloneRamDisk(const COMMAND_OPTIONS *options)
+{
+    TEMP_DEVICE_INFO devices[TEMP_MAX_DEVICES];
+    const TEMP_DEVICE_INFO *source = NULL;
+    const TEMP_DEVICE_INFO *target = NULL;
+    ULONG count = 0;
+    DWORD bytesReturned = 0;
+
+    if (options->DeviceNumber == options->TargetDevice)
+    {
+        printf("Error: Source and target must be different RAM disks\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!FetchDeviceList(devices, &count))
+    {
+        printf("Error: Cannot list devices. Driver may not be installed. Windows error: %d\n", GetLastError());
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        if (devices[i].DeviceNumber == options->DeviceNumber)
+        {
+            source = &devices[i];
+        }
+        else if (devices[i].DeviceNumber == options->TargetDevice)
+        {
+            target = &devices[i];
+        }
+    }
+
+    if (!source || !target)
+    {
+        printf("Error: RAM disk %d not found\n", source ? options->TargetDevice : options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    if (target->Statistics.DiskSize < source->Statistics.DiskSize)
+    {
+        printf("Error: RAM disk %d is smaller than RAM disk %d\n", options->TargetDevice, options->DeviceNumber);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (source->Encryption != TEMP_ENCRYPTION_NONE && target->Encryption == TEMP_ENCRYPTION_NONE)
+    {
+        printf("Error: RAM disk %d is encrypted and RAM disk %d is not; its data cannot be cloned in the clear\n",
+               options->DeviceNumber, options->TargetDevice);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The driver copies around the file systems' security, so it asks for the same
+    // privilege as other volume-level tools
+    if (!EnableTokenPrivilege(SE_MANAGE_VOLUME_NAME))
+    {
+        printf("Error: Cloning needs the \"Perform volume maintenance tasks\" privilege. Run as administrator.\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    HANDLE sourceVolume, targetVolume;
+    WCHAR sourceLetter, targetLetter;
+
+    if (!LockRamDiskVolume(options->DeviceNumber, FALSE, options->Force, &sourceLetter, &sourceVolume))
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (!LockRamDiskVolume(options->TargetDevice, TRUE, options->Force, &targetLetter, &targetVolume))
+    {
+        if (sourceVolume != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(sourceVolume);
+        }
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    HANDLE hDevice = OpenControlDevice();
+    BOOL success = hDevice != INVALID_HANDLE_VALUE;
+    DWORD error = success ? ERROR_SUCCESS : GetLastError();
+    ULONG64 diskSize = source->Statistics.DiskSize;
+    ULONG64 copied = 0;
+    ULONG64 shared = 0;
+
+    char sizeText[32];
+    FormatListSize(diskSize, sizeText, sizeof(sizeText));
+    printf("Cloning RAM disk %d to RAM disk %d (%s)...\n", options->DeviceNumber, options->TargetDevice, sizeText);
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    while (success && copied < diskSize)
+    {
+        TEMP_COPY_DATA copy = {0};
+
+        copy.SourceDevice = options->DeviceNumber;
+        copy.TargetDevice = options->TargetDevice;
+        copy.SourceOffset = copied;
+        copy.TargetOffset = copied;
+        copy.Length = diskSize - copied < CLONE_STEP_SIZE ? diskSize - copied : CLONE_STEP_SIZE;
+
+        success = DeviceIoControl(hDevice, TEMP_IOCTL_COPY_RANGE, &copy, sizeof(copy), &copy, sizeof(copy),
+                                  &bytesReturned, NULL);
+        if (!success)
+        {
+            error = GetLastError();
+            break;
+        }
+
+        copied += copy.Length;
+        shared += copy.SharedLength;
+        printf("\r  %3llu%%", copied * 100 / diskSize);
+    }
+
+    QueryPerformanceCounter(&end);
+    printf("\n");
+
+    if (hDevice != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hDevice);
+    }
+    if (targetVolume != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(targetVolume);
+    }
+    if (sourceVolume != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(sourceVolume);
+    }
+
+    if (!success)
+    {
+        printf("Failed to clone RAM disk %d after %llu bytes. Windows error: %d\n", options->DeviceNumber, copied,
+               error);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+    char sharedText[32];
+    FormatListSize(shared, sharedText, sizeof(sharedText));
+
+    printf("RAM disk %d cloned to RAM disk %d in %.2f s", options->DeviceNumber, options->TargetDevice, seconds);
+    if (seconds > 0)
+    {
+        printf(" (%.0f MB/s)", (double)diskSize / (1024.0 * 1024.0) / seconds);
+    }
+    printf("\n  %s shared copy-on-write, the rest copied\n", sharedText);
+
+    if (targetLetter)
+    {
+        printf("  Volume %C: was dismounted; it mounts again with the cloned file system on next access.\n",
+               targetLetter);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static const char *DeviceTypeName(const TEMP_DEVICE_INFO *info)
+{
+    if (info->Encryption != TEMP_ENCRYPTION_NONE)
+    {
+        return info->CdRomType ? "CD-ROM, encrypted" : info->RemovableMedia ? "Removable, encrypted" : "Fixed, encrypted";
+    }
+
+    return info->CdRomType ? "CD-ROM" : info->RemovableMedia ? "Removable" : "Fixed";
+}
+
+NTSTATUS ListRamDisks(void)
+{
+    TEMP_DEVICE_INFO devices[TEMP_MAX_DEVICES];
+    ULONG count = 0;
+
+    if (!FetchDeviceList(devices, &count))
+    {
+        printf("Error: Cannot list devices. Driver may not be installed. Windows error: %d\n", GetLastError());
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (count == 0)
+    {
+        printf("No RAM disks found.\n");
+        return STATUS_SUCCESS;
+    }
+
+    printf("Active RAM Disks:\n");
+    printf("Device | Size      | Used      | Drive | Sector | Type\n");
+    printf("-------|-----------|-----------|-------|--------|----------\n");
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        const TEMP_DEVICE_INFO *info = &devices[i];
+        char sizeStr[32];
+        char usedStr[32];
+        char driveStr[8] = "N/A";
+
+        FormatListSize(info->Statistics.DiskSize, sizeStr, sizeof(sizeStr));
+        FormatListSize(info->Statistics.MemoryUsed, usedStr, sizeof(usedStr));
+
+        if (info->DriveLetter)
+        {
+            sprintf_s(driveStr, sizeof(driveStr), "%c:", (char)info->DriveLetter);
+        }
+
+        printf("%-6u | %-9s | %-9s | %-5s | %-6u | %s\n",
+               info->DeviceNumber, sizeStr, usedStr, driveStr, info->SectorSize, DeviceTypeName(info));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ShowStatistics(ULONG deviceNumber)
+{
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", deviceNumber);
+
+    HANDLE hDevice = CreateFileW(
+        devicePath,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        0,
+        NULL);
+
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", deviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    TEMP_STATISTICS stats = {0};
+    DWORD bytesReturned = 0;
+
+    BOOL success = DeviceIoControl(
+        hDevice,
+        TEMP_IOCTL_GET_STATISTICS,
+        NULL,
+        0,
+        &stats,
+        sizeof(stats),
+        &bytesReturned,
+        NULL);
+
+    if (success)
+    {
+        printf("Statistics for RAM Disk %d:\n", deviceNumber);
+        printf("  Disk Size: %llu bytes (%.2f MB)\n", stats.DiskSize,
+               (double)stats.DiskSize / (1024.0 * 1024.0));
+        printf("  Memory Used: %llu bytes (%.2f MB)\n", stats.MemoryUsed,
+               (double)stats.MemoryUsed / (1024.0 * 1024.0));
+        printf("  Total Reads: %llu\n", stats.TotalReads);
+        printf("  Total Writes: %llu\n", stats.TotalWrites);
+        printf("  Bytes Read: %llu (%.2f MB)\n", stats.BytesRead,
+               (double)stats.BytesRead / (1024.0 * 1024.0));
+        printf("  Bytes Written: %llu (%.2f MB)\n", stats.BytesWritten,
+               (double)stats.BytesWritten / (1024.0 * 1024.0));
+        printf("  Cache Hits: %llu\n", stats.CacheHits);
+        printf("  Cache Misses: %llu\n", stats.CacheMisses);
+
+        if (stats.CacheHits + stats.CacheMisses > 0)
+        {
+            double hitRatio = (double)stats.CacheHits / (stats.CacheHits + stats.CacheMisses) * 100.0;
+            printf("  Cache Hit Ratio: %.2f%%\n", hitRatio);
+        }
+
+        printf("  Evictions: %llu\n", stats.EvictionCount);
+        printf("  Memory Pressure Events: %llu\n", stats.PressureEvents);
+        printf("  Bytes Reclaimed: %llu (%.2f MB)\n", stats.BytesReclaimed,
+               (double)stats.BytesReclaimed / (1024.0 * 1024.0));
+        printf("  Compressed Chunks: %llu (%.2f MB stored)\n", stats.CompressedChunks,
+               (double)stats.CompressedBytes / (1024.0 * 1024.0));
+        printf("  Spilled Chunks: %llu\n", stats.SpilledChunks);
+
+        ShowMemoryUsage(hDevice);
+
+        CloseHandle(hDevice);
+        return STATUS_SUCCESS;
+    }
+    else
+    {
+        DWORD error = GetLastError();
+        CloseHandle(hDevice);
+        printf("Failed to get statistics for device %d. Windows error: %d\n", deviceNumber, error);
+        return STATUS_UNSUCCESSFUL;
+    }
+}
+
+// Prints the memory accounting section of the stats command; drivers without
+// TEMP_IOCTL_GET_MEMORY_STATISTICS are skipped silently
+void ShowMemoryUsage(HANDLE hDevice)
+{
+    TEMP_MEMORY_STATISTICS usage = {0};
+    DWORD bytesReturned = 0;
+
+    if (!DeviceIoControl(hDevice, TEMP_IOCTL_GET_MEMORY_STATISTICS, NULL, 0,
+                         &usage, sizeof(usage), &bytesReturned, NULL) ||
+        bytesReturned < sizeof(usage))
+    {
+        return;
+    }
+
+    ULONG64 allocatedBytes = usage.AllocatedChunks * usage.ChunkSize;
+
+    printf("\nMemory Accounting:\n");
+    printf("  Chunks Allocated: %llu of %llu (%llu resident, %llu compressed, %llu spilled)\n",
+           usage.AllocatedChunks, usage.ChunkCapacity, usage.ResidentChunks,
+           usage.CompressedChunks, usage.SpilledChunks);
+    printf("  Resident Data: %llu bytes (%.2f MB)\n", usage.ResidentDataBytes,
+           (double)usage.ResidentDataBytes / (1024.0 * 1024.0));
+    printf("  Compressed Data: %llu bytes (%.2f MB)\n", usage.CompressedDataBytes,
+           (double)usage.CompressedDataBytes / (1024.0 * 1024.0));
+    printf("  Metadata: %llu bytes (%.2f MB)\n", usage.MetadataBytes,
+           (double)usage.MetadataBytes / (1024.0 * 1024.0));
+    printf("  In-Use Data: %llu bytes (%.2f MB)", usage.InUseDataBytes,
+           (double)usage.InUseDataBytes / (1024.0 * 1024.0));
+
+    if (allocatedBytes > 0)
+    {
+        printf(", %.1f%% of allocated", (double)usage.InUseDataBytes / allocatedBytes * 100.0);
+    }
+
+    printf("\n");
+    printf("  Partially Used Chunks: %llu", usage.PartialChunks);
+
+    if (usage.AllocatedChunks > 0)
+    {
+        printf(" (%.1f%% fragmentation)", (double)usage.PartialChunks / usage.AllocatedChunks * 100.0);
+    }
+
+    printf("\n");
+    printf("  Allocation Failures: %llu\n", usage.AllocationFailures);
+
+    if (usage.SharedChunks)
+    {
+        printf("  Shared Chunks: %llu, copy-on-write with clones\n", usage.SharedChunks);
+    }
+
+    if (usage.ImagePendingChunks || usage.ImageDemandLoads)
+    {
+        printf("  Image: %llu chunks still to load, %llu loaded on demand\n",
+               usage.ImagePendingChunks, usage.ImageDemandLoads);
+    }
+
+    printf("  Budget: %.2f MB charged, %.2f MB guaranteed, ", (double)usage.BudgetCharged / (1024.0 * 1024.0),
+           (double)usage.BudgetMinimum / (1024.0 * 1024.0));
+    if (usage.BudgetMaximum)
+    {
+        printf("%.2f MB maximum", (double)usage.BudgetMaximum / (1024.0 * 1024.0));
+    }
+    else
+    {
+        printf("no maximum");
+    }
+    printf(", %llu allocations refused\n", usage.BudgetDenials);
+
+    printf("  Bucket Occupancy: %u buckets, %u to %u chunks each\n",
+           usage.BucketCount, usage.MinBucketChunks, usage.MaxBucketChunks);
+
+    for (ULONG i = 0; i < TEMP_OCCUPANCY_BINS; i++)
+    {
+        if (usage.BucketOccupancy[i])
+        {
+            printf("    %3u%%-%3u%%: %u\n", i * 100 / TEMP_OCCUPANCY_BINS,
+                   (i + 1) * 100 / TEMP_OCCUPANCY_BINS, usage.BucketOccupancy[i]);
+        }
+    }
+}
+
+// Prints service latency percentiles and the request size distribution per operation
+NTSTATUS ShowLatency(ULONG deviceNumber)
+{
+    static const char *operationNames[TEMP_OPERATION_COUNT] = {"Read", "Write", "IOCTL"};
+
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", deviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", deviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    TEMP_LATENCY_STATISTICS *latency = (TEMP_LATENCY_STATISTICS *)calloc(1, sizeof(TEMP_LATENCY_STATISTICS));
+    DWORD bytesReturned = 0;
+
+    BOOL success = latency && DeviceIoControl(hDevice, TEMP_IOCTL_GET_LATENCY_STATISTICS, NULL, 0,
+                                              latency, sizeof(TEMP_LATENCY_STATISTICS), &bytesReturned, NULL);
+
+    CloseHandle(hDevice);
+
+    if (!success || bytesReturned < sizeof(TEMP_LATENCY_STATISTICS))
+    {
+        printf("Failed to get latency statistics for device %d. Windows error: %d\n", deviceNumber, GetLastError());
+        free(latency);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("Latency for RAM Disk %d:\n", deviceNumber);
+    printf("Operation | Count        | Mean      | p50       | p90       | p99       | p99.9     | Max\n");
+    printf("----------|--------------|-----------|-----------|-----------|-----------|-----------|----------\n");
+
+    for (ULONG op = 0; op < TEMP_OPERATION_COUNT; op++)
+    {
+        TEMP_OPERATION_LATENCY *operation = &latency->Operations[op];
+        char values[TEMP_PERCENTILE_COUNT + 2][16];
+
+        FormatLatency(operation->Count ? operation->TotalLatency / operation->Count : 0, values[0], sizeof(values[0]));
+        for (ULONG p = 0; p < TEMP_PERCENTILE_COUNT; p++)
+        {
+            FormatLatency(operation->LatencyPercentiles[p], values[p + 1], sizeof(values[p + 1]));
+        }
+        FormatLatency(operation->MaxLatency, values[TEMP_PERCENTILE_COUNT + 1], sizeof(values[0]));
+
+        printf("%-9s | %-12llu | %-9s | %-9s | %-9s | %-9s | %-9s | %s\n", operationNames[op], operation->Count,
+               values[0], values[1], values[2], values[3], values[4], values[5]);
+    }
+
+    // Collapse the size histogram into power-of-two ranges. Buckets below
+    // 2 << SubBucketBits hold one value each; above that, each group of
+    // 2^SubBucketBits buckets covers one power of two.
+    for (ULONG op = 0; op < TEMP_OPERATION_COUNT; op++)
+    {
+        TEMP_OPERATION_LATENCY *operation = &latency->Operations[op];
+        ULONG64 classes[64] = {0};
+        ULONG subBuckets = 1UL << latency->SubBucketBits;
+
+        if (operation->Count == 0)
+        {
+            continue;
+        }
+
+        for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+        {
+            ULONG sizeClass;
+
+            if (i < 2 * subBuckets)
+            {
+                sizeClass = 0;
+                for (ULONG value = i; value > 1; value >>= 1)
+                {
+                    sizeClass++;
+                }
+            }
+            else
+            {
+                sizeClass = i / subBuckets + latency->SubBucketBits - 1;
+            }
+
+            classes[sizeClass < 63 ? sizeClass : 63] += operation->SizeHistogram[i];
+        }
+
+        char p50[16], p99[16];
+        FormatBytes(operation->SizePercentiles[0], p50, sizeof(p50));
+        FormatBytes(operation->SizePercentiles[2], p99, sizeof(p99));
+
+        printf("\n%s Request Sizes (p50 %s, p99 %s):\n", operationNames[op], p50, p99);
+
+        for (ULONG c = 0; c < 64; c++)
+        {
+            if (classes[c])
+            {
+                char low[16], high[16];
+                FormatBytes(c ? 1ULL << c : 0, low, sizeof(low));
+                FormatBytes(2ULL << c, high, sizeof(high));
+                printf("  %8s - %-8s %12llu (%5.1f%%)\n", low, high, classes[c],
+                       (double)classes[c] / operation->Count * 100.0);
+            }
+        }
+    }
+
+    free(latency);
+    return STATUS_SUCCESS;
+}
+
+void FormatLatency(ULONG64 nanoseconds, char *buffer, size_t bufferSize)
+{
+    if (nanoseconds < 1000)
+    {
+        sprintf_s(buffer, bufferSize, "%llu ns", nanoseconds);
+    }
+    else if (nanoseconds < 1000000)
+    {
+        sprintf_s(buffer, bufferSize, "%.1f us", nanoseconds / 1000.0);
+    }
+    else if (nanoseconds < 1000000000)
+    {
+        sprintf_s(buffer, bufferSize, "%.2f ms", nanoseconds / 1000000.0);
+    }
+    else
+    {
+        sprintf_s(buffer, bufferSize, "%.2f s", nanoseconds / 1000000000.0);
+    }
+}
+
+void FormatBytes(ULONG64 bytes, char *buffer, size_t bufferSize)
+{
+    if (bytes >= 1024ULL * 1024 * 1024)
+    {
+        sprintf_s(buffer, bufferSize, "%llu GB", bytes >> 30);
+    }
+    else if (bytes >= 1024 * 1024)
+    {
+        sprintf_s(buffer, bufferSize, "%llu MB", bytes >> 20);
+    }
+    else if (bytes >= 1024)
+    {
+        sprintf_s(buffer, bufferSize, "%llu KB", bytes >> 10);
+    }
+    else
+    {
+        sprintf_s(buffer, bufferSize, "%llu B", bytes);
+    }
+}
+
+NTSTATUS ResizeRamDisk(const COMMAND_OPTIONS *options)
+{
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    TEMP_STATISTICS stats = {0};
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDisk = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, 0, NULL);
+    if (hDisk != INVALID_HANDLE_VALUE)
+    {
+        DWORD statsReturned = 0;
+        if (!DeviceIoControl(hDisk, TEMP_IOCTL_GET_STATISTICS, NULL, 0, &stats, sizeof(stats), &statsReturned, NULL))
+        {
+            stats.DiskSize = 0;
+        }
+        CloseHandle(hDisk);
+    }
+
+    // The file system on the disk does not shrink with it. Without the current size
+    // any resize might be a shrink.
+    if (!stats.DiskSize && !options->Force)
+    {
+        printf("Error: Cannot read the current size of RAM disk %d, so the resize may discard data. Use --force to proceed.\n",
+               options->DeviceNumber);
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (options->DiskSize < stats.DiskSize && !options->Force)
+    {
+        printf("Error: Shrinking RAM disk %d discards all data past %llu bytes. Use --force to proceed.\n",
+               options->DeviceNumber, options->DiskSize);
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    TEMP_RESIZE_DATA resizeData = {0};
+    resizeData.DeviceNumber = options->DeviceNumber;
+    resizeData.NewSize = options->DiskSize;
+
+    DWORD bytesReturned = 0;
+    BOOL success = DeviceIoControl(
+        hDevice,
+        TEMP_IOCTL_RESIZE_DEVICE,
+        &resizeData,
+        sizeof(resizeData),
+        &resizeData,
+        sizeof(resizeData),
+        &bytesReturned,
+        NULL);
+
+    CloseHandle(hDevice);
+
+    if (!success)
+    {
+        DWORD error = GetLastError();
+        printf("Failed to resize RAM disk %d. Windows error: %d\n", options->DeviceNumber, error);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("RAM disk %d resized to %llu bytes (%.2f MB).\n", options->DeviceNumber, resizeData.NewSize,
+           (double)resizeData.NewSize / (1024.0 * 1024.0));
+
+    if (resizeData.NewSize > stats.DiskSize)
+    {
+        WCHAR driveLetter = FindDriveLetter(options->DeviceNumber);
+        if (driveLetter)
+        {
+            if (ExtendFileSystem(driveLetter, resizeData.NewSize))
+            {
+                printf("  Volume %C: extended to the new size.\n", driveLetter);
+            }
+            else
+            {
+                printf("  Volume %C: was not extended (error %d). Run \"extend filesystem\" in diskpart to use the new space.\n",
+                       driveLetter, GetLastError());
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Returns the drive letter linked to the device, or 0 if it has none
+WCHAR FindDriveLetter(ULONG deviceNumber)
+{
+    WCHAR deviceName[64];
+    swprintf_s(deviceName, ARRAYSIZE(deviceName), L"\\Device\\TempRamDisk%d", deviceNumber);
+
+    for (WCHAR letter = L'A'; letter <= L'Z'; letter++)
+    {
+        WCHAR driveName[3] = {letter, L':', L'\0'};
+        WCHAR target[MAX_PATH];
+
+        if (QueryDosDeviceW(driveName, target, ARRAYSIZE(target)) && _wcsicmp(target, deviceName) == 0)
+        {
+            return letter;
+        }
+    }
+
+    return 0;
+}
+
+// Grows the file system mounted on the drive to cover the whole disk
+BOOL ExtendFileSystem(WCHAR driveLetter, ULONG64 diskSize)
+{
+    WCHAR volumePath[8];
+    swprintf_s(volumePath, ARRAYSIZE(volumePath), L"\\\\.\\%c:", driveLetter);
+
+    HANDLE hVolume = CreateFileW(volumePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    DISK_GEOMETRY geometry = {0};
+    DWORD bytesReturned = 0;
+    BOOL success = DeviceIoControl(hVolume, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+                                   &geometry, sizeof(geometry), &bytesReturned, NULL);
+
+    if (success && geometry.BytesPerSector)
+    {
+        // FSCTL_EXTEND_VOLUME takes the new volume size in sectors
+        LONGLONG totalSectors = (LONGLONG)(diskSize / geometry.BytesPerSector);
+
+        DeviceIoControl(hVolume, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &bytesReturned, NULL);
+        success = DeviceIoControl(hVolume, FSCTL_EXTEND_VOLUME, &totalSectors, sizeof(totalSectors),
+                                  NULL, 0, &bytesReturned, NULL);
+    }
+
+    CloseHandle(hVolume);
+    return success;
+}
+
+// Switches lock profiling on or off, or lists the buckets whose locks cost the most
+NTSTATUS ShowLockContention(const COMMAND_OPTIONS *options)
+{
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    DWORD bytesReturned = 0;
+
+    if (options->LockAction != LOCK_ACTION_SHOW)
+    {
+        ULONG enable = options->LockAction == LOCK_ACTION_ENABLE;
+        BOOL success = DeviceIoControl(hDevice, TEMP_IOCTL_SET_LOCK_PROFILING, &enable, sizeof(enable),
+                                       NULL, 0, &bytesReturned, NULL);
+        DWORD error = GetLastError();
+        CloseHandle(hDevice);
+
+        if (!success)
+        {
+            printf("Failed to change lock profiling for device %d. Windows error: %d\n", options->DeviceNumber, error);
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        printf("Lock profiling %s for RAM disk %d.\n", enable ? "enabled" : "disabled", options->DeviceNumber);
+        return STATUS_SUCCESS;
+    }
+
+    TEMP_LOCK_CONTENTION *contention = (TEMP_LOCK_CONTENTION *)calloc(1, sizeof(TEMP_LOCK_CONTENTION));
+    ULONG topCount = options->TopCount;
+
+    BOOL success = contention && DeviceIoControl(hDevice, TEMP_IOCTL_GET_LOCK_CONTENTION, &topCount, sizeof(topCount),
+                                                 contention, sizeof(TEMP_LOCK_CONTENTION), &bytesReturned, NULL);
+
+    CloseHandle(hDevice);
+
+    if (!success || bytesReturned < sizeof(TEMP_LOCK_CONTENTION))
+    {
+        printf("Failed to get lock contention for device %d. Windows error: %d\n", options->DeviceNumber, GetLastError());
+        free(contention);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    char spin[16], hold[16];
+    FormatLatency(contention->SpinTime, spin, sizeof(spin));
+    FormatLatency(contention->HoldTime, hold, sizeof(hold));
+
+    printf("Bucket Locks for RAM Disk %d (profiling %s):\n", options->DeviceNumber, contention->Enabled ? "on" : "off");
+    printf("  %u buckets, each owning every %u-th %u KB stripe\n", contention->BucketCount, contention->BucketCount,
+           contention->StripeSize / 1024);
+    printf("  Acquisitions: %llu, contended: %llu (%.2f%%), spinning: %s, held: %s\n",
+           contention->Acquisitions, contention->ContendedAcquisitions,
+           contention->Acquisitions ? (double)contention->ContendedAcquisitions / contention->Acquisitions * 100.0 : 0.0,
+           spin, hold);
+
+    if (!contention->Enabled && contention->Acquisitions == 0)
+    {
+        printf("  Nothing recorded. Start profiling with: locks %d --enable\n", options->DeviceNumber);
+        free(contention);
+        return STATUS_SUCCESS;
+    }
+
+    printf("\nBucket | Chunks   | Acquisitions | Contended    | Contended %% | Spin      | Mean Hold | Max Hold\n");
+    printf("-------|----------|--------------|--------------|-------------|-----------|-----------|----------\n");
+
+    for (ULONG i = 0; i < contention->BucketsReturned && i < TEMP_LOCK_CONTENTION_MAX_TOP; i++)
+    {
+        TEMP_BUCKET_CONTENTION *bucket = &contention->Buckets[i];
+        char bucketSpin[16], meanHold[16], maxHold[16];
+
+        FormatLatency(bucket->SpinTime, bucketSpin, sizeof(bucketSpin));
+        FormatLatency(bucket->Acquisitions ? bucket->HoldTime / bucket->Acquisitions : 0, meanHold, sizeof(meanHold));
+        FormatLatency(bucket->MaxHoldTime, maxHold, sizeof(maxHold));
+
+        printf("%-6u | %-8u | %-12llu | %-12llu | %10.2f%% | %-9s | %-9s | %s\n", bucket->Bucket, bucket->ChunkCount,
+               bucket->Acquisitions, bucket->ContendedAcquisitions,
+               bucket->Acquisitions ? (double)bucket->ContendedAcquisitions / bucket->Acquisitions * 100.0 : 0.0,
+               bucketSpin, meanHold, maxHold);
+    }
+
+    free(contention);
+    return STATUS_SUCCESS;
+}
+
+// Fetches every region of 2^regionShift stripes, a page at a time. Returns a
+// malloc'd array of header->RegionCount entries, or NULL.
+static TEMP_HEATMAP_REGION *FetchHeatmap(HANDLE hDevice, ULONG regionShift, TEMP_HEATMAP *header)
+{
+    DWORD pageSize = FIELD_OFFSET(TEMP_HEATMAP, Regions) + HEATMAP_PAGE_REGIONS * sizeof(TEMP_HEATMAP_REGION);
+    TEMP_HEATMAP *page = (TEMP_HEATMAP *)malloc(pageSize);
+    TEMP_HEATMAP_REGION *regions = NULL;
+    TEMP_HEATMAP_QUERY query = {0, regionShift};
+    DWORD bytesReturned = 0;
+
+    if (!page)
+    {
+        return NULL;
+    }
+
+    for (;;)
+    {
+        if (!DeviceIoControl(hDevice, TEMP_IOCTL_GET_HEATMAP, &query, sizeof(query), page, pageSize,
+                             &bytesReturned, NULL) ||
+            bytesReturned < FIELD_OFFSET(TEMP_HEATMAP, Regions))
+        {
+            free(regions);
+            regions = NULL;
+            break;
+        }
+
+        if (!regions)
+        {
+            memcpy(header, page, FIELD_OFFSET(TEMP_HEATMAP, Regions));
+            regions = (TEMP_HEATMAP_REGION *)calloc(header->RegionCount ? header->RegionCount : 1, sizeof(TEMP_HEATMAP_REGION));
+            if (!regions)
+            {
+                break;
+            }
+        }
+
+        // A resize between pages changes the region count; keep to the first answer
+        ULONG count = page->RegionsReturned;
+        if (query.FirstRegion + count > header->RegionCount)
+        {
+            count = header->RegionCount - query.FirstRegion;
+        }
+
+        memcpy(regions + query.FirstRegion, page->Regions, (size_t)count * sizeof(TEMP_HEATMAP_REGION));
+        query.FirstRegion += count;
+
+        if (count == 0 || query.FirstRegion >= header->RegionCount)
+        {
+            break;
+        }
+    }
+
+    free(page);
+    return regions;
+}
+
+static int CompareHeatDescending(const void *left, const void *right)
+{
+    ULONG64 a = *(const ULONG64 *)left;
+    ULONG64 b = *(const ULONG64 *)right;
+
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+// Prints how much of the disk the hottest regions take to serve a share of the accesses
+static void ShowHotSet(const TEMP_HEATMAP *header, const TEMP_HEATMAP_REGION *regions)
+{
+    static const ULONG shares[] = {50, 90, 99};
+    ULONG64 total = header->TotalReads + header->TotalWrites;
+    ULONG64 *heat = (ULONG64 *)malloc((size_t)header->RegionCount * sizeof(ULONG64));
+
+    if (!heat || total == 0)
+    {
+        free(heat);
+        return;
+    }
+
+    for (ULONG i = 0; i < header->RegionCount; i++)
+    {
+        heat[i] = regions[i].Reads + regions[i].Writes;
+    }
+
+    qsort(heat, header->RegionCount, sizeof(ULONG64), CompareHeatDescending);
+
+    printf("  Hot set:");
+
+    ULONG64 covered = 0;
+    ULONG taken = 0;
+    for (ULONG s = 0; s < ARRAYSIZE(shares); s++)
+    {
+        while (taken < header->RegionCount && covered * 100 < total * shares[s])
+        {
+            covered += heat[taken++];
+        }
+
+        char size[32];
+        FormatBytes((ULONG64)taken * header->RegionSize, size, sizeof(size));
+        printf("%s %lu%% of accesses in %s (%.1f%%)", s ? "," : "", shares[s], size,
+               (double)taken * 100.0 / header->RegionCount);
+    }
+
+    printf("\n");
+    free(heat);
+}
+
+// Renders the heatmap of a RAM disk as a map of regions or as CSV
+NTSTATUS ShowHeatmap(const COMMAND_OPTIONS *options)
+{
+    static const char scale[] = " .:-=+*#%@";
+
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    // The first query learns the disk size; the map then picks the finest regions
+    // that fit in HEATMAP_MAX_ROWS rows
+    TEMP_HEATMAP header;
+    TEMP_HEATMAP_QUERY probe = {0, 0};
+    DWORD bytesReturned = 0;
+
+    if (!DeviceIoControl(hDevice, TEMP_IOCTL_GET_HEATMAP, &probe, sizeof(probe), &header,
+                         FIELD_OFFSET(TEMP_HEATMAP, Regions), &bytesReturned, NULL))
+    {
+        printf("Failed to get heatmap for device %d. Windows error: %d\n", options->DeviceNumber, GetLastError());
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    ULONG regionShift = 0;
+    if (options->RegionSize)
+    {
+        while (((ULONG64)header.StripeSize << regionShift) < options->RegionSize)
+        {
+            regionShift++;
+        }
+    }
+    else if (!options->Csv)
+    {
+        while (regionShift < TEMP_HEATMAP_MAX_REGION_SHIFT &&
+               (header.RegionCount >> regionShift) > (ULONG64)options->Width * HEATMAP_MAX_ROWS)
+        {
+            regionShift++;
+        }
+    }
+
+    TEMP_HEATMAP_REGION *regions = FetchHeatmap(hDevice, regionShift, &header);
+    DWORD error = GetLastError();
+    CloseHandle(hDevice);
+
+    if (!regions)
+    {
+        printf("Failed to get heatmap for device %d. Windows error: %d\n", options->DeviceNumber, error);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (options->Csv)
+    {
+        FILE *file = stdout;
+        if (options->OutputFile[0] && fopen_s(&file, options->OutputFile, "w") != 0)
+        {
+            printf("Error: Cannot create %s\n", options->OutputFile);
+            free(regions);
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        fprintf(file, "region,offset,length,reads,writes\n");
+        for (ULONG i = 0; i < header.RegionCount; i++)
+        {
+            ULONG64 offset = (ULONG64)i * header.RegionSize;
+            ULONG64 length = header.DiskSize - offset < header.RegionSize ? header.DiskSize - offset : header.RegionSize;
+
+            fprintf(file, "%lu,%llu,%llu,%llu,%llu\n", i, offset, length, regions[i].Reads, regions[i].Writes);
+        }
+
+        if (file != stdout)
+        {
+            fclose(file);
+            printf("Wrote %lu regions to %s\n", header.RegionCount, options->OutputFile);
+        }
+
+        free(regions);
+        return STATUS_SUCCESS;
+    }
+
+    char diskSize[32], regionSize[32];
+    FormatBytes(header.DiskSize, diskSize, sizeof(diskSize));
+    FormatBytes(header.RegionSize, regionSize, sizeof(regionSize));
+
+    printf("Access Heatmap for RAM Disk %d (%s, %s per cell):\n", options->DeviceNumber, diskSize, regionSize);
+    printf("  Decayed reads: %llu, writes: %llu\n", header.TotalReads, header.TotalWrites);
+    if (header.HotStripeHeat)
+    {
+        printf("  Reclaim spares %lu KB stripes with at least %lu accesses\n", header.StripeSize / 1024, header.HotStripeHeat);
+    }
+
+    if (header.TotalReads + header.TotalWrites == 0)
+    {
+        printf("  No accesses recorded yet.\n");
+        free(regions);
+        return STATUS_SUCCESS;
+    }
+
+    ShowHotSet(&header, regions);
+
+    ULONG64 maxHeat = 0;
+    for (ULONG i = 0; i < header.RegionCount; i++)
+    {
+        if (regions[i].Reads + regions[i].Writes > maxHeat)
+        {
+            maxHeat = regions[i].Reads + regions[i].Writes;
+        }
+    }
+
+    // Log scale: any access shows, and the busiest region gets the last symbol
+    printf("\n");
+    for (ULONG row = 0; row * options->Width < header.RegionCount; row++)
+    {
+        char offset[32];
+        FormatBytes((ULONG64)row * options->Width * header.RegionSize, offset, sizeof(offset));
+        printf("  %10s |", offset);
+
+        for (ULONG column = 0; column < options->Width; column++)
+        {
+            ULONG i = row * options->Width + column;
+            if (i >= header.RegionCount)
+            {
+                break;
+            }
+
+            ULONG64 heat = regions[i].Reads + regions[i].Writes;
+            int level = 0;
+            if (heat)
+            {
+                level = 1 + (int)(log((double)heat + 1.0) / log((double)maxHeat + 1.0) * (sizeof(scale) - 2));
+                if (level > (int)sizeof(scale) - 2)
+                {
+                    level = (int)sizeof(scale) - 2;
+                }
+            }
+
+            putchar(scale[level]);
+        }
+
+        printf("|\n");
+    }
+
+    printf("\n  Scale: '%s' on a log scale, '%c' = %llu accesses\n", scale, scale[sizeof(scale) - 2], maxHeat);
+
+    free(regions);
+    return STATUS_SUCCESS;
+}
+
+// One request slot of a bench thread. The OVERLAPPED comes first, so the
+// lpOverlapped of a completion is the slot itself.
+typedef struct
+{
+    OVERLAPPED Overlapped;
+    PUCHAR Buffer;
+    LARGE_INTEGER Submitted;
+    ULONG Operation; // TEMP_OPERATION_READ or TEMP_OPERATION_WRITE
+} BENCH_SLOT;
+
+typedef struct
+{
+    const COMMAND_OPTIONS *Options;
+    ULONG Index;
+    ULONG64 DiskSize;
+    LONGLONG Frequency;
+    LONGLONG Deadline; // Performance counter value after which no request starts
+    ULONG64 Cursor;    // Next block of a sequential stream
+    ULONG64 Seed;
+    ULONG64 Count[2];
+    ULONG64 Bytes[2];
+    ULONG64 TotalLatency[2];
+    ULONG64 MaxLatency[2];
+    ULONG64 Latency[2][TEMP_HISTOGRAM_BUCKETS];
+    DWORD Error;
+} BENCH_THREAD;
+
+// Percentiles shown by bench, in hundredths of a percent, like the driver's
+static const ULONG BenchPercentiles[TEMP_PERCENTILE_COUNT] = {5000, 9000, 9900, 9990};
+
+// The same buckets as the driver's histograms, so both sides' percentiles
+// carry the same resolution and compare directly
+static ULONG BenchHistogramIndex(ULONG64 value)
+{
+    if (value < (2ULL << TEMP_HISTOGRAM_SUB_BITS))
+    {
+        return (ULONG)value;
+    }
+
+    ULONG log2 = 0;
+    for (ULONG64 v = value; v > 1; v >>= 1)
+    {
+        log2++;
+    }
+
+    ULONG magnitude = log2 - TEMP_HISTOGRAM_SUB_BITS;
+    ULONG index = (magnitude << TEMP_HISTOGRAM_SUB_BITS) + (ULONG)(value >> magnitude);
+
+    return index < TEMP_HISTOGRAM_BUCKETS ? index : TEMP_HISTOGRAM_BUCKETS - 1;
+}
+
+// Upper bound of the bucket holding the given rank
+static ULONG64 BenchPercentile(const ULONG64 *counts, ULONG64 total, ULONG perTenThousand)
+{
+    ULONG64 rank = (total * perTenThousand + 9999) / 10000;
+    ULONG64 seen = 0;
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= (rank ? rank : 1))
+        {
+            if (i < (2UL << TEMP_HISTOGRAM_SUB_BITS))
+            {
+                return i;
+            }
+
+            ULONG magnitude = (i >> TEMP_HISTOGRAM_SUB_BITS) - 1;
+            ULONG64 mantissa = (i & ((1UL << TEMP_HISTOGRAM_SUB_BITS) - 1)) + (1ULL << TEMP_HISTOGRAM_SUB_BITS);
+            return ((mantissa + 1) << magnitude) - 1;
+        }
+    }
+
+    return 0;
+}
+
+static ULONG64 BenchRandom(ULONG64 *state)
+{
+    ULONG64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Picks the next offset and operation for the slot and issues it
+static BOOL BenchSubmit(HANDLE hDevice, BENCH_THREAD *thread, BENCH_SLOT *slot)
+{
+    const COMMAND_OPTIONS *options = thread->Options;
+    ULONG64 blocks = thread->DiskSize / options->BlockSize;
+    ULONG64 block;
+
+    if (options->Random)
+    {
+        block = BenchRandom(&thread->Seed) % blocks;
+    }
+    else
+    {
+        // Each thread streams through its own slice of the disk
+        ULONG64 slice = blocks / options->Threads;
+        block = slice * thread->Index + thread->Cursor;
+        thread->Cursor = (thread->Cursor + 1) % slice;
+    }
+
+    BOOL read = options->ReadPercent == 100 ||
+                (options->ReadPercent > 0 && BenchRandom(&thread->Seed) % 100 < options->ReadPercent);
+    ULONG64 offset = block * options->BlockSize;
+
+    memset(&slot->Overlapped, 0, sizeof(slot->Overlapped));
+    slot->Overlapped.Offset = (DWORD)offset;
+    slot->Overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    slot->Operation = read ? TEMP_OPERATION_READ : TEMP_OPERATION_WRITE;
+    QueryPerformanceCounter(&slot->Submitted);
+
+    // Requests that complete at once still queue a completion packet
+    BOOL issued = read ? ReadFile(hDevice, slot->Buffer, options->BlockSize, NULL, &slot->Overlapped)
+                       : WriteFile(hDevice, slot->Buffer, options->BlockSize, NULL, &slot->Overlapped);
+
+    if (!issued && GetLastError() != ERROR_IO_PENDING)
+    {
+        thread->Error = GetLastError();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Keeps QueueDepth requests in flight on its own handle and completion port
+// until the deadline, then waits for the last ones to finish
+static DWORD WINAPI BenchThread(LPVOID context)
+{
+    BENCH_THREAD *thread = (BENCH_THREAD *)context;
+    const COMMAND_OPTIONS *options = thread->Options;
+
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    DWORD access = GENERIC_READ | (options->ReadPercent < 100 ? GENERIC_WRITE : 0);
+    HANDLE hDevice = CreateFileW(devicePath, access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                                 FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        thread->Error = GetLastError();
+        return 0;
+    }
+
+    HANDLE port = CreateIoCompletionPort(hDevice, NULL, 0, 1);
+    BENCH_SLOT *slots = (BENCH_SLOT *)calloc(options->QueueDepth, sizeof(BENCH_SLOT));
+
+    // Page aligned, which unbuffered I/O requires
+    PUCHAR buffers = (PUCHAR)VirtualAlloc(NULL, (SIZE_T)options->QueueDepth * options->BlockSize,
+                                          MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    if (!port || !slots || !buffers)
+    {
+        thread->Error = GetLastError() ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+        goto cleanup;
+    }
+
+    memset(buffers, 0xA5, (SIZE_T)options->QueueDepth * options->BlockSize);
+
+    ULONG outstanding = 0;
+    for (ULONG i = 0; i < options->QueueDepth; i++)
+    {
+        slots[i].Buffer = buffers + (SIZE_T)i * options->BlockSize;
+        if (!BenchSubmit(hDevice, thread, &slots[i]))
+        {
+            break;
+        }
+        outstanding++;
+    }
+
+    while (outstanding > 0)
+    {
+        OVERLAPPED_ENTRY entries[BENCH_COMPLETION_BATCH];
+        ULONG count = 0;
+
+        if (!GetQueuedCompletionStatusEx(port, entries, BENCH_COMPLETION_BATCH, &count, INFINITE, FALSE))
+        {
+            thread->Error = GetLastError();
+            break;
+        }
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            BENCH_SLOT *slot = (BENCH_SLOT *)entries[i].lpOverlapped;
+            DWORD transferred = 0;
+
+            outstanding--;
+
+            if (!GetOverlappedResult(hDevice, &slot->Overlapped, &transferred, FALSE))
+            {
+                thread->Error = GetLastError();
+                continue;
+            }
+
+            LONGLONG ticks = now.QuadPart - slot->Submitted.QuadPart;
+            ULONG64 latency = (ULONG64)(ticks / thread->Frequency) * 1000000000ULL +
+                              (ULONG64)(ticks % thread->Frequency) * 1000000000ULL / thread->Frequency;
+            ULONG op = slot->Operation;
+
+            thread->Count[op]++;
+            thread->Bytes[op] += transferred;
+            thread->TotalLatency[op] += latency;
+            thread->Latency[op][BenchHistogramIndex(latency)]++;
+            if (latency > thread->MaxLatency[op])
+            {
+                thread->MaxLatency[op] = latency;
+            }
+
+            if (!thread->Error && now.QuadPart < thread->Deadline && BenchSubmit(hDevice, thread, slot))
+            {
+                outstanding++;
+            }
+        }
+    }
+
+cleanup:
+    if (buffers)
+    {
+        VirtualFree(buffers, 0, MEM_RELEASE);
+    }
+    free(slots);
+    if (port)
+    {
+        CloseHandle(port);
+    }
+    CloseHandle(hDevice);
+    return 0;
+}
+
+// Prints the driver-side service latency percentiles of the run next to the
+// end-to-end ones; the difference is the I/O manager and completion path
+static void ShowBenchServiceLatency(const TEMP_LATENCY_STATISTICS *before, const TEMP_LATENCY_STATISTICS *after,
+                                    ULONG op, const char *name, const ULONG64 *endToEnd, ULONG64 endToEndCount)
+{
+    const TEMP_OPERATION_LATENCY *first = &before->Operations[op];
+    const TEMP_OPERATION_LATENCY *last = &after->Operations[op];
+    ULONG64 delta[TEMP_HISTOGRAM_BUCKETS];
+    ULONG64 count = last->Count - first->Count;
+
+    if (count == 0 || endToEndCount == 0)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+    {
+        delta[i] = last->LatencyHistogram[i] - first->LatencyHistogram[i];
+    }
+
+    char service[2][16], total[2][16];
+    FormatLatency(BenchPercentile(delta, count, 5000), service[0], sizeof(service[0]));
+    FormatLatency(BenchPercentile(delta, count, 9900), service[1], sizeof(service[1]));
+    FormatLatency(BenchPercentile(endToEnd, endToEndCount, 5000), total[0], sizeof(total[0]));
+    FormatLatency(BenchPercentile(endToEnd, endToEndCount, 9900), total[1], sizeof(total[1]));
+
+    printf("  %-5s p50 %s in the driver of %s end to end, p99 %s of %s\n",
+           name, service[0], total[0], service[1], total[1]);
+}
+
+// Drives overlapped I/O at the raw device and reports IOPS, bandwidth and latency
+// percentiles, then checks the driver's own counters against what was issued
+NTSTATUS BenchRamDisk(const COMMAND_OPTIONS *options)
+{
+    static const char *operationNames[2] = {"Read", "Write"};
+
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    TEMP_STATISTICS statsBefore = {0}, statsAfter = {0};
+    DISK_GEOMETRY geometry = {0};
+    DWORD bytesReturned = 0;
+
+    DeviceIoControl(hDevice, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL);
+
+    if (!DeviceIoControl(hDevice, TEMP_IOCTL_GET_STATISTICS, NULL, 0, &statsBefore, sizeof(statsBefore),
+                         &bytesReturned, NULL))
+    {
+        printf("Failed to get statistics for device %d. Windows error: %d\n", options->DeviceNumber, GetLastError());
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    ULONG sectorSize = geometry.BytesPerSector ? geometry.BytesPerSector : TEMP_DEFAULT_SECTOR_SIZE;
+    if (options->BlockSize % sectorSize != 0 || statsBefore.DiskSize / options->BlockSize < options->Threads)
+    {
+        printf("Error: --bs must be a multiple of the %u byte sector size, and the disk must hold a block per thread\n",
+               sectorSize);
+        CloseHandle(hDevice);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Service latency deltas are optional; older drivers lack the IOCTL
+    TEMP_LATENCY_STATISTICS *latencyBefore = (TEMP_LATENCY_STATISTICS *)calloc(1, sizeof(TEMP_LATENCY_STATISTICS));
+    TEMP_LATENCY_STATISTICS *latencyAfter = (TEMP_LATENCY_STATISTICS *)calloc(1, sizeof(TEMP_LATENCY_STATISTICS));
+    BENCH_THREAD *threads = (BENCH_THREAD *)calloc(options->Threads, sizeof(BENCH_THREAD));
+    HANDLE *handles = (HANDLE *)calloc(options->Threads, sizeof(HANDLE));
+
+    if (!latencyBefore || !latencyAfter || !threads || !handles)
+    {
+        printf("Error: Out of memory\n");
+        free(latencyBefore);
+        free(latencyAfter);
+        free(threads);
+        free(handles);
+        CloseHandle(hDevice);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    BOOL haveLatency = DeviceIoControl(hDevice, TEMP_IOCTL_GET_LATENCY_STATISTICS, NULL, 0, latencyBefore,
+                                       sizeof(TEMP_LATENCY_STATISTICS), &bytesReturned, NULL) &&
+                       bytesReturned >= sizeof(TEMP_LATENCY_STATISTICS);
+
+    char blockSize[16];
+    FormatBytes(options->BlockSize, blockSize, sizeof(blockSize));
+    printf("Benchmarking RAM disk %d: %s %s", options->DeviceNumber, options->Random ? "random" : "sequential",
+           options->ReadPercent == 100 ? "reads" : options->ReadPercent == 0 ? "writes" : "mix");
+    if (options->ReadPercent != 0 && options->ReadPercent != 100)
+    {
+        printf(" (%u%% reads)", options->ReadPercent);
+    }
+    printf(", %s blocks, iodepth %u, %u thread%s, %u s...\n", blockSize, options->QueueDepth, options->Threads,
+           options->Threads == 1 ? "" : "s", options->Seconds);
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    ULONG started = 0;
+    for (ULONG i = 0; i < options->Threads; i++)
+    {
+        threads[i].Options = options;
+        threads[i].Index = i;
+        threads[i].DiskSize = statsBefore.DiskSize;
+        threads[i].Frequency = frequency.QuadPart;
+        threads[i].Deadline = start.QuadPart + (LONGLONG)options->Seconds * frequency.QuadPart;
+        threads[i].Seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+
+        handles[i] = CreateThread(NULL, 0, BenchThread, &threads[i], 0, NULL);
+        if (!handles[i])
+        {
+            break;
+        }
+        started++;
+    }
+
+    WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    for (ULONG i = 0; i < started; i++)
+    {
+        CloseHandle(handles[i]);
+    }
+
+    DeviceIoControl(hDevice, TEMP_IOCTL_GET_STATISTICS, NULL, 0, &statsAfter, sizeof(statsAfter), &bytesReturned, NULL);
+    haveLatency = haveLatency &&
+                  DeviceIoControl(hDevice, TEMP_IOCTL_GET_LATENCY_STATISTICS, NULL, 0, latencyAfter,
+                                  sizeof(TEMP_LATENCY_STATISTICS), &bytesReturned, NULL) &&
+                  bytesReturned >= sizeof(TEMP_LATENCY_STATISTICS);
+    CloseHandle(hDevice);
+
+    // Merge the threads
+    BENCH_THREAD *total = (BENCH_THREAD *)calloc(1, sizeof(BENCH_THREAD));
+    DWORD error = started < options->Threads ? GetLastError() : 0;
+
+    for (ULONG i = 0; total && i < started; i++)
+    {
+        for (ULONG op = 0; op < 2; op++)
+        {
+            total->Count[op] += threads[i].Count[op];
+            total->Bytes[op] += threads[i].Bytes[op];
+            total->TotalLatency[op] += threads[i].TotalLatency[op];
+            if (threads[i].MaxLatency[op] > total->MaxLatency[op])
+            {
+                total->MaxLatency[op] = threads[i].MaxLatency[op];
+            }
+            for (ULONG b = 0; b < TEMP_HISTOGRAM_BUCKETS; b++)
+            {
+                total->Latency[op][b] += threads[i].Latency[op][b];
+            }
+        }
+
+        if (threads[i].Error && !error)
+        {
+            error = threads[i].Error;
+        }
+    }
+
+    double elapsed = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!total || error || total->Count[0] + total->Count[1] == 0)
+    {
+        printf("Benchmark failed. Windows error: %d\n", error);
+        status = STATUS_UNSUCCESSFUL;
+        goto cleanup;
+    }
+
+    printf("\nOperation | IOPS       | MB/s      | Mean      | p50       | p90       | p99       | p99.9     | Max\n");
+    printf("----------|------------|-----------|-----------|-----------|-----------|-----------|-----------|----------\n");
+
+    for (ULONG op = 0; op < 2; op++)
+    {
+        char values[TEMP_PERCENTILE_COUNT + 2][16];
+
+        if (total->Count[op] == 0)
+        {
+            continue;
+        }
+
+        FormatLatency(total->TotalLatency[op] / total->Count[op], values[0], sizeof(values[0]));
+        for (ULONG p = 0; p < TEMP_PERCENTILE_COUNT; p++)
+        {
+            FormatLatency(BenchPercentile(total->Latency[op], total->Count[op], BenchPercentiles[p]),
+                          values[p + 1], sizeof(values[p + 1]));
+        }
+        FormatLatency(total->MaxLatency[op], values[TEMP_PERCENTILE_COUNT + 1], sizeof(values[0]));
+
+        printf("%-9s | %-10.0f | %-9.1f | %-9s | %-9s | %-9s | %-9s | %-9s | %s\n", operationNames[op],
+               total->Count[op] / elapsed, total->Bytes[op] / elapsed / (1024.0 * 1024.0),
+               values[0], values[1], values[2], values[3], values[4], values[5]);
+    }
+
+    printf("Total: %.0f IOPS, %.1f MB/s over %.2f s\n",
+           (total->Count[0] + total->Count[1]) / elapsed,
+           (total->Bytes[0] + total->Bytes[1]) / elapsed / (1024.0 * 1024.0), elapsed);
+
+    // Every completed request passed through the driver's counters; more there
+    // means something else used the disk during the run, fewer means a miscount
+    ULONG64 driverReads = statsAfter.TotalReads - statsBefore.TotalReads;
+    ULONG64 driverWrites = statsAfter.TotalWrites - statsBefore.TotalWrites;
+    ULONG64 driverBytesRead = statsAfter.BytesRead - statsBefore.BytesRead;
+    ULONG64 driverBytesWritten = statsAfter.BytesWritten - statsBefore.BytesWritten;
+
+    printf("\nDriver Cross-Check (TEMP_IOCTL_GET_STATISTICS):\n");
+    printf("  Reads: %llu completed, %llu counted by the driver\n", total->Count[0], driverReads);
+    printf("  Writes: %llu completed, %llu counted by the driver\n", total->Count[1], driverWrites);
+    printf("  Bytes Read: %llu completed, %llu counted by the driver\n", total->Bytes[0], driverBytesRead);
+    printf("  Bytes Written: %llu completed, %llu counted by the driver\n", total->Bytes[1], driverBytesWritten);
+
+    if (driverReads < total->Count[0] || driverWrites < total->Count[1] ||
+        driverBytesRead < total->Bytes[0] || driverBytesWritten < total->Bytes[1])
+    {
+        printf("  MISMATCH: the driver counted less than was completed\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+    else if (driverReads != total->Count[0] || driverWrites != total->Count[1] ||
+             driverBytesRead != total->Bytes[0] || driverBytesWritten != total->Bytes[1])
+    {
+        printf("  The driver counted more; other I/O reached the disk during the run\n");
+    }
+    else
+    {
+        printf("  All counters match\n");
+    }
+
+    if (haveLatency)
+    {
+        printf("\nService Latency (TEMP_IOCTL_GET_LATENCY_STATISTICS):\n");
+        for (ULONG op = 0; op < 2; op++)
+        {
+            ShowBenchServiceLatency(latencyBefore, latencyAfter, op, operationNames[op], total->Latency[op], total->Count[op]);
+        }
+    }
+
+cleanup:
+    free(total);
+    free(latencyBefore);
+    free(latencyAfter);
+    free(threads);
+    free(handles);
+    return status;
+}
+
+// Set by Ctrl+C to end a trace, stats watch or exporter that runs without --seconds
+static volatile LONG g_StopRequested = 0;
+
+static BOOL WINAPI StopCtrlHandler(DWORD ctrlType)
+{
+    if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT)
+    {
+        InterlockedExchange(&g_StopRequested, 1);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Reads everything the driver has buffered and appends it to the file. Returns
+// FALSE once the trace has stopped and been read to the end.
+static BOOL DrainTrace(HANDLE hDevice, TEMP_TRACE_DATA *data, DWORD dataSize, FILE *file, TEMP_TRACE_FILE_HEADER *header)
+{
+    ULONG maxRecords = (dataSize - FIELD_OFFSET(TEMP_TRACE_DATA, Records)) / sizeof(TEMP_TRACE_RECORD);
+
+    for (;;)
+    {
+        DWORD bytesReturned = 0;
+
+        if (!DeviceIoControl(hDevice, TEMP_IOCTL_READ_TRACE, NULL, 0, data, dataSize, &bytesReturned, NULL) ||
+            bytesReturned < (DWORD)FIELD_OFFSET(TEMP_TRACE_DATA, Records))
+        {
+            return FALSE;
+        }
+
+        if (data->RecordCount &&
+            fwrite(data->Records, sizeof(TEMP_TRACE_RECORD), data->RecordCount, file) != data->RecordCount)
+        {
+            return FALSE;
+        }
+
+        header->RecordCount += data->RecordCount;
+        header->DroppedRecords = data->DroppedRecords;
+
+        if (data->RecordCount < maxRecords)
+        {
+            return data->Active != 0;
+        }
+    }
+}
+
+// Records every request the device serves into a trace file. The driver buffers
+// records per processor; they are drained ten times a second until the time is up.
+NTSTATUS TraceRamDisk(const COMMAND_OPTIONS *options)
+{
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    // The header carries the geometry a replay needs to rebuild the disk
+    TEMP_TRACE_FILE_HEADER header = {0};
+    TEMP_STATISTICS stats = {0};
+    TEMP_MEMORY_STATISTICS usage = {0};
+    DISK_GEOMETRY geometry = {0};
+    DWORD bytesReturned = 0;
+
+    DeviceIoControl(hDevice, TEMP_IOCTL_GET_STATISTICS, NULL, 0, &stats, sizeof(stats), &bytesReturned, NULL);
+    DeviceIoControl(hDevice, TEMP_IOCTL_GET_MEMORY_STATISTICS, NULL, 0, &usage, sizeof(usage), &bytesReturned, NULL);
+    DeviceIoControl(hDevice, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL);
+
+    header.Magic = TEMP_TRACE_FILE_MAGIC;
+    header.Version = TEMP_TRACE_FILE_VERSION;
+    header.RecordSize = sizeof(TEMP_TRACE_RECORD);
+    header.SectorSize = geometry.BytesPerSector ? geometry.BytesPerSector : TEMP_DEFAULT_SECTOR_SIZE;
+    header.ChunkSize = usage.ChunkSize;
+    header.DiskSize = stats.DiskSize;
+
+    FILE *file = NULL;
+    if (fopen_s(&file, options->OutputFile, "wb") != 0 || !file)
+    {
+        printf("Error: Cannot create %s\n", options->OutputFile);
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+
+    DWORD dataSize = FIELD_OFFSET(TEMP_TRACE_DATA, Records) + 16384 * sizeof(TEMP_TRACE_RECORD);
+    TEMP_TRACE_DATA *data = (TEMP_TRACE_DATA *)malloc(dataSize);
+
+    TEMP_TRACE_CONTROL control = {0};
+    control.Enable = 1;
+    control.RecordsPerProcessor = options->TraceRecords;
+
+    if (!data || !DeviceIoControl(hDevice, TEMP_IOCTL_SET_TRACE, &control, sizeof(control), NULL, 0, &bytesReturned, NULL))
+    {
+        printf("Failed to start tracing device %d. Windows error: %d\n", options->DeviceNumber, GetLastError());
+        free(data);
+        fclose(file);
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    if (options->Seconds)
+    {
+        printf("Tracing RAM disk %d for %u seconds...\n", options->DeviceNumber, options->Seconds);
+    }
+    else
+    {
+        printf("Tracing RAM disk %d, press Ctrl+C to stop...\n", options->DeviceNumber);
+    }
+
+    ULONGLONG deadline = GetTickCount64() + (ULONGLONG)options->Seconds * 1000;
+    BOOL ok = TRUE;
+
+    while (ok && !g_StopRequested && (!options->Seconds || GetTickCount64() < deadline))
+    {
+        Sleep(100);
+        ok = DrainTrace(hDevice, data, dataSize, file, &header);
+    }
+
+    // Stopping keeps the buffered records; read them until the driver has none left
+    control.Enable = 0;
+    DeviceIoControl(hDevice, TEMP_IOCTL_SET_TRACE, &control, sizeof(control), NULL, 0, &bytesReturned, NULL);
+    while (DrainTrace(hDevice, data, dataSize, file, &header))
+    {
+    }
+
+    SetConsoleCtrlHandler(StopCtrlHandler, FALSE);
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    BOOL written = !ferror(file);
+    fclose(file);
+
+    free(data);
+    CloseHandle(hDevice);
+
+    if (!written)
+    {
+        printf("Error: Failed writing %s\n", options->OutputFile);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("Captured %llu requests to %s", header.RecordCount, options->OutputFile);
+    if (header.DroppedRecords)
+    {
+        printf(" (%llu dropped; use a larger --buffer)", header.DroppedRecords);
+    }
+    printf("\n");
+
+    return STATUS_SUCCESS;
+}
+
+// Counter change between two samples. A device removed and created again
+// under the same number starts from zero, so a smaller value is a fresh count.
+static ULONG64 StatDelta(ULONG64 previous, ULONG64 current)
+{
+    return current >= previous ? current - previous : current;
+}
+
+// Samples the device every interval and prints what changed since the last
+// sample: request and byte rates, the hit ratio of the interval and memory growth
+NTSTATUS WatchStatistics(const COMMAND_OPTIONS *options)
+{
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    TEMP_STATISTICS previous = {0}, current = {0};
+    DWORD bytesReturned = 0;
+
+    if (!DeviceIoControl(hDevice, TEMP_IOCTL_GET_STATISTICS, NULL, 0, &previous, sizeof(previous),
+                         &bytesReturned, NULL))
+    {
+        printf("Failed to get statistics for device %d. Windows error: %d\n", options->DeviceNumber, GetLastError());
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (options->Csv)
+    {
+        printf("time,device,interval_s,read_iops,write_iops,read_bytes_per_s,write_bytes_per_s,"
+               "hit_ratio,memory_used,memory_delta\n");
+    }
+    else if (!options->Json)
+    {
+        printf("Watching RAM disk %d every %.1f s (Ctrl+C to stop)\n", options->DeviceNumber,
+               options->IntervalMs / 1000.0);
+    }
+    fflush(stdout);
+
+    LARGE_INTEGER frequency, last, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&last);
+
+    ULONG64 deadline = GetTickCount64() + (ULONG64)options->Seconds * 1000;
+    ULONG64 wake = GetTickCount64();
+    ULONG rows = 0;
+    DWORD error = 0;
+
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    while (!g_StopRequested && (!options->Seconds || GetTickCount64() < deadline))
+    {
+        // Sleep in short steps so Ctrl+C is seen within a tenth of a second;
+        // waking on a fixed schedule keeps the samples from drifting
+        wake += options->IntervalMs;
+        while (!g_StopRequested && GetTickCount64() < wake)
+        {
+            ULONG64 remaining = wake - GetTickCount64();
+            Sleep(remaining < 100 ? (DWORD)remaining : 100);
+        }
+
+        if (g_StopRequested)
+        {
+            break;
+        }
+
+        if (!DeviceIoControl(hDevice, TEMP_IOCTL_GET_STATISTICS, NULL, 0, &current, sizeof(current),
+                             &bytesReturned, NULL))
+        {
+            error = GetLastError();
+            break;
+        }
+
+        QueryPerformanceCounter(&now);
+
+        double seconds = (double)(now.QuadPart - last.QuadPart) / frequency.QuadPart;
+        double readIops = StatDelta(previous.TotalReads, current.TotalReads) / seconds;
+        double writeIops = StatDelta(previous.TotalWrites, current.TotalWrites) / seconds;
+        double readBytes = StatDelta(previous.BytesRead, current.BytesRead) / seconds;
+        double writeBytes = StatDelta(previous.BytesWritten, current.BytesWritten) / seconds;
+        ULONG64 hits = StatDelta(previous.CacheHits, current.CacheHits);
+        ULONG64 lookups = hits + StatDelta(previous.CacheMisses, current.CacheMisses);
+        LONG64 memoryDelta = (LONG64)(current.MemoryUsed - previous.MemoryUsed);
+
+        SYSTEMTIME time;
+        GetLocalTime(&time);
+
+        if (options->Csv || options->Json)
+        {
+            char timestamp[32], hitRatio[16];
+            sprintf_s(timestamp, sizeof(timestamp), "%04u-%02u-%02uT%02u:%02u:%02u", time.wYear, time.wMonth,
+                      time.wDay, time.wHour, time.wMinute, time.wSecond);
+
+            // No lookups in the interval leaves the ratio empty rather than 0
+            if (lookups)
+            {
+                sprintf_s(hitRatio, sizeof(hitRatio), "%.4f", (double)hits / lookups);
+            }
+            else
+            {
+                strcpy_s(hitRatio, sizeof(hitRatio), options->Json ? "null" : "");
+            }
+
+            if (options->Csv)
+            {
+                printf("%s,%u,%.3f,%.0f,%.0f,%.0f,%.0f,%s,%llu,%lld\n", timestamp, options->DeviceNumber, seconds,
+                       readIops, writeIops, readBytes, writeBytes, hitRatio, current.MemoryUsed, memoryDelta);
+            }
+            else
+            {
+                printf("{\"time\":\"%s\",\"device\":%u,\"interval_s\":%.3f,\"read_iops\":%.0f,\"write_iops\":%.0f,"
+                       "\"read_bytes_per_s\":%.0f,\"write_bytes_per_s\":%.0f,\"hit_ratio\":%s,"
+                       "\"memory_used\":%llu,\"memory_delta\":%lld}\n",
+                       timestamp, options->DeviceNumber, seconds, readIops, writeIops, readBytes, writeBytes,
+                       hitRatio, current.MemoryUsed, memoryDelta);
+            }
+        }
+        else
+        {
+            if (rows % WATCH_HEADER_ROWS == 0)
+            {
+                printf("\nTime     | Read IOPS | Write IOPS | Read MB/s | Write MB/s | Hit Ratio | Memory Used | Change\n");
+                printf("---------|-----------|------------|-----------|------------|-----------|-------------|----------\n");
+            }
+
+            char hitRatio[16];
+            if (lookups)
+            {
+                sprintf_s(hitRatio, sizeof(hitRatio), "%.2f%%", (double)hits / lookups * 100.0);
+            }
+            else
+            {
+                strcpy_s(hitRatio, sizeof(hitRatio), "-");
+            }
+
+            printf("%02u:%02u:%02u | %-9.0f | %-10.0f | %-9.1f | %-10.1f | %-9s | %8.1f MB | %+.1f MB\n",
+                   time.wHour, time.wMinute, time.wSecond, readIops, writeIops,
+                   readBytes / (1024.0 * 1024.0), writeBytes / (1024.0 * 1024.0), hitRatio,
+                   (double)current.MemoryUsed / (1024.0 * 1024.0), (double)memoryDelta / (1024.0 * 1024.0));
+        }
+
+        fflush(stdout);
+        previous = current;
+        last = now;
+        rows++;
+    }
+
+    SetConsoleCtrlHandler(StopCtrlHandler, FALSE);
+    CloseHandle(hDevice);
+
+    if (error)
+    {
+        printf("Failed to get statistics for device %d. Windows error: %d\n", options->DeviceNumber, error);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Prints the driver's per-second history of a device. Every sample covers one
+// second the driver measured itself, so short bursts show up however rarely this
+// is run; the closing summary names the busiest seconds.
+NTSTATUS ShowHistory(const COMMAND_OPTIONS *options)
+{
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    DWORD bufferSize = FIELD_OFFSET(TEMP_HISTORY, Samples) + options->Seconds * sizeof(TEMP_HISTORY_SAMPLE);
+    TEMP_HISTORY *history = (TEMP_HISTORY *)calloc(1, bufferSize);
+    DWORD bytesReturned = 0;
+
+    if (!history)
+    {
+        CloseHandle(hDevice);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    BOOL success = DeviceIoControl(hDevice, TEMP_IOCTL_GET_HISTORY, NULL, 0, history, bufferSize, &bytesReturned, NULL);
+    DWORD error = GetLastError();
+    CloseHandle(hDevice);
+
+    if (!success || bytesReturned < FIELD_OFFSET(TEMP_HISTORY, Samples) || history->Version != TEMP_HISTORY_VERSION ||
+        history->SampleSize < sizeof(TEMP_HISTORY_SAMPLE) ||
+        (ULONG64)history->Size + (ULONG64)history->SamplesReturned * history->SampleSize > bytesReturned)
+    {
+        printf("Failed to get history for device %d. Windows error: %d\n", options->DeviceNumber, success ? 0 : error);
+        free(history);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (history->SamplesReturned == 0)
+    {
+        printf("No history yet; the first sample is taken a second after the device is created.\n");
+        free(history);
+        return STATUS_SUCCESS;
+    }
+
+    if (options->Csv)
+    {
+        printf("time,device,interval_s,read_iops,write_iops,read_bytes_per_s,write_bytes_per_s,hit_ratio,"
+               "read_p99_ns,write_p99_ns,memory_used\n");
+    }
+    else if (!options->Json)
+    {
+        printf("History of RAM disk %d, %u of %llu seconds recorded\n\n", options->DeviceNumber,
+               history->SamplesReturned, history->TotalSamples);
+        printf("Time     | Read IOPS | Write IOPS | Read MB/s | Write MB/s | Hit Ratio | Read p99  | Write p99 | Memory Used\n");
+        printf("---------|-----------|------------|-----------|------------|-----------|-----------|-----------|------------\n");
+    }
+
+    double peakRead = 0.0, peakWrite = 0.0;
+    SYSTEMTIME peakReadTime = {0}, peakWriteTime = {0};
+
+    for (ULONG i = 0; i < history->SamplesReturned; i++)
+    {
+        const TEMP_HISTORY_SAMPLE *sample =
+            (const TEMP_HISTORY_SAMPLE *)((const BYTE *)history + history->Size + (SIZE_T)i * history->SampleSize);
+        double seconds = sample->ElapsedMs ? sample->ElapsedMs / 1000.0 : history->IntervalMs / 1000.0;
+        double readIops = sample->Reads / seconds;
+        double writeIops = sample->Writes / seconds;
+        double readBytes = sample->BytesRead / seconds;
+        double writeBytes = sample->BytesWritten / seconds;
+        ULONG64 lookups = sample->CacheHits + sample->CacheMisses;
+
+        FILETIME utc, local;
+        SYSTEMTIME time;
+        utc.dwLowDateTime = (DWORD)sample->Time;
+        utc.dwHighDateTime = (DWORD)(sample->Time >> 32);
+        FileTimeToLocalFileTime(&utc, &local);
+        FileTimeToSystemTime(&local, &time);
+
+        if (readBytes > peakRead)
+        {
+            peakRead = readBytes;
+            peakReadTime = time;
+        }
+        if (writeBytes > peakWrite)
+        {
+            peakWrite = writeBytes;
+            peakWriteTime = time;
+        }
+
+        if (options->Csv || options->Json)
+        {
+            char timestamp[32], hitRatio[16];
+            sprintf_s(timestamp, sizeof(timestamp), "%04u-%02u-%02uT%02u:%02u:%02u", time.wYear, time.wMonth,
+                      time.wDay, time.wHour, time.wMinute, time.wSecond);
+
+            if (lookups)
+            {
+                sprintf_s(hitRatio, sizeof(hitRatio), "%.4f", (double)sample->CacheHits / lookups);
+            }
+            else
+            {
+                strcpy_s(hitRatio, sizeof(hitRatio), options->Json ? "null" : "");
+            }
+
+            if (options->Csv)
+            {
+                printf("%s,%u,%.3f,%.0f,%.0f,%.0f,%.0f,%s,%llu,%llu,%llu\n", timestamp, options->DeviceNumber, seconds,
+                       readIops, writeIops, readBytes, writeBytes, hitRatio, sample->ReadLatencyP99,
+                       sample->WriteLatencyP99, sample->MemoryUsed);
+            }
+            else
+            {
+                printf("{\"time\":\"%s\",\"device\":%u,\"interval_s\":%.3f,\"read_iops\":%.0f,\"write_iops\":%.0f,"
+                       "\"read_bytes_per_s\":%.0f,\"write_bytes_per_s\":%.0f,\"hit_ratio\":%s,"
+                       "\"read_p99_ns\":%llu,\"write_p99_ns\":%llu,\"memory_used\":%llu}\n",
+                       timestamp, options->DeviceNumber, seconds, readIops, writeIops, readBytes, writeBytes,
+                       hitRatio, sample->ReadLatencyP99, sample->WriteLatencyP99, sample->MemoryUsed);
+            }
+        }
+        else
+        {
+            char hitRatio[16], readP99[32], writeP99[32];
+
+            if (lookups)
+            {
+                sprintf_s(hitRatio, sizeof(hitRatio), "%.2f%%", (double)sample->CacheHits / lookups * 100.0);
+            }
+            else
+            {
+                strcpy_s(hitRatio, sizeof(hitRatio), "-");
+            }
+
+            strcpy_s(readP99, sizeof(readP99), "-");
+            strcpy_s(writeP99, sizeof(writeP99), "-");
+            if (sample->Reads)
+            {
+                FormatLatency(sample->ReadLatencyP99, readP99, sizeof(readP99));
+            }
+            if (sample->Writes)
+            {
+                FormatLatency(sample->WriteLatencyP99, writeP99, sizeof(writeP99));
+            }
+
+            printf("%02u:%02u:%02u | %-9.0f | %-10.0f | %-9.1f | %-10.1f | %-9s | %-9s | %-9s | %8.1f MB\n",
+                   time.wHour, time.wMinute, time.wSecond, readIops, writeIops,
+                   readBytes / (1024.0 * 1024.0), writeBytes / (1024.0 * 1024.0), hitRatio, readP99, writeP99,
+                   (double)sample->MemoryUsed / (1024.0 * 1024.0));
+        }
+    }
+
+    if (!options->Csv && !options->Json)
+    {
+        printf("\nBusiest second for reads:  %.1f MB/s at %02u:%02u:%02u\n", peakRead / (1024.0 * 1024.0),
+               peakReadTime.wHour, peakReadTime.wMinute, peakReadTime.wSecond);
+        printf("Busiest second for writes: %.1f MB/s at %02u:%02u:%02u\n", peakWrite / (1024.0 * 1024.0),
+               peakWriteTime.wHour, peakWriteTime.wMinute, peakWriteTime.wSecond);
+    }
+
+    free(history);
+    return STATUS_SUCCESS;
+}
+
+static BOOL IsZeroBlock(const UCHAR *data, DWORD length)
+{
+    const ULONG64 *words = (const ULONG64 *)data;
+
+    for (DWORD i = 0; i < length / sizeof(ULONG64); i++)
+    {
+        if (words[i])
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Writes a device's contents to an image for create --image. The stripe heat goes
+// in front of the data so the restored disk loads what was hot first; blocks of
+// zeros are left as holes in a sparse file.
+NTSTATUS SaveRamDisk(const COMMAND_OPTIONS *options)
+{
+    WCHAR devicePath[64];
+    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", options->DeviceNumber);
+
+    HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, OPEN_EXISTING, 0, NULL);
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open device %d. Device may not exist.\n", options->DeviceNumber);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    TEMP_IMAGE_FILE_HEADER header = {0};
+    TEMP_HEATMAP heatmap = {0};
+    DISK_GEOMETRY geometry = {0};
+    DWORD bytesReturned = 0;
+
+    DeviceIoControl(hDevice, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL);
+
+    // One region per stripe is the heat the driver keeps
+    TEMP_HEATMAP_REGION *regions = FetchHeatmap(hDevice, 0, &heatmap);
+    if (!regions)
+    {
+        printf("Failed to read the heat of device %d. Windows error: %d\n", options->DeviceNumber, GetLastError());
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    header.Magic = TEMP_IMAGE_FILE_MAGIC;
+    header.Version = TEMP_IMAGE_FILE_VERSION;
+    header.HeaderSize = sizeof(TEMP_IMAGE_FILE_HEADER);
+    header.SectorSize = geometry.BytesPerSector ? geometry.BytesPerSector : TEMP_DEFAULT_SECTOR_SIZE;
+    header.StripeSize = heatmap.StripeSize;
+    header.DiskSize = heatmap.DiskSize;
+    header.StripeCount = heatmap.RegionCount;
+    header.DataOffset = (sizeof(header) + header.StripeCount * sizeof(ULONG) + TEMP_IMAGE_DATA_ALIGNMENT - 1) &
+                        ~((ULONG64)TEMP_IMAGE_DATA_ALIGNMENT - 1);
+
+    ULONG *heat = (ULONG *)calloc(heatmap.RegionCount ? heatmap.RegionCount : 1, sizeof(ULONG));
+    PUCHAR buffer = (PUCHAR)VirtualAlloc(NULL, SAVE_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    for (ULONG i = 0; heat && i < heatmap.RegionCount; i++)
+    {
+        ULONG64 value = regions[i].Reads + regions[i].Writes;
+        heat[i] = value > MAXULONG ? MAXULONG : (ULONG)value;
+    }
+
+    free(regions);
+
+    HANDLE hFile = CreateFileA(options->OutputFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE || !heat || !buffer)
+    {
+        printf("Error: Cannot create %s\n", options->OutputFile);
+        if (hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hFile);
+        }
+        if (buffer)
+        {
+            VirtualFree(buffer, 0, MEM_RELEASE);
+        }
+        free(heat);
+        CloseHandle(hDevice);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // Without sparse file support the holes are written out as zeros
+    DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL);
+
+    DWORD heatBytes = (DWORD)(header.StripeCount * sizeof(ULONG));
+    DWORD transferred = 0;
+    BOOL ok = WriteFile(hFile, &header, sizeof(header), &transferred, NULL) && transferred == sizeof(header) &&
+              WriteFile(hFile, heat, heatBytes, &transferred, NULL) && transferred == heatBytes;
+
+    printf("Saving RAM disk %d (%.2f MB) to %s...\n", options->DeviceNumber,
+           (double)header.DiskSize / (1024.0 * 1024.0), options->OutputFile);
+
+    ULONG64 dataBytes = 0;
+    LARGE_INTEGER position;
+
+    for (ULONG64 offset = 0; ok && offset < header.DiskSize; offset += SAVE_BLOCK_SIZE)
+    {
+        DWORD length = header.DiskSize - offset < SAVE_BLOCK_SIZE ? (DWORD)(header.DiskSize - offset) : SAVE_BLOCK_SIZE;
+
+        position.QuadPart = (LONGLONG)offset;
+        ok = SetFilePointerEx(hDevice, position, NULL, FILE_BEGIN) &&
+             ReadFile(hDevice, buffer, length, &transferred, NULL) && transferred == length;
+
+        if (!ok || IsZeroBlock(buffer, length))
+        {
+            continue;
+        }
+
+        position.QuadPart = (LONGLONG)(header.DataOffset + offset);
+        ok = SetFilePointerEx(hFile, position, NULL, FILE_BEGIN) &&
+             WriteFile(hFile, buffer, length, &transferred, NULL) && transferred == length;
+        dataBytes += length;
+    }
+
+    // Zeros at the end of the disk become one more hole
+    position.QuadPart = (LONGLONG)(header.DataOffset + header.DiskSize);
+    ok = ok && SetFilePointerEx(hFile, position, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+    DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+
+    CloseHandle(hFile);
+    VirtualFree(buffer, 0, MEM_RELEASE);
+    free(heat);
+    CloseHandle(hDevice);
+
+    if (!ok)
+    {
+        printf("Error: Failed writing %s. Windows error: %d\n", options->OutputFile, error);
+        DeleteFileA(options->OutputFile);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("Saved %.2f MB of data, %llu stripes of heat\n", (double)dataBytes / (1024.0 * 1024.0), header.StripeCount);
+    return STATUS_SUCCESS;
+}
+
+static void FormatBudgetSize(ULONG64 bytes, char *buffer, size_t bufferSize, const char *none)
 {
-    printf("TEMP - High-Performance RAM Disk for Windows\n");
-    printf("Version %d.%d.%d\n\n", TEMP_VERSION_MAJOR, TEMP_VERSION_MINOR, TEMP_VERSION_BUILD);
+    if (bytes == 0 && none)
+    {
+        sprintf_s(buffer, bufferSize, "%s", none);
+    }
+    else
+    {
+        FormatListSize(bytes, buffer, bufferSize);
+    }
+}
 
-    printf("Usage: %s <command> [options]\n\n", programName);
+// Show the shared memory budget, after applying whatever --limit, --min and --max
+// asked for. A device change sends both bounds, so the one left out is taken
+// from the current report.
+NTSTATUS MemoryBudget(const COMMAND_OPTIONS *options)
+{
+    TEMP_MEMORY_BUDGET *budget = (TEMP_MEMORY_BUDGET *)calloc(1, sizeof(TEMP_MEMORY_BUDGET));
+    TEMP_BUDGET_CONTROL control = {0};
+    DWORD bytesReturned = 0;
 
-    printf("Commands:\n");
-    printf("  create          Create a new RAM disk\n");
-    printf("  remove <num>    Remove RAM disk by device number\n");
-    printf("  list            List all RAM disks\n");
-    printf("  stats <num>     Show statistics for device number\n");
-    printf("  version         Show version information\n");
-    printf("  help            Show this help message\n\n");
+    if (!budget)
+    {
+        printf("Error: Out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    printf("Create Options:\n");
-    printf("  --size <size>        Disk size (e.g., 128M, 1G, 2048K)\n");
-    printf("  --drive <letter>     Drive letter (A-Z)\n");
-    printf("  --device <num>       Device number (0-%d)\n", TEMP_MAX_DEVICES - 1);
-    printf("  --sector-size <size> Sector size in bytes (default: 512)\n");
-    printf("  --removable          Mark as removable media\n");
-    printf("  --cdrom              Emulate CD-ROM drive\n\n");
+    HANDLE hDevice = OpenControlDevice();
+    if (hDevice == INVALID_HANDLE_VALUE)
+    {
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        free(budget);
+        return STATUS_DEVICE_NOT_READY;
+    }
 
-    printf("Size Examples:\n");
-    printf("  64M     64 megabytes\n");
-    printf("  1G      1 gigabyte\n");
-    printf("  512K    512 kilobytes\n");
-    printf("  1048576 1048576 bytes\n\n");
+    control.Flags = options->BudgetFlags;
+    control.DeviceNumber = options->DeviceNumber;
+    control.PoolLimit = options->PoolLimit;
+    control.Minimum = options->MemoryMinimum;
+    control.Maximum = options->MemoryMaximum;
 
-    printf("Examples:\n");
-    printf("  %s create --size 256M --drive R\n", programName);
-    printf("  %s create --size 1G --device 1 --removable\n", programName);
-    printf("  %s remove 0\n", programName);
-    printf("  %s list\n", programName);
-    printf("  %s stats 0\n", programName);
+    if ((control.Flags & TEMP_BUDGET_SET_DEVICE) && (!options->MinimumSpecified || !options->MaximumSpecified))
+    {
+        BOOL found = FALSE;
+
+        if (DeviceIoControl(hDevice, TEMP_IOCTL_MEMORY_BUDGET, NULL, 0, budget, sizeof(TEMP_MEMORY_BUDGET),
+                            &bytesReturned, NULL) &&
+            bytesReturned >= sizeof(TEMP_MEMORY_BUDGET))
+        {
+            for (ULONG i = 0; i < budget->DevicesReturned && i < TEMP_MAX_DEVICES; i++)
+            {
+                if (budget->Devices[i].DeviceNumber == control.DeviceNumber)
+                {
+                    control.Minimum = options->MinimumSpecified ? control.Minimum : budget->Devices[i].Minimum;
+                    control.Maximum = options->MaximumSpecified ? control.Maximum : budget->Devices[i].Maximum;
+                    found = TRUE;
+                    break;
+                }
+            }
+        }
+
+        if (!found)
+        {
+            printf("Error: RAM disk %u not found\n", control.DeviceNumber);
+            CloseHandle(hDevice);
+            free(budget);
+            return STATUS_NO_SUCH_DEVICE;
+        }
+    }
+
+    if ((control.Flags & TEMP_BUDGET_SET_DEVICE) && control.Maximum && control.Maximum < control.Minimum)
+    {
+        printf("Error: The maximum must not be below the minimum\n");
+        CloseHandle(hDevice);
+        free(budget);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    BOOL success = DeviceIoControl(hDevice, control.Flags ? TEMP_IOCTL_SET_MEMORY_BUDGET : TEMP_IOCTL_MEMORY_BUDGET,
+                                   control.Flags ? &control : NULL, control.Flags ? sizeof(control) : 0,
+                                   budget, sizeof(TEMP_MEMORY_BUDGET), &bytesReturned, NULL);
+    DWORD error = success ? ERROR_SUCCESS : GetLastError();
+
+    CloseHandle(hDevice);
+
+    if (!success)
+    {
+        if (error == ERROR_NOT_ENOUGH_MEMORY || error == ERROR_NO_SYSTEM_RESOURCES)
+        {
+            printf("Failed to change the memory budget: the guaranteed minimums would exceed the limit\n");
+        }
+        else if (error == ERROR_INVALID_PARAMETER)
+        {
+            printf("Failed to change the memory budget: the limit cannot go below the guaranteed minimums\n");
+        }
+        else
+        {
+            printf("Failed to change the memory budget. Windows error: %d\n", error);
+        }
+        free(budget);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (bytesReturned < sizeof(TEMP_MEMORY_BUDGET) || budget->Version != TEMP_MEMORY_BUDGET_VERSION)
+    {
+        printf("Error: Driver returned an unexpected memory budget report\n");
+        free(budget);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    char limit[32], guaranteed[32], charged[32], burst[32];
+
+    FormatBudgetSize(budget->PoolLimit, limit, sizeof(limit), "no limit");
+    FormatBudgetSize(budget->Guaranteed, guaranteed, sizeof(guaranteed), NULL);
+    FormatBudgetSize(budget->Charged, charged, sizeof(charged), NULL);
+    FormatBudgetSize(budget->Burst, burst, sizeof(burst), NULL);
+
+    printf("Memory Budget:\n");
+    printf("  Limit: %s\n", limit);
+    printf("  Guaranteed: %s\n", guaranteed);
+    printf("  Charged: %s (%s above the guaranteed minimums)\n", charged, burst);
+    printf("  Allocations refused: %llu\n", budget->Denials);
+
+    if (budget->DevicesReturned)
+    {
+        printf("\n%-6s %-12s %-12s %-12s %-10s %s\n", "Device", "Minimum", "Maximum", "Charged", "Refused", "On pressure");
+
+        for (ULONG i = 0; i < budget->DevicesReturned && i < TEMP_MAX_DEVICES; i++)
+        {
+            const TEMP_DEVICE_BUDGET *device = &budget->Devices[i];
+            char minimum[32], maximum[32], deviceCharged[32], policy[32];
+
+            FormatBudgetSize(device->Minimum, minimum, sizeof(minimum), NULL);
+            FormatBudgetSize(device->Maximum, maximum, sizeof(maximum), "none");
+            FormatBudgetSize(device->Charged, deviceCharged, sizeof(deviceCharged), NULL);
+            sprintf_s(policy, sizeof(policy), "%s%s%s",
+                      (device->PressurePolicy & TEMP_PRESSURE_COMPRESS) ? "compress " : "",
+                      (device->PressurePolicy & TEMP_PRESSURE_SPILL) ? "spill " : "",
+                      (device->PressurePolicy & TEMP_PRESSURE_POLICY_MASK) ? "" : "none (not rebalanced)");
+
+            printf("%-6u %-12s %-12s %-12s %-10llu %s\n", device->DeviceNumber, minimum, maximum, deviceCharged,
+                   device->Denials, policy);
+        }
+    }
+
+    free(budget);
+    return STATUS_SUCCESS;
 }
 
-void ShowVersion(void)
+static void FormatQosIops(ULONG64 iops, char *buffer, size_t bufferSize)
 {
+    if (iops == 0)
+    {
+        sprintf_s(buffer, bufferSize, "none");
+    }
+    else
+    {
+        sprintf_s(buffer, bufferSize, "%llu", iops);
+    }
+}
+
+// Show the QoS settings, after applying whatever the command line changed. The
+// driver takes a device's or the driver-wide settings as a whole, so the ones the
+// command line leaves out are taken from the current report.
+NTSTATUS IoQos(const COMMAND_OPTIONS *options)
+{
+    TEMP_QOS_REPORT *report = (TEMP_QOS_REPORT *)calloc(1, sizeof(TEMP_QOS_REPORT));
+    TEMP_QOS_CONTROL control = {0};
+    DWORD bytesReturned = 0;
+
+    if (!report)
+    {
+        printf("Error: Out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
     HANDLE hDevice = OpenControlDevice();
-    if (hDevice != INVALID_HANDLE_VALUE)
+    if (hDevice == INVALID_HANDLE_VALUE)
     {
-        ULONG version = 0;
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        free(report);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (!DeviceIoControl(hDevice, TEMP_IOCTL_QOS, NULL, 0, report, sizeof(TEMP_QOS_REPORT), &bytesReturned, NULL) ||
+        bytesReturned < sizeof(TEMP_QOS_REPORT) || report->Version != TEMP_QOS_VERSION)
+    {
+        printf("Error: Driver did not return its QoS settings. Windows error: %d\n", GetLastError());
+        CloseHandle(hDevice);
+        free(report);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    control.Flags = options->QosFlags;
+    control.DeviceNumber = options->DeviceNumber;
+    control.TotalIops = (options->QosFields & QOS_FIELD_TOTAL_IOPS) ? options->TotalIops : report->TotalIops;
+    control.TotalBandwidth =
+        (options->QosFields & QOS_FIELD_TOTAL_BANDWIDTH) ? options->TotalBandwidth : report->TotalBandwidth;
+    control.IdleIntervalMs = (options->QosFields & QOS_FIELD_IDLE) ? options->IdleIntervalMs : report->IdleIntervalMs;
+
+    if (control.Flags & TEMP_QOS_SET_DEVICE)
+    {
+        const TEMP_DEVICE_QOS *current = NULL;
+
+        for (ULONG i = 0; i < report->DevicesReturned && i < TEMP_MAX_DEVICES; i++)
+        {
+            if (report->Devices[i].DeviceNumber == control.DeviceNumber)
+            {
+                current = &report->Devices[i];
+                break;
+            }
+        }
+
+        if (!current)
+        {
+            printf("Error: RAM disk %u not found\n", control.DeviceNumber);
+            CloseHandle(hDevice);
+            free(report);
+            return STATUS_NO_SUCH_DEVICE;
+        }
+
+        control.IopsLimit = (options->QosFields & QOS_FIELD_IOPS) ? options->IopsLimit : current->IopsLimit;
+        control.BandwidthLimit =
+            (options->QosFields & QOS_FIELD_BANDWIDTH) ? options->BandwidthLimit : current->BandwidthLimit;
+        control.Weight = (options->QosFields & QOS_FIELD_WEIGHT) ? options->QosWeight : current->Weight;
+    }
+
+    if (control.Flags)
+    {
+        BOOL success = DeviceIoControl(hDevice, TEMP_IOCTL_SET_QOS, &control, sizeof(control), report,
+                                       sizeof(TEMP_QOS_REPORT), &bytesReturned, NULL);
+        if (!success || bytesReturned < sizeof(TEMP_QOS_REPORT))
+        {
+            printf("Failed to change the QoS settings. Windows error: %d\n", GetLastError());
+            CloseHandle(hDevice);
+            free(report);
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    CloseHandle(hDevice);
+
+    char totalIops[32], totalBandwidth[32];
+
+    FormatQosIops(report->TotalIops, totalIops, sizeof(totalIops));
+    FormatBudgetSize(report->TotalBandwidth, totalBandwidth, sizeof(totalBandwidth), "none");
+
+    printf("I/O QoS:\n");
+    printf("  Shared IOPS limit: %s\n", totalIops);
+    printf("  Shared bandwidth limit: %s%s\n", totalBandwidth, report->TotalBandwidth ? "/s" : "");
+    if (report->IdleIntervalMs)
+    {
+        printf("  Low-priority I/O: waits for %ums without other requests\n", report->IdleIntervalMs);
+    }
+    else
+    {
+        printf("  Low-priority I/O: not held back\n");
+    }
+
+    if (report->DevicesReturned)
+    {
+        printf("\n%-6s %-6s %-10s %-12s %-10s %-12s %-18s %s\n", "Device", "Weight", "IOPS", "Bandwidth",
+               "IOPS now", "MB/s now", "Throttled", "Deferred");
+
+        for (ULONG i = 0; i < report->DevicesReturned && i < TEMP_MAX_DEVICES; i++)
+        {
+            const TEMP_DEVICE_QOS *device = &report->Devices[i];
+            char iops[32], bandwidth[32], iopsRate[32], bandwidthRate[32], throttled[32], deferred[32];
+
+            FormatQosIops(device->IopsLimit, iops, sizeof(iops));
+            FormatBudgetSize(device->BandwidthLimit, bandwidth, sizeof(bandwidth), "none");
+            FormatQosIops(device->IopsRate, iopsRate, sizeof(iopsRate));
+            if (device->BandwidthRate)
+            {
+                sprintf_s(bandwidthRate, sizeof(bandwidthRate), "%.1f", (double)device->BandwidthRate / (1024.0 * 1024.0));
+            }
+            else
+            {
+                sprintf_s(bandwidthRate, sizeof(bandwidthRate), "none");
+            }
+            sprintf_s(throttled, sizeof(throttled), "%llu, %.1fs", device->ThrottledRequests,
+                      (double)device->ThrottledTime / 1e9);
+            sprintf_s(deferred, sizeof(deferred), "%llu, %.1fs", device->DeferredRequests,
+                      (double)device->DeferredTime / 1e9);
+
+            printf("%-6u %-6u %-10s %-12s %-10s %-12s %-18s %s\n", device->DeviceNumber, device->Weight, iops,
+                   bandwidth, iopsRate, bandwidthRate, throttled, deferred);
+        }
+    }
+
+    free(report);
+    return STATUS_SUCCESS;
+}
+
+// One device's numbers for a scrape; the optional IOCTLs may be missing on
+// older drivers
+typedef struct
+{
+    TEMP_STATISTICS Stats;
+    TEMP_MEMORY_STATISTICS Memory;
+    TEMP_LATENCY_STATISTICS Latency;
+    BOOLEAN HaveMemory;
+    BOOLEAN HaveLatency;
+} EXPORTER_DEVICE;
+
+typedef struct
+{
+    const char *Name;
+    const char *Type; // Prometheus counter or gauge
+    const char *Help;
+    ULONG Offset;     // Of a ULONG64 in the source structure
+} EXPORTER_METRIC;
+
+static const EXPORTER_METRIC ExporterStatistics[] = {
+    {"temp_disk_size_bytes", "gauge", "Size of the RAM disk", FIELD_OFFSET(TEMP_STATISTICS, DiskSize)},
+    {"temp_memory_used_bytes", "gauge", "Memory allocated for the disk's data", FIELD_OFFSET(TEMP_STATISTICS, MemoryUsed)},
+    {"temp_reads_total", "counter", "Read requests completed", FIELD_OFFSET(TEMP_STATISTICS, TotalReads)},
+    {"temp_writes_total", "counter", "Write requests completed", FIELD_OFFSET(TEMP_STATISTICS, TotalWrites)},
+    {"temp_read_bytes_total", "counter", "Bytes read", FIELD_OFFSET(TEMP_STATISTICS, BytesRead)},
+    {"temp_written_bytes_total", "counter", "Bytes written", FIELD_OFFSET(TEMP_STATISTICS, BytesWritten)},
+    {"temp_cache_hits_total", "counter", "Sector lookups that found allocated data", FIELD_OFFSET(TEMP_STATISTICS, CacheHits)},
+    {"temp_cache_misses_total", "counter", "Sector lookups that found no data", FIELD_OFFSET(TEMP_STATISTICS, CacheMisses)},
+    {"temp_evictions_total", "counter", "Chunks evicted", FIELD_OFFSET(TEMP_STATISTICS, EvictionCount)},
+    {"temp_pressure_events_total", "counter", "Low memory conditions seen", FIELD_OFFSET(TEMP_STATISTICS, PressureEvents)},
+    {"temp_reclaimed_bytes_total", "counter", "Memory given back under pressure", FIELD_OFFSET(TEMP_STATISTICS, BytesReclaimed)},
+    {"temp_compressed_chunks", "gauge", "Chunks held compressed", FIELD_OFFSET(TEMP_STATISTICS, CompressedChunks)},
+    {"temp_compressed_bytes", "gauge", "Memory holding compressed chunks", FIELD_OFFSET(TEMP_STATISTICS, CompressedBytes)},
+    {"temp_spilled_chunks", "gauge", "Chunks spilled to the backing file", FIELD_OFFSET(TEMP_STATISTICS, SpilledChunks)},
+};
+
+static const EXPORTER_METRIC ExporterMemory[] = {
+    {"temp_chunk_capacity", "gauge", "Chunks the disk can hold", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, ChunkCapacity)},
+    {"temp_allocated_chunks", "gauge", "Chunks allocated", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, AllocatedChunks)},
+    {"temp_partial_chunks", "gauge", "Allocated chunks with unused sectors", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, PartialChunks)},
+    {"temp_resident_data_bytes", "gauge", "Uncompressed chunk data in memory", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, ResidentDataBytes)},
+    {"temp_compressed_data_bytes", "gauge", "Compressed chunk data in memory", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, CompressedDataBytes)},
+    {"temp_in_use_bytes", "gauge", "Written, untrimmed data", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, InUseDataBytes)},
+    {"temp_metadata_bytes", "gauge", "Buckets, slot arrays and chunk headers", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, MetadataBytes)},
+    {"temp_allocation_failures_total", "counter", "Chunk allocations that failed", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, AllocationFailures)},
+    {"temp_image_pending_chunks", "gauge", "Chunks not loaded from the image yet", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, ImagePendingChunks)},
+    {"temp_image_demand_loads_total", "counter", "Image chunks loaded because a request needed them", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, ImageDemandLoads)},
+    {"temp_budget_charged_bytes", "gauge", "Chunk data charged to the shared memory budget", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, BudgetCharged)},
+    {"temp_budget_minimum_bytes", "gauge", "Memory guaranteed from the shared budget", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, BudgetMinimum)},
+    {"temp_budget_maximum_bytes", "gauge", "Most memory the disk may hold, 0 for no maximum", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, BudgetMaximum)},
+    {"temp_budget_denials_total", "counter", "Chunk allocations refused by the memory budget", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, BudgetDenials)},
+    {"temp_shared_chunks", "gauge", "Chunks sharing their data copy-on-write", FIELD_OFFSET(TEMP_MEMORY_STATISTICS, SharedChunks)},
+};
+
+// Growable text for one response; Failed is set once memory runs out
+typedef struct
+{
+    char *Data;
+    size_t Length;
+    size_t Capacity;
+    BOOL Failed;
+} EXPORTER_BUFFER;
+
+static void ExporterAppend(EXPORTER_BUFFER *buffer, const char *format, ...)
+{
+    va_list args;
+
+    for (;;)
+    {
+        if (buffer->Failed)
+        {
+            return;
+        }
+
+        size_t available = buffer->Capacity - buffer->Length;
+        if (available > 0)
+        {
+            va_start(args, format);
+            int written = vsnprintf(buffer->Data + buffer->Length, available, format, args);
+            va_end(args);
+
+            if (written < 0)
+            {
+                buffer->Failed = TRUE;
+                return;
+            }
+
+            if ((size_t)written < available)
+            {
+                buffer->Length += written;
+                return;
+            }
+        }
+
+        size_t capacity = buffer->Capacity ? buffer->Capacity * 2 : 16384;
+        char *data = (char *)realloc(buffer->Data, capacity);
+        if (!data)
+        {
+            buffer->Failed = TRUE;
+            return;
+        }
+
+        buffer->Data = data;
+        buffer->Capacity = capacity;
+    }
+}
+
+// Lists the devices with one request, then opens each for the optional
+// memory and latency statistics; returns how many exist
+static ULONG ExporterCollect(EXPORTER_DEVICE *devices, ULONG *deviceNumbers)
+{
+    TEMP_DEVICE_INFO list[TEMP_MAX_DEVICES];
+    ULONG count = 0;
+
+    if (!FetchDeviceList(list, &count))
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        EXPORTER_DEVICE *device = &devices[i];
+        WCHAR devicePath[64];
         DWORD bytesReturned = 0;
 
-        if (DeviceIoControl(hDevice, TEMP_IOCTL_GET_VERSION, NULL, 0,
-                            &version, sizeof(version), &bytesReturned, NULL))
+        memset(device, 0, sizeof(*device));
+        device->Stats = list[i].Statistics;
+        deviceNumbers[i] = list[i].DeviceNumber;
+
+        swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", list[i].DeviceNumber);
+
+        HANDLE hDevice = CreateFileW(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                     NULL, OPEN_EXISTING, 0, NULL);
+        if (hDevice == INVALID_HANDLE_VALUE)
         {
-            ULONG major = (version >> 16) & 0xFF;
-            ULONG minor = (version >> 8) & 0xFF;
-            ULONG build = version & 0xFF;
+            continue;
+        }
+
+        device->HaveMemory = DeviceIoControl(hDevice, TEMP_IOCTL_GET_MEMORY_STATISTICS, NULL, 0,
+                                             &device->Memory, sizeof(device->Memory), &bytesReturned, NULL) &&
+                             bytesReturned >= sizeof(device->Memory);
+        device->HaveLatency = DeviceIoControl(hDevice, TEMP_IOCTL_GET_LATENCY_STATISTICS, NULL, 0,
+                                              &device->Latency, sizeof(device->Latency), &bytesReturned, NULL) &&
+                              bytesReturned >= sizeof(device->Latency);
+
+        CloseHandle(hDevice);
+    }
+
+    return count;
+}
+
+// Prometheus text exposition format: every family once, with a sample per device
+static void ExporterFormat(EXPORTER_BUFFER *buffer, const EXPORTER_DEVICE *devices, const ULONG *deviceNumbers,
+                           ULONG count)
+{
+    static const char *operationNames[TEMP_OPERATION_COUNT] = {"read", "write", "ioctl"};
+    static const char *quantiles[TEMP_PERCENTILE_COUNT] = {"0.5", "0.9", "0.99", "0.999"};
+
+    ExporterAppend(buffer, "# HELP temp_devices RAM disks present\n# TYPE temp_devices gauge\ntemp_devices %u\n", count);
+
+    for (ULONG m = 0; m < ARRAYSIZE(ExporterStatistics); m++)
+    {
+        const EXPORTER_METRIC *metric = &ExporterStatistics[m];
+
+        ExporterAppend(buffer, "# HELP %s %s\n# TYPE %s %s\n", metric->Name, metric->Help, metric->Name, metric->Type);
+        for (ULONG d = 0; d < count; d++)
+        {
+            ULONG64 value = *(const ULONG64 *)((const UCHAR *)&devices[d].Stats + metric->Offset);
+            ExporterAppend(buffer, "%s{device=\"%u\"} %llu\n", metric->Name, deviceNumbers[d], value);
+        }
+    }
+
+    for (ULONG m = 0; m < ARRAYSIZE(ExporterMemory); m++)
+    {
+        const EXPORTER_METRIC *metric = &ExporterMemory[m];
+
+        ExporterAppend(buffer, "# HELP %s %s\n# TYPE %s %s\n", metric->Name, metric->Help, metric->Name, metric->Type);
+        for (ULONG d = 0; d < count; d++)
+        {
+            if (devices[d].HaveMemory)
+            {
+                ULONG64 value = *(const ULONG64 *)((const UCHAR *)&devices[d].Memory + metric->Offset);
+                ExporterAppend(buffer, "%s{device=\"%u\"} %llu\n", metric->Name, deviceNumbers[d], value);
+            }
+        }
+    }
+
+    // The driver's percentiles cover everything since the device was created
+    ExporterAppend(buffer, "# HELP temp_request_duration_seconds Driver service time per request\n"
+                           "# TYPE temp_request_duration_seconds summary\n");
+    for (ULONG d = 0; d < count; d++)
+    {
+        if (!devices[d].HaveLatency)
+        {
+            continue;
+        }
+
+        for (ULONG op = 0; op < TEMP_OPERATION_COUNT; op++)
+        {
+            const TEMP_OPERATION_LATENCY *operation = &devices[d].Latency.Operations[op];
+
+            for (ULONG p = 0; p < TEMP_PERCENTILE_COUNT; p++)
+            {
+                ExporterAppend(buffer, "temp_request_duration_seconds{device=\"%u\",operation=\"%s\",quantile=\"%s\"} %.9f\n",
+                               deviceNumbers[d], operationNames[op], quantiles[p],
+                               operation->LatencyPercentiles[p] / 1e9);
+            }
+
+            ExporterAppend(buffer, "temp_request_duration_seconds_sum{device=\"%u\",operation=\"%s\"} %.9f\n",
+                           deviceNumbers[d], operationNames[op], operation->TotalLatency / 1e9);
+            ExporterAppend(buffer, "temp_request_duration_seconds_count{device=\"%u\",operation=\"%s\"} %llu\n",
+                           deviceNumbers[d], operationNames[op], operation->Count);
+        }
+    }
+}
+
+static void ExporterSend(SOCKET client, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        int sent = send(client, data, length < 65536 ? (int)length : 65536, 0);
+        if (sent <= 0)
+        {
+            return;
+        }
+
+        data += sent;
+        length -= sent;
+    }
+}
 
-            printf("TEMP RAM Disk Driver Version: %d.%d.%d\n", major, minor, build);
+// Answers one HTTP request: GET /metrics with a fresh scrape, anything else 404
+static void ExporterServe(SOCKET client, EXPORTER_DEVICE *devices, ULONG *deviceNumbers)
+{
+    char request[EXPORTER_REQUEST_SIZE];
+    int length = 0;
+
+    // Only the request line matters, but read the whole header so the client
+    // does not see a reset for unread data when the socket closes
+    while (length < (int)sizeof(request) - 1)
+    {
+        int received = recv(client, request + length, (int)sizeof(request) - 1 - length, 0);
+        if (received <= 0)
+        {
+            return;
         }
-        else
+
+        length += received;
+        request[length] = '\0';
+
+        if (strstr(request, "\r\n\r\n"))
         {
-            printf("TEMP RAM Disk Driver: Version information unavailable\n");
+            break;
         }
+    }
 
-        CloseHandle(hDevice);
+    BOOL head = strncmp(request, "HEAD ", 5) == 0;
+    const char *path = head ? request + 5 : strncmp(request, "GET ", 4) == 0 ? request + 4 : NULL;
+    char header[256];
+
+    if (!path || (strncmp(path, "/metrics ", 9) != 0 && strncmp(path, "/metrics?", 9) != 0))
+    {
+        static const char notFound[] = "Metrics are at /metrics\n";
+        sprintf_s(header, sizeof(header),
+                  "HTTP/1.1 %s\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Length: %u\r\n"
+                  "Connection: close\r\n\r\n",
+                  path ? "404 Not Found" : "405 Method Not Allowed", (ULONG)(sizeof(notFound) - 1));
+        ExporterSend(client, header, strlen(header));
+        ExporterSend(client, notFound, sizeof(notFound) - 1);
+        return;
+    }
+
+    EXPORTER_BUFFER body = {0};
+    ULONG count = ExporterCollect(devices, deviceNumbers);
+    ExporterFormat(&body, devices, deviceNumbers, count);
+
+    if (body.Failed)
+    {
+        static const char failed[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        ExporterSend(client, failed, sizeof(failed) - 1);
     }
     else
     {
-        printf("TEMP RAM Disk Driver: Not installed or not running\n");
+        sprintf_s(header, sizeof(header),
+                  "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                  "Content-Length: %llu\r\nConnection: close\r\n\r\n",
+                  (ULONG64)body.Length);
+        ExporterSend(client, header, strlen(header));
+        if (!head)
+        {
+            ExporterSend(client, body.Data, body.Length);
+        }
     }
 
-    printf("Command Line Tool Version: %d.%d.%d\n",
-           TEMP_VERSION_MAJOR, TEMP_VERSION_MINOR, TEMP_VERSION_BUILD);
+    free(body.Data);
 }
 
-NTSTATUS CreateRamDisk(const COMMAND_OPTIONS *options)
+// Serves /metrics for every RAM disk until Ctrl+C. Scrapes are answered one at
+// a time; each reads the drivers' counters fresh, so nothing is cached between them.
+NTSTATUS RunExporter(const COMMAND_OPTIONS *options)
 {
-    HANDLE hDevice = OpenControlDevice();
-    if (hDevice == INVALID_HANDLE_VALUE)
+    char host[64];
+    strcpy_s(host, sizeof(host), options->ListenAddress);
+
+    char *colon = strrchr(host, ':');
+    int port = colon ? atoi(colon + 1) : 0;
+    struct sockaddr_in address = {0};
+
+    if (colon)
     {
-        printf("Error: Cannot open control device. Driver may not be installed.\n");
-        return STATUS_DEVICE_NOT_READY;
+        *colon = '\0';
     }
 
-    TEMP_CREATE_DATA createData = {0};
-    createData.DeviceNumber = options->DeviceNumber;
-    createData.DiskSize = options->DiskSize;
-    createData.SectorSize = options->SectorSize;
-    createData.DriveLetter = options->DriveLetter;
-    createData.RemovableMedia = options->RemovableMedia;
-    createData.CdRomType = options->CdRomType;
+    address.sin_family = AF_INET;
+    if (!colon || port <= 0 || port > 65535 || inet_pton(AF_INET, host, &address.sin_addr) != 1)
+    {
+        printf("Error: --listen takes an IPv4 address and port, such as 127.0.0.1:9477\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    address.sin_port = htons((USHORT)port);
 
-    DWORD bytesReturned = 0;
-    BOOL success = DeviceIoControl(
-        hDevice,
-        TEMP_IOCTL_CREATE_DEVICE,
-        &createData,
-        sizeof(createData),
-        NULL,
-        0,
-        &bytesReturned,
-        NULL);
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        printf("Error: Winsock initialization failed\n");
+        return STATUS_UNSUCCESSFUL;
+    }
 
-    CloseHandle(hDevice);
+    EXPORTER_DEVICE *devices = (EXPORTER_DEVICE *)calloc(TEMP_MAX_DEVICES, sizeof(EXPORTER_DEVICE));
+    ULONG deviceNumbers[TEMP_MAX_DEVICES];
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    NTSTATUS status = STATUS_SUCCESS;
 
-    if (success)
+    if (!devices || listener == INVALID_SOCKET ||
+        bind(listener, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR)
     {
-        printf("RAM disk created successfully:\n");
-        printf("  Device Number: %d\n", options->DeviceNumber);
-        printf("  Size: %llu bytes (%.2f MB)\n", options->DiskSize,
-               (double)options->DiskSize / (1024.0 * 1024.0));
-        printf("  Sector Size: %d bytes\n", options->SectorSize);
+        printf("Error: Cannot listen on %s. Winsock error: %d\n", options->ListenAddress, WSAGetLastError());
+        status = STATUS_UNSUCCESSFUL;
+        goto cleanup;
+    }
 
-        if (options->DriveLetter)
-        {
-            printf("  Drive Letter: %C:\n", options->DriveLetter);
-        }
+    printf("Serving RAM disk metrics at http://%s/metrics (Ctrl+C to stop)\n", options->ListenAddress);
+    fflush(stdout);
 
-        if (options->RemovableMedia)
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    while (!g_StopRequested)
+    {
+        // Wake regularly to notice Ctrl+C
+        fd_set readSet;
+        struct timeval timeout = {0, 200000};
+
+        FD_ZERO(&readSet);
+        FD_SET(listener, &readSet);
+
+        int ready = select(0, &readSet, NULL, NULL, &timeout);
+        if (ready == SOCKET_ERROR)
         {
-            printf("  Type: Removable Media\n");
+            printf("Error: select failed. Winsock error: %d\n", WSAGetLastError());
+            status = STATUS_UNSUCCESSFUL;
+            break;
         }
-        else if (options->CdRomType)
+
+        if (ready == 0)
         {
-            printf("  Type: CD-ROM\n");
+            continue;
         }
-        else
+
+        SOCKET client = accept(listener, NULL, NULL);
+        if (client == INVALID_SOCKET)
         {
-            printf("  Type: Fixed Disk\n");
+            continue;
         }
 
-        return STATUS_SUCCESS;
+        DWORD timeoutMs = EXPORTER_TIMEOUT_MS;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeoutMs, sizeof(timeoutMs));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeoutMs, sizeof(timeoutMs));
+
+        ExporterServe(client, devices, deviceNumbers);
+
+        shutdown(client, SD_BOTH);
+        closesocket(client);
     }
-    else
+
+    SetConsoleCtrlHandler(StopCtrlHandler, FALSE);
+
+cleanup:
+    if (listener != INVALID_SOCKET)
     {
-        DWORD error = GetLastError();
-        printf("Failed to create RAM disk. Windows error: %d\n", error);
-        return STATUS_UNSUCCESSFUL;
+        closesocket(listener);
     }
+    free(devices);
+    WSACleanup();
+    return status;
 }
 
-NTSTATUS RemoveRamDisk(ULONG deviceNumber)
+// Copies one slot of the shared page. The driver makes Sequence odd while it
+// rewrites the slot, so a copy only counts if Sequence was even and unchanged
+// around it; a refresh takes microseconds, so a few retries always suffice.
+static BOOL ReadSharedSlot(const TEMP_SHARED_DEVICE_STATS *slot, TEMP_SHARED_DEVICE_STATS *copy)
 {
-    HANDLE hDevice = OpenControlDevice();
-    if (hDevice == INVALID_HANDLE_VALUE)
+    for (int attempt = 0; attempt < 1000; attempt++)
     {
-        printf("Error: Cannot open control device. Driver may not be installed.\n");
-        return STATUS_DEVICE_NOT_READY;
-    }
+        LONG sequence = slot->Sequence;
+        if (sequence & 1)
+        {
+            Sleep(0);
+            continue;
+        }
 
-    DWORD bytesReturned = 0;
-    BOOL success = DeviceIoControl(
-        hDevice,
-        TEMP_IOCTL_REMOVE_DEVICE,
-        &deviceNumber,
-        sizeof(deviceNumber),
-        NULL,
-        0,
-        &bytesReturned,
-        NULL);
+        MemoryBarrier();
+        memcpy(copy, (const void *)slot, sizeof(*copy));
+        MemoryBarrier();
 
-    CloseHandle(hDevice);
+        if (slot->Sequence == sequence)
+        {
+            return TRUE;
+        }
+    }
 
-    if (success)
+    return FALSE;
+}
+
+static NTSTATUS ShowSharedStatistics(void)
+{
+    HANDLE hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, TEMP_SHARED_STATS_USER_NAME);
+    if (!hMapping)
     {
-        printf("RAM disk %d removed successfully.\n", deviceNumber);
-        return STATUS_SUCCESS;
+        printf("Shared statistics are not enabled. Use shared-stats --enable.\n");
+        return STATUS_DEVICE_NOT_READY;
     }
-    else
+
+    const TEMP_SHARED_STATS *shared = (const TEMP_SHARED_STATS *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!shared)
     {
-        DWORD error = GetLastError();
-        printf("Failed to remove RAM disk %d. Windows error: %d\n", deviceNumber, error);
+        printf("Error: Cannot map shared statistics. Windows error: %d\n", GetLastError());
+        CloseHandle(hMapping);
         return STATUS_UNSUCCESSFUL;
     }
-}
 
-NTSTATUS ListRamDisks(void)
-{
-    printf("Active RAM Disks:\n");
-    printf("Device | Size      | Drive | Type\n");
-    printf("-------|-----------|-------|------------------\n");
-
-    BOOLEAN foundAny = FALSE;
+    NTSTATUS status = STATUS_SUCCESS;
 
-    // Try to get statistics for each possible device number
-    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    if (shared->Version != TEMP_SHARED_STATS_VERSION || shared->EntrySize < sizeof(TEMP_SHARED_DEVICE_STATS) ||
+        shared->DeviceSlots > TEMP_MAX_DEVICES)
     {
-        WCHAR devicePath[64];
-        swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", i);
+        printf("Error: Shared statistics version %u is not supported\n", shared->Version);
+        status = STATUS_UNSUCCESSFUL;
+    }
+    else
+    {
+        FILETIME now;
+        ULARGE_INTEGER nowTime;
+        ULONG64 updateTime = (ULONG64)shared->UpdateTime;
+        ULONG found = 0;
 
-        HANDLE hDevice = CreateFileW(
-            devicePath,
-            GENERIC_READ,
-            FILE_SHARE_READ | FILE_SHARE_WRITE,
-            NULL,
-            OPEN_EXISTING,
-            0,
-            NULL);
+        GetSystemTimeAsFileTime(&now);
+        nowTime.LowPart = now.dwLowDateTime;
+        nowTime.HighPart = now.dwHighDateTime;
 
-        if (hDevice != INVALID_HANDLE_VALUE)
+        if (shared->IntervalMs)
+        {
+            printf("Shared statistics: refreshed every %u ms, %lld updates, last %llu ms ago\n\n", shared->IntervalMs,
+                   shared->UpdateCount, nowTime.QuadPart > updateTime ? (nowTime.QuadPart - updateTime) / 10000 : 0);
+        }
+        else
         {
-            TEMP_STATISTICS stats = {0};
-            DWORD bytesReturned = 0;
+            printf("Shared statistics: no longer refreshed by the driver\n\n");
+        }
 
-            if (DeviceIoControl(hDevice, TEMP_IOCTL_GET_STATISTICS, NULL, 0,
-                                &stats, sizeof(stats), &bytesReturned, NULL))
-            {
+        printf("Device | Drive | Size      | Used      | Reads        | Writes       | Read      | Written   | Hit %%\n");
+        printf("-------|-------|-----------|-----------|--------------|--------------|-----------|-----------|------\n");
 
-                foundAny = TRUE;
+        for (ULONG i = 0; i < shared->DeviceSlots; i++)
+        {
+            const TEMP_SHARED_DEVICE_STATS *slot =
+                (const TEMP_SHARED_DEVICE_STATS *)((const BYTE *)shared->Devices + (SIZE_T)i * shared->EntrySize);
+            TEMP_SHARED_DEVICE_STATS copy;
 
-                char sizeStr[32];
-                if (stats.DiskSize >= 1024 * 1024 * 1024)
-                {
-                    sprintf_s(sizeStr, sizeof(sizeStr), "%.1f GB",
-                              (double)stats.DiskSize / (1024.0 * 1024.0 * 1024.0));
-                }
-                else if (stats.DiskSize >= 1024 * 1024)
-                {
-                    sprintf_s(sizeStr, sizeof(sizeStr), "%.1f MB",
-                              (double)stats.DiskSize / (1024.0 * 1024.0));
-                }
-                else
-                {
-                    sprintf_s(sizeStr, sizeof(sizeStr), "%.1f KB",
-                              (double)stats.DiskSize / 1024.0);
-                }
+            if (!ReadSharedSlot(slot, &copy) || !copy.Present)
+            {
+                continue;
+            }
+
+            const TEMP_STATISTICS *stats = &copy.Info.Statistics;
+            ULONG64 lookups = stats->CacheHits + stats->CacheMisses;
+            char driveStr[8] = "N/A";
+            char sizeStr[32];
+            char usedStr[32];
+            char readStr[32];
+            char writtenStr[32];
 
-                printf("%-6d | %-9s | %-5s | %s\n",
-                       i, sizeStr, "N/A", "RAM Disk");
+            if (copy.Info.DriveLetter)
+            {
+                sprintf_s(driveStr, sizeof(driveStr), "%c:", (char)copy.Info.DriveLetter);
             }
 
-            CloseHandle(hDevice);
+            FormatListSize(stats->DiskSize, sizeStr, sizeof(sizeStr));
+            FormatListSize(stats->MemoryUsed, usedStr, sizeof(usedStr));
+            FormatBytes(stats->BytesRead, readStr, sizeof(readStr));
+            FormatBytes(stats->BytesWritten, writtenStr, sizeof(writtenStr));
+
+            printf("%-6u | %-5s | %-9s | %-9s | %-12llu | %-12llu | %-9s | %-9s | %5.1f\n",
+                   copy.Info.DeviceNumber, driveStr, sizeStr, usedStr, stats->TotalReads, stats->TotalWrites,
+                   readStr, writtenStr, lookups ? (double)stats->CacheHits * 100.0 / lookups : 0.0);
+            found++;
         }
-    }
 
-    if (!foundAny)
-    {
-        printf("No RAM disks found.\n");
+        if (found == 0)
+        {
+            printf("No RAM disks found.\n");
+        }
     }
 
-    return STATUS_SUCCESS;
+    UnmapViewOfFile(shared);
+    CloseHandle(hMapping);
+    return status;
 }
 
-NTSTATUS ShowStatistics(ULONG deviceNumber)
+// Turns the driver's shared statistics page on or off, or prints it. Readers
+// only need the section name and the TEMP_SHARED_STATS layout in temp_core.h.
+NTSTATUS SharedStatistics(const COMMAND_OPTIONS *options)
 {
-    WCHAR devicePath[64];
-    swprintf_s(devicePath, ARRAYSIZE(devicePath), L"\\\\.\\TempRamDisk%d", deviceNumber);
-
-    HANDLE hDevice = CreateFileW(
-        devicePath,
-        GENERIC_READ,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        NULL,
-        OPEN_EXISTING,
-        0,
-        NULL);
+    if (options->LockAction == LOCK_ACTION_SHOW)
+    {
+        return ShowSharedStatistics();
+    }
 
+    HANDLE hDevice = OpenControlDevice();
     if (hDevice == INVALID_HANDLE_VALUE)
     {
-        printf("Error: Cannot open device %d. Device may not exist.\n", deviceNumber);
-        return STATUS_NO_SUCH_DEVICE;
+        printf("Error: Cannot open control device. Driver may not be installed.\n");
+        return STATUS_DEVICE_NOT_READY;
     }
 
-    TEMP_STATISTICS stats = {0};
+    ULONG interval = options->LockAction == LOCK_ACTION_ENABLE ? options->IntervalMs : 0;
     DWORD bytesReturned = 0;
 
-    BOOL success = DeviceIoControl(
-        hDevice,
-        TEMP_IOCTL_GET_STATISTICS,
-        NULL,
-        0,
-        &stats,
-        sizeof(stats),
-        &bytesReturned,
-        NULL);
-
+    BOOL success = DeviceIoControl(hDevice, TEMP_IOCTL_SET_SHARED_STATS, &interval, sizeof(interval), NULL, 0,
+                                   &bytesReturned, NULL);
+    DWORD error = GetLastError();
     CloseHandle(hDevice);
 
-    if (success)
+    if (!success)
     {
-        printf("Statistics for RAM Disk %d:\n", deviceNumber);
-        printf("  Disk Size: %llu bytes (%.2f MB)\n", stats.DiskSize,
-               (double)stats.DiskSize / (1024.0 * 1024.0));
-        printf("  Memory Used: %llu bytes (%.2f MB)\n", stats.MemoryUsed,
-               (double)stats.MemoryUsed / (1024.0 * 1024.0));
-        printf("  Total Reads: %llu\n", stats.TotalReads);
-        printf("  Total Writes: %llu\n", stats.TotalWrites);
-        printf("  Bytes Read: %llu (%.2f MB)\n", stats.BytesRead,
-               (double)stats.BytesRead / (1024.0 * 1024.0));
-        printf("  Bytes Written: %llu (%.2f MB)\n", stats.BytesWritten,
-               (double)stats.BytesWritten / (1024.0 * 1024.0));
-        printf("  Cache Hits: %llu\n", stats.CacheHits);
-        printf("  Cache Misses: %llu\n", stats.CacheMisses);
-
-        if (stats.CacheHits + stats.CacheMisses > 0)
-        {
-            double hitRatio = (double)stats.CacheHits / (stats.CacheHits + stats.CacheMisses) * 100.0;
-            printf("  Cache Hit Ratio: %.2f%%\n", hitRatio);
-        }
-
-        printf("  Evictions: %llu\n", stats.EvictionCount);
+        printf("Failed to %s shared statistics. Windows error: %d\n", interval ? "enable" : "disable", error);
+        return STATUS_UNSUCCESSFUL;
+    }
 
-        return STATUS_SUCCESS;
+    if (interval)
+    {
+        printf("Shared statistics refreshed every %u ms in Global\\TempRamDiskStats\n", interval);
     }
     else
     {
-        DWORD error = GetLastError();
-        printf("Failed to get statistics for device %d. Windows error: %d\n", deviceNumber, error);
-        return STATUS_UNSUCCESSFUL;
+        printf("Shared statistics disabled\n");
     }
+
+    return STATUS_SUCCESS;
 }
 
 ULONG64 ParseSize(const char *sizeStr)
@@ -590,6 +5174,75 @@ ULONG64 ParseSize(const char *sizeStr)
     return value;
 }
 
+// Returns milliseconds for "500ms", "1s", "5m" or a bare number of seconds, 0 if invalid
+ULONG ParseInterval(const char *intervalStr)
+{
+    if (!intervalStr)
+    {
+        return 0;
+    }
+
+    char *endPtr;
+    double value = strtod(intervalStr, &endPtr);
+
+    if (endPtr == intervalStr || value <= 0)
+    {
+        return 0;
+    }
+
+    if (*endPtr == '\0' || _stricmp(endPtr, "s") == 0)
+    {
+        value *= 1000;
+    }
+    else if (_stricmp(endPtr, "m") == 0)
+    {
+        value *= 60 * 1000;
+    }
+    else if (_stricmp(endPtr, "ms") != 0)
+    {
+        return 0;
+    }
+
+    return value < MAXULONG ? (ULONG)value : 0;
+}
+
+// Returns TEMP_PRESSURE_* flags for a list such as "release-zero,compress", or MAXULONG
+ULONG ParsePressurePolicy(const char *policyStr)
+{
+    char buffer[128];
+    char *context = NULL;
+    ULONG policy = 0;
+
+    if (!policyStr || strlen(policyStr) >= sizeof(buffer))
+    {
+        return MAXULONG;
+    }
+
+    strcpy_s(buffer, sizeof(buffer), policyStr);
+
+    for (char *token = strtok_s(buffer, ",", &context); token; token = strtok_s(NULL, ",", &context))
+    {
+        if (strcmp(token, "release-zero") == 0)
+        {
+            policy |= TEMP_PRESSURE_RELEASE_ZERO;
+        }
+        else if (strcmp(token, "compress") == 0)
+        {
+            policy |= TEMP_PRESSURE_COMPRESS;
+        }
+        else if (strcmp(token, "spill") == 0)
+        {
+            policy |= TEMP_PRESSURE_SPILL;
+        }
+        else if (strcmp(token, "none") != 0)
+        {
+            return MAXULONG;
+        }
+    }
+
+    return policy;
+}
+
 HANDLE OpenControlDevice(void)
 {
     return CreateFileW(
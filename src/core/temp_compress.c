@@ -0,0 +1,247 @@
+#include "temp_core.h"
+
+// Byte-oriented LZ compression for cold chunks. The format follows LZ4 block
+// encoding: each sequence is a token (literal length in the high nibble, match
+// length minus four in the low nibble), optional length extension bytes, the
+// literals, then a 16-bit little-endian match offset and its length extension.
+// The final sequence carries literals only. It is fast enough to run while the
+// system is short of memory and needs no allocations beyond the caller's workspace.
+
+#define TEMP_LZ_HASH_BITS 12
+#define TEMP_LZ_MIN_MATCH 4
+#define TEMP_LZ_MAX_OFFSET 65535
+
+FORCEINLINE ULONG TempLzRead32(const UCHAR *Pointer)
+{
+    ULONG value;
+    RtlCopyMemory(&value, Pointer, sizeof(value));
+    return value;
+}
+
+FORCEINLINE ULONG TempLzHash(ULONG Value)
+{
+    return (Value * 2654435761U) >> (32 - TEMP_LZ_HASH_BITS);
+}
+
+// Writes the extension bytes of a length that did not fit in its nibble
+static PUCHAR TempLzWriteLength(PUCHAR Output, PUCHAR OutputEnd, ULONG Length)
+{
+    while (Length >= 255)
+    {
+        if (Output >= OutputEnd)
+        {
+            return NULL;
+        }
+        *Output++ = 255;
+        Length -= 255;
+    }
+
+    if (Output >= OutputEnd)
+    {
+        return NULL;
+    }
+
+    *Output++ = (UCHAR)Length;
+    return Output;
+}
+
+// Emits one sequence; a MatchLength of zero marks the final, literal-only sequence
+static PUCHAR TempLzEmit(PUCHAR Output, PUCHAR OutputEnd, const UCHAR *Literals, ULONG LiteralLength, ULONG Offset, ULONG MatchLength)
+{
+    if (Output >= OutputEnd)
+    {
+        return NULL;
+    }
+
+    PUCHAR token = Output++;
+    ULONG literalCode = LiteralLength < 15 ? LiteralLength : 15;
+    ULONG matchCode = 0;
+
+    if (MatchLength)
+    {
+        matchCode = MatchLength - TEMP_LZ_MIN_MATCH < 15 ? MatchLength - TEMP_LZ_MIN_MATCH : 15;
+    }
+
+    *token = (UCHAR)((literalCode << 4) | matchCode);
+
+    if (literalCode == 15)
+    {
+        Output = TempLzWriteLength(Output, OutputEnd, LiteralLength - 15);
+        if (!Output)
+        {
+            return NULL;
+        }
+    }
+
+    if ((ULONG)(OutputEnd - Output) < LiteralLength)
+    {
+        return NULL;
+    }
+
+    RtlCopyMemory(Output, Literals, LiteralLength);
+    Output += LiteralLength;
+
+    if (MatchLength)
+    {
+        if (OutputEnd - Output < 2)
+        {
+            return NULL;
+        }
+
+        *Output++ = (UCHAR)Offset;
+        *Output++ = (UCHAR)(Offset >> 8);
+
+        if (matchCode == 15)
+        {
+            Output = TempLzWriteLength(Output, OutputEnd, MatchLength - TEMP_LZ_MIN_MATCH - 15);
+        }
+    }
+
+    return Output;
+}
+
+// Reads the extension bytes of a length whose nibble was 15
+static BOOLEAN TempLzReadLength(const UCHAR *Source, ULONG SourceLength, PULONG Position, PULONG Length)
+{
+    UCHAR next;
+
+    do
+    {
+        if (*Position >= SourceLength)
+        {
+            return FALSE;
+        }
+        next = Source[(*Position)++];
+        *Length += next;
+    } while (next == 255);
+
+    return TRUE;
+}
+
+// Returns the compressed length, or 0 if the result would not fit in DestinationLength.
+// Workspace must hold TEMP_COMPRESS_WORKSPACE_SIZE bytes.
+ULONG TempCompressBuffer(const UCHAR *Source, ULONG SourceLength, PUCHAR Destination, ULONG DestinationLength, PVOID Workspace)
+{
+    PULONG table = (PULONG)Workspace; // Position + 1 of the last occurrence of each hash
+    PUCHAR output = Destination;
+    PUCHAR outputEnd = Destination + DestinationLength;
+    ULONG position = 0;
+    ULONG anchor = 0;
+
+    if (!Source || !Destination || !Workspace)
+    {
+        return 0;
+    }
+
+    RtlZeroMemory(table, TEMP_COMPRESS_WORKSPACE_SIZE);
+
+    while (position + TEMP_LZ_MIN_MATCH <= SourceLength)
+    {
+        ULONG sequence = TempLzRead32(Source + position);
+        ULONG hash = TempLzHash(sequence);
+        ULONG candidate = table[hash];
+        table[hash] = position + 1;
+
+        if (candidate == 0 ||
+            position - (candidate - 1) > TEMP_LZ_MAX_OFFSET ||
+            TempLzRead32(Source + candidate - 1) != sequence)
+        {
+            position++;
+            continue;
+        }
+
+        ULONG reference = candidate - 1;
+        ULONG matchLength = TEMP_LZ_MIN_MATCH;
+        while (position + matchLength < SourceLength &&
+               Source[reference + matchLength] == Source[position + matchLength])
+        {
+            matchLength++;
+        }
+
+        output = TempLzEmit(output, outputEnd, Source + anchor, position - anchor, position - reference, matchLength);
+        if (!output)
+        {
+            return 0;
+        }
+
+        position += matchLength;
+        anchor = position;
+    }
+
+    output = TempLzEmit(output, outputEnd, Source + anchor, SourceLength - anchor, 0, 0);
+    if (!output)
+    {
+        return 0;
+    }
+
+    return (ULONG)(output - Destination);
+}
+
+// Returns the decompressed length, or 0 if the input is malformed or does not fit
+ULONG TempDecompressBuffer(const UCHAR *Source, ULONG SourceLength, PUCHAR Destination, ULONG DestinationLength)
+{
+    ULONG input = 0;
+    ULONG output = 0;
+
+    if (!Source || !Destination)
+    {
+        return 0;
+    }
+
+    while (input < SourceLength)
+    {
+        UCHAR token = Source[input++];
+        ULONG literalLength = token >> 4;
+
+        if (literalLength == 15 && !TempLzReadLength(Source, SourceLength, &input, &literalLength))
+        {
+            return 0;
+        }
+
+        if (literalLength > SourceLength - input || literalLength > DestinationLength - output)
+        {
+            return 0;
+        }
+
+        RtlCopyMemory(Destination + output, Source + input, literalLength);
+        input += literalLength;
+        output += literalLength;
+
+        // The final sequence ends with its literals
+        if (input == SourceLength)
+        {
+            break;
+        }
+
+        if (SourceLength - input < 2)
+        {
+            return 0;
+        }
+
+        ULONG offset = Source[input] | ((ULONG)Source[input + 1] << 8);
+        input += 2;
+
+        ULONG matchLength = token & 15;
+        if (matchLength == 15 && !TempLzReadLength(Source, SourceLength, &input, &matchLength))
+        {
+            return 0;
+        }
+        matchLength += TEMP_LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > output || matchLength > DestinationLength - output)
+        {
+            return 0;
+        }
+
+        // Matches may overlap their own output, so copy forward one byte at a time
+        PUCHAR target = Destination + output;
+        const UCHAR *from = target - offset;
+        for (ULONG i = 0; i < matchLength; i++)
+        {
+            target[i] = from[i];
+        }
+        output += matchLength;
+    }
+
+    return output;
+}
@@ -11,6 +11,10 @@ extern "C"
 // Kernel mode headers only
 #include <ntddk.h>
 #include <ntstrsafe.h>
+#elif defined(TEMP_PORTABLE)
+// Portable user-mode build of the memory manager (benchmarks, tools and the
+// embeddable block store library)
+#include "temp_portable.h"
 #else
 // User mode headers only
 #include <windows.h>
@@ -25,10 +29,137 @@ extern "C"
 
 // Configuration constants
 #define TEMP_MAX_DEVICES 32
-#define TEMP_BUCKET_COUNT 512
-#define TEMP_CHUNK_SIZE (64 * 1024) // 64KB chunks like fastcache
+#define TEMP_MAX_BUCKET_COUNT 512         // Upper bound on memory manager shards
+#define TEMP_BUCKETS_PER_PROCESSOR 4      // Shards allocated per active processor
+#define TEMP_STRIPES_PER_BUCKET 256       // Stripes per shard above which larger disks get more shards
+#define TEMP_STRIPE_SIZE (1024 * 1024)    // Contiguous bytes owned by one shard
+#define TEMP_DEFAULT_CHUNK_SIZE (64 * 1024) // 64KB chunks like fastcache
+#define TEMP_MIN_CHUNK_SIZE (16 * 1024)
+#define TEMP_MAX_CHUNK_SIZE (2 * 1024 * 1024)
 #define TEMP_DEFAULT_SECTOR_SIZE 512
+#define TEMP_NATIVE_4K_SECTOR_SIZE 4096
+#define TEMP_MIN_SECTOR_SIZE 512
+#define TEMP_MAX_SECTOR_SIZE 4096
 #define TEMP_MAX_DISK_SIZE (1ULL << 40) // 1TB max
+#define TEMP_MAX_TRANSFER_LENGTH (4 * 1024 * 1024) // Largest single transfer advertised to the storage stack
+
+// Memory pressure policies (TEMP_CREATE_DATA PressurePolicy flags)
+#define TEMP_PRESSURE_RELEASE_ZERO 0x00000001 // Free chunks that hold only zeros
+#define TEMP_PRESSURE_COMPRESS 0x00000002     // Compress cold chunks in place
+#define TEMP_PRESSURE_SPILL 0x00000004        // Write cold chunks to the spill file and free them
+#define TEMP_PRESSURE_POLICY_MASK 0x00000007
+#define TEMP_PRESSURE_SCAN_INTERVAL_MS 1000            // Pressure monitor wake-up interval
+#define TEMP_PRESSURE_COLD_AGE_SCANS 30                // Scans without access before a chunk is cold
+#define TEMP_PRESSURE_RECLAIM_STEP (64 * 1024 * 1024)  // Bytes reclaimed per device per scan
+#define TEMP_PRESSURE_RESTORE_STEP (16 * 1024 * 1024)  // Bytes brought back per device per scan
+#define TEMP_FORMAT_SWEEP_CHUNKS (1024 * 1024)         // Slots swept for formatted chunks per device per scan
+
+// At-rest encryption (TEMP_CREATE_DATA Encryption). Chunk data is kept encrypted with
+// AES-256-XTS under a random key drawn when the device is created; the tweak is the
+// disk offset in TEMP_XTS_DATA_UNIT units, so it does not depend on the sector size.
+#define TEMP_ENCRYPTION_NONE 0
+#define TEMP_ENCRYPTION_AES_XTS 1
+#define TEMP_XTS_KEY_SIZE 64   // Data key then tweak key, 256 bits each
+#define TEMP_XTS_DATA_UNIT 512 // Bytes encrypted under one tweak
+#define TEMP_AES_ROUNDS 14
+#define TEMP_XTS_SOFTWARE 0    // Table-driven AES, any processor
+#define TEMP_XTS_AESNI 1       // AES-NI, eight blocks in flight
+#define TEMP_XTS_VAES 2        // VAES on 256-bit registers, eight blocks in flight
+
+// Image files. A device created from one (TEMP_CREATE_DATA FileName) is usable at once:
+// chunks are loaded on first access while a system thread prefetches the rest, hottest
+// stripes first by the heat recorded in the image. Files without the header are raw
+// images whose data starts at offset 0.
+#define TEMP_IMAGE_FILE_MAGIC 0x474D4954      // "TIMG" at the start of an image file
+#define TEMP_IMAGE_FILE_VERSION 1
+#define TEMP_IMAGE_DATA_ALIGNMENT (64 * 1024) // Image data starts on this boundary
+
+// How TEMP_CREATE_DATA FileName is attached
+#define TEMP_IMAGE_RESTORE 0 // Copied into chunks as above; the disk is writable
+#define TEMP_IMAGE_MAPPED 1  // Read-only, every read served from a view of the file
+
+// Memory accounting
+#define TEMP_CHUNK_SEGMENTS 32          // Written-data granularity tracked per chunk (bits of UsedMask)
+#define TEMP_MEMORY_STATISTICS_VERSION 4
+#define TEMP_OCCUPANCY_BINS 10          // Bucket occupancy histogram, in tenths of a bucket's share
+
+// Global memory budget. Every device draws its chunk data from one driver-wide pool:
+// up to its guaranteed minimum at any time, past it while the pool has room, never
+// past its maximum. Limits of 0 mean no limit. When the room left for bursting runs
+// low the pressure monitor reclaims from the devices furthest past their minimum.
+#define TEMP_MEMORY_BUDGET_VERSION 1
+#define TEMP_BUDGET_SET_POOL 0x00000001   // TEMP_BUDGET_CONTROL PoolLimit is applied
+#define TEMP_BUDGET_SET_DEVICE 0x00000002 // Minimum and Maximum are applied to DeviceNumber
+#define TEMP_BUDGET_RECLAIM_PERCENT 90    // Share of the burst room in use at which reclaim starts
+#define TEMP_BUDGET_RESTORE_PERCENT 80    // Reclaim stops, and restore may fill up to here
+
+// I/O QoS. Reads and writes of a device pass two token buckets, requests per second
+// and bytes per second, each holding TEMP_QOS_BURST_MS of its rate. An optional
+// driver-wide ceiling is divided among the busy devices by weight. Requests the OS
+// marks low priority wait until no other request arrived for the idle interval.
+#define TEMP_QOS_VERSION 1
+#define TEMP_QOS_SET_DRIVER 0x00000001   // TEMP_QOS_CONTROL TotalIops, TotalBandwidth and IdleIntervalMs are applied
+#define TEMP_QOS_SET_DEVICE 0x00000002   // IopsLimit, BandwidthLimit and Weight are applied to DeviceNumber
+#define TEMP_QOS_DEFAULT_WEIGHT 100
+#define TEMP_QOS_MAX_WEIGHT 10000
+#define TEMP_QOS_BURST_MS 100            // Bucket depth, in time at the bucket's rate
+#define TEMP_QOS_IDLE_INTERVAL_MS 10     // Default quiet time low-priority requests wait for
+#define TEMP_QOS_MAX_IDLE_INTERVAL_MS 1000
+#define TEMP_QOS_STARVATION_MS 500       // Longest a low-priority request is held back
+
+// Latency and request size histograms. Values below 16 get a bucket each; above
+// that every power of two is split into 2^TEMP_HISTOGRAM_SUB_BITS buckets, so a
+// bucket's width stays within 12.5% of its values. 256 buckets reach 2^34.
+#define TEMP_HISTOGRAM_SUB_BITS 3
+#define TEMP_HISTOGRAM_BUCKETS 256
+#define TEMP_LATENCY_STATISTICS_VERSION 1
+#define TEMP_OPERATION_READ 0
+#define TEMP_OPERATION_WRITE 1
+#define TEMP_OPERATION_IOCTL 2
+#define TEMP_OPERATION_COUNT 3
+#define TEMP_PERCENTILE_COUNT 4 // p50, p90, p99 and p99.9, in that order
+
+// Request tracing. Each processor records into its own ring; a full ring drops
+// new records until the trace is drained.
+#define TEMP_TRACE_OPERATION_TRIM 3           // Trace records also use TEMP_OPERATION_* values
+#define TEMP_TRACE_FLAG_FAILED 0x01           // The request completed with an error
+#define TEMP_TRACE_DEFAULT_RECORDS 8192       // Per processor ring capacity
+#define TEMP_TRACE_MAX_RECORDS (1024 * 1024)  // Largest per processor ring
+#define TEMP_TRACE_OFFSET_SHIFT 9             // Record offsets are in 512-byte units
+#define TEMP_TRACE_FILE_MAGIC 0x43525454      // "TTRC" at the start of a trace file
+#define TEMP_TRACE_FILE_VERSION 1
+
+// Bucket lock contention profiling
+#define TEMP_LOCK_CONTENTION_VERSION 1
+#define TEMP_LOCK_CONTENTION_DEFAULT_TOP 16 // Buckets returned when the caller does not ask
+#define TEMP_LOCK_CONTENTION_MAX_TOP 64
+
+// Access heatmap. Every stripe keeps read and write counts that lose an eighth of
+// their value each decay interval, about a minute of half-life with the defaults.
+#define TEMP_HEATMAP_VERSION 1
+#define TEMP_HEATMAP_DECAY_SCANS 10     // Pressure monitor scans between decays
+#define TEMP_HEATMAP_DECAY_SHIFT 3      // Each decay removes 1/2^shift of the counts, rounded up
+#define TEMP_HEATMAP_MAX_REGION_SHIFT 20 // Largest log2 of stripes merged into one reported region
+
+// Device enumeration and the shared statistics page. The page is a named section
+// the driver refreshes from a system thread while enabled; user mode maps it read-only.
+#define TEMP_DEVICE_LIST_VERSION 1
+#define TEMP_SHARED_STATS_VERSION 1
+#define TEMP_SHARED_STATS_DEFAULT_INTERVAL_MS 100
+#define TEMP_SHARED_STATS_MIN_INTERVAL_MS 10
+#define TEMP_SHARED_STATS_MAX_INTERVAL_MS 60000
+
+// Per-second history. A timer DPC closes one sample a second per device; the ring
+// keeps the last TEMP_HISTORY_SECONDS of them.
+#define TEMP_HISTORY_VERSION 1
+#define TEMP_HISTORY_SECONDS 600
+#define TEMP_HISTORY_INTERVAL_MS 1000
+#define TEMP_HISTORY_TOLERANCE_MS 50 // Timer coalescing allowance
+
+// Identification strings reported through IOCTL_STORAGE_QUERY_PROPERTY
+#define TEMP_VENDOR_ID "TEMP"
+#define TEMP_PRODUCT_ID "RAM Disk"
+#define TEMP_PRODUCT_REVISION "1.0"
 
 // Kernel mode constants not available by default
 #ifdef _KERNEL_MODE
@@ -60,77 +191,231 @@ extern "C"
 #define TEMP_SYMLINK_PREFIX L"\\DosDevices\\"
 #define TEMP_CTL_DEVICE_NAME L"\\Device\\TempRamDiskControl"
 #define TEMP_CTL_SYMLINK_NAME L"\\DosDevices\\TempRamDiskControl"
+#define TEMP_SHARED_STATS_NAME L"\\BaseNamedObjects\\TempRamDiskStats"
+#define TEMP_SHARED_STATS_USER_NAME L"Global\\TempRamDiskStats" // For OpenFileMapping
 
 // IOCTLs
-#ifdef _KERNEL_MODE
-#define TEMP_IOCTL_CREATE_DEVICE CTL_CODE(FILE_DEVICE_DISK, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define TEMP_IOCTL_REMOVE_DEVICE CTL_CODE(FILE_DEVICE_DISK, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define TEMP_IOCTL_LIST_DEVICES CTL_CODE(FILE_DEVICE_DISK, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define TEMP_IOCTL_GET_VERSION CTL_CODE(FILE_DEVICE_DISK, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define TEMP_IOCTL_GET_STATISTICS CTL_CODE(FILE_DEVICE_DISK, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#else
-// User mode IOCTL definitions
-#define TEMP_IOCTL_CREATE_DEVICE 0x83000800
-#define TEMP_IOCTL_REMOVE_DEVICE 0x83000801
-#define TEMP_IOCTL_LIST_DEVICES 0x83000802
-#define TEMP_IOCTL_GET_VERSION 0x83000803
-#define TEMP_IOCTL_GET_STATISTICS 0x83000804
-#endif
+#include "temp_ioctl.h"
 
     // Forward declarations
     typedef struct _TEMP_DEVICE_EXTENSION TEMP_DEVICE_EXTENSION, *PTEMP_DEVICE_EXTENSION;
     typedef struct _TEMP_BUCKET TEMP_BUCKET, *PTEMP_BUCKET;
     typedef struct _TEMP_MEMORY_MANAGER TEMP_MEMORY_MANAGER, *PTEMP_MEMORY_MANAGER;
 
+    // Bucket lock. The driver spins; the portable build maps KSPIN_LOCK onto a user-mode
+    // lock in temp_portable.h, so the driver and the library run the same locking code.
+    // Other user-mode code only needs the layout.
+#if defined(_KERNEL_MODE) || defined(TEMP_PORTABLE)
+    typedef KSPIN_LOCK TEMP_LOCK;
+#else
+    typedef SRWLOCK TEMP_LOCK;
+#endif
+
+    // Chunk states. Compressed and spilled chunks are brought back to resident on access;
+    // shared chunks are read in place and get a copy of their own when written.
+#define TEMP_CHUNK_RESIDENT 0   // Data holds ChunkSize bytes
+#define TEMP_CHUNK_COMPRESSED 1 // Data holds StoredLength compressed bytes
+#define TEMP_CHUNK_SPILLED 2    // Data lives in the spill file at the chunk's disk offset
+#define TEMP_CHUNK_SHARED 3     // Data holds a pointer to a resident chunk other slots share
+
     // Memory chunk structure (inspired by fastcache)
+    // Data is allocated together with the header and sized for the chunk's state
     typedef struct _TEMP_CHUNK
     {
-        UCHAR Data[TEMP_CHUNK_SIZE];
         volatile LONG64 Generation;
-        volatile LONG RefCount;
+        volatile LONG RefCount; // Of a chunk shared through TEMP_CHUNK_SHARED slots: the slots sharing it
+        USHORT State;       // TEMP_CHUNK_*
+        USHORT Reserved;
+        ULONG StoredLength; // Bytes of compressed data when TEMP_CHUNK_COMPRESSED
+        ULONG UsedMask;     // Segments written since they were last trimmed; clear bits read as zeros
+        UCHAR Data[ANYSIZE_ARRAY];
     } TEMP_CHUNK, *PTEMP_CHUNK;
 
-    // Hash table entry for fast lookup
-    typedef struct _TEMP_HASH_ENTRY
+    // Moves one chunk between memory and the spill file. Called at PASSIVE_LEVEL or
+    // APC_LEVEL without any bucket lock held.
+    typedef NTSTATUS (*PTEMP_SPILL_ROUTINE)(PVOID Context, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length);
+
+    // Decayed access counts of one stripe; a request counts once per stripe it touches
+    typedef struct _TEMP_STRIPE_HEAT
     {
-        ULONG64 Key;        // Hash of the sector address
-        ULONG64 ChunkIndex; // Index into bucket's chunk array
-        ULONG64 Offset;     // Offset within the chunk
-    } TEMP_HASH_ENTRY, *PTEMP_HASH_ENTRY;
+        ULONG Reads;
+        ULONG Writes;
+    } TEMP_STRIPE_HEAT, *PTEMP_STRIPE_HEAT;
 
-    // Bucket structure for scalable memory management
-    typedef struct _TEMP_BUCKET
+    // Expanded AES-XTS key of an encrypted device (temp_crypto.c). The decryption
+    // schedule is the equivalent inverse cipher's, which the table-driven and the
+    // AES-NI code share.
+    typedef struct DECLSPEC_CACHEALIGN _TEMP_XTS_KEY
     {
-#ifdef _KERNEL_MODE
-        KSPIN_LOCK Lock; // Per-bucket lock for scalability
-#else
-    CRITICAL_SECTION Lock; // User mode critical section
-#endif
-        PTEMP_CHUNK *Chunks;        // Array of chunk pointers
+        UCHAR EncryptKey[TEMP_AES_ROUNDS + 1][16]; // Data key
+        UCHAR DecryptKey[TEMP_AES_ROUNDS + 1][16]; // Data key, inverse cipher
+        UCHAR TweakKey[TEMP_AES_ROUNDS + 1][16];
+        ULONG Implementation; // TEMP_XTS_*, the fastest the processor supports
+    } TEMP_XTS_KEY, *PTEMP_XTS_KEY;
+
+    // Bucket structure for scalable memory management. A bucket owns whole stripes
+    // of the disk; its chunk slots are indexed directly by position within them.
+    typedef struct DECLSPEC_CACHEALIGN _TEMP_BUCKET
+    {
+        TEMP_LOCK Lock;             // Per-bucket lock for scalability
+        PTEMP_CHUNK *Chunks;        // Chunk slots, NULL until first written
+        PTEMP_STRIPE_HEAT Heat;     // One entry per owned stripe, indexed by slot >> StripeChunkShift
+        PULONG ImagePending;        // One bit per slot still to be loaded from the image; NULL without one
         ULONG ChunkCount;           // Current number of chunks
-        ULONG MaxChunks;            // Maximum allowed chunks
-        PTEMP_HASH_ENTRY HashTable; // Hash table for O(1) lookups
-        ULONG HashTableSize;        // Size of hash table
+        ULONG MaxChunks;            // Number of chunk slots
         volatile LONG64 Generation; // Current generation for eviction
+        LONG64 AgeMark;             // Chunks at or below this generation are cold
+        LONG64 FormatMark;          // Chunks at or below this generation were formatted away
 
-        // Statistics
+        // Statistics, updated under the bucket lock
         volatile LONG64 HitCount;
         volatile LONG64 MissCount;
         volatile LONG64 EvictionCount;
+        ULONG64 UsedSegments; // Set UsedMask bits across the bucket's chunks
+        ULONG PartialChunks;  // Chunks with at least one clear UsedMask bit
+
+        // Lock profiling, in performance counter ticks; only counted while
+        // TEMP_MEMORY_MANAGER LockProfiling is set and updated by the lock holder
+        ULONG64 LockAcquisitions;
+        ULONG64 LockContentions; // Acquisitions that found the lock taken
+        ULONG64 LockSpinTicks;
+        ULONG64 LockHoldTicks;
+        ULONG64 LockMaxHoldTicks;
+        LONG64 LockHoldStart;    // Set while a profiled holder owns the lock
     } TEMP_BUCKET, *PTEMP_BUCKET;
 
+    // Driver-wide memory pool shared by the memory managers attached to it. Only chunk
+    // data is charged: resident chunks at ChunkSize, compressed ones at their compressed
+    // length. Charges are lock-free; Lock serializes attaching and budget changes.
+    typedef struct _TEMP_MEMORY_POOL
+    {
+        TEMP_LOCK Lock;
+        volatile LONG64 Limit;      // Bytes; 0 for no limit
+        volatile LONG64 Guaranteed; // Sum of the attached managers' minimums
+        volatile LONG64 Charged;    // Chunk data held by all attached managers
+        volatile LONG64 Burst;      // Sum of each manager's charge past its minimum
+        volatile LONG64 Denials;    // Allocations refused for want of budget
+    } TEMP_MEMORY_POOL, *PTEMP_MEMORY_POOL;
+
     // Memory manager structure
     typedef struct _TEMP_MEMORY_MANAGER
     {
-        TEMP_BUCKET Buckets[TEMP_BUCKET_COUNT];
-        ULONG64 TotalSize; // Total allocated memory
-        ULONG64 MaxSize;   // Maximum allowed memory
+        PTEMP_BUCKET Buckets;   // BucketCount entries
+        ULONG BucketCount;      // Power of two, scaled with the processor count
+        ULONG BucketShift;      // log2(BucketCount)
+        ULONG64 TotalSize;      // Total allocated memory
+        ULONG64 MaxSize;        // Maximum allowed memory
+        ULONG ChunkSize;        // Bytes of data per chunk, power of two
+        ULONG ChunkShift;       // log2(ChunkSize)
+        ULONG StripeShift;      // log2 of bytes per stripe
+        ULONG StripeChunkShift; // log2 of chunks per stripe
+        ULONG SegmentShift;     // log2 of bytes per UsedMask bit
         volatile LONG64 TotalReads;
         volatile LONG64 TotalWrites;
-        volatile LONG64 TotalHits;
-        volatile LONG64 TotalMisses;
+        volatile LONG64 AllocationFailures;
+        volatile LONG LockProfiling; // Bucket locks record contention (TempSetLockProfiling)
+
+        // Memory pressure handling; reclaim and restore run on one thread at a time
+        ULONG PressurePolicy;             // TEMP_PRESSURE_* flags
+        PTEMP_SPILL_ROUTINE SpillRoutine; // Moves chunks to and from the spill file
+        PVOID SpillContext;
+        PUCHAR ReclaimBuffer;             // Snapshot, compression output and workspace
+        ULONG64 ReclaimCursor;            // Next chunk number examined by reclaim
+        ULONG64 RestoreCursor;            // Next chunk number examined by restore
+        ULONG64 DrainCursor;              // Next slot TempDrainMemoryManager frees: bucket << 32 | slot
+        volatile LONG64 PressureEvents;
+        volatile LONG64 BytesReclaimed;
+        volatile LONG64 CompressedChunks;
+        volatile LONG64 CompressedBytes;  // Bytes held by compressed chunks
+        volatile LONG64 SpilledChunks;
+        volatile LONG64 SharedChunks;     // Slots sharing their data with others (TempCopyRange)
+        volatile LONG64 OwnedSharedChunks; // Shared data this manager counts as resident, once however many slots share it
+
+        // Formatting (TempFormatDisk). Formatted chunks stay in their slots until a
+        // request touches them or the sweep frees them; one thread sweeps at a time.
+        volatile LONG64 FormatEpoch; // Formats so far
+        LONG64 SweepEpoch;           // Format the sweep cursor belongs to
+        ULONG64 SweepCursor;         // Next chunk number examined by the sweep
+
+        // Stripes at least this hot (reads + writes) are spared by reclaim while colder
+        // ones remain; 0 until the first TempDecayHeatmap
+        ULONG HotStripeHeat;
+
+        // Chunk data is ciphertext when set (TempSetEncryption). Compressing and
+        // spilling then work on ciphertext, so nothing leaves memory in the clear.
+        PTEMP_XTS_KEY Cipher;
+
+        // Lazy restore (TempSetImageSource). Slots with an ImagePending bit are read
+        // through ImageRoutine on first access or by the driver's prefetcher.
+        PTEMP_SPILL_ROUTINE ImageRoutine;
+        PVOID ImageContext;
+        volatile LONG64 ImagePendingChunks;
+        volatile LONG64 ImageDemandLoads; // Chunks a request had to wait for
+
+        // Memory budget (TempAttachMemoryPool, TempSetMemoryBudget). Data written to
+        // chunks not allocated yet is refused past BudgetMaximum, or past BudgetMinimum
+        // once the pool is full. Bringing compressed or spilled data back for a request
+        // is always allowed; the pressure monitor takes it back later.
+        PTEMP_MEMORY_POOL Pool;       // NULL when not attached
+        ULONG64 BudgetMinimum;        // Guaranteed bytes, reserved in the pool
+        ULONG64 BudgetMaximum;        // 0 for no maximum
+        volatile LONG64 ChargedBytes; // Chunk data held, as the pool counts it
+        volatile LONG64 BudgetDenials;
     } TEMP_MEMORY_MANAGER, *PTEMP_MEMORY_MANAGER;
 
+    // One processor's record of one kind of operation. Each processor updates its own
+    // copy, so recording never shares a cache line; queries add the copies together.
+    typedef struct DECLSPEC_CACHEALIGN _TEMP_OPERATION_COUNTERS
+    {
+        volatile LONG64 TotalLatency;
+        volatile LONG64 MaxLatency;
+        volatile LONG64 TotalBytes;
+        volatile LONG64 Latency[TEMP_HISTOGRAM_BUCKETS];
+        volatile LONG64 Size[TEMP_HISTOGRAM_BUCKETS];
+    } TEMP_OPERATION_COUNTERS, *PTEMP_OPERATION_COUNTERS;
+
+    typedef struct _TEMP_IO_HISTOGRAMS
+    {
+        ULONG ProcessorCount;
+        PTEMP_OPERATION_COUNTERS Counters; // ProcessorCount * TEMP_OPERATION_COUNT entries
+    } TEMP_IO_HISTOGRAMS, *PTEMP_IO_HISTOGRAMS;
+
+    // One traced request; also the record format of trace files
+    typedef struct _TEMP_TRACE_RECORD
+    {
+        ULONG64 Timestamp; // Nanoseconds from enabling the trace to the request's arrival
+        ULONG Offset;      // Byte offset >> TEMP_TRACE_OFFSET_SHIFT; 0 for IOCTLs
+        ULONG Length;      // Bytes transferred or trimmed; buffer bytes for IOCTLs
+        ULONG Latency;     // Nanoseconds, saturated at MAXULONG
+        UCHAR Operation;   // TEMP_OPERATION_* or TEMP_TRACE_OPERATION_TRIM
+        UCHAR Flags;       // TEMP_TRACE_FLAG_*
+        USHORT Processor;  // Processor the request completed on
+    } TEMP_TRACE_RECORD, *PTEMP_TRACE_RECORD;
+
+    // A ring slot is published by storing its position + 1 in Sequence once the
+    // record is complete, so the reader never sees a half-written record
+    typedef struct _TEMP_TRACE_SLOT
+    {
+        volatile LONG64 Sequence;
+        TEMP_TRACE_RECORD Record;
+    } TEMP_TRACE_SLOT, *PTEMP_TRACE_SLOT;
+
+    typedef struct DECLSPEC_CACHEALIGN _TEMP_TRACE_RING
+    {
+        volatile LONG64 Head;    // Next position claimed by a writer
+        volatile LONG64 Tail;    // Next position the reader consumes
+        volatile LONG64 Dropped; // Records lost to a full ring
+        PTEMP_TRACE_SLOT Slots;  // Capacity entries
+    } TEMP_TRACE_RING, *PTEMP_TRACE_RING;
+
+    typedef struct _TEMP_TRACE_BUFFER
+    {
+        ULONG ProcessorCount;
+        ULONG Capacity;         // Slots per ring, power of two
+        ULONG NextRing;         // Ring the next read starts with, so none is starved
+        PTEMP_TRACE_RING Rings; // ProcessorCount entries
+    } TEMP_TRACE_BUFFER, *PTEMP_TRACE_BUFFER;
+
     // Device creation parameters
     typedef struct _TEMP_CREATE_DATA
     {
@@ -140,28 +425,167 @@ extern "C"
         WCHAR DriveLetter;
         BOOLEAN RemovableMedia;
         BOOLEAN CdRomType;
-        WCHAR FileName[MAX_PATH]; // Optional backing file
+        WCHAR FileName[MAX_PATH]; // NT path of an image to restore lazily, empty for a blank disk
+        ULONG ChunkSize;          // 0 selects TEMP_DEFAULT_CHUNK_SIZE
+        ULONG PressurePolicy;     // TEMP_PRESSURE_* flags, 0 keeps the disk fully resident
+        WCHAR SpillFileName[MAX_PATH]; // NT path of the spill file for TEMP_PRESSURE_SPILL
+        ULONG Encryption;         // TEMP_ENCRYPTION_*
+        ULONG ImageMode;          // TEMP_IMAGE_*; TEMP_IMAGE_MAPPED takes no pressure policy or encryption
+        ULONG64 MemoryMinimum;    // Bytes guaranteed from the global memory pool
+        ULONG64 MemoryMaximum;    // Bytes the device may burst to, 0 for no maximum
+        ULONG64 IopsLimit;        // Reads and writes per second, 0 for no limit
+        ULONG64 BandwidthLimit;   // Bytes read and written per second, 0 for no limit
+        ULONG QosWeight;          // Share of the driver-wide ceiling, 0 selects TEMP_QOS_DEFAULT_WEIGHT
     } TEMP_CREATE_DATA, *PTEMP_CREATE_DATA;
 
+    // TEMP_IOCTL_COPY_RANGE input and output on the control device. Offsets and Length
+    // are in bytes, multiples of both devices' sector sizes. Source and target may be
+    // the same device as long as the ranges do not overlap.
+    typedef struct _TEMP_COPY_DATA
+    {
+        ULONG SourceDevice;
+        ULONG TargetDevice;
+        ULONG64 SourceOffset;
+        ULONG64 TargetOffset;
+        ULONG64 Length;
+        ULONG64 SharedLength; // Returned: bytes shared copy-on-write, or unallocated in both, instead of copied
+    } TEMP_COPY_DATA, *PTEMP_COPY_DATA;
+
+    // Resize parameters; NewSize is rounded down to a sector multiple and returned
+    typedef struct _TEMP_RESIZE_DATA
+    {
+        ULONG DeviceNumber;
+        ULONG64 NewSize;
+    } TEMP_RESIZE_DATA, *PTEMP_RESIZE_DATA;
+
+    // One second of a device's activity. Counts are for the interval ending at Time;
+    // ElapsedMs is how long it actually was, a little over a second when the timer
+    // was coalesced or the DPC ran late.
+    typedef struct _TEMP_HISTORY_SAMPLE
+    {
+        ULONG64 Time;      // System time at the end of the interval, 100ns units since 1601
+        ULONG ElapsedMs;
+        ULONG Reserved;
+        ULONG64 Reads;     // Requests completed
+        ULONG64 Writes;
+        ULONG64 BytesRead;
+        ULONG64 BytesWritten;
+        ULONG64 CacheHits;
+        ULONG64 CacheMisses;
+        ULONG64 ReadLatencyP99;  // Nanoseconds, upper bound of the bucket; 0 without reads
+        ULONG64 WriteLatencyP99; // Nanoseconds, upper bound of the bucket; 0 without writes
+        ULONG64 MemoryUsed;      // As in TEMP_STATISTICS, at the end of the interval
+    } TEMP_HISTORY_SAMPLE, *PTEMP_HISTORY_SAMPLE;
+
+    // TEMP_IOCTL_GET_HISTORY output: the newest samples that fit, oldest first.
+    // Samples start Size bytes in and are SampleSize apart.
+    typedef struct _TEMP_HISTORY
+    {
+        ULONG Version; // TEMP_HISTORY_VERSION
+        ULONG Size;    // Bytes before Samples in the driver's structure
+        ULONG SampleSize;
+        ULONG SamplesReturned;
+        ULONG Capacity;   // TEMP_HISTORY_SECONDS
+        ULONG IntervalMs; // TEMP_HISTORY_INTERVAL_MS
+        ULONG64 TotalSamples; // Taken since the device was created
+        TEMP_HISTORY_SAMPLE Samples[ANYSIZE_ARRAY];
+    } TEMP_HISTORY, *PTEMP_HISTORY;
+
 #ifdef _KERNEL_MODE
+    // Per-second history ring of a device (temp_history.c). The DPC keeps the totals
+    // it saw last so each sample holds only that second's activity; the read and
+    // write latency buckets are kept the same way, which also gives the request counts.
+    typedef struct _TEMP_HISTORY_RING
+    {
+        KTIMER Timer;
+        KDPC Dpc;
+        KSPIN_LOCK Lock; // Samples and TotalSamples, between the DPC and readers
+        ULONG64 TotalSamples;
+        LARGE_INTEGER LastTime;
+        ULONG64 LastBytesRead;
+        ULONG64 LastBytesWritten;
+        ULONG64 LastCacheHits;
+        ULONG64 LastCacheMisses;
+        ULONG64 LastLatency[2][TEMP_HISTOGRAM_BUCKETS]; // Reads and writes
+        ULONG64 Latency[TEMP_HISTOGRAM_BUCKETS];        // The DPC's scratch histogram
+        TEMP_HISTORY_SAMPLE Samples[TEMP_HISTORY_SECONDS];
+    } TEMP_HISTORY_RING, *PTEMP_HISTORY_RING;
+
+    // Image a device is being restored from (temp_image.c). Reads of FileHandle hold
+    // Rundown, so the prefetcher can close the file once everything is loaded while
+    // late faults still see it.
+    typedef struct _TEMP_IMAGE
+    {
+        HANDLE FileHandle; // NULL once closed
+        EX_RUNDOWN_REF Rundown;
+        ULONG64 DataOffset; // File offset of disk offset 0
+        ULONG StripeSize;   // Disk bytes per heat entry; 0 for a raw image
+        ULONG64 StripeCount;
+        KEVENT StopEvent;
+        PVOID Thread;       // Prefetcher, NULL if it could not be started
+        LARGE_INTEGER StartTime;
+        PVOID View;         // TEMP_IMAGE_MAPPED: the whole file in system space
+        ULONG64 ViewSize;   // Bytes of the file behind View
+    } TEMP_IMAGE, *PTEMP_IMAGE;
+
+    // I/O QoS state of a device (temp_qos.c). Each bucket is kept as the time its
+    // tokens are used up to, in nanoseconds: a request moves it on by its cost and
+    // waits for whatever lies beyond the bucket's depth. The rates in force change
+    // when the driver-wide ceiling is redivided; 0 is no limit.
+    typedef struct _TEMP_QOS
+    {
+        ULONG64 IopsLimit;
+        ULONG64 BandwidthLimit;
+        ULONG Weight;
+        BOOLEAN Busy;                  // Had requests in the last rebalancing interval
+        volatile LONG64 IopsRate;
+        volatile LONG64 BandwidthRate;
+        volatile LONG64 IopsDue;
+        volatile LONG64 BandwidthDue;
+        ULONG64 LastRequests;          // Read and write requests at the last rebalancing
+        volatile LONG64 ThrottledRequests;
+        volatile LONG64 ThrottledTime;
+        volatile LONG64 DeferredRequests;
+        volatile LONG64 DeferredTime;
+    } TEMP_QOS, *PTEMP_QOS;
+
     // Device extension structure (kernel mode only)
     typedef struct _TEMP_DEVICE_EXTENSION
     {
         ULONG DeviceNumber;
         ULONG64 DiskSize;
         ULONG SectorSize;
+        ULONG SectorShift; // log2(SectorSize)
+        ULONG ChunkSize;
         WCHAR DriveLetter;
         BOOLEAN RemovableMedia;
         BOOLEAN CdRomType;
+        BOOLEAN ReadOnly; // Mapped image: reads come from its view, writes are refused
 
         PTEMP_MEMORY_MANAGER MemoryManager;
         PDEVICE_OBJECT DeviceObject;
         PDEVICE_OBJECT PhysicalDeviceObject;
+        HANDLE SpillFileHandle; // Open while TEMP_PRESSURE_SPILL is selected
+        TEMP_IO_HISTOGRAMS IoHistograms;
+        PTEMP_HISTORY_RING History; // NULL if it could not be allocated
+        PTEMP_IMAGE Image;          // NULL unless created from an image
+        TEMP_QOS Qos;
+
+        // Request tracing (TEMP_IOCTL_SET_TRACE). Writers check TraceEnabled and then
+        // hold TraceRundown while touching Trace; the rest is under TraceMutex.
+        volatile LONG TraceEnabled;
+        TEMP_TRACE_BUFFER Trace;
+        PEX_RUNDOWN_REF_CACHE_AWARE TraceRundown; // Allocated on first use
+        LARGE_INTEGER TraceStart;                 // KeQueryPerformanceCounter when enabled
+        FAST_MUTEX TraceMutex;
 
         UNICODE_STRING DeviceName;
         UNICODE_STRING SymbolicLinkName;
 
-        volatile LONG ReferenceCount;
+        // Held by every request on the device and by TempFindDevice; TempRemoveDevice
+        // waits for it to drain. It lives in the device object's extension right past
+        // this structure, so requests arriving after removal still find it.
+        PEX_RUNDOWN_REF_CACHE_AWARE IoRundown;
         KEVENT RemoveEvent;
 
         // I/O Statistics
@@ -185,27 +609,452 @@ extern "C"
         ULONG64 CacheHits;
         ULONG64 CacheMisses;
         ULONG64 EvictionCount;
+        ULONG64 PressureEvents;   // Low memory conditions seen while the device existed
+        ULONG64 BytesReclaimed;   // Memory given back under pressure
+        ULONG64 CompressedChunks;
+        ULONG64 CompressedBytes;
+        ULONG64 SpilledChunks;
     } TEMP_STATISTICS, *PTEMP_STATISTICS;
 
-#ifdef _KERNEL_MODE
-    // Kernel mode function declarations
-    NTSTATUS TempInitializeMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 MaxSize);
+    // One device in TEMP_IOCTL_LIST_DEVICES output and the shared statistics page:
+    // its configuration and the counters TEMP_IOCTL_GET_STATISTICS returns
+    typedef struct _TEMP_DEVICE_INFO
+    {
+        ULONG DeviceNumber;
+        ULONG SectorSize;
+        ULONG ChunkSize;
+        ULONG PressurePolicy; // TEMP_PRESSURE_* flags
+        WCHAR DriveLetter;    // 0 without a drive letter
+        BOOLEAN RemovableMedia;
+        BOOLEAN CdRomType;
+        ULONG Encryption;     // TEMP_ENCRYPTION_*
+        TEMP_STATISTICS Statistics;
+    } TEMP_DEVICE_INFO, *PTEMP_DEVICE_INFO;
+
+    // TEMP_IOCTL_LIST_DEVICES output on the control device: every device in number
+    // order, as many as fit after the header. DeviceCount counts all of them, so a
+    // caller whose buffer was short can tell. Entries start Size bytes in and are
+    // EntrySize apart, which lets later versions grow TEMP_DEVICE_INFO.
+    typedef struct _TEMP_DEVICE_LIST
+    {
+        ULONG Version; // TEMP_DEVICE_LIST_VERSION
+        ULONG Size;    // Bytes before Devices in the driver's structure
+        ULONG EntrySize;
+        ULONG DeviceCount;
+        ULONG DevicesReturned;
+        ULONG Reserved;
+        TEMP_DEVICE_INFO Devices[ANYSIZE_ARRAY];
+    } TEMP_DEVICE_LIST, *PTEMP_DEVICE_LIST;
+
+    // A slot of the shared statistics page. The driver makes Sequence odd while it
+    // rewrites the slot; a reader copies the slot between two reads of an even,
+    // unchanged Sequence.
+    typedef struct _TEMP_SHARED_DEVICE_STATS
+    {
+        volatile LONG Sequence;
+        ULONG Present; // A device with this number exists
+        TEMP_DEVICE_INFO Info;
+    } TEMP_SHARED_DEVICE_STATS, *PTEMP_SHARED_DEVICE_STATS;
+
+    // Layout of the TEMP_SHARED_STATS_NAME section, enabled by TEMP_IOCTL_SET_SHARED_STATS.
+    // Slots are indexed by device number.
+    typedef struct _TEMP_SHARED_STATS
+    {
+        ULONG Version; // TEMP_SHARED_STATS_VERSION
+        ULONG Size;    // sizeof the driver's structure
+        ULONG EntrySize;
+        ULONG DeviceSlots; // TEMP_MAX_DEVICES
+        ULONG IntervalMs;  // Refresh interval; 0 once the driver stopped refreshing
+        ULONG Reserved;
+        volatile LONG64 UpdateCount; // Completed refreshes
+        volatile LONG64 UpdateTime;  // System time of the last refresh, 100ns units since 1601
+        TEMP_SHARED_DEVICE_STATS Devices[TEMP_MAX_DEVICES];
+    } TEMP_SHARED_STATS, *PTEMP_SHARED_STATS;
+
+    // Memory accounting returned by TEMP_IOCTL_GET_MEMORY_STATISTICS. Later versions
+    // only append fields: the driver fills as much as the output buffer holds and
+    // reports its own Version and Size, so callers check Size before reading a field.
+    typedef struct _TEMP_MEMORY_STATISTICS
+    {
+        ULONG Version; // TEMP_MEMORY_STATISTICS_VERSION
+        ULONG Size;    // sizeof the driver's structure
+        ULONG DeviceNumber;
+        ULONG ChunkSize;
+        ULONG BucketCount;
+        ULONG SegmentSize;           // Bytes per UsedMask bit
+        ULONG64 DiskSize;
+        ULONG64 ChunkCapacity;       // Chunks needed to back the whole disk
+        ULONG64 AllocatedChunks;     // Chunks holding memory, in any state
+        ULONG64 ResidentChunks;
+        ULONG64 CompressedChunks;
+        ULONG64 SpilledChunks;
+        ULONG64 PartialChunks;       // Allocated chunks with unwritten or trimmed segments
+        ULONG64 ResidentDataBytes;   // Uncompressed chunk data in memory
+        ULONG64 CompressedDataBytes; // Compressed chunk data in memory
+        ULONG64 InUseDataBytes;      // Written segments of allocated chunks
+        ULONG64 MetadataBytes;       // Manager, buckets, slot arrays, chunk headers, reclaim buffer
+        ULONG64 AllocationFailures;
+        ULONG64 EvictionCount;       // Chunks released, compressed or spilled under pressure
+        ULONG MinBucketChunks;
+        ULONG MaxBucketChunks;
+        ULONG BucketOccupancy[TEMP_OCCUPANCY_BINS]; // Buckets by allocated share of their slots
+        ULONG64 ImagePendingChunks;  // Chunks not loaded from the device's image yet (version 2)
+        ULONG64 ImageDemandLoads;    // Image chunks loaded because a request needed them
+        ULONG64 BudgetCharged;       // Chunk data charged to the memory budget (version 3)
+        ULONG64 BudgetMinimum;
+        ULONG64 BudgetMaximum;       // 0 for no maximum
+        ULONG64 BudgetDenials;       // Allocations refused by the budget
+        ULONG64 SharedChunks;        // Slots sharing data copy-on-write; the data counts once, as resident on one device (version 4)
+    } TEMP_MEMORY_STATISTICS, *PTEMP_MEMORY_STATISTICS;
+
+    // TEMP_IOCTL_SET_MEMORY_BUDGET input on the control device. TEMP_IOCTL_MEMORY_BUDGET
+    // only reports the budget and refuses an input that sets anything.
+    typedef struct _TEMP_BUDGET_CONTROL
+    {
+        ULONG Flags;        // TEMP_BUDGET_SET_*
+        ULONG DeviceNumber; // Device TEMP_BUDGET_SET_DEVICE applies to
+        ULONG64 PoolLimit;  // Bytes, 0 for no limit; not below the sum of the minimums
+        ULONG64 Minimum;    // Guaranteed bytes
+        ULONG64 Maximum;    // Bytes the device may burst to, 0 for no maximum
+    } TEMP_BUDGET_CONTROL, *PTEMP_BUDGET_CONTROL;
+
+    typedef struct _TEMP_DEVICE_BUDGET
+    {
+        ULONG DeviceNumber;
+        ULONG PressurePolicy; // A device without one cannot give memory back to the pool
+        ULONG64 Minimum;
+        ULONG64 Maximum;
+        ULONG64 Charged;
+        ULONG64 Denials;
+    } TEMP_DEVICE_BUDGET, *PTEMP_DEVICE_BUDGET;
+
+    // TEMP_IOCTL_MEMORY_BUDGET output, after any change was applied. Versioned like
+    // TEMP_MEMORY_STATISTICS.
+    typedef struct _TEMP_MEMORY_BUDGET
+    {
+        ULONG Version; // TEMP_MEMORY_BUDGET_VERSION
+        ULONG Size;    // sizeof the driver's structure
+        ULONG DevicesReturned;
+        ULONG Reserved;
+        ULONG64 PoolLimit;  // 0 for no limit
+        ULONG64 Guaranteed; // Sum of the device minimums
+        ULONG64 Charged;
+        ULONG64 Burst;      // Charged past the devices' minimums
+        ULONG64 Denials;
+        TEMP_DEVICE_BUDGET Devices[TEMP_MAX_DEVICES]; // In device number order
+    } TEMP_MEMORY_BUDGET, *PTEMP_MEMORY_BUDGET;
+
+    // TEMP_IOCTL_SET_QOS input on the control device. TEMP_IOCTL_QOS only reports the
+    // settings and throttling counters and refuses an input that sets anything.
+    typedef struct _TEMP_QOS_CONTROL
+    {
+        ULONG Flags;          // TEMP_QOS_SET_*
+        ULONG DeviceNumber;   // Device TEMP_QOS_SET_DEVICE applies to
+        ULONG64 TotalIops;    // Driver-wide ceiling shared by weight, 0 for none
+        ULONG64 TotalBandwidth;
+        ULONG IdleIntervalMs; // Quiet time before low-priority requests run, 0 runs them at once
+        ULONG Weight;         // 1 to TEMP_QOS_MAX_WEIGHT, 0 selects TEMP_QOS_DEFAULT_WEIGHT
+        ULONG64 IopsLimit;    // The device's own limits, 0 for no limit
+        ULONG64 BandwidthLimit;
+    } TEMP_QOS_CONTROL, *PTEMP_QOS_CONTROL;
+
+    typedef struct _TEMP_DEVICE_QOS
+    {
+        ULONG DeviceNumber;
+        ULONG Weight;
+        ULONG64 IopsLimit;         // As configured
+        ULONG64 BandwidthLimit;
+        ULONG64 IopsRate;          // In force: the limit, or the device's share of the ceiling if lower
+        ULONG64 BandwidthRate;
+        ULONG64 ThrottledRequests; // Requests that waited for their bucket
+        ULONG64 ThrottledTime;     // Nanoseconds spent waiting for it
+        ULONG64 DeferredRequests;  // Low-priority requests that waited for the device to go idle
+        ULONG64 DeferredTime;      // Nanoseconds
+    } TEMP_DEVICE_QOS, *PTEMP_DEVICE_QOS;
+
+    // TEMP_IOCTL_QOS output, after any change was applied
+    typedef struct _TEMP_QOS_REPORT
+    {
+        ULONG Version; // TEMP_QOS_VERSION
+        ULONG Size;    // sizeof the driver's structure
+        ULONG DevicesReturned;
+        ULONG IdleIntervalMs;
+        ULONG64 TotalIops; // 0 for no ceiling
+        ULONG64 TotalBandwidth;
+        TEMP_DEVICE_QOS Devices[TEMP_MAX_DEVICES]; // In device number order
+    } TEMP_QOS_REPORT, *PTEMP_QOS_REPORT;
+
+    // Service latency and request size of one kind of operation, merged across processors
+    typedef struct _TEMP_OPERATION_LATENCY
+    {
+        ULONG64 Count;
+        ULONG64 TotalLatency;                             // Nanoseconds
+        ULONG64 MaxLatency;                               // Nanoseconds
+        ULONG64 LatencyPercentiles[TEMP_PERCENTILE_COUNT]; // Nanoseconds, upper bound of the bucket
+        ULONG64 TotalBytes;
+        ULONG64 SizePercentiles[TEMP_PERCENTILE_COUNT];    // Bytes, upper bound of the bucket
+        ULONG64 LatencyHistogram[TEMP_HISTOGRAM_BUCKETS];
+        ULONG64 SizeHistogram[TEMP_HISTOGRAM_BUCKETS];
+    } TEMP_OPERATION_LATENCY, *PTEMP_OPERATION_LATENCY;
+
+    // Returned by TEMP_IOCTL_GET_LATENCY_STATISTICS; versioned like TEMP_MEMORY_STATISTICS
+    typedef struct _TEMP_LATENCY_STATISTICS
+    {
+        ULONG Version; // TEMP_LATENCY_STATISTICS_VERSION
+        ULONG Size;    // sizeof the driver's structure
+        ULONG DeviceNumber;
+        ULONG SubBucketBits; // TEMP_HISTOGRAM_SUB_BITS
+        TEMP_OPERATION_LATENCY Operations[TEMP_OPERATION_COUNT]; // Indexed by TEMP_OPERATION_*
+    } TEMP_LATENCY_STATISTICS, *PTEMP_LATENCY_STATISTICS;
+
+    // One bucket's lock profile; times in nanoseconds
+    typedef struct _TEMP_BUCKET_CONTENTION
+    {
+        ULONG Bucket;     // Owns stripes Bucket, Bucket + BucketCount, ... of the disk
+        ULONG ChunkCount;
+        ULONG64 Acquisitions;
+        ULONG64 ContendedAcquisitions;
+        ULONG64 SpinTime;
+        ULONG64 HoldTime;
+        ULONG64 MaxHoldTime;
+    } TEMP_BUCKET_CONTENTION, *PTEMP_BUCKET_CONTENTION;
+
+    // Returned by TEMP_IOCTL_GET_LOCK_CONTENTION, whose optional ULONG input is the
+    // number of buckets wanted. Buckets come hottest first: most time spent spinning,
+    // then most contended acquisitions. Versioned like TEMP_MEMORY_STATISTICS.
+    typedef struct _TEMP_LOCK_CONTENTION
+    {
+        ULONG Version; // TEMP_LOCK_CONTENTION_VERSION
+        ULONG Size;    // sizeof the driver's structure
+        ULONG DeviceNumber;
+        ULONG Enabled;          // Profiling is on (TEMP_IOCTL_SET_LOCK_PROFILING)
+        ULONG BucketCount;
+        ULONG StripeSize;
+        ULONG BucketsReturned;
+        ULONG Reserved;
+        ULONG64 Acquisitions;   // Totals across all buckets
+        ULONG64 ContendedAcquisitions;
+        ULONG64 SpinTime;
+        ULONG64 HoldTime;
+        TEMP_BUCKET_CONTENTION Buckets[TEMP_LOCK_CONTENTION_MAX_TOP];
+    } TEMP_LOCK_CONTENTION, *PTEMP_LOCK_CONTENTION;
+
+    // TEMP_IOCTL_GET_HEATMAP input, optional. Regions merge 2^RegionShift stripes;
+    // the output starts at region FirstRegion.
+    typedef struct _TEMP_HEATMAP_QUERY
+    {
+        ULONG FirstRegion;
+        ULONG RegionShift; // Up to TEMP_HEATMAP_MAX_REGION_SHIFT
+    } TEMP_HEATMAP_QUERY, *PTEMP_HEATMAP_QUERY;
+
+    typedef struct _TEMP_HEATMAP_REGION
+    {
+        ULONG64 Reads;
+        ULONG64 Writes;
+    } TEMP_HEATMAP_REGION, *PTEMP_HEATMAP_REGION;
+
+    // TEMP_IOCTL_GET_HEATMAP output: as many regions as fit after the header. Totals
+    // cover the whole disk whichever regions were returned.
+    typedef struct _TEMP_HEATMAP
+    {
+        ULONG Version; // TEMP_HEATMAP_VERSION
+        ULONG Size;    // Bytes before Regions in the driver's structure
+        ULONG DeviceNumber;
+        ULONG StripeSize;
+        ULONG64 RegionSize;  // StripeSize << RegionShift
+        ULONG RegionCount;   // Regions covering the disk at this size
+        ULONG FirstRegion;
+        ULONG RegionsReturned;
+        ULONG HotStripeHeat; // Reclaim spares stripes this hot; 0 before the first decay
+        ULONG64 TotalReads;
+        ULONG64 TotalWrites;
+        ULONG64 DiskSize;
+        TEMP_HEATMAP_REGION Regions[ANYSIZE_ARRAY];
+    } TEMP_HEATMAP, *PTEMP_HEATMAP;
+
+    // TEMP_IOCTL_SET_TRACE input. Enabling an active trace restarts it with new rings.
+    typedef struct _TEMP_TRACE_CONTROL
+    {
+        ULONG Enable;
+        ULONG RecordsPerProcessor; // 0 selects TEMP_TRACE_DEFAULT_RECORDS
+    } TEMP_TRACE_CONTROL, *PTEMP_TRACE_CONTROL;
+
+    // TEMP_IOCTL_READ_TRACE output: as many records as fit, oldest first per processor.
+    // Records of different processors are not merged; sort by Timestamp for order.
+    typedef struct _TEMP_TRACE_DATA
+    {
+        ULONG RecordCount;
+        ULONG Active;           // Still recording; once 0 and drained the rings are freed
+        ULONG64 DroppedRecords; // Lost to full rings since the trace was enabled
+        TEMP_TRACE_RECORD Records[ANYSIZE_ARRAY];
+    } TEMP_TRACE_DATA, *PTEMP_TRACE_DATA;
+
+    // Trace file layout: this header followed by RecordCount TEMP_TRACE_RECORDs
+    typedef struct _TEMP_TRACE_FILE_HEADER
+    {
+        ULONG Magic;       // TEMP_TRACE_FILE_MAGIC
+        USHORT Version;    // TEMP_TRACE_FILE_VERSION
+        USHORT RecordSize; // sizeof(TEMP_TRACE_RECORD)
+        ULONG SectorSize;
+        ULONG ChunkSize;
+        ULONG64 DiskSize;
+        ULONG64 RecordCount;
+        ULONG64 DroppedRecords;
+    } TEMP_TRACE_FILE_HEADER, *PTEMP_TRACE_FILE_HEADER;
+
+    // Image file layout: this header, StripeCount ULONG stripe heats (decayed reads plus
+    // writes when the image was saved), then the disk's contents from DataOffset on.
+    // Image files are sparse where the disk held zeros.
+    typedef struct _TEMP_IMAGE_FILE_HEADER
+    {
+        ULONG Magic;       // TEMP_IMAGE_FILE_MAGIC
+        USHORT Version;    // TEMP_IMAGE_FILE_VERSION
+        USHORT HeaderSize; // sizeof(TEMP_IMAGE_FILE_HEADER)
+        ULONG SectorSize;
+        ULONG StripeSize;  // Disk bytes per heat entry
+        ULONG64 DiskSize;
+        ULONG64 StripeCount;
+        ULONG64 DataOffset; // Multiple of TEMP_IMAGE_DATA_ALIGNMENT
+    } TEMP_IMAGE_FILE_HEADER, *PTEMP_IMAGE_FILE_HEADER;
+
+#if defined(_KERNEL_MODE) || defined(TEMP_PORTABLE)
+    // Memory manager function declarations
+    NTSTATUS TempInitializeMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 MaxSize, ULONG ChunkSize);
     VOID TempCleanupMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager);
+    BOOLEAN TempDrainMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG MaxSlots);
     NTSTATUS TempReadSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG SectorCount, PVOID Buffer, ULONG SectorSize);
     NTSTATUS TempWriteSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG SectorCount, PVOID Buffer, ULONG SectorSize);
     NTSTATUS TempFormatDisk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 DiskSize, ULONG SectorSize);
+    VOID TempSweepFormattedChunks(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 MaxChunks);
+    NTSTATUS TempTrimSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG64 SectorCount, ULONG SectorSize);
+    NTSTATUS TempCopyRange(PTEMP_MEMORY_MANAGER Source, ULONG64 SourceOffset, PTEMP_MEMORY_MANAGER Target, ULONG64 TargetOffset, ULONG64 Length, PULONG64 SharedLength);
+    NTSTATUS TempResizeMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 NewSize);
+    VOID TempQueryMemoryStatistics(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_STATISTICS Statistics);
+    VOID TempQueryMemoryUsage(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_MEMORY_STATISTICS Usage);
+    VOID TempSetLockProfiling(PTEMP_MEMORY_MANAGER MemoryManager, BOOLEAN Enable);
+    VOID TempQueryLockContention(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_LOCK_CONTENTION Contention, ULONG TopCount);
+    VOID TempDecayHeatmap(PTEMP_MEMORY_MANAGER MemoryManager);
+    VOID TempQueryHeatmap(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_HEATMAP Heatmap, ULONG FirstRegion, ULONG RegionShift, ULONG MaxRegions);
+
+    // Latency and size histograms (temp_histogram.c)
+    NTSTATUS TempInitializeIoHistograms(PTEMP_IO_HISTOGRAMS Histograms, ULONG ProcessorCount);
+    VOID TempCleanupIoHistograms(PTEMP_IO_HISTOGRAMS Histograms);
+    VOID TempRecordOperation(PTEMP_IO_HISTOGRAMS Histograms, ULONG Processor, ULONG Operation, ULONG64 Latency, ULONG64 Bytes);
+    VOID TempQueryIoHistograms(PTEMP_IO_HISTOGRAMS Histograms, PTEMP_LATENCY_STATISTICS Statistics);
+    ULONG TempHistogramIndex(ULONG64 Value);
+    ULONG64 TempHistogramBucketLimit(ULONG Index);
+    ULONG64 TempHistogramPercentile(const ULONG64 *Counts, ULONG64 Total, ULONG PerTenThousand);
+    VOID TempSumLatencyHistogram(PTEMP_IO_HISTOGRAMS Histograms, ULONG Operation, PULONG64 Counts);
+
+    // Per-processor trace rings (temp_trace.c). Any number of writers, one reader at a time.
+    NTSTATUS TempInitializeTraceBuffer(PTEMP_TRACE_BUFFER Trace, ULONG ProcessorCount, ULONG RecordsPerProcessor);
+    VOID TempCleanupTraceBuffer(PTEMP_TRACE_BUFFER Trace);
+    BOOLEAN TempWriteTraceRecord(PTEMP_TRACE_BUFFER Trace, ULONG Processor, const TEMP_TRACE_RECORD *Record);
+    ULONG TempReadTraceRecords(PTEMP_TRACE_BUFFER Trace, PTEMP_TRACE_RECORD Records, ULONG MaxRecords);
+    ULONG64 TempQueryTraceDropped(PTEMP_TRACE_BUFFER Trace);
+
+    // Memory pressure handling (PASSIVE_LEVEL, one caller at a time)
+    NTSTATUS TempSetPressurePolicy(PTEMP_MEMORY_MANAGER MemoryManager, ULONG Policy, PTEMP_SPILL_ROUTINE SpillRoutine, PVOID SpillContext);
+    VOID TempAgeMemory(PTEMP_MEMORY_MANAGER MemoryManager);
+    ULONG64 TempReclaimMemory(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 TargetBytes);
+    ULONG64 TempRestoreMemory(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 TargetBytes);
+
+    // Chunk compression (temp_compress.c)
+#define TEMP_COMPRESS_WORKSPACE_SIZE (4096 * sizeof(ULONG))
+    ULONG TempCompressBuffer(const UCHAR *Source, ULONG SourceLength, PUCHAR Destination, ULONG DestinationLength, PVOID Workspace);
+    ULONG TempDecompressBuffer(const UCHAR *Source, ULONG SourceLength, PUCHAR Destination, ULONG DestinationLength);
+
+    // AES-XTS at-rest encryption (temp_crypto.c). Lengths are multiples of
+    // TEMP_XTS_DATA_UNIT; DataUnit numbers the first one. Source may equal Destination.
+    ULONG TempXtsDetectImplementation(VOID);
+    VOID TempXtsSetKey(PTEMP_XTS_KEY Key, const UCHAR *KeyBytes);
+    VOID TempXtsEncrypt(const TEMP_XTS_KEY *Key, ULONG64 DataUnit, const UCHAR *Source, PUCHAR Destination, ULONG Length);
+    VOID TempXtsDecrypt(const TEMP_XTS_KEY *Key, ULONG64 DataUnit, const UCHAR *Source, PUCHAR Destination, ULONG Length);
+    NTSTATUS TempSetEncryption(PTEMP_MEMORY_MANAGER MemoryManager, const UCHAR *KeyBytes);
+
+    // Lazy restore from an image. The source is set before any I/O; chunks load on
+    // first access or through TempLoadImageChunk (PASSIVE_LEVEL).
+    NTSTATUS TempSetImageSource(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_SPILL_ROUTINE ImageRoutine, PVOID ImageContext);
+    NTSTATUS TempLoadImageChunk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 ChunkNumber);
+    VOID TempEndImageSource(PTEMP_MEMORY_MANAGER MemoryManager);
+
+    // Global memory budget. A manager is attached before any I/O and detached by
+    // TempCleanupMemoryManager; budgets may change at any time (PASSIVE_LEVEL).
+    VOID TempInitializeMemoryPool(PTEMP_MEMORY_POOL Pool);
+    NTSTATUS TempSetMemoryPoolLimit(PTEMP_MEMORY_POOL Pool, ULONG64 Limit);
+    NTSTATUS TempAttachMemoryPool(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_MEMORY_POOL Pool, ULONG64 Minimum, ULONG64 Maximum);
+    NTSTATUS TempSetMemoryBudget(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 Minimum, ULONG64 Maximum);
+    ULONG64 TempQueryPoolShortfall(PTEMP_MEMORY_POOL Pool);
+    ULONG64 TempQueryBudgetExcess(PTEMP_MEMORY_MANAGER MemoryManager);
 
     // Utility functions
     ULONG64 TempHashFunction(ULONG64 SectorAddress);
-    ULONG TempGetBucketIndex(ULONG64 Hash);
-    NTSTATUS TempAllocateChunk(PTEMP_BUCKET Bucket, PTEMP_CHUNK *Chunk);
+    ULONG TempLog2(ULONG Value);
+    NTSTATUS TempAllocateChunk(PTEMP_BUCKET Bucket, ULONG ChunkSize, ULONG Slot, PTEMP_CHUNK *Chunk);
     VOID TempReleaseChunk(PTEMP_BUCKET Bucket, PTEMP_CHUNK Chunk);
+#endif
 
+#ifdef _KERNEL_MODE
     // Driver entry points
     NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
     VOID TempUnloadDriver(PDRIVER_OBJECT DriverObject);
-    NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateData);
+    NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateData, KPROCESSOR_MODE RequestorMode);
     NTSTATUS TempRemoveDevice(ULONG DeviceNumber);
+    NTSTATUS TempResizeDevice(ULONG DeviceNumber, PULONG64 NewSize);
+    NTSTATUS TempFormatDevice(ULONG DeviceNumber);
+    NTSTATUS TempCopyDevice(PTEMP_COPY_DATA Copy, KPROCESSOR_MODE RequestorMode);
+    PTEMP_DEVICE_EXTENSION TempFindDevice(ULONG DeviceNumber);
+    VOID TempDereferenceDevice(PTEMP_DEVICE_EXTENSION DeviceExtension);
+    VOID TempQueryDeviceInfo(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_DEVICE_INFO Info);
+    NTSTATUS TempListDevices(PTEMP_DEVICE_LIST List, ULONG OutputLength, PULONG_PTR Information);
+
+    // Shared statistics page (temp_shared.c)
+    VOID TempInitializeSharedStats(VOID);
+    NTSTATUS TempSetSharedStats(ULONG IntervalMs);
+    VOID TempStopSharedStats(VOID);
+
+    // Per-second history (temp_history.c)
+    NTSTATUS TempStartHistory(PTEMP_DEVICE_EXTENSION DeviceExtension);
+    VOID TempStopHistory(PTEMP_DEVICE_EXTENSION DeviceExtension);
+    NTSTATUS TempReadHistory(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_HISTORY History, ULONG OutputLength, PULONG_PTR Information);
+
+    // Freeing removed devices' memory in the background (temp_retire.c)
+    NTSTATUS TempStartRetireWorker(VOID);
+    VOID TempStopRetireWorker(VOID);
+    VOID TempRetireMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager);
+
+    // Memory pressure monitor and spill file (temp_pressure.c)
+    NTSTATUS TempStartPressureMonitor(VOID);
+    VOID TempStopPressureMonitor(VOID);
+    NTSTATUS TempOpenSpillFile(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode);
+    VOID TempCloseSpillFile(PTEMP_DEVICE_EXTENSION DeviceExtension);
+    NTSTATUS TempSpillTransfer(PVOID Context, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length);
+    NTSTATUS TempTransferFile(PTEMP_DEVICE_EXTENSION DeviceExtension, HANDLE FileHandle, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length, PULONG Transferred);
+
+    // Global memory budget, rebalanced by the pressure monitor (temp_pressure.c)
+    VOID TempInitializeMemoryBudget(VOID);
+    NTSTATUS TempJoinMemoryBudget(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 Minimum, ULONG64 Maximum);
+    NTSTATUS TempControlMemoryBudget(PVOID Buffer, ULONG InputLength, ULONG OutputLength, BOOLEAN AllowChanges, PULONG_PTR Information);
+
+    // I/O QoS and priority (temp_qos.c). TempThrottleRequest runs on every read and
+    // write at PASSIVE_LEVEL or APC_LEVEL and may wait there.
+    VOID TempInitializeQos(VOID);
+    NTSTATUS TempSetDeviceQos(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 IopsLimit, ULONG64 BandwidthLimit, ULONG Weight);
+    VOID TempThrottleRequest(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, LARGE_INTEGER Start, ULONG Length);
+    VOID TempBalanceQos(VOID);
+    NTSTATUS TempControlQos(PVOID Buffer, ULONG InputLength, ULONG OutputLength, BOOLEAN AllowChanges, PULONG_PTR Information);
+
+    // Image files: lazy restore and read-only mounts (temp_image.c)
+    NTSTATUS TempOpenImage(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode);
+    NTSTATUS TempMapImage(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode);
+    NTSTATUS TempReadMappedImage(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 Offset, PVOID Buffer, ULONG Length);
+    VOID TempStartImagePrefetch(PTEMP_DEVICE_EXTENSION DeviceExtension);
+    VOID TempCloseImage(PTEMP_DEVICE_EXTENSION DeviceExtension);
+
+    // Request tracing
+    NTSTATUS TempSetTrace(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_TRACE_CONTROL Control);
+    NTSTATUS TempReadTrace(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_TRACE_DATA Data, ULONG OutputLength, PULONG_PTR Information);
+    VOID TempTraceRequest(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG Operation, LARGE_INTEGER Start, ULONG64 Offset, ULONG64 Length, ULONG64 Latency, NTSTATUS Status);
 
     // IRP handlers
     NTSTATUS TempDispatchCreateClose(PDEVICE_OBJECT DeviceObject, PIRP Irp);
@@ -0,0 +1,229 @@
+#include "temp_core.h"
+
+// Per-processor latency and request size histograms. Recording touches only the
+// current processor's counters with uncontended interlocked adds; queries merge
+// every processor's copy and derive the percentiles from the merged buckets.
+
+#define TEMP_POOL_TAG 'pmeT' // 'Temp' backwards
+
+// Percentiles reported in TEMP_OPERATION_LATENCY, in hundredths of a percent
+static const ULONG TempPercentiles[TEMP_PERCENTILE_COUNT] = {5000, 9000, 9900, 9990};
+
+static ULONG TempLog2Ulong64(ULONG64 Value)
+{
+    ULONG shift = 0;
+
+    for (ULONG step = 32; step > 0; step >>= 1)
+    {
+        if (Value >> step)
+        {
+            Value >>= step;
+            shift += step;
+        }
+    }
+
+    return shift;
+}
+
+ULONG TempHistogramIndex(ULONG64 Value)
+{
+    if (Value < (2ULL << TEMP_HISTOGRAM_SUB_BITS))
+    {
+        return (ULONG)Value;
+    }
+
+    // The top TEMP_HISTOGRAM_SUB_BITS + 1 bits select the bucket within the magnitude
+    ULONG magnitude = TempLog2Ulong64(Value) - TEMP_HISTOGRAM_SUB_BITS;
+    ULONG index = (magnitude << TEMP_HISTOGRAM_SUB_BITS) + (ULONG)(Value >> magnitude);
+
+    return index < TEMP_HISTOGRAM_BUCKETS ? index : TEMP_HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value counted in a bucket
+ULONG64 TempHistogramBucketLimit(ULONG Index)
+{
+    if (Index < (2UL << TEMP_HISTOGRAM_SUB_BITS))
+    {
+        return Index;
+    }
+
+    if (Index >= TEMP_HISTOGRAM_BUCKETS - 1)
+    {
+        return MAXULONG64;
+    }
+
+    ULONG magnitude = (Index >> TEMP_HISTOGRAM_SUB_BITS) - 1;
+    ULONG64 mantissa = (Index & ((1UL << TEMP_HISTOGRAM_SUB_BITS) - 1)) + (1ULL << TEMP_HISTOGRAM_SUB_BITS);
+
+    return ((mantissa + 1) << magnitude) - 1;
+}
+
+// Upper bound of the bucket holding the given rank, or 0 for an empty histogram
+ULONG64 TempHistogramPercentile(const ULONG64 *Counts, ULONG64 Total, ULONG PerTenThousand)
+{
+    if (!Counts || Total == 0)
+    {
+        return 0;
+    }
+
+    ULONG64 rank = (Total * PerTenThousand + 9999) / 10000;
+    ULONG64 seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += Counts[i];
+        if (seen >= rank)
+        {
+            return TempHistogramBucketLimit(i);
+        }
+    }
+
+    return TempHistogramBucketLimit(TEMP_HISTOGRAM_BUCKETS - 1);
+}
+
+NTSTATUS TempInitializeIoHistograms(PTEMP_IO_HISTOGRAMS Histograms, ULONG ProcessorCount)
+{
+    if (!Histograms || ProcessorCount == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Histograms->Counters = (PTEMP_OPERATION_COUNTERS)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)ProcessorCount * TEMP_OPERATION_COUNT * sizeof(TEMP_OPERATION_COUNTERS),
+        TEMP_POOL_TAG);
+
+    if (!Histograms->Counters)
+    {
+        Histograms->ProcessorCount = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Histograms->ProcessorCount = ProcessorCount;
+
+    return STATUS_SUCCESS;
+}
+
+VOID TempCleanupIoHistograms(PTEMP_IO_HISTOGRAMS Histograms)
+{
+    if (Histograms && Histograms->Counters)
+    {
+        ExFreePool(Histograms->Counters);
+        Histograms->Counters = NULL;
+        Histograms->ProcessorCount = 0;
+    }
+}
+
+// Latency is in nanoseconds. Processor only spreads the updates; a thread that
+// moves to another processor meanwhile still records correctly.
+VOID TempRecordOperation(PTEMP_IO_HISTOGRAMS Histograms, ULONG Processor, ULONG Operation, ULONG64 Latency, ULONG64 Bytes)
+{
+    if (!Histograms || !Histograms->Counters || Operation >= TEMP_OPERATION_COUNT)
+    {
+        return;
+    }
+
+    PTEMP_OPERATION_COUNTERS counters =
+        &Histograms->Counters[(Processor % Histograms->ProcessorCount) * TEMP_OPERATION_COUNT + Operation];
+
+    InterlockedAdd64(&counters->TotalLatency, (LONG64)Latency);
+    InterlockedAdd64(&counters->TotalBytes, (LONG64)Bytes);
+    InterlockedIncrement64(&counters->Latency[TempHistogramIndex(Latency)]);
+    InterlockedIncrement64(&counters->Size[TempHistogramIndex(Bytes)]);
+
+    LONG64 max = counters->MaxLatency;
+    while ((LONG64)Latency > max)
+    {
+        LONG64 previous = InterlockedCompareExchange64(&counters->MaxLatency, (LONG64)Latency, max);
+        if (previous == max)
+        {
+            break;
+        }
+        max = previous;
+    }
+}
+
+VOID TempQueryIoHistograms(PTEMP_IO_HISTOGRAMS Histograms, PTEMP_LATENCY_STATISTICS Statistics)
+{
+    if (!Statistics)
+    {
+        return;
+    }
+
+    RtlZeroMemory(Statistics, sizeof(TEMP_LATENCY_STATISTICS));
+    Statistics->Version = TEMP_LATENCY_STATISTICS_VERSION;
+    Statistics->Size = sizeof(TEMP_LATENCY_STATISTICS);
+    Statistics->SubBucketBits = TEMP_HISTOGRAM_SUB_BITS;
+
+    if (!Histograms || !Histograms->Counters)
+    {
+        return;
+    }
+
+    for (ULONG op = 0; op < TEMP_OPERATION_COUNT; op++)
+    {
+        PTEMP_OPERATION_LATENCY merged = &Statistics->Operations[op];
+
+        for (ULONG cpu = 0; cpu < Histograms->ProcessorCount; cpu++)
+        {
+            PTEMP_OPERATION_COUNTERS counters = &Histograms->Counters[cpu * TEMP_OPERATION_COUNT + op];
+
+            merged->TotalLatency += counters->TotalLatency;
+            merged->TotalBytes += counters->TotalBytes;
+            if ((ULONG64)counters->MaxLatency > merged->MaxLatency)
+            {
+                merged->MaxLatency = counters->MaxLatency;
+            }
+
+            for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+            {
+                merged->LatencyHistogram[i] += counters->Latency[i];
+                merged->SizeHistogram[i] += counters->Size[i];
+            }
+        }
+
+        for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+        {
+            merged->Count += merged->LatencyHistogram[i];
+        }
+
+        for (ULONG p = 0; p < TEMP_PERCENTILE_COUNT; p++)
+        {
+            merged->LatencyPercentiles[p] = TempHistogramPercentile(merged->LatencyHistogram, merged->Count, TempPercentiles[p]);
+            merged->SizePercentiles[p] = TempHistogramPercentile(merged->SizeHistogram, merged->Count, TempPercentiles[p]);
+
+            // The top bucket is open-ended; the maximum is the better bound
+            if (merged->LatencyPercentiles[p] > merged->MaxLatency)
+            {
+                merged->LatencyPercentiles[p] = merged->MaxLatency;
+            }
+        }
+    }
+}
+
+// Latency buckets of one operation summed across processors, without the rest of
+// TEMP_LATENCY_STATISTICS; small enough to run from a DPC every second
+VOID TempSumLatencyHistogram(PTEMP_IO_HISTOGRAMS Histograms, ULONG Operation, PULONG64 Counts)
+{
+    RtlZeroMemory(Counts, TEMP_HISTOGRAM_BUCKETS * sizeof(ULONG64));
+
+    if (!Histograms || !Histograms->Counters || Operation >= TEMP_OPERATION_COUNT)
+    {
+        return;
+    }
+
+    for (ULONG cpu = 0; cpu < Histograms->ProcessorCount; cpu++)
+    {
+        PTEMP_OPERATION_COUNTERS counters = &Histograms->Counters[cpu * TEMP_OPERATION_COUNT + Operation];
+
+        for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+        {
+            Counts[i] += counters->Latency[i];
+        }
+    }
+}
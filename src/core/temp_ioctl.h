@@ -0,0 +1,33 @@
+#ifndef TEMP_IOCTL_H
+#define TEMP_IOCTL_H
+
+// Control codes, shared by the driver and its user-mode tools. CTL_CODE comes from
+// ntddk.h in the driver and winioctl.h in user mode, so both build the same values.
+// Include nothing else here: the simplified CLI build uses this header on its own.
+// Codes that remove, shrink or overwrite a device, copy one into another, or change
+// driver-wide settings name the access they need, and the I/O manager refuses them on
+// a control device handle opened without it. The rest only create devices or report.
+
+#define TEMP_IOCTL_CREATE_DEVICE CTL_CODE(FILE_DEVICE_DISK, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_REMOVE_DEVICE CTL_CODE(FILE_DEVICE_DISK, 0x801, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define TEMP_IOCTL_LIST_DEVICES CTL_CODE(FILE_DEVICE_DISK, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_GET_VERSION CTL_CODE(FILE_DEVICE_DISK, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_GET_STATISTICS CTL_CODE(FILE_DEVICE_DISK, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_RESIZE_DEVICE CTL_CODE(FILE_DEVICE_DISK, 0x805, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define TEMP_IOCTL_GET_MEMORY_STATISTICS CTL_CODE(FILE_DEVICE_DISK, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_GET_LATENCY_STATISTICS CTL_CODE(FILE_DEVICE_DISK, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_SET_TRACE CTL_CODE(FILE_DEVICE_DISK, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_READ_TRACE CTL_CODE(FILE_DEVICE_DISK, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_SET_LOCK_PROFILING CTL_CODE(FILE_DEVICE_DISK, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_GET_LOCK_CONTENTION CTL_CODE(FILE_DEVICE_DISK, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_GET_HEATMAP CTL_CODE(FILE_DEVICE_DISK, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_SET_SHARED_STATS CTL_CODE(FILE_DEVICE_DISK, 0x80D, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define TEMP_IOCTL_GET_HISTORY CTL_CODE(FILE_DEVICE_DISK, 0x80E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_MEMORY_BUDGET CTL_CODE(FILE_DEVICE_DISK, 0x80F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_QOS CTL_CODE(FILE_DEVICE_DISK, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define TEMP_IOCTL_FORMAT_DEVICE CTL_CODE(FILE_DEVICE_DISK, 0x811, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define TEMP_IOCTL_COPY_RANGE CTL_CODE(FILE_DEVICE_DISK, 0x812, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define TEMP_IOCTL_SET_MEMORY_BUDGET CTL_CODE(FILE_DEVICE_DISK, 0x813, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define TEMP_IOCTL_SET_QOS CTL_CODE(FILE_DEVICE_DISK, 0x814, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#endif // TEMP_IOCTL_H
@@ -1,10 +1,28 @@
 #include "temp_core.h"
-#include <ntstrsafe.h>
 
 // Pool tags for memory allocation tracking
 #define TEMP_POOL_TAG 'pmeT' // 'Temp' backwards
 #define TEMP_CHUNK_TAG 'hCeT'
-#define TEMP_HASH_TAG 'hHeT'
+
+// What a TEMP_CHUNK_SHARED stub's Data holds. The stubs sharing one chunk of data
+// form a ring, so that when the owner goes the data can be handed to another stub:
+// the owner's manager counts the data as resident, once however many slots share it.
+typedef struct _TEMP_SHARE_LINK
+{
+    PTEMP_CHUNK Shared;
+    PTEMP_MEMORY_MANAGER MemoryManager; // Whose slot holds, or is about to hold, the stub
+    PTEMP_CHUNK Next;
+    PTEMP_CHUNK Previous;
+    BOOLEAN Owner;
+} TEMP_SHARE_LINK, *PTEMP_SHARE_LINK;
+
+// Guards the rings and the references they hold. Sharing spans managers, so no bucket
+// lock covers it; it is taken with at most one bucket lock held, never the other way.
+#ifdef TEMP_PORTABLE
+static KSPIN_LOCK g_ShareLock = TEMP_SPIN_LOCK_INIT;
+#else
+static KSPIN_LOCK g_ShareLock; // A zeroed spin lock is free
+#endif
 
 // Hash function using xxHash-like algorithm optimized for sector addresses
 ULONG64 TempHashFunction(ULONG64 SectorAddress)
@@ -19,16 +37,9 @@ ULONG64 TempHashFunction(ULONG64 SectorAddress)
     return hash;
 }
 
-ULONG TempGetBucketIndex(ULONG64 Hash)
-{
-    return (ULONG)(Hash % TEMP_BUCKET_COUNT);
-}
-
-NTSTATUS TempInitializeBucket(PTEMP_BUCKET Bucket, ULONG MaxChunks)
+NTSTATUS TempInitializeBucket(PTEMP_BUCKET Bucket, ULONG MaxChunks, ULONG StripeCount)
 {
-    NTSTATUS status = STATUS_SUCCESS;
-
-    if (!Bucket || MaxChunks == 0)
+    if (!Bucket || MaxChunks == 0 || StripeCount == 0)
     {
         return STATUS_INVALID_PARAMETER;
     }
@@ -37,10 +48,10 @@ NTSTATUS TempInitializeBucket(PTEMP_BUCKET Bucket, ULONG MaxChunks)
     RtlZeroMemory(Bucket, sizeof(TEMP_BUCKET));
     KeInitializeSpinLock(&Bucket->Lock);
 
-    // Allocate chunk pointer array
+    // Allocate the chunk slots; ExAllocatePool2 zeroes them, so every slot starts unmapped
     Bucket->Chunks = (PTEMP_CHUNK *)ExAllocatePool2(
         POOL_FLAG_NON_PAGED,
-        MaxChunks * sizeof(PTEMP_CHUNK),
+        (SIZE_T)MaxChunks * sizeof(PTEMP_CHUNK),
         TEMP_POOL_TAG);
 
     if (!Bucket->Chunks)
@@ -48,36 +59,81 @@ NTSTATUS TempInitializeBucket(PTEMP_BUCKET Bucket, ULONG MaxChunks)
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory(Bucket->Chunks, MaxChunks * sizeof(PTEMP_CHUNK));
     Bucket->MaxChunks = MaxChunks;
 
-    // Initialize hash table (start with reasonable size)
-    Bucket->HashTableSize = MaxChunks * 2; // Load factor of 0.5
-    if (Bucket->HashTableSize < 64)
-    {
-        Bucket->HashTableSize = 64;
-    }
-
-    Bucket->HashTable = (PTEMP_HASH_ENTRY)ExAllocatePool2(
+    Bucket->Heat = (PTEMP_STRIPE_HEAT)ExAllocatePool2(
         POOL_FLAG_NON_PAGED,
-        Bucket->HashTableSize * sizeof(TEMP_HASH_ENTRY),
-        TEMP_HASH_TAG);
+        (SIZE_T)StripeCount * sizeof(TEMP_STRIPE_HEAT),
+        TEMP_POOL_TAG);
 
-    if (!Bucket->HashTable)
+    if (!Bucket->Heat)
     {
-        ExFreePoolWithTag(Bucket->Chunks, TEMP_POOL_TAG);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    // Initialize hash table with empty entries
-    for (ULONG i = 0; i < Bucket->HashTableSize; i++)
+    return STATUS_SUCCESS;
+}
+
+FORCEINLINE PTEMP_SHARE_LINK TempShareLink(PTEMP_CHUNK Stub)
+{
+    return (PTEMP_SHARE_LINK)Stub->Data;
+}
+
+// The resident chunk a TEMP_CHUNK_SHARED stub reads from
+FORCEINLINE PTEMP_CHUNK TempSharedData(PTEMP_CHUNK Stub)
+{
+    return TempShareLink(Stub)->Shared;
+}
+
+// Where a resident or shared chunk's ChunkSize bytes of data are
+FORCEINLINE PUCHAR TempChunkData(PTEMP_CHUNK Chunk)
+{
+    return Chunk->State == TEMP_CHUNK_SHARED ? TempSharedData(Chunk)->Data : Chunk->Data;
+}
+
+// Frees a chunk no slot holds any more. A stub leaves its ring, handing the data to
+// the next stub if it owned it; the data goes with the last stub, whichever bucket
+// or manager that stub belongs to.
+static VOID TempDeleteChunk(PTEMP_CHUNK Chunk)
+{
+    if (Chunk->State == TEMP_CHUNK_SHARED)
     {
-        Bucket->HashTable[i].Key = 0;
-        Bucket->HashTable[i].ChunkIndex = MAXULONG64;
-        Bucket->HashTable[i].Offset = 0;
+        PTEMP_SHARE_LINK link = TempShareLink(Chunk);
+        PTEMP_CHUNK shared = link->Shared;
+        KIRQL oldIrql;
+
+        KeAcquireSpinLock(&g_ShareLock, &oldIrql);
+
+        if (link->Next != Chunk)
+        {
+            PTEMP_SHARE_LINK next = TempShareLink(link->Next);
+
+            next->Previous = link->Previous;
+            TempShareLink(link->Previous)->Next = link->Next;
+
+            if (link->Owner)
+            {
+                next->Owner = TRUE;
+                InterlockedIncrement64(&next->MemoryManager->OwnedSharedChunks);
+            }
+        }
+
+        if (link->Owner)
+        {
+            InterlockedDecrement64(&link->MemoryManager->OwnedSharedChunks);
+        }
+
+        LONG references = InterlockedDecrement(&shared->RefCount);
+
+        KeReleaseSpinLock(&g_ShareLock, oldIrql);
+
+        if (references == 0)
+        {
+            ExFreePool(shared);
+        }
     }
 
-    return status;
+    ExFreePool(Chunk);
 }
 
 VOID TempCleanupBucket(PTEMP_BUCKET Bucket)
@@ -93,428 +149,2721 @@ VOID TempCleanupBucket(PTEMP_BUCKET Bucket)
     // Free all chunks
     if (Bucket->Chunks)
     {
-        for (ULONG i = 0; i < Bucket->ChunkCount; i++)
+        for (ULONG i = 0; i < Bucket->MaxChunks; i++)
         {
             if (Bucket->Chunks[i])
             {
-                ExFreePool(Bucket->Chunks[i]);
+                TempDeleteChunk(Bucket->Chunks[i]);
             }
         }
         ExFreePool(Bucket->Chunks);
         Bucket->Chunks = NULL;
     }
 
-    // Free hash table
-    if (Bucket->HashTable)
+    if (Bucket->Heat)
+    {
+        ExFreePool(Bucket->Heat);
+        Bucket->Heat = NULL;
+    }
+
+    if (Bucket->ImagePending)
     {
-        ExFreePool(Bucket->HashTable);
-        Bucket->HashTable = NULL;
+        ExFreePool(Bucket->ImagePending);
+        Bucket->ImagePending = NULL;
     }
 
+    Bucket->ChunkCount = 0;
+
     KeReleaseSpinLock(&Bucket->Lock, oldIrql);
 }
 
-NTSTATUS TempAllocateChunk(PTEMP_BUCKET Bucket, PTEMP_CHUNK *Chunk)
+// Bucket locks are taken through these so their contention can be profiled. With
+// profiling off the only cost is the LockProfiling check.
+static VOID TempLockBucketProfiled(PTEMP_BUCKET Bucket, PKIRQL OldIrql)
 {
-    if (!Bucket || !Chunk)
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+
+    if (!KeTryToAcquireSpinLockAtDpcLevel(&Bucket->Lock))
     {
-        return STATUS_INVALID_PARAMETER;
+        LONG64 start = KeQueryPerformanceCounter(NULL).QuadPart;
+        KeAcquireSpinLockAtDpcLevel(&Bucket->Lock);
+        Bucket->LockContentions++;
+        Bucket->LockSpinTicks += KeQueryPerformanceCounter(NULL).QuadPart - start;
     }
 
-    *Chunk = NULL;
+    Bucket->LockAcquisitions++;
+    Bucket->LockHoldStart = KeQueryPerformanceCounter(NULL).QuadPart;
+}
 
-    if (Bucket->ChunkCount >= Bucket->MaxChunks)
+FORCEINLINE VOID TempLockBucket(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, PKIRQL OldIrql)
+{
+    if (MemoryManager->LockProfiling)
     {
-        // Need to evict oldest chunk using LRU-like policy
-        InterlockedIncrement64(&Bucket->EvictionCount);
-
-        // Find chunk with lowest generation
-        ULONG64 oldestGeneration = MAXULONG64;
-        ULONG oldestIndex = 0;
+        TempLockBucketProfiled(Bucket, OldIrql);
+    }
+    else
+    {
+        KeAcquireSpinLock(&Bucket->Lock, OldIrql);
+    }
+}
 
-        for (ULONG i = 0; i < Bucket->ChunkCount; i++)
-        {
-            if (Bucket->Chunks[i] &&
-                Bucket->Chunks[i]->Generation < oldestGeneration &&
-                Bucket->Chunks[i]->RefCount == 0)
-            {
-                oldestGeneration = Bucket->Chunks[i]->Generation;
-                oldestIndex = i;
-            }
-        }
+// Profiling may have been switched off while the lock was held; LockHoldStart
+// tells whether this hold was being timed
+FORCEINLINE VOID TempUnlockBucket(PTEMP_BUCKET Bucket, KIRQL OldIrql)
+{
+    if (Bucket->LockHoldStart)
+    {
+        ULONG64 held = (ULONG64)(KeQueryPerformanceCounter(NULL).QuadPart - Bucket->LockHoldStart);
 
-        if (oldestGeneration != MAXULONG64)
+        Bucket->LockHoldTicks += held;
+        if (held > Bucket->LockMaxHoldTicks)
         {
-            // Reuse the oldest chunk
-            *Chunk = Bucket->Chunks[oldestIndex];
-            (*Chunk)->Generation = InterlockedIncrement64(&Bucket->Generation);
-            RtlZeroMemory((*Chunk)->Data, TEMP_CHUNK_SIZE);
-            return STATUS_SUCCESS;
+            Bucket->LockMaxHoldTicks = held;
         }
-
-        // If no chunk can be evicted, allocation fails
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Bucket->LockHoldStart = 0;
     }
 
-    // Allocate new chunk
-    PTEMP_CHUNK newChunk = (PTEMP_CHUNK)ExAllocatePool2(
-        POOL_FLAG_NON_PAGED,
-        sizeof(TEMP_CHUNK),
-        TEMP_CHUNK_TAG);
+    KeReleaseSpinLock(&Bucket->Lock, OldIrql);
+}
 
-    if (!newChunk)
+static ULONG TempCountBits(ULONG Value)
+{
+    ULONG count = 0;
+
+    while (Value)
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Value &= Value - 1;
+        count++;
     }
 
-    // Initialize chunk
-    RtlZeroMemory(newChunk, sizeof(TEMP_CHUNK));
-    newChunk->Generation = InterlockedIncrement64(&Bucket->Generation);
-    newChunk->RefCount = 0;
+    return count;
+}
 
-    // Add to bucket
-    Bucket->Chunks[Bucket->ChunkCount] = newChunk;
-    Bucket->ChunkCount++;
+// UsedMask bits for segments First up to, but not including, End
+FORCEINLINE ULONG TempSegmentBits(ULONG First, ULONG End)
+{
+    return (ULONG)(((1ULL << End) - 1) & ~((1ULL << First) - 1));
+}
 
-    *Chunk = newChunk;
-    return STATUS_SUCCESS;
+// Adds a chunk's UsedMask to the bucket's accounting, or removes it; the caller
+// holds the bucket lock
+static VOID TempAccountChunk(PTEMP_BUCKET Bucket, ULONG UsedMask, BOOLEAN Present)
+{
+    ULONG segments = TempCountBits(UsedMask);
+    ULONG partial = UsedMask != MAXULONG ? 1 : 0;
+
+    if (Present)
+    {
+        Bucket->UsedSegments += segments;
+        Bucket->PartialChunks += partial;
+    }
+    else
+    {
+        Bucket->UsedSegments -= segments;
+        Bucket->PartialChunks -= partial;
+    }
 }
 
-VOID TempReleaseChunk(PTEMP_BUCKET Bucket, PTEMP_CHUNK Chunk)
+static VOID TempSetUsedMask(PTEMP_BUCKET Bucket, PTEMP_CHUNK Chunk, ULONG UsedMask)
 {
-    if (!Bucket || !Chunk)
+    if (Chunk->UsedMask != UsedMask)
     {
-        return;
+        TempAccountChunk(Bucket, Chunk->UsedMask, FALSE);
+        Chunk->UsedMask = UsedMask;
+        TempAccountChunk(Bucket, UsedMask, TRUE);
     }
+}
 
-    InterlockedDecrement(&Chunk->RefCount);
+FORCEINLINE BOOLEAN TempIsImagePending(PTEMP_BUCKET Bucket, ULONG Slot)
+{
+    return Bucket->ImagePending && (Bucket->ImagePending[Slot >> 5] & (1UL << (Slot & 31))) != 0;
 }
 
-NTSTATUS TempHashTableInsert(PTEMP_BUCKET Bucket, ULONG64 Key, ULONG64 ChunkIndex, ULONG64 Offset)
+// The slot no longer waits for the image; the caller holds the bucket lock
+static VOID TempClearImagePending(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot)
 {
-    if (!Bucket || !Bucket->HashTable)
+    if (TempIsImagePending(Bucket, Slot))
     {
-        return STATUS_INVALID_PARAMETER;
+        Bucket->ImagePending[Slot >> 5] &= ~(1UL << (Slot & 31));
+        InterlockedDecrement64(&MemoryManager->ImagePendingChunks);
     }
+}
 
-    // Linear probing for collision resolution
-    ULONG startIndex = (ULONG)(Key % Bucket->HashTableSize);
-    ULONG index = startIndex;
-
-    do
+// Chunk data a chunk is charged to the memory budget for. Every slot sharing data is
+// charged for all of it, so shared data counts once per slot and never less than once.
+FORCEINLINE ULONG TempChunkCharge(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_CHUNK Chunk)
+{
+    if (Chunk->State == TEMP_CHUNK_RESIDENT || Chunk->State == TEMP_CHUNK_SHARED)
     {
-        if (Bucket->HashTable[index].Key == 0 || Bucket->HashTable[index].Key == Key)
-        {
-            // Found empty slot or updating existing entry
-            Bucket->HashTable[index].Key = Key;
-            Bucket->HashTable[index].ChunkIndex = ChunkIndex;
-            Bucket->HashTable[index].Offset = Offset;
-            return STATUS_SUCCESS;
-        }
+        return MemoryManager->ChunkSize;
+    }
+
+    return Chunk->State == TEMP_CHUNK_COMPRESSED ? Chunk->StoredLength : 0;
+}
 
-        index = (index + 1) % Bucket->HashTableSize;
-    } while (index != startIndex);
+// Change in a manager's charge past its minimum when the charge moves from Old to New.
+// Every change of ChargedBytes applies its own delta, so the pool's Burst stays the
+// exact sum without a lock.
+FORCEINLINE LONG64 TempBurstDelta(ULONG64 Minimum, LONG64 Old, LONG64 New)
+{
+    LONG64 minimum = (LONG64)Minimum;
 
-    // Hash table is full
-    return STATUS_INSUFFICIENT_RESOURCES;
+    return (New > minimum ? New - minimum : 0) - (Old > minimum ? Old - minimum : 0);
 }
 
-BOOLEAN TempHashTableLookup(PTEMP_BUCKET Bucket, ULONG64 Key, PULONG64 ChunkIndex, PULONG64 Offset)
+// Gives chunk data back to the budget. Any IRQL.
+static VOID TempUnchargeMemory(PTEMP_MEMORY_MANAGER MemoryManager, ULONG Bytes)
 {
-    if (!Bucket || !Bucket->HashTable || !ChunkIndex || !Offset)
+    PTEMP_MEMORY_POOL pool = MemoryManager->Pool;
+
+    if (Bytes == 0)
     {
-        return FALSE;
+        return;
     }
 
-    // Linear probing for lookup
-    ULONG startIndex = (ULONG)(Key % Bucket->HashTableSize);
-    ULONG index = startIndex;
+    LONG64 charged = InterlockedAdd64(&MemoryManager->ChargedBytes, -(LONG64)Bytes);
 
-    do
+    if (pool)
     {
-        if (Bucket->HashTable[index].Key == Key)
-        {
-            *ChunkIndex = Bucket->HashTable[index].ChunkIndex;
-            *Offset = Bucket->HashTable[index].Offset;
-            return TRUE;
-        }
+        InterlockedAdd64(&pool->Charged, -(LONG64)Bytes);
 
-        if (Bucket->HashTable[index].Key == 0)
+        LONG64 burst = TempBurstDelta(MemoryManager->BudgetMinimum, charged + Bytes, charged);
+        if (burst)
         {
-            // Empty slot means key not found
-            return FALSE;
+            InterlockedAdd64(&pool->Burst, burst);
         }
-
-        index = (index + 1) % Bucket->HashTableSize;
-    } while (index != startIndex);
-
-    return FALSE;
+    }
 }
 
-NTSTATUS TempInitializeMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 MaxSize)
+// Charges chunk data about to be allocated. The charge is taken first and rolled back
+// if it went past the manager's maximum, or past its minimum into a pool with no room
+// left. Forced charges always succeed: they bring back data the disk already holds.
+// Any IRQL.
+static NTSTATUS TempChargeMemory(PTEMP_MEMORY_MANAGER MemoryManager, ULONG Bytes, BOOLEAN Force)
 {
-    NTSTATUS status = STATUS_SUCCESS;
+    PTEMP_MEMORY_POOL pool = MemoryManager->Pool;
+    LONG64 maximum = (LONG64)MemoryManager->BudgetMaximum;
+    LONG64 charged = InterlockedAdd64(&MemoryManager->ChargedBytes, (LONG64)Bytes);
+    BOOLEAN denied = !Force && maximum && charged > maximum;
 
-    if (!MemoryManager || MaxSize == 0)
+    if (pool)
     {
-        return STATUS_INVALID_PARAMETER;
-    }
+        InterlockedAdd64(&pool->Charged, (LONG64)Bytes);
 
-    // Initialize memory manager
-    RtlZeroMemory(MemoryManager, sizeof(TEMP_MEMORY_MANAGER));
-    MemoryManager->MaxSize = MaxSize;
+        // Only the part past the manager's minimum competes for the pool's room
+        LONG64 burst = TempBurstDelta(MemoryManager->BudgetMinimum, charged - Bytes, charged);
+        if (burst)
+        {
+            LONG64 total = InterlockedAdd64(&pool->Burst, burst);
+            LONG64 limit = pool->Limit;
 
-    // Calculate max chunks per bucket
-    ULONG maxChunksPerBucket = (ULONG)((MaxSize / TEMP_BUCKET_COUNT) / sizeof(TEMP_CHUNK));
-    if (maxChunksPerBucket < 1)
-    {
-        maxChunksPerBucket = 1;
+            if (!Force && limit && total > limit - pool->Guaranteed)
+            {
+                denied = TRUE;
+            }
+        }
     }
 
-    // Initialize all buckets
-    for (ULONG i = 0; i < TEMP_BUCKET_COUNT; i++)
+    if (denied)
     {
-        status = TempInitializeBucket(&MemoryManager->Buckets[i], maxChunksPerBucket);
-        if (!NT_SUCCESS(status))
+        TempUnchargeMemory(MemoryManager, Bytes);
+        InterlockedIncrement64(&MemoryManager->BudgetDenials);
+        if (pool)
         {
-            // Cleanup already initialized buckets
-            for (ULONG j = 0; j < i; j++)
-            {
-                TempCleanupBucket(&MemoryManager->Buckets[j]);
-            }
-            return status;
+            InterlockedIncrement64(&pool->Denials);
         }
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
-VOID TempCleanupMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager)
+// Whether Bytes more chunk data keep the manager within its maximum and the pool's
+// burst use within Percent of the room it has
+static BOOLEAN TempBudgetHasRoom(PTEMP_MEMORY_MANAGER MemoryManager, ULONG Bytes, ULONG Percent)
 {
-    if (!MemoryManager)
+    PTEMP_MEMORY_POOL pool = MemoryManager->Pool;
+    LONG64 charged = MemoryManager->ChargedBytes + (LONG64)Bytes;
+
+    if (MemoryManager->BudgetMaximum && charged > (LONG64)MemoryManager->BudgetMaximum)
     {
-        return;
+        return FALSE;
     }
 
-    // Cleanup all buckets
-    for (ULONG i = 0; i < TEMP_BUCKET_COUNT; i++)
+    if (!pool || !pool->Limit || charged <= (LONG64)MemoryManager->BudgetMinimum)
     {
-        TempCleanupBucket(&MemoryManager->Buckets[i]);
+        return TRUE;
     }
 
-    RtlZeroMemory(MemoryManager, sizeof(TEMP_MEMORY_MANAGER));
+    LONG64 room = pool->Limit - pool->Guaranteed;
+
+    return pool->Burst + (LONG64)Bytes <= room / 100 * Percent;
 }
 
-NTSTATUS TempReadSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG SectorCount, PVOID Buffer, ULONG SectorSize)
+// Backs an unmapped slot with a zeroed chunk; the caller holds the bucket lock.
+// Every slot is reserved up front, so a bucket never has to evict to make room.
+NTSTATUS TempAllocateChunk(PTEMP_BUCKET Bucket, ULONG ChunkSize, ULONG Slot, PTEMP_CHUNK *Chunk)
 {
-    if (!MemoryManager || !Buffer || SectorCount == 0 || SectorSize == 0)
+    if (!Bucket || !Chunk || Slot >= Bucket->MaxChunks)
     {
         return STATUS_INVALID_PARAMETER;
     }
 
-    InterlockedIncrement64(&MemoryManager->TotalReads);
-
-    PUCHAR bufferPtr = (PUCHAR)Buffer;
-    NTSTATUS status = STATUS_SUCCESS;
+    // Allocate new chunk; ExAllocatePool2 hands back zeroed memory
+    PTEMP_CHUNK newChunk = (PTEMP_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(TEMP_CHUNK, Data) + ChunkSize,
+        TEMP_CHUNK_TAG);
 
-    for (ULONG i = 0; i < SectorCount; i++)
+    if (!newChunk)
     {
-        ULONG64 sectorAddress = StartSector + i;
-        ULONG64 hash = TempHashFunction(sectorAddress);
-        ULONG bucketIndex = TempGetBucketIndex(hash);
-        PTEMP_BUCKET bucket = &MemoryManager->Buckets[bucketIndex];
+        *Chunk = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&bucket->Lock, &oldIrql);
+    // Initialize chunk
+    newChunk->Generation = ++Bucket->Generation;
+    newChunk->RefCount = 0;
 
-        ULONG64 chunkIndex, offset;
-        if (TempHashTableLookup(bucket, hash, &chunkIndex, &offset))
-        {
-            // Cache hit
-            InterlockedIncrement64(&bucket->HitCount);
-            InterlockedIncrement64(&MemoryManager->TotalHits);
+    Bucket->Chunks[Slot] = newChunk;
+    Bucket->ChunkCount++;
+    TempAccountChunk(Bucket, 0, TRUE);
 
-            if (chunkIndex < bucket->ChunkCount && bucket->Chunks[chunkIndex])
-            {
-                PTEMP_CHUNK chunk = bucket->Chunks[chunkIndex];
-                InterlockedIncrement(&chunk->RefCount);
+    *Chunk = newChunk;
+    return STATUS_SUCCESS;
+}
 
-                // Update generation for LRU
-                chunk->Generation = InterlockedIncrement64(&bucket->Generation);
+VOID TempReleaseChunk(PTEMP_BUCKET Bucket, PTEMP_CHUNK Chunk)
+{
+    if (!Bucket || !Chunk)
+    {
+        return;
+    }
 
-                // Copy data
-                if (offset + SectorSize <= TEMP_CHUNK_SIZE)
-                {
-                    RtlCopyMemory(bufferPtr + (i * SectorSize),
-                                  chunk->Data + offset,
-                                  SectorSize);
-                }
-                else
-                {
-                    // Data spans multiple chunks or is invalid
-                    RtlZeroMemory(bufferPtr + (i * SectorSize), SectorSize);
-                }
+    InterlockedDecrement(&Chunk->RefCount);
+}
 
-                TempReleaseChunk(bucket, chunk);
-            }
-            else
-            {
-                // Invalid chunk index, treat as miss
-                InterlockedIncrement64(&bucket->MissCount);
-                InterlockedIncrement64(&MemoryManager->TotalMisses);
-                RtlZeroMemory(bufferPtr + (i * SectorSize), SectorSize);
-            }
+// Returns a slot's chunk to the pool whatever its state; the caller holds the bucket
+// lock. A slot still waiting for the image is dropped too, so it reads as zeros.
+static VOID TempFreeChunk(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot)
+{
+    PTEMP_CHUNK chunk = Bucket->Chunks[Slot];
+
+    TempClearImagePending(MemoryManager, Bucket, Slot);
+
+    if (chunk)
+    {
+        if (chunk->State == TEMP_CHUNK_COMPRESSED)
+        {
+            InterlockedDecrement64(&MemoryManager->CompressedChunks);
+            InterlockedAdd64(&MemoryManager->CompressedBytes, -(LONG64)chunk->StoredLength);
         }
-        else
+        else if (chunk->State == TEMP_CHUNK_SPILLED)
         {
-            // Cache miss - return zeros (uninitialized data)
-            InterlockedIncrement64(&bucket->MissCount);
-            InterlockedIncrement64(&MemoryManager->TotalMisses);
-            RtlZeroMemory(bufferPtr + (i * SectorSize), SectorSize);
+            InterlockedDecrement64(&MemoryManager->SpilledChunks);
+        }
+        else if (chunk->State == TEMP_CHUNK_SHARED)
+        {
+            InterlockedDecrement64(&MemoryManager->SharedChunks);
         }
 
-        KeReleaseSpinLock(&bucket->Lock, oldIrql);
+        TempAccountChunk(Bucket, chunk->UsedMask, FALSE);
+        TempUnchargeMemory(MemoryManager, TempChunkCharge(MemoryManager, chunk));
+        Bucket->Chunks[Slot] = NULL;
+        Bucket->ChunkCount--;
+        TempDeleteChunk(chunk);
     }
-
-    return status;
 }
 
-NTSTATUS TempWriteSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG SectorCount, PVOID Buffer, ULONG SectorSize)
+// The chunk in a slot, or NULL. A chunk the disk was formatted over since it was
+// last written is freed here, so it reads back as zeros; the caller holds the
+// bucket lock.
+static PTEMP_CHUNK TempSlotChunk(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot)
 {
-    if (!MemoryManager || !Buffer || SectorCount == 0 || SectorSize == 0)
+    PTEMP_CHUNK chunk = Bucket->Chunks[Slot];
+
+    if (chunk && chunk->Generation <= Bucket->FormatMark)
     {
-        return STATUS_INVALID_PARAMETER;
+        TempFreeChunk(MemoryManager, Bucket, Slot);
+        chunk = NULL;
     }
 
-    InterlockedIncrement64(&MemoryManager->TotalWrites);
+    return chunk;
+}
 
-    PUCHAR bufferPtr = (PUCHAR)Buffer;
-    NTSTATUS status = STATUS_SUCCESS;
+// Swaps a compressed or spilled chunk for a resident one that inherits its age;
+// the caller holds the bucket lock
+static VOID TempReplaceChunk(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot, PTEMP_CHUNK Resident)
+{
+    PTEMP_CHUNK old = Bucket->Chunks[Slot];
 
-    for (ULONG i = 0; i < SectorCount; i++)
-    {
-        ULONG64 sectorAddress = StartSector + i;
-        ULONG64 hash = TempHashFunction(sectorAddress);
-        ULONG bucketIndex = TempGetBucketIndex(hash);
-        PTEMP_BUCKET bucket = &MemoryManager->Buckets[bucketIndex];
+    Resident->Generation = old->Generation;
+    Resident->RefCount = 0;
+    Resident->State = TEMP_CHUNK_RESIDENT;
+    Resident->Reserved = 0;
+    Resident->StoredLength = 0;
+    Resident->UsedMask = old->UsedMask;
 
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&bucket->Lock, &oldIrql);
+    TempFreeChunk(MemoryManager, Bucket, Slot);
+    Bucket->Chunks[Slot] = Resident;
+    Bucket->ChunkCount++;
+    TempAccountChunk(Bucket, Resident->UsedMask, TRUE);
+}
 
-        ULONG64 chunkIndex, offset;
-        PTEMP_CHUNK chunk = NULL;
+// Maps a chunk number to the bucket that owns it and the slot inside that bucket.
+// The disk is cut into stripes of consecutive chunks; each stripe belongs to one
+// bucket, so a sequential transfer takes one lock per stripe instead of one per
+// chunk. Stripes are dealt out in groups of BucketCount: within a group every
+// bucket receives exactly one stripe, rotated by a hash of the group number so
+// that fixed strides do not keep landing on the same bucket. Each bucket therefore
+// holds the same number of stripes and its slots can be indexed directly.
+FORCEINLINE PTEMP_BUCKET TempMapChunk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 ChunkNumber, PULONG Slot)
+{
+    ULONG64 stripe = ChunkNumber >> MemoryManager->StripeChunkShift;
+    ULONG64 group = stripe >> MemoryManager->BucketShift;
+    ULONG bucketIndex = (ULONG)(stripe + TempHashFunction(group)) & (MemoryManager->BucketCount - 1);
+    ULONG chunkInStripe = (ULONG)ChunkNumber & ((1UL << MemoryManager->StripeChunkShift) - 1);
 
-        if (TempHashTableLookup(bucket, hash, &chunkIndex, &offset))
-        {
-            // Update existing chunk
-            if (chunkIndex < bucket->ChunkCount && bucket->Chunks[chunkIndex])
-            {
-                chunk = bucket->Chunks[chunkIndex];
-                InterlockedIncrement(&chunk->RefCount);
-            }
-        }
-        else
-        {
-            // Allocate new chunk
-            NTSTATUS allocStatus = TempAllocateChunk(bucket, &chunk);
-            if (NT_SUCCESS(allocStatus) && chunk)
-            {
-                // Find a suitable offset in the chunk
-                offset = 0; // For simplicity, use start of chunk
+    *Slot = (ULONG)(group << MemoryManager->StripeChunkShift) | chunkInStripe;
+    return &MemoryManager->Buckets[bucketIndex];
+}
 
-                // Add to hash table
-                for (ULONG j = 0; j < bucket->ChunkCount; j++)
-                {
-                    if (bucket->Chunks[j] == chunk)
-                    {
-                        TempHashTableInsert(bucket, hash, j, offset);
-                        break;
-                    }
-                }
+// The inverse of TempMapChunk at stripe granularity: the stripe a bucket received
+// from a group
+FORCEINLINE ULONG64 TempBucketStripe(PTEMP_MEMORY_MANAGER MemoryManager, ULONG BucketIndex, ULONG64 Group)
+{
+    ULONG64 rotation = TempHashFunction(Group);
 
-                InterlockedIncrement(&chunk->RefCount);
-            }
-        }
+    return (Group << MemoryManager->BucketShift) |
+           ((BucketIndex - rotation) & (MemoryManager->BucketCount - 1));
+}
 
-        if (chunk)
-        {
-            // Update generation for LRU
-            chunk->Generation = InterlockedIncrement64(&bucket->Generation);
+// Makes the chunk in a slot resident, inflating a compressed chunk in place; the
+// caller holds the bucket lock. With Overwrite set the old contents are about to be
+// replaced wholesale and are not brought back. Spilled chunks and chunks still in
+// the image cannot be read at raised IRQL, so STATUS_PENDING tells the caller to
+// drop the lock and call TempFaultInChunk. Shared chunks are left shared: their
+// data is in memory, and writers call TempUnshareChunk before changing it.
+static NTSTATUS TempResolveChunk(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot, BOOLEAN Overwrite, PTEMP_CHUNK *Chunk)
+{
+    PTEMP_CHUNK chunk = TempSlotChunk(MemoryManager, Bucket, Slot);
 
-            // Copy data
-            if (offset + SectorSize <= TEMP_CHUNK_SIZE)
+    *Chunk = chunk;
+
+    if (!chunk)
+    {
+        if (TempIsImagePending(Bucket, Slot))
+        {
+            if (!Overwrite)
             {
-                RtlCopyMemory(chunk->Data + offset,
-                              bufferPtr + (i * SectorSize),
-                              SectorSize);
+                return STATUS_PENDING;
             }
 
-            TempReleaseChunk(bucket, chunk);
-        }
-        else
-        {
-            status = STATUS_INSUFFICIENT_RESOURCES;
+            TempClearImagePending(MemoryManager, Bucket, Slot);
         }
 
-        KeReleaseSpinLock(&bucket->Lock, oldIrql);
-
-        if (!NT_SUCCESS(status))
-        {
-            break;
-        }
+        return STATUS_SUCCESS;
     }
 
-    return status;
-}
-
-NTSTATUS TempFormatDisk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 DiskSize, ULONG SectorSize)
-{
-    if (!MemoryManager || DiskSize == 0 || SectorSize == 0)
+    if (chunk->State == TEMP_CHUNK_RESIDENT || chunk->State == TEMP_CHUNK_SHARED)
     {
-        return STATUS_INVALID_PARAMETER;
+        return STATUS_SUCCESS;
     }
 
-    // Clear all buckets to simulate disk format
-    for (ULONG i = 0; i < TEMP_BUCKET_COUNT; i++)
+    if (chunk->State == TEMP_CHUNK_SPILLED && !Overwrite)
     {
-        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+        return STATUS_PENDING;
+    }
 
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&bucket->Lock, &oldIrql);
+    // The data is the disk's already, so the budget cannot refuse it
+    TempChargeMemory(MemoryManager, MemoryManager->ChunkSize, TRUE);
 
-        // Clear hash table
-        for (ULONG j = 0; j < bucket->HashTableSize; j++)
-        {
-            bucket->HashTable[j].Key = 0;
-            bucket->HashTable[j].ChunkIndex = MAXULONG64;
-            bucket->HashTable[j].Offset = 0;
+    PTEMP_CHUNK resident = (PTEMP_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED,
+        FIELD_OFFSET(TEMP_CHUNK, Data) + MemoryManager->ChunkSize,
+        TEMP_CHUNK_TAG);
+
+    if (!resident)
+    {
+        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+        InterlockedIncrement64(&MemoryManager->AllocationFailures);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!Overwrite &&
+        TempDecompressBuffer(chunk->Data, chunk->StoredLength, resident->Data, MemoryManager->ChunkSize) != MemoryManager->ChunkSize)
+    {
+        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+        ExFreePool(resident);
+        return STATUS_DATA_ERROR;
+    }
+
+    TempReplaceChunk(MemoryManager, Bucket, Slot, resident);
+
+    *Chunk = resident;
+    return STATUS_SUCCESS;
+}
+
+// Gives a slot sharing its data a resident chunk of its own before the data is
+// changed; the caller holds the bucket lock. The last slot still sharing the data
+// takes it over without a copy. With Overwrite set the old contents are about to
+// be replaced wholesale and are not copied.
+static NTSTATUS TempUnshareChunk(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot, BOOLEAN Overwrite, PTEMP_CHUNK *Chunk)
+{
+    PTEMP_CHUNK stub = Bucket->Chunks[Slot];
+    PTEMP_CHUNK shared = TempSharedData(stub);
+
+    // References are only taken through a slot holding one, so with this slot's lock
+    // held a count of one cannot grow. The stub is then alone in its ring and owns the
+    // data, which stays counted as resident.
+    if (shared->RefCount == 1)
+    {
+        shared->Generation = stub->Generation;
+        shared->RefCount = 0;
+        shared->UsedMask = stub->UsedMask;
+        Bucket->Chunks[Slot] = shared;
+        InterlockedDecrement64(&MemoryManager->SharedChunks);
+        InterlockedDecrement64(&MemoryManager->OwnedSharedChunks);
+        ExFreePool(stub);
+
+        *Chunk = shared;
+        return STATUS_SUCCESS;
+    }
+
+    // The stub is already charged for a whole chunk; the copy takes its place
+    TempChargeMemory(MemoryManager, MemoryManager->ChunkSize, TRUE);
+
+    PTEMP_CHUNK resident = (PTEMP_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED,
+        FIELD_OFFSET(TEMP_CHUNK, Data) + MemoryManager->ChunkSize,
+        TEMP_CHUNK_TAG);
+
+    if (!resident)
+    {
+        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+        InterlockedIncrement64(&MemoryManager->AllocationFailures);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!Overwrite)
+    {
+        RtlCopyMemory(resident->Data, shared->Data, MemoryManager->ChunkSize);
+    }
+
+    TempReplaceChunk(MemoryManager, Bucket, Slot, resident);
+
+    *Chunk = resident;
+    return STATUS_SUCCESS;
+}
+
+static BOOLEAN TempIsZeroChunk(const UCHAR *Data, ULONG Length)
+{
+    const ULONG64 *words = (const ULONG64 *)Data;
+
+    for (ULONG i = 0; i < Length / sizeof(ULONG64); i++)
+    {
+        if (words[i] != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Reads a spilled chunk back from the spill file, or a chunk not loaded yet from the
+// image. Runs without the bucket lock at PASSIVE_LEVEL or APC_LEVEL; if the slot
+// changed meanwhile the copy is discarded. Demand is set when a request waits for it.
+static NTSTATUS TempFaultInChunk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 ChunkNumber, BOOLEAN Demand)
+{
+    ULONG slot;
+    PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, ChunkNumber, &slot);
+    PTEMP_SPILL_ROUTINE routine = MemoryManager->SpillRoutine;
+    PVOID context = MemoryManager->SpillContext;
+    KIRQL oldIrql;
+
+    // The image source is only dropped once no slot waits for it, so it is safe to
+    // take while the slot's bit is seen under the lock
+    TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+    PTEMP_CHUNK chunk = TempSlotChunk(MemoryManager, bucket, slot);
+    BOOLEAN fromImage = TempIsImagePending(bucket, slot);
+    BOOLEAN spilled = chunk && chunk->State == TEMP_CHUNK_SPILLED;
+
+    if (fromImage)
+    {
+        routine = MemoryManager->ImageRoutine;
+        context = MemoryManager->ImageContext;
+    }
+
+    TempUnlockBucket(bucket, oldIrql);
+
+    // Another request brought the chunk in first
+    if (!fromImage && !spilled)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (!routine)
+    {
+        return STATUS_DATA_ERROR;
+    }
+
+    // A waiting request always gets its data; prefetch and restore stay within budget
+    NTSTATUS status = TempChargeMemory(MemoryManager, MemoryManager->ChunkSize, Demand);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    PTEMP_CHUNK resident = (PTEMP_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED,
+        FIELD_OFFSET(TEMP_CHUNK, Data) + MemoryManager->ChunkSize,
+        TEMP_CHUNK_TAG);
+
+    if (!resident)
+    {
+        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+        InterlockedIncrement64(&MemoryManager->AllocationFailures);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ULONG64 offset = ChunkNumber << MemoryManager->ChunkShift;
+    BOOLEAN empty = FALSE;
+    status = routine(context, FALSE, offset, resident->Data, MemoryManager->ChunkSize);
+
+    if (NT_SUCCESS(status) && fromImage)
+    {
+        // Images hold plaintext, and chunks of zeros need no memory at all
+        empty = TempIsZeroChunk(resident->Data, MemoryManager->ChunkSize);
+        if (!empty && MemoryManager->Cipher)
+        {
+            TempXtsEncrypt(MemoryManager->Cipher, offset / TEMP_XTS_DATA_UNIT, resident->Data, resident->Data, MemoryManager->ChunkSize);
+        }
+    }
+
+    TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+    // A format meanwhile dropped both the image bit and the spilled chunk
+    chunk = TempSlotChunk(MemoryManager, bucket, slot);
+
+    if (!NT_SUCCESS(status))
+    {
+        // A failed read does not matter if the chunk was brought in meanwhile
+        if (fromImage ? !TempIsImagePending(bucket, slot) : !(chunk && chunk->State == TEMP_CHUNK_SPILLED))
+        {
+            status = STATUS_SUCCESS;
+        }
+    }
+    else if (fromImage)
+    {
+        if (TempIsImagePending(bucket, slot))
+        {
+            TempClearImagePending(MemoryManager, bucket, slot);
+
+            if (!empty)
+            {
+                resident->Generation = ++bucket->Generation;
+                resident->RefCount = 0;
+                resident->State = TEMP_CHUNK_RESIDENT;
+                resident->Reserved = 0;
+                resident->StoredLength = 0;
+                resident->UsedMask = MAXULONG;
+
+                bucket->Chunks[slot] = resident;
+                bucket->ChunkCount++;
+                TempAccountChunk(bucket, MAXULONG, TRUE);
+                resident = NULL;
+            }
+
+            if (Demand)
+            {
+                InterlockedIncrement64(&MemoryManager->ImageDemandLoads);
+            }
+        }
+    }
+    else if (chunk && chunk->State == TEMP_CHUNK_SPILLED)
+    {
+        TempReplaceChunk(MemoryManager, bucket, slot, resident);
+        resident = NULL;
+    }
+
+    TempUnlockBucket(bucket, oldIrql);
+
+    if (resident)
+    {
+        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+        ExFreePool(resident);
+    }
+
+    return status;
+}
+
+// Largest power of two not above Value
+static ULONG TempRoundDownPowerOfTwo(ULONG64 Value)
+{
+    ULONG result = 1;
+
+    while ((ULONG64)result * 2 <= Value && result < 0x80000000UL)
+    {
+        result *= 2;
+    }
+
+    return result;
+}
+
+ULONG TempLog2(ULONG Value)
+{
+    ULONG shift = 0;
+
+    while ((1UL << (shift + 1)) <= Value && shift < 31)
+    {
+        shift++;
+    }
+
+    return shift;
+}
+
+// Sector counts are converted to byte ranges with a shift. The two sector sizes
+// devices are normally created with resolve to compile-time constants.
+FORCEINLINE ULONG TempSectorShift(ULONG SectorSize)
+{
+    switch (SectorSize)
+    {
+    case 512:
+        return 9;
+    case 4096:
+        return 12;
+    default:
+        return TempLog2(SectorSize);
+    }
+}
+
+VOID TempInitializeMemoryPool(PTEMP_MEMORY_POOL Pool)
+{
+    RtlZeroMemory(Pool, sizeof(TEMP_MEMORY_POOL));
+    KeInitializeSpinLock(&Pool->Lock);
+}
+
+// The minimums already promised stay guaranteed, so the limit cannot go below their
+// sum. A limit below what is charged only stops bursting until reclaim catches up.
+NTSTATUS TempSetMemoryPoolLimit(PTEMP_MEMORY_POOL Pool, ULONG64 Limit)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!Pool || Limit > MAXLONG64)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&Pool->Lock, &oldIrql);
+
+    if (Limit && (LONG64)Limit < Pool->Guaranteed)
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        InterlockedExchange64(&Pool->Limit, (LONG64)Limit);
+    }
+
+    KeReleaseSpinLock(&Pool->Lock, oldIrql);
+
+    return status;
+}
+
+// Reserves Minimum in the pool for a manager nothing has been written to yet
+NTSTATUS TempAttachMemoryPool(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_MEMORY_POOL Pool, ULONG64 Minimum, ULONG64 Maximum)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!MemoryManager || !Pool || MemoryManager->Pool ||
+        Minimum > MAXLONG64 || Maximum > MAXLONG64 || (Maximum && Maximum < Minimum))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&Pool->Lock, &oldIrql);
+
+    if (Pool->Limit && Pool->Guaranteed + (LONG64)Minimum > Pool->Limit)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else
+    {
+        LONG64 charged = MemoryManager->ChargedBytes;
+
+        MemoryManager->BudgetMinimum = Minimum;
+        MemoryManager->BudgetMaximum = Maximum;
+        InterlockedAdd64(&Pool->Guaranteed, (LONG64)Minimum);
+        InterlockedAdd64(&Pool->Charged, charged);
+        InterlockedAdd64(&Pool->Burst, TempBurstDelta(Minimum, 0, charged));
+        MemoryManager->Pool = Pool;
+    }
+
+    KeReleaseSpinLock(&Pool->Lock, oldIrql);
+
+    return status;
+}
+
+// Changes a manager's minimum and maximum. Lowering the maximum below what the manager
+// holds refuses new data until reclaim brings it back under. A charge racing the
+// change may count against the old minimum, which leaves the pool's Burst off by at
+// most that charge.
+NTSTATUS TempSetMemoryBudget(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 Minimum, ULONG64 Maximum)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!MemoryManager || Minimum > MAXLONG64 || Maximum > MAXLONG64 || (Maximum && Maximum < Minimum))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PTEMP_MEMORY_POOL pool = MemoryManager->Pool;
+    if (!pool)
+    {
+        MemoryManager->BudgetMinimum = Minimum;
+        MemoryManager->BudgetMaximum = Maximum;
+        return STATUS_SUCCESS;
+    }
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pool->Lock, &oldIrql);
+
+    LONG64 guaranteed = pool->Guaranteed - (LONG64)MemoryManager->BudgetMinimum + (LONG64)Minimum;
+
+    if (pool->Limit && guaranteed > pool->Limit)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else
+    {
+        LONG64 charged = MemoryManager->ChargedBytes;
+
+        InterlockedAdd64(&pool->Burst, TempBurstDelta(Minimum, 0, charged) - TempBurstDelta(MemoryManager->BudgetMinimum, 0, charged));
+        InterlockedExchange64(&pool->Guaranteed, guaranteed);
+        MemoryManager->BudgetMinimum = Minimum;
+        MemoryManager->BudgetMaximum = Maximum;
+    }
+
+    KeReleaseSpinLock(&pool->Lock, oldIrql);
+
+    return status;
+}
+
+// Releases everything the manager held in its pool, including its minimum
+static VOID TempDetachMemoryPool(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    PTEMP_MEMORY_POOL pool = MemoryManager->Pool;
+
+    if (!pool)
+    {
+        return;
+    }
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pool->Lock, &oldIrql);
+
+    LONG64 charged = MemoryManager->ChargedBytes;
+
+    InterlockedAdd64(&pool->Charged, -charged);
+    InterlockedAdd64(&pool->Burst, -TempBurstDelta(MemoryManager->BudgetMinimum, 0, charged));
+    InterlockedAdd64(&pool->Guaranteed, -(LONG64)MemoryManager->BudgetMinimum);
+    MemoryManager->Pool = NULL;
+
+    KeReleaseSpinLock(&pool->Lock, oldIrql);
+}
+
+// Bytes the managers past their minimums should give back: none while the pool's burst
+// use stays below TEMP_BUDGET_RECLAIM_PERCENT of its room, and enough to get down to
+// TEMP_BUDGET_RESTORE_PERCENT once it does not
+ULONG64 TempQueryPoolShortfall(PTEMP_MEMORY_POOL Pool)
+{
+    LONG64 limit = Pool ? Pool->Limit : 0;
+
+    if (!limit)
+    {
+        return 0;
+    }
+
+    LONG64 room = limit - Pool->Guaranteed;
+    LONG64 burst = Pool->Burst;
+
+    if (burst <= 0 || burst < room / 100 * TEMP_BUDGET_RECLAIM_PERCENT)
+    {
+        return 0;
+    }
+
+    LONG64 target = room > 0 ? room / 100 * TEMP_BUDGET_RESTORE_PERCENT : 0;
+
+    return (ULONG64)(burst - target);
+}
+
+// Bytes a manager holds past its maximum, after the maximum was lowered
+ULONG64 TempQueryBudgetExcess(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    LONG64 charged = MemoryManager->ChargedBytes;
+    LONG64 maximum = (LONG64)MemoryManager->BudgetMaximum;
+
+    return maximum && charged > maximum ? (ULONG64)(charged - maximum) : 0;
+}
+
+NTSTATUS TempInitializeMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 MaxSize, ULONG ChunkSize)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!MemoryManager || MaxSize == 0 ||
+        ChunkSize < TEMP_MIN_CHUNK_SIZE || ChunkSize > TEMP_MAX_CHUNK_SIZE ||
+        (ChunkSize & (ChunkSize - 1)) != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Initialize memory manager
+    RtlZeroMemory(MemoryManager, sizeof(TEMP_MEMORY_MANAGER));
+    MemoryManager->MaxSize = MaxSize;
+    MemoryManager->ChunkSize = ChunkSize;
+    MemoryManager->ChunkShift = TempLog2(ChunkSize);
+
+    // A stripe is never smaller than one chunk
+    MemoryManager->StripeShift = TempLog2(TEMP_STRIPE_SIZE);
+    if (MemoryManager->StripeShift < MemoryManager->ChunkShift)
+    {
+        MemoryManager->StripeShift = MemoryManager->ChunkShift;
+    }
+    MemoryManager->StripeChunkShift = MemoryManager->StripeShift - MemoryManager->ChunkShift;
+    MemoryManager->SegmentShift = MemoryManager->ChunkShift - TempLog2(TEMP_CHUNK_SEGMENTS);
+
+    // Scale the shard count with the processors that can issue I/O, and with the
+    // disk size once a shard would own more than TEMP_STRIPES_PER_BUCKET stripes:
+    // a large disk keeps more of its random I/O on different locks. Small disks
+    // still get the processor count, since a resize can grow them later. The count
+    // is fixed for the device's lifetime because it decides which bucket owns each
+    // stripe; only the buckets' slot arrays change when the device is resized.
+    ULONG64 totalStripes = (MaxSize + (1ULL << MemoryManager->StripeShift) - 1) >> MemoryManager->StripeShift;
+    ULONG64 wantedBuckets = (ULONG64)KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS) * TEMP_BUCKETS_PER_PROCESSOR;
+    if (wantedBuckets < totalStripes / TEMP_STRIPES_PER_BUCKET)
+    {
+        wantedBuckets = totalStripes / TEMP_STRIPES_PER_BUCKET;
+    }
+    ULONG bucketCount = TempRoundDownPowerOfTwo(wantedBuckets);
+    if (bucketCount < wantedBuckets)
+    {
+        bucketCount *= 2;
+    }
+    if (bucketCount > TEMP_MAX_BUCKET_COUNT)
+    {
+        bucketCount = TEMP_MAX_BUCKET_COUNT;
+    }
+
+    MemoryManager->BucketCount = bucketCount;
+    MemoryManager->BucketShift = TempLog2(bucketCount);
+
+    // Every bucket owns one stripe per group, so capacity is exact
+    ULONG64 groups = (totalStripes + bucketCount - 1) >> MemoryManager->BucketShift;
+    ULONG64 chunksPerBucket = groups << MemoryManager->StripeChunkShift;
+    if (chunksPerBucket > MAXULONG)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MemoryManager->Buckets = (PTEMP_BUCKET)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)bucketCount * sizeof(TEMP_BUCKET),
+        TEMP_POOL_TAG);
+
+    if (!MemoryManager->Buckets)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Initialize all buckets
+    for (ULONG i = 0; i < bucketCount; i++)
+    {
+        status = TempInitializeBucket(&MemoryManager->Buckets[i], (ULONG)chunksPerBucket, (ULONG)groups);
+        if (!NT_SUCCESS(status))
+        {
+            // Cleanup already initialized buckets and this one's partial allocations
+            for (ULONG j = 0; j <= i; j++)
+            {
+                TempCleanupBucket(&MemoryManager->Buckets[j]);
+            }
+            ExFreePool(MemoryManager->Buckets);
+            MemoryManager->Buckets = NULL;
+            return status;
+        }
+    }
+
+    return status;
+}
+
+VOID TempCleanupMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    if (!MemoryManager)
+    {
+        return;
+    }
+
+    TempDetachMemoryPool(MemoryManager);
+
+    // Cleanup all buckets
+    if (MemoryManager->Buckets)
+    {
+        for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+        {
+            TempCleanupBucket(&MemoryManager->Buckets[i]);
+        }
+        ExFreePool(MemoryManager->Buckets);
+    }
+
+    if (MemoryManager->ReclaimBuffer)
+    {
+        ExFreePool(MemoryManager->ReclaimBuffer);
+    }
+
+    if (MemoryManager->Cipher)
+    {
+        RtlSecureZeroMemory(MemoryManager->Cipher, sizeof(TEMP_XTS_KEY));
+        ExFreePool(MemoryManager->Cipher);
+    }
+
+    RtlZeroMemory(MemoryManager, sizeof(TEMP_MEMORY_MANAGER));
+}
+
+// Frees the chunks of up to MaxSlots slots of a manager nothing uses any more,
+// resuming where the previous call stopped, and returns TRUE once every slot is
+// empty. No bucket lock is taken, so a large device's memory can be given back in
+// steps at PASSIVE_LEVEL and TempCleanupMemoryManager is left with empty buckets.
+// Each chunk's charge returns to the memory budget as the chunk is freed.
+BOOLEAN TempDrainMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG MaxSlots)
+{
+    if (!MemoryManager || !MemoryManager->Buckets)
+    {
+        return TRUE;
+    }
+
+    // A resize that failed part way leaves some buckets with more slots than others
+    while (MaxSlots > 0)
+    {
+        ULONG index = (ULONG)(MemoryManager->DrainCursor >> 32);
+        ULONG slot = (ULONG)MemoryManager->DrainCursor;
+
+        if (index >= MemoryManager->BucketCount)
+        {
+            break;
+        }
+
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[index];
+
+        if (!bucket->Chunks || slot >= bucket->MaxChunks)
+        {
+            MemoryManager->DrainCursor = (ULONG64)(index + 1) << 32;
+            continue;
+        }
+
+        TempFreeChunk(MemoryManager, bucket, slot);
+        MemoryManager->DrainCursor++;
+        MaxSlots--;
+    }
+
+    return (MemoryManager->DrainCursor >> 32) >= MemoryManager->BucketCount;
+}
+
+// Keeps the chunk data of a memory manager nothing has been written to encrypted
+// under KeyBytes (TEMP_XTS_KEY_SIZE bytes)
+NTSTATUS TempSetEncryption(PTEMP_MEMORY_MANAGER MemoryManager, const UCHAR *KeyBytes)
+{
+    if (!MemoryManager || !KeyBytes || MemoryManager->Cipher)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PTEMP_XTS_KEY key = (PTEMP_XTS_KEY)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(TEMP_XTS_KEY),
+        TEMP_POOL_TAG);
+
+    if (!key)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    TempXtsSetKey(key, KeyBytes);
+    MemoryManager->Cipher = key;
+
+    return STATUS_SUCCESS;
+}
+
+// Sets Count bits from First on
+static VOID TempSetBits(PULONG Bitmap, ULONG First, ULONG Count)
+{
+    while (Count > 0)
+    {
+        ULONG bit = First & 31;
+        ULONG run = 32 - bit < Count ? 32 - bit : Count;
+
+        Bitmap[First >> 5] |= (ULONG)(((1ULL << run) - 1) << bit);
+        First += run;
+        Count -= run;
+    }
+}
+
+// Marks every chunk of a memory manager nothing has been written to as still in
+// the image. ImageRoutine reads a chunk's data from the image at its disk offset
+// and returns zeros past the image's end.
+NTSTATUS TempSetImageSource(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_SPILL_ROUTINE ImageRoutine, PVOID ImageContext)
+{
+    if (!MemoryManager || !MemoryManager->Buckets || !ImageRoutine || MemoryManager->ImageRoutine)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG64 totalChunks = (MemoryManager->MaxSize + MemoryManager->ChunkSize - 1) >> MemoryManager->ChunkShift;
+    ULONG stripeChunks = 1UL << MemoryManager->StripeChunkShift;
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+        PULONG bitmap = (PULONG)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (SIZE_T)((bucket->MaxChunks + 31) / 32) * sizeof(ULONG),
+            TEMP_POOL_TAG);
+
+        if (!bitmap)
+        {
+            for (ULONG j = 0; j < i; j++)
+            {
+                ExFreePool(MemoryManager->Buckets[j].ImagePending);
+                MemoryManager->Buckets[j].ImagePending = NULL;
+            }
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        // Only slots of chunks on the disk wait, so the count can reach zero
+        for (ULONG group = 0; group < bucket->MaxChunks >> MemoryManager->StripeChunkShift; group++)
+        {
+            ULONG64 firstChunk = TempBucketStripe(MemoryManager, i, group) << MemoryManager->StripeChunkShift;
+
+            if (firstChunk < totalChunks)
+            {
+                ULONG count = totalChunks - firstChunk < stripeChunks ? (ULONG)(totalChunks - firstChunk) : stripeChunks;
+                TempSetBits(bitmap, group << MemoryManager->StripeChunkShift, count);
+            }
+        }
+
+        bucket->ImagePending = bitmap;
+    }
+
+    MemoryManager->ImagePendingChunks = (LONG64)totalChunks;
+    MemoryManager->ImageContext = ImageContext;
+    MemoryManager->ImageRoutine = ImageRoutine;
+
+    return STATUS_SUCCESS;
+}
+
+// Forgets the bucket's chunks still in the image; the caller holds the bucket lock
+static VOID TempDropImagePending(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket)
+{
+    if (!Bucket->ImagePending)
+    {
+        return;
+    }
+
+    ULONG words = (Bucket->MaxChunks + 31) / 32;
+    LONG64 dropped = 0;
+
+    for (ULONG i = 0; i < words; i++)
+    {
+        dropped += TempCountBits(Bucket->ImagePending[i]);
+        Bucket->ImagePending[i] = 0;
+    }
+
+    InterlockedAdd64(&MemoryManager->ImagePendingChunks, -dropped);
+}
+
+// Loads one chunk from the image unless a request loaded, overwrote or trimmed it
+// first; the prefetcher's counterpart of a fault. PASSIVE_LEVEL.
+NTSTATUS TempLoadImageChunk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 ChunkNumber)
+{
+    if (!MemoryManager || ChunkNumber >= (MemoryManager->MaxSize + MemoryManager->ChunkSize - 1) >> MemoryManager->ChunkShift)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return TempFaultInChunk(MemoryManager, ChunkNumber, FALSE);
+}
+
+// Detaches the image. Chunks that were still in it read as zeros from then on, so
+// callers normally wait until ImagePendingChunks reaches zero. Faults that already
+// took the routine may still call it.
+VOID TempEndImageSource(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    if (!MemoryManager || !MemoryManager->ImageRoutine)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        PULONG bitmap = bucket->ImagePending;
+        TempDropImagePending(MemoryManager, bucket);
+        bucket->ImagePending = NULL;
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        if (bitmap)
+        {
+            ExFreePool(bitmap);
+        }
+    }
+
+    MemoryManager->ImageRoutine = NULL;
+    MemoryManager->ImageContext = NULL;
+}
+
+// Stores encrypted zeros over Length bytes of an encrypted chunk whose data starts
+// at disk offset ChunkBase
+static VOID TempSealRange(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_CHUNK Chunk, ULONG64 ChunkBase, ULONG ChunkOffset, ULONG Length)
+{
+    PUCHAR data = Chunk->Data + ChunkOffset;
+
+    RtlZeroMemory(data, Length);
+    TempXtsEncrypt(MemoryManager->Cipher, (ChunkBase + ChunkOffset) / TEMP_XTS_DATA_UNIT, data, data, Length);
+}
+
+// Decrypts Span bytes at disk offset Offset, ChunkOffset bytes into an encrypted
+// chunk. Segments with a clear UsedMask bit hold no ciphertext and read as zeros.
+static VOID TempDecryptSpan(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_CHUNK Chunk, ULONG64 Offset, ULONG ChunkOffset, ULONG Span, PUCHAR Buffer)
+{
+    ULONG shift = MemoryManager->SegmentShift;
+    ULONG spanEnd = ChunkOffset + Span;
+
+    while (ChunkOffset < spanEnd)
+    {
+        // Take the run of segments that share the first one's state
+        ULONG used = (Chunk->UsedMask >> (ChunkOffset >> shift)) & 1;
+        ULONG runEnd = ((ChunkOffset >> shift) + 1) << shift;
+
+        while (runEnd < spanEnd && ((Chunk->UsedMask >> (runEnd >> shift)) & 1) == used)
+        {
+            runEnd += 1UL << shift;
+        }
+
+        ULONG length = (runEnd < spanEnd ? runEnd : spanEnd) - ChunkOffset;
+
+        if (used)
+        {
+            TempXtsDecrypt(MemoryManager->Cipher, Offset / TEMP_XTS_DATA_UNIT, Chunk->Data + ChunkOffset, Buffer, length);
+        }
+        else
+        {
+            RtlZeroMemory(Buffer, length);
+        }
+
+        Buffer += length;
+        Offset += length;
+        ChunkOffset += length;
+    }
+}
+
+// Encrypts Span bytes of Buffer into an encrypted chunk. The part of a segment the
+// span does not cover is sealed as encrypted zeros if the segment held no data yet,
+// so the whole segment decrypts once its UsedMask bit is set.
+static VOID TempEncryptSpan(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_CHUNK Chunk, ULONG64 Offset, ULONG ChunkOffset, ULONG Span, const UCHAR *Buffer)
+{
+    ULONG shift = MemoryManager->SegmentShift;
+    ULONG64 chunkBase = Offset - ChunkOffset;
+    ULONG spanEnd = ChunkOffset + Span;
+    ULONG first = ChunkOffset >> shift;
+    ULONG last = (spanEnd - 1) >> shift;
+
+    if ((first << shift) < ChunkOffset && !(Chunk->UsedMask & (1UL << first)))
+    {
+        TempSealRange(MemoryManager, Chunk, chunkBase, first << shift, ChunkOffset - (first << shift));
+    }
+
+    if (spanEnd < ((last + 1) << shift) && !(Chunk->UsedMask & (1UL << last)))
+    {
+        TempSealRange(MemoryManager, Chunk, chunkBase, spanEnd, ((last + 1) << shift) - spanEnd);
+    }
+
+    TempXtsEncrypt(MemoryManager->Cipher, Offset / TEMP_XTS_DATA_UNIT, Buffer, Chunk->Data + ChunkOffset, Span);
+}
+
+NTSTATUS TempReadSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG SectorCount, PVOID Buffer, ULONG SectorSize)
+{
+    if (!MemoryManager || !Buffer || SectorCount == 0 || SectorSize == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InterlockedIncrement64(&MemoryManager->TotalReads);
+
+    ULONG sectorShift = TempSectorShift(SectorSize);
+    ULONG64 offset = StartSector << sectorShift;
+    ULONG64 remaining = (ULONG64)SectorCount << sectorShift;
+    ULONG chunkMask = MemoryManager->ChunkSize - 1;
+    PUCHAR bufferPtr = (PUCHAR)Buffer;
+    ULONG64 heatedStripeEnd = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // Walk the request one stripe at a time, holding the owning bucket's lock
+    // across every chunk span that falls inside the stripe
+    while (remaining > 0 && NT_SUCCESS(status))
+    {
+        ULONG slot;
+        PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, offset >> MemoryManager->ChunkShift, &slot);
+        ULONG64 stripeEnd = ((offset >> MemoryManager->StripeShift) + 1) << MemoryManager->StripeShift;
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        // A stripe revisited after a fault-in was already counted
+        if (stripeEnd != heatedStripeEnd)
+        {
+            bucket->Heat[slot >> MemoryManager->StripeChunkShift].Reads++;
+            heatedStripeEnd = stripeEnd;
+        }
+
+        do
+        {
+            ULONG chunkOffset = (ULONG)offset & chunkMask;
+            ULONG span = MemoryManager->ChunkSize - chunkOffset;
+            if (span > remaining)
+            {
+                span = (ULONG)remaining;
+            }
+
+            PTEMP_CHUNK chunk;
+            status = TempResolveChunk(MemoryManager, bucket, slot, FALSE, &chunk);
+            if (status != STATUS_SUCCESS)
+            {
+                break;
+            }
+
+            if (chunk)
+            {
+                // Cache hit
+                bucket->HitCount++;
+                InterlockedIncrement(&chunk->RefCount);
+
+                // Update generation for LRU
+                chunk->Generation = ++bucket->Generation;
+
+                if (MemoryManager->Cipher)
+                {
+                    TempDecryptSpan(MemoryManager, chunk, offset, chunkOffset, span, bufferPtr);
+                }
+                else
+                {
+                    RtlCopyMemory(bufferPtr, TempChunkData(chunk) + chunkOffset, span);
+                }
+
+                TempReleaseChunk(bucket, chunk);
+            }
+            else
+            {
+                // Cache miss - return zeros (never written)
+                bucket->MissCount++;
+                RtlZeroMemory(bufferPtr, span);
+            }
+
+            bufferPtr += span;
+            offset += span;
+            remaining -= span;
+            slot++;
+        } while (remaining > 0 && offset < stripeEnd);
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        if (status == STATUS_PENDING)
+        {
+            status = TempFaultInChunk(MemoryManager, offset >> MemoryManager->ChunkShift, TRUE);
+        }
+    }
+
+    return status;
+}
+
+NTSTATUS TempWriteSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG SectorCount, PVOID Buffer, ULONG SectorSize)
+{
+    if (!MemoryManager || !Buffer || SectorCount == 0 || SectorSize == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InterlockedIncrement64(&MemoryManager->TotalWrites);
+
+    ULONG sectorShift = TempSectorShift(SectorSize);
+    ULONG64 offset = StartSector << sectorShift;
+    ULONG64 remaining = (ULONG64)SectorCount << sectorShift;
+    ULONG chunkMask = MemoryManager->ChunkSize - 1;
+    PUCHAR bufferPtr = (PUCHAR)Buffer;
+    ULONG64 heatedStripeEnd = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    while (remaining > 0 && NT_SUCCESS(status))
+    {
+        ULONG slot;
+        PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, offset >> MemoryManager->ChunkShift, &slot);
+        ULONG64 stripeEnd = ((offset >> MemoryManager->StripeShift) + 1) << MemoryManager->StripeShift;
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        if (stripeEnd != heatedStripeEnd)
+        {
+            bucket->Heat[slot >> MemoryManager->StripeChunkShift].Writes++;
+            heatedStripeEnd = stripeEnd;
+        }
+
+        do
+        {
+            ULONG chunkOffset = (ULONG)offset & chunkMask;
+            ULONG span = MemoryManager->ChunkSize - chunkOffset;
+            if (span > remaining)
+            {
+                span = (ULONG)remaining;
+            }
+
+            // A span covering the whole chunk does not need the old contents back
+            PTEMP_CHUNK chunk;
+            status = TempResolveChunk(MemoryManager, bucket, slot, span == MemoryManager->ChunkSize, &chunk);
+            if (status == STATUS_SUCCESS && chunk && chunk->State == TEMP_CHUNK_SHARED)
+            {
+                status = TempUnshareChunk(MemoryManager, bucket, slot, span == MemoryManager->ChunkSize, &chunk);
+            }
+            if (status != STATUS_SUCCESS)
+            {
+                break;
+            }
+
+            if (!chunk)
+            {
+                // First write to this chunk; new data is what the budget limits
+                status = TempChargeMemory(MemoryManager, MemoryManager->ChunkSize, FALSE);
+                if (NT_SUCCESS(status))
+                {
+                    status = TempAllocateChunk(bucket, MemoryManager->ChunkSize, slot, &chunk);
+                    if (!NT_SUCCESS(status))
+                    {
+                        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+                    }
+                }
+
+                if (!NT_SUCCESS(status))
+                {
+                    InterlockedIncrement64(&MemoryManager->AllocationFailures);
+                    break;
+                }
+            }
+
+            InterlockedIncrement(&chunk->RefCount);
+
+            // Update generation for LRU
+            chunk->Generation = ++bucket->Generation;
+
+            if (MemoryManager->Cipher)
+            {
+                TempEncryptSpan(MemoryManager, chunk, offset, chunkOffset, span, bufferPtr);
+            }
+            else
+            {
+                RtlCopyMemory(chunk->Data + chunkOffset, bufferPtr, span);
+            }
+
+            TempSetUsedMask(bucket, chunk, chunk->UsedMask |
+                            TempSegmentBits(chunkOffset >> MemoryManager->SegmentShift,
+                                            ((chunkOffset + span - 1) >> MemoryManager->SegmentShift) + 1));
+
+            TempReleaseChunk(bucket, chunk);
+
+            bufferPtr += span;
+            offset += span;
+            remaining -= span;
+            slot++;
+        } while (remaining > 0 && offset < stripeEnd);
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        if (status == STATUS_PENDING)
+        {
+            status = TempFaultInChunk(MemoryManager, offset >> MemoryManager->ChunkShift, TRUE);
+        }
+    }
+
+    return status;
+}
+
+NTSTATUS TempFormatDisk(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 DiskSize, ULONG SectorSize)
+{
+    if (!MemoryManager || DiskSize == 0 || SectorSize == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Everything written so far is formatted away by marking each bucket's current
+    // generation; no chunk is visited. Chunks at or below the mark read as unmapped
+    // zeros, and their memory comes back as requests touch them or the sweep
+    // (TempSweepFormattedChunks) reaches them.
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        bucket->FormatMark = bucket->Generation;
+        TempDropImagePending(MemoryManager, bucket);
+
+        // Reset statistics
+        bucket->HitCount = 0;
+        bucket->MissCount = 0;
+        bucket->EvictionCount = 0;
+        RtlZeroMemory(bucket->Heat, (SIZE_T)(bucket->MaxChunks >> MemoryManager->StripeChunkShift) * sizeof(TEMP_STRIPE_HEAT));
+
+        TempUnlockBucket(bucket, oldIrql);
+    }
+
+    InterlockedIncrement64(&MemoryManager->FormatEpoch);
+
+    // Reset global statistics
+    MemoryManager->TotalReads = 0;
+    MemoryManager->TotalWrites = 0;
+    MemoryManager->HotStripeHeat = 0;
+
+    return STATUS_SUCCESS;
+}
+
+// Frees chunks the last format left behind, examining up to MaxChunks slots from
+// where the previous call stopped; a new format starts the sweep over. The bucket
+// lock is held for one stripe at a time.
+VOID TempSweepFormattedChunks(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 MaxChunks)
+{
+    if (!MemoryManager || !MemoryManager->FormatEpoch)
+    {
+        return;
+    }
+
+    ULONG64 totalChunks = (MemoryManager->MaxSize + MemoryManager->ChunkSize - 1) >> MemoryManager->ChunkShift;
+    LONG64 epoch = MemoryManager->FormatEpoch;
+
+    if (MemoryManager->SweepEpoch != epoch)
+    {
+        MemoryManager->SweepEpoch = epoch;
+        MemoryManager->SweepCursor = 0;
+    }
+
+    while (MaxChunks > 0 && MemoryManager->SweepCursor < totalChunks)
+    {
+        ULONG64 chunkNumber = MemoryManager->SweepCursor;
+        ULONG64 stripeEnd = ((chunkNumber >> MemoryManager->StripeChunkShift) + 1) << MemoryManager->StripeChunkShift;
+        if (stripeEnd > totalChunks)
+        {
+            stripeEnd = totalChunks;
+        }
+
+        ULONG slot;
+        PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, chunkNumber, &slot);
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        for (; chunkNumber < stripeEnd && MaxChunks > 0; chunkNumber++, slot++, MaxChunks--)
+        {
+            TempSlotChunk(MemoryManager, bucket, slot);
+        }
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        MemoryManager->SweepCursor = chunkNumber;
+    }
+}
+
+// Releases or clears the byte range [Offset, Offset + Length)
+static NTSTATUS TempTrimRange(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 Offset, ULONG64 Length)
+{
+    ULONG64 offset = Offset;
+    ULONG64 remaining = Length;
+    ULONG chunkMask = MemoryManager->ChunkSize - 1;
+    ULONG segmentMask = (1UL << MemoryManager->SegmentShift) - 1;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // Trimmed ranges must read back as zeros. Chunks covered completely are handed
+    // back to the pool, as are chunks with no written segment left once the trimmed
+    // ones are dropped; other partially covered chunks have the span cleared.
+    while (remaining > 0 && NT_SUCCESS(status))
+    {
+        ULONG slot;
+        PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, offset >> MemoryManager->ChunkShift, &slot);
+        ULONG64 stripeEnd = ((offset >> MemoryManager->StripeShift) + 1) << MemoryManager->StripeShift;
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        do
+        {
+            ULONG chunkOffset = (ULONG)offset & chunkMask;
+            ULONG span = MemoryManager->ChunkSize - chunkOffset;
+            if (span > remaining)
+            {
+                span = (ULONG)remaining;
+            }
+
+            PTEMP_CHUNK current = TempSlotChunk(MemoryManager, bucket, slot);
+
+            if (span == MemoryManager->ChunkSize)
+            {
+                TempFreeChunk(MemoryManager, bucket, slot);
+            }
+            else if (!current && TempIsImagePending(bucket, slot))
+            {
+                // Load the rest of the chunk from the image, then trim it like any other
+                status = STATUS_PENDING;
+                break;
+            }
+            else if (current)
+            {
+                ULONG first = (chunkOffset + segmentMask) >> MemoryManager->SegmentShift;
+                ULONG end = (chunkOffset + span) >> MemoryManager->SegmentShift;
+                ULONG usedMask = current->UsedMask;
+
+                if (end > first)
+                {
+                    usedMask &= ~TempSegmentBits(first, end);
+                }
+
+                if (usedMask == 0)
+                {
+                    // Compressed and spilled chunks go without being brought back
+                    TempFreeChunk(MemoryManager, bucket, slot);
+                }
+                else
+                {
+                    PTEMP_CHUNK chunk;
+                    status = TempResolveChunk(MemoryManager, bucket, slot, FALSE, &chunk);
+                    if (status == STATUS_SUCCESS && chunk->State == TEMP_CHUNK_SHARED)
+                    {
+                        status = TempUnshareChunk(MemoryManager, bucket, slot, FALSE, &chunk);
+                    }
+                    if (status != STATUS_SUCCESS)
+                    {
+                        break;
+                    }
+
+                    // A new generation keeps reclaim from committing a stale snapshot.
+                    // Encrypted chunks get the zeros encrypted: segments that stay
+                    // marked used are decrypted when read.
+                    if (MemoryManager->Cipher)
+                    {
+                        TempSealRange(MemoryManager, chunk, offset - chunkOffset, chunkOffset, span);
+                    }
+                    else
+                    {
+                        RtlZeroMemory(chunk->Data + chunkOffset, span);
+                    }
+                    chunk->Generation = ++bucket->Generation;
+                    TempSetUsedMask(bucket, chunk, usedMask);
+                }
+            }
+
+            offset += span;
+            remaining -= span;
+            slot++;
+        } while (remaining > 0 && offset < stripeEnd);
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        if (status == STATUS_PENDING)
+        {
+            status = TempFaultInChunk(MemoryManager, offset >> MemoryManager->ChunkShift, TRUE);
+        }
+    }
+
+    return status;
+}
+
+NTSTATUS TempTrimSectors(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 StartSector, ULONG64 SectorCount, ULONG SectorSize)
+{
+    if (!MemoryManager || SectorSize == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG sectorShift = TempSectorShift(SectorSize);
+
+    return TempTrimRange(MemoryManager, StartSector << sectorShift, SectorCount << sectorShift);
+}
+
+// A stub for a slot of MemoryManager sharing Shared's data. Linked after Previous in
+// its ring, taking a reference, or, without Previous, alone in a new ring owning the
+// data with the reference the slot held. NULL when out of memory.
+static PTEMP_CHUNK TempAllocateSharedStub(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_CHUNK Shared, PTEMP_CHUNK Previous, LONG64 Generation, ULONG UsedMask)
+{
+    PTEMP_CHUNK stub = (PTEMP_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(TEMP_CHUNK, Data) + sizeof(TEMP_SHARE_LINK),
+        TEMP_CHUNK_TAG);
+
+    if (!stub)
+    {
+        return NULL;
+    }
+
+    PTEMP_SHARE_LINK link = TempShareLink(stub);
+    KIRQL oldIrql;
+
+    stub->Generation = Generation;
+    stub->State = TEMP_CHUNK_SHARED;
+    stub->UsedMask = UsedMask;
+    link->Shared = Shared;
+    link->MemoryManager = MemoryManager;
+
+    if (!Previous)
+    {
+        link->Next = stub;
+        link->Previous = stub;
+        link->Owner = TRUE;
+        Shared->RefCount = 1;
+        InterlockedIncrement64(&MemoryManager->OwnedSharedChunks);
+        return stub;
+    }
+
+    KeAcquireSpinLock(&g_ShareLock, &oldIrql);
+
+    PTEMP_SHARE_LINK previous = TempShareLink(Previous);
+
+    link->Previous = Previous;
+    link->Next = previous->Next;
+    TempShareLink(previous->Next)->Previous = stub;
+    previous->Next = stub;
+    InterlockedIncrement(&Shared->RefCount);
+
+    KeReleaseSpinLock(&g_ShareLock, oldIrql);
+
+    return stub;
+}
+
+// Makes a target chunk read what a source chunk holds without copying it: a resident
+// source chunk becomes data shared by both slots, and an unmapped one leaves the
+// target unmapped. Only one bucket lock is held at a time, so the target's stub joins
+// the ring while the source slot is locked and is put in its slot afterwards.
+// STATUS_PENDING means the source chunk is compressed, spilled or still in the image
+// and has to be copied.
+static NTSTATUS TempShareChunk(PTEMP_MEMORY_MANAGER Source, ULONG64 SourceChunk, PTEMP_MEMORY_MANAGER Target, ULONG64 TargetChunk)
+{
+    ULONG sourceSlot;
+    ULONG targetSlot;
+    PTEMP_BUCKET sourceBucket = TempMapChunk(Source, SourceChunk, &sourceSlot);
+    PTEMP_BUCKET targetBucket = TempMapChunk(Target, TargetChunk, &targetSlot);
+    PTEMP_CHUNK pending = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL oldIrql;
+
+    TempLockBucket(Source, sourceBucket, &oldIrql);
+
+    PTEMP_CHUNK chunk = TempSlotChunk(Source, sourceBucket, sourceSlot);
+
+    if (chunk ? chunk->State == TEMP_CHUNK_COMPRESSED || chunk->State == TEMP_CHUNK_SPILLED
+              : TempIsImagePending(sourceBucket, sourceSlot))
+    {
+        status = STATUS_PENDING;
+    }
+    else if (chunk && chunk->State == TEMP_CHUNK_RESIDENT)
+    {
+        // The chunk itself becomes the shared data and a stub takes its place
+        PTEMP_CHUNK stub = TempAllocateSharedStub(Source, chunk, NULL, chunk->Generation, chunk->UsedMask);
+
+        if (stub)
+        {
+            sourceBucket->Chunks[sourceSlot] = stub;
+            InterlockedIncrement64(&Source->SharedChunks);
+            chunk = stub;
+        }
+        else
+        {
+            InterlockedIncrement64(&Source->AllocationFailures);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    // The target's stub holds its reference from here on, so the data outlives the
+    // source slot letting go of it once unlocked
+    if (status == STATUS_SUCCESS && chunk)
+    {
+        pending = TempAllocateSharedStub(Target, TempSharedData(chunk), chunk, 0, chunk->UsedMask);
+        if (!pending)
+        {
+            InterlockedIncrement64(&Target->AllocationFailures);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    TempUnlockBucket(sourceBucket, oldIrql);
+
+    if (status != STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    TempLockBucket(Target, targetBucket, &oldIrql);
+
+    // Like a write over the whole chunk, replacing data the disk holds is not refused
+    BOOLEAN replacing = TempSlotChunk(Target, targetBucket, targetSlot) != NULL;
+    TempFreeChunk(Target, targetBucket, targetSlot);
+
+    if (pending)
+    {
+        status = TempChargeMemory(Target, Target->ChunkSize, replacing);
+        if (NT_SUCCESS(status))
+        {
+            pending->Generation = ++targetBucket->Generation;
+            targetBucket->Chunks[targetSlot] = pending;
+            targetBucket->ChunkCount++;
+            TempAccountChunk(targetBucket, pending->UsedMask, TRUE);
+            InterlockedIncrement64(&Target->SharedChunks);
+            pending = NULL;
+        }
+        else
+        {
+            InterlockedIncrement64(&Target->AllocationFailures);
+        }
+    }
+
+    TempUnlockBucket(targetBucket, oldIrql);
+
+    // The source may have let go of the data meanwhile
+    if (pending)
+    {
+        TempDeleteChunk(pending);
+    }
+
+    return status;
+}
+
+// Copies Length bytes from one memory manager to another, or within one, without the
+// data leaving the driver. Whole chunks are shared copy-on-write rather than copied
+// when neither manager encrypts, the chunk sizes match and the offsets are the same
+// distance from a chunk boundary; everything else goes through a chunk-sized buffer.
+// Offsets and Length are multiples of TEMP_MIN_SECTOR_SIZE and the ranges must not
+// overlap. SharedLength, optional, receives the bytes not copied. PASSIVE_LEVEL.
+NTSTATUS TempCopyRange(PTEMP_MEMORY_MANAGER Source, ULONG64 SourceOffset, PTEMP_MEMORY_MANAGER Target, ULONG64 TargetOffset, ULONG64 Length, PULONG64 SharedLength)
+{
+    const ULONG sectorMask = TEMP_MIN_SECTOR_SIZE - 1;
+    PUCHAR buffer = NULL;
+    ULONG64 shared = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!Source || !Target ||
+        ((SourceOffset | TargetOffset | Length) & sectorMask) != 0 ||
+        SourceOffset > Source->MaxSize || Length > Source->MaxSize - SourceOffset ||
+        TargetOffset > Target->MaxSize || Length > Target->MaxSize - TargetOffset)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Source == Target && SourceOffset < TargetOffset + Length && TargetOffset < SourceOffset + Length)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG chunkSize = Target->ChunkSize;
+    BOOLEAN share = !Source->Cipher && !Target->Cipher &&
+                    Source->ChunkSize == chunkSize &&
+                    ((SourceOffset ^ TargetOffset) & (chunkSize - 1)) == 0;
+
+    // One target chunk at a time, so that aligned ranges reach whole chunks
+    while (Length > 0 && NT_SUCCESS(status))
+    {
+        ULONG span = chunkSize - ((ULONG)TargetOffset & (chunkSize - 1));
+        if (span > Length)
+        {
+            span = (ULONG)Length;
+        }
+
+        status = STATUS_PENDING;
+
+        if (share && span == chunkSize)
+        {
+            status = TempShareChunk(Source, SourceOffset >> Source->ChunkShift, Target, TargetOffset >> Target->ChunkShift);
+            if (status == STATUS_SUCCESS)
+            {
+                shared += span;
+            }
+        }
+
+        if (status == STATUS_PENDING)
+        {
+            if (!buffer)
+            {
+                buffer = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, chunkSize, TEMP_POOL_TAG);
+            }
+
+            if (!buffer)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+
+            status = TempReadSectors(Source, SourceOffset / TEMP_MIN_SECTOR_SIZE, span / TEMP_MIN_SECTOR_SIZE, buffer, TEMP_MIN_SECTOR_SIZE);
+            if (NT_SUCCESS(status))
+            {
+                status = TempWriteSectors(Target, TargetOffset / TEMP_MIN_SECTOR_SIZE, span / TEMP_MIN_SECTOR_SIZE, buffer, TEMP_MIN_SECTOR_SIZE);
+            }
+        }
+
+        SourceOffset += span;
+        TargetOffset += span;
+        Length -= span;
+    }
+
+    if (buffer)
+    {
+        ExFreePool(buffer);
+    }
+
+    if (SharedLength)
+    {
+        *SharedLength = shared;
+    }
+
+    return status;
+}
+
+// Forgets the access counts of stripes from FirstStripe on, which a shrink left
+// past the end of the disk
+static VOID TempClearHeat(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 FirstStripe)
+{
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        ULONG stripes = bucket->MaxChunks >> MemoryManager->StripeChunkShift;
+        for (ULONG group = (ULONG)(FirstStripe >> MemoryManager->BucketShift); group < stripes; group++)
+        {
+            if (TempBucketStripe(MemoryManager, i, group) >= FirstStripe)
+            {
+                bucket->Heat[group].Reads = 0;
+                bucket->Heat[group].Writes = 0;
+            }
+        }
+
+        TempUnlockBucket(bucket, oldIrql);
+    }
+}
+
+// Changes the capacity of a live memory manager. Chunk placement depends only on
+// the bucket count, so no chunk moves: growing widens each bucket's slot and heat
+// arrays one bucket lock at a time, and shrinking releases the chunks past the new
+// end. Arrays are never narrowed, which keeps I/O that raced with a shrink in bounds.
+// Callers serialize resizes and stop issuing I/O past the new end before shrinking.
+NTSTATUS TempResizeMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 NewSize)
+{
+    if (!MemoryManager || !MemoryManager->Buckets || NewSize == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The image bitmaps are sized for the slot arrays; wait until everything is loaded
+    if (MemoryManager->ImagePendingChunks > 0)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    TempEndImageSource(MemoryManager);
+
+    ULONG64 oldSize = MemoryManager->MaxSize;
+    ULONG64 totalStripes = (NewSize + (1ULL << MemoryManager->StripeShift) - 1) >> MemoryManager->StripeShift;
+    ULONG64 groups = (totalStripes + MemoryManager->BucketCount - 1) >> MemoryManager->BucketShift;
+    ULONG64 chunksPerBucket = groups << MemoryManager->StripeChunkShift;
+
+    if (chunksPerBucket > MAXULONG)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        if (bucket->MaxChunks >= chunksPerBucket)
+        {
+            continue;
+        }
+
+        PTEMP_CHUNK *slots = (PTEMP_CHUNK *)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (SIZE_T)chunksPerBucket * sizeof(PTEMP_CHUNK),
+            TEMP_POOL_TAG);
+
+        PTEMP_STRIPE_HEAT heat = (PTEMP_STRIPE_HEAT)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (SIZE_T)groups * sizeof(TEMP_STRIPE_HEAT),
+            TEMP_POOL_TAG);
+
+        if (!slots || !heat)
+        {
+            // Buckets widened so far simply keep their larger arrays
+            if (slots)
+            {
+                ExFreePool(slots);
+            }
+            if (heat)
+            {
+                ExFreePool(heat);
+            }
+            InterlockedIncrement64(&MemoryManager->AllocationFailures);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        PTEMP_CHUNK *oldSlots = bucket->Chunks;
+        PTEMP_STRIPE_HEAT oldHeat = bucket->Heat;
+        RtlCopyMemory(slots, oldSlots, (SIZE_T)bucket->MaxChunks * sizeof(PTEMP_CHUNK));
+        RtlCopyMemory(heat, oldHeat, (SIZE_T)(bucket->MaxChunks >> MemoryManager->StripeChunkShift) * sizeof(TEMP_STRIPE_HEAT));
+        bucket->Chunks = slots;
+        bucket->Heat = heat;
+        bucket->MaxChunks = (ULONG)chunksPerBucket;
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        ExFreePool(oldSlots);
+        ExFreePool(oldHeat);
+    }
+
+    if (NewSize < oldSize)
+    {
+        // Only whole chunks past the new end are dropped, which cannot fail. The chunk
+        // holding the new end keeps its tail until a grow exposes it again, and a grow
+        // clears the exposed range before publishing it.
+        ULONG64 chunkMask = MemoryManager->ChunkSize - 1;
+        ULONG64 trimStart = (NewSize + chunkMask) & ~chunkMask;
+        ULONG64 trimEnd = (oldSize + chunkMask) & ~chunkMask;
+        NTSTATUS status = STATUS_SUCCESS;
+
+        MemoryManager->MaxSize = NewSize;
+        TempClearHeat(MemoryManager, totalStripes);
+
+        if (trimEnd > trimStart)
+        {
+            status = TempTrimRange(MemoryManager, trimStart, trimEnd - trimStart);
+        }
+        if (!NT_SUCCESS(status))
+        {
+            MemoryManager->MaxSize = oldSize;
+        }
+
+        return status;
+    }
+
+    // Writes that raced with an earlier shrink may have left data past the old end;
+    // the newly exposed range has to read back as zeros
+    NTSTATUS status = TempTrimRange(MemoryManager, oldSize, NewSize - oldSize);
+    if (NT_SUCCESS(status))
+    {
+        MemoryManager->MaxSize = NewSize;
+    }
+
+    return status;
+}
+
+VOID TempQueryMemoryStatistics(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_STATISTICS Statistics)
+{
+    if (!MemoryManager || !Statistics)
+    {
+        return;
+    }
+
+    Statistics->TotalReads = MemoryManager->TotalReads;
+    Statistics->TotalWrites = MemoryManager->TotalWrites;
+    Statistics->PressureEvents = MemoryManager->PressureEvents;
+    Statistics->BytesReclaimed = MemoryManager->BytesReclaimed;
+    Statistics->CompressedChunks = MemoryManager->CompressedChunks;
+    Statistics->CompressedBytes = MemoryManager->CompressedBytes;
+    Statistics->SpilledChunks = MemoryManager->SpilledChunks;
+    Statistics->CacheHits = 0;
+    Statistics->CacheMisses = 0;
+
+    // Hit and miss counts live with their buckets so the I/O path never shares a
+    // counter cache line between processors; sum them on demand
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        Statistics->CacheHits += MemoryManager->Buckets[i].HitCount;
+        Statistics->CacheMisses += MemoryManager->Buckets[i].MissCount;
+    }
+
+    TEMP_MEMORY_STATISTICS usage;
+    TempQueryMemoryUsage(MemoryManager, &usage);
+
+    Statistics->MemoryUsed = usage.ResidentDataBytes + usage.CompressedDataBytes + usage.MetadataBytes;
+    Statistics->EvictionCount = usage.EvictionCount;
+}
+
+// Reports where the device's memory goes. Bucket totals are kept current under
+// each bucket's lock, so this costs one lock round trip per bucket, not a slot walk.
+VOID TempQueryMemoryUsage(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_MEMORY_STATISTICS Usage)
+{
+    if (!MemoryManager || !Usage)
+    {
+        return;
+    }
+
+    RtlZeroMemory(Usage, sizeof(TEMP_MEMORY_STATISTICS));
+    Usage->Version = TEMP_MEMORY_STATISTICS_VERSION;
+    Usage->Size = sizeof(TEMP_MEMORY_STATISTICS);
+    Usage->ChunkSize = MemoryManager->ChunkSize;
+    Usage->BucketCount = MemoryManager->BucketCount;
+    Usage->SegmentSize = 1UL << MemoryManager->SegmentShift;
+    Usage->DiskSize = MemoryManager->MaxSize;
+    Usage->ChunkCapacity = (MemoryManager->MaxSize + MemoryManager->ChunkSize - 1) >> MemoryManager->ChunkShift;
+    Usage->MinBucketChunks = MAXULONG;
+
+    // Each bucket's fair share of the disk, the baseline for its occupancy
+    ULONG64 share = (Usage->ChunkCapacity + MemoryManager->BucketCount - 1) >> MemoryManager->BucketShift;
+    ULONG64 slots = 0;
+    ULONG64 imageWords = 0;
+    ULONG64 usedSegments = 0;
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        ULONG chunkCount = bucket->ChunkCount;
+        slots += bucket->MaxChunks;
+        imageWords += bucket->ImagePending ? (bucket->MaxChunks + 31) / 32 : 0;
+        usedSegments += bucket->UsedSegments;
+        Usage->PartialChunks += bucket->PartialChunks;
+        Usage->EvictionCount += bucket->EvictionCount;
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        Usage->AllocatedChunks += chunkCount;
+
+        if (chunkCount < Usage->MinBucketChunks)
+        {
+            Usage->MinBucketChunks = chunkCount;
+        }
+        if (chunkCount > Usage->MaxBucketChunks)
+        {
+            Usage->MaxBucketChunks = chunkCount;
+        }
+
+        ULONG64 bin = share ? (ULONG64)chunkCount * TEMP_OCCUPANCY_BINS / share : 0;
+        Usage->BucketOccupancy[bin < TEMP_OCCUPANCY_BINS ? bin : TEMP_OCCUPANCY_BINS - 1]++;
+    }
+
+    Usage->CompressedChunks = MemoryManager->CompressedChunks;
+    Usage->SpilledChunks = MemoryManager->SpilledChunks;
+    Usage->SharedChunks = MemoryManager->SharedChunks;
+
+    // Shared slots hold stubs. The data they share is resident once, in the manager
+    // owning it, which may be another device's.
+    ULONG64 ownedShared = MemoryManager->OwnedSharedChunks;
+
+    // The state counters are not sampled together with the buckets
+    if (Usage->AllocatedChunks > Usage->CompressedChunks + Usage->SpilledChunks + Usage->SharedChunks)
+    {
+        Usage->ResidentChunks = Usage->AllocatedChunks - Usage->CompressedChunks - Usage->SpilledChunks - Usage->SharedChunks;
+    }
+    Usage->ResidentChunks += ownedShared;
+
+    Usage->ResidentDataBytes = Usage->ResidentChunks << MemoryManager->ChunkShift;
+    Usage->CompressedDataBytes = MemoryManager->CompressedBytes;
+    Usage->InUseDataBytes = usedSegments << MemoryManager->SegmentShift;
+    Usage->AllocationFailures = MemoryManager->AllocationFailures;
+    Usage->ImagePendingChunks = MemoryManager->ImagePendingChunks;
+    Usage->ImageDemandLoads = MemoryManager->ImageDemandLoads;
+    Usage->BudgetCharged = MemoryManager->ChargedBytes;
+    Usage->BudgetMinimum = MemoryManager->BudgetMinimum;
+    Usage->BudgetMaximum = MemoryManager->BudgetMaximum;
+    Usage->BudgetDenials = MemoryManager->BudgetDenials;
+
+    Usage->MetadataBytes = sizeof(TEMP_MEMORY_MANAGER) +
+                           (ULONG64)MemoryManager->BucketCount * sizeof(TEMP_BUCKET) +
+                           slots * sizeof(PTEMP_CHUNK) +
+                           (slots >> MemoryManager->StripeChunkShift) * sizeof(TEMP_STRIPE_HEAT) +
+                           imageWords * sizeof(ULONG) +
+                           Usage->AllocatedChunks * FIELD_OFFSET(TEMP_CHUNK, Data) +
+                           Usage->SharedChunks * sizeof(TEMP_SHARE_LINK) +
+                           ownedShared * FIELD_OFFSET(TEMP_CHUNK, Data);
+
+    if (MemoryManager->ReclaimBuffer)
+    {
+        Usage->MetadataBytes += (ULONG64)MemoryManager->ChunkSize * 2 + TEMP_COMPRESS_WORKSPACE_SIZE;
+    }
+}
+
+// Switching profiling on starts every bucket's counters from zero
+VOID TempSetLockProfiling(PTEMP_MEMORY_MANAGER MemoryManager, BOOLEAN Enable)
+{
+    if (!MemoryManager)
+    {
+        return;
+    }
+
+    if (!Enable)
+    {
+        InterlockedExchange(&MemoryManager->LockProfiling, 0);
+        return;
+    }
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&bucket->Lock, &oldIrql);
+
+        bucket->LockAcquisitions = 0;
+        bucket->LockContentions = 0;
+        bucket->LockSpinTicks = 0;
+        bucket->LockHoldTicks = 0;
+        bucket->LockMaxHoldTicks = 0;
+
+        KeReleaseSpinLock(&bucket->Lock, oldIrql);
+    }
+
+    InterlockedExchange(&MemoryManager->LockProfiling, 1);
+}
+
+static ULONG64 TempTicksToNanoseconds(ULONG64 Ticks, ULONG64 Frequency)
+{
+    return (Ticks / Frequency) * 1000000000ULL + (Ticks % Frequency) * 1000000000ULL / Frequency;
+}
+
+// Fills in the TopCount hottest buckets. The counters are read under the plain
+// lock so that the query does not show up in its own results.
+VOID TempQueryLockContention(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_LOCK_CONTENTION Contention, ULONG TopCount)
+{
+    LARGE_INTEGER frequency;
+
+    if (!MemoryManager || !Contention)
+    {
+        return;
+    }
+
+    RtlZeroMemory(Contention, sizeof(TEMP_LOCK_CONTENTION));
+    Contention->Version = TEMP_LOCK_CONTENTION_VERSION;
+    Contention->Size = sizeof(TEMP_LOCK_CONTENTION);
+    Contention->Enabled = MemoryManager->LockProfiling ? 1 : 0;
+    Contention->BucketCount = MemoryManager->BucketCount;
+    Contention->StripeSize = 1UL << MemoryManager->StripeShift;
+
+    if (TopCount > TEMP_LOCK_CONTENTION_MAX_TOP)
+    {
+        TopCount = TEMP_LOCK_CONTENTION_MAX_TOP;
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+        TEMP_BUCKET_CONTENTION entry;
+
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&bucket->Lock, &oldIrql);
+
+        entry.Bucket = i;
+        entry.ChunkCount = bucket->ChunkCount;
+        entry.Acquisitions = bucket->LockAcquisitions;
+        entry.ContendedAcquisitions = bucket->LockContentions;
+        entry.SpinTime = bucket->LockSpinTicks;
+        entry.HoldTime = bucket->LockHoldTicks;
+        entry.MaxHoldTime = bucket->LockMaxHoldTicks;
+
+        KeReleaseSpinLock(&bucket->Lock, oldIrql);
+
+        entry.SpinTime = TempTicksToNanoseconds(entry.SpinTime, (ULONG64)frequency.QuadPart);
+        entry.HoldTime = TempTicksToNanoseconds(entry.HoldTime, (ULONG64)frequency.QuadPart);
+        entry.MaxHoldTime = TempTicksToNanoseconds(entry.MaxHoldTime, (ULONG64)frequency.QuadPart);
+
+        Contention->Acquisitions += entry.Acquisitions;
+        Contention->ContendedAcquisitions += entry.ContendedAcquisitions;
+        Contention->SpinTime += entry.SpinTime;
+        Contention->HoldTime += entry.HoldTime;
+
+        if (entry.Acquisitions == 0)
+        {
+            continue;
         }
 
-        // Clear all chunks
-        for (ULONG j = 0; j < bucket->ChunkCount; j++)
+        // Insert into the sorted top list, dropping its coolest entry when full
+        ULONG position = Contention->BucketsReturned;
+        while (position > 0)
         {
-            if (bucket->Chunks[j])
+            PTEMP_BUCKET_CONTENTION above = &Contention->Buckets[position - 1];
+
+            if (above->SpinTime > entry.SpinTime ||
+                (above->SpinTime == entry.SpinTime && above->ContendedAcquisitions >= entry.ContendedAcquisitions))
             {
-                RtlZeroMemory(bucket->Chunks[j]->Data, TEMP_CHUNK_SIZE);
-                bucket->Chunks[j]->Generation = 0;
-                bucket->Chunks[j]->RefCount = 0;
+                break;
             }
+            position--;
         }
 
-        // Reset statistics
-        bucket->HitCount = 0;
-        bucket->MissCount = 0;
-        bucket->EvictionCount = 0;
-        bucket->Generation = 0;
+        if (position >= TopCount)
+        {
+            continue;
+        }
 
-        KeReleaseSpinLock(&bucket->Lock, oldIrql);
+        ULONG last = Contention->BucketsReturned < TopCount ? Contention->BucketsReturned : TopCount - 1;
+        RtlMoveMemory(&Contention->Buckets[position + 1], &Contention->Buckets[position],
+                      (last - position) * sizeof(TEMP_BUCKET_CONTENTION));
+        Contention->Buckets[position] = entry;
+
+        if (Contention->BucketsReturned < TopCount)
+        {
+            Contention->BucketsReturned++;
+        }
     }
+}
 
-    // Reset global statistics
-    MemoryManager->TotalReads = 0;
-    MemoryManager->TotalWrites = 0;
-    MemoryManager->TotalHits = 0;
-    MemoryManager->TotalMisses = 0;
+// Removes 1/2^TEMP_HEATMAP_DECAY_SHIFT of a count, rounding up so counts reach zero
+FORCEINLINE ULONG TempDecayCount(ULONG Count)
+{
+    ULONG mask = (1UL << TEMP_HEATMAP_DECAY_SHIFT) - 1;
+
+    return Count - (Count >> TEMP_HEATMAP_DECAY_SHIFT) - ((Count & mask) != 0);
+}
+
+// Ages the access heatmap and recomputes the heat at which reclaim spares a stripe:
+// the mean over the stripes that still have any
+VOID TempDecayHeatmap(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    ULONG64 totalHeat = 0;
+    ULONG64 heatedStripes = 0;
+
+    if (!MemoryManager)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        ULONG stripes = bucket->MaxChunks >> MemoryManager->StripeChunkShift;
+        for (ULONG group = 0; group < stripes; group++)
+        {
+            PTEMP_STRIPE_HEAT heat = &bucket->Heat[group];
+
+            heat->Reads = TempDecayCount(heat->Reads);
+            heat->Writes = TempDecayCount(heat->Writes);
+
+            if (heat->Reads || heat->Writes)
+            {
+                totalHeat += (ULONG64)heat->Reads + heat->Writes;
+                heatedStripes++;
+            }
+        }
+
+        TempUnlockBucket(bucket, oldIrql);
+    }
+
+    ULONG64 mean = heatedStripes ? totalHeat / heatedStripes : 0;
+    MemoryManager->HotStripeHeat = mean > MAXULONG ? MAXULONG : (ULONG)mean;
+}
+
+// Fills the heatmap header and up to MaxRegions regions, which the caller provides
+// after it. Regions past the end of the disk are not returned.
+VOID TempQueryHeatmap(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_HEATMAP Heatmap, ULONG FirstRegion, ULONG RegionShift, ULONG MaxRegions)
+{
+    if (!MemoryManager || !Heatmap || RegionShift > TEMP_HEATMAP_MAX_REGION_SHIFT)
+    {
+        return;
+    }
+
+    ULONG64 totalStripes = (MemoryManager->MaxSize + (1ULL << MemoryManager->StripeShift) - 1) >> MemoryManager->StripeShift;
+    ULONG regionCount = (ULONG)((totalStripes + (1ULL << RegionShift) - 1) >> RegionShift);
+    ULONG returned = 0;
+
+    if (FirstRegion < regionCount)
+    {
+        returned = regionCount - FirstRegion < MaxRegions ? regionCount - FirstRegion : MaxRegions;
+    }
+
+    RtlZeroMemory(Heatmap, FIELD_OFFSET(TEMP_HEATMAP, Regions) + (SIZE_T)returned * sizeof(TEMP_HEATMAP_REGION));
+    Heatmap->Version = TEMP_HEATMAP_VERSION;
+    Heatmap->Size = FIELD_OFFSET(TEMP_HEATMAP, Regions);
+    Heatmap->StripeSize = 1UL << MemoryManager->StripeShift;
+    Heatmap->RegionSize = (ULONG64)Heatmap->StripeSize << RegionShift;
+    Heatmap->RegionCount = regionCount;
+    Heatmap->FirstRegion = FirstRegion;
+    Heatmap->RegionsReturned = returned;
+    Heatmap->HotStripeHeat = MemoryManager->HotStripeHeat;
+    Heatmap->DiskSize = MemoryManager->MaxSize;
+
+    // Stripes are spread over the buckets, so take each bucket's lock once and drop
+    // its stripes into their regions
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        ULONG stripes = bucket->MaxChunks >> MemoryManager->StripeChunkShift;
+        for (ULONG group = 0; group < stripes; group++)
+        {
+            PTEMP_STRIPE_HEAT heat = &bucket->Heat[group];
+            ULONG64 stripe = TempBucketStripe(MemoryManager, i, group);
+
+            if (stripe >= totalStripes || (heat->Reads == 0 && heat->Writes == 0))
+            {
+                continue;
+            }
+
+            Heatmap->TotalReads += heat->Reads;
+            Heatmap->TotalWrites += heat->Writes;
+
+            ULONG64 region = stripe >> RegionShift;
+            if (region >= FirstRegion && region - FirstRegion < returned)
+            {
+                Heatmap->Regions[region - FirstRegion].Reads += heat->Reads;
+                Heatmap->Regions[region - FirstRegion].Writes += heat->Writes;
+            }
+        }
+
+        TempUnlockBucket(bucket, oldIrql);
+    }
+}
+
+NTSTATUS TempSetPressurePolicy(PTEMP_MEMORY_MANAGER MemoryManager, ULONG Policy, PTEMP_SPILL_ROUTINE SpillRoutine, PVOID SpillContext)
+{
+    if (!MemoryManager || (Policy & ~TEMP_PRESSURE_POLICY_MASK) != 0 ||
+        ((Policy & TEMP_PRESSURE_SPILL) && !SpillRoutine))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Compression and spilling work from a snapshot of the chunk taken under the
+    // bucket lock; reserve it now so reclaiming never has to allocate a full chunk
+    if ((Policy & (TEMP_PRESSURE_COMPRESS | TEMP_PRESSURE_SPILL)) && !MemoryManager->ReclaimBuffer)
+    {
+        MemoryManager->ReclaimBuffer = (PUCHAR)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (SIZE_T)MemoryManager->ChunkSize * 2 + TEMP_COMPRESS_WORKSPACE_SIZE,
+            TEMP_POOL_TAG);
+
+        if (!MemoryManager->ReclaimBuffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    MemoryManager->SpillRoutine = SpillRoutine;
+    MemoryManager->SpillContext = SpillContext;
+    MemoryManager->PressurePolicy = Policy;
 
     return STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+// Marks every chunk not accessed since the previous call as cold
+VOID TempAgeMemory(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    if (!MemoryManager)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < MemoryManager->BucketCount; i++)
+    {
+        PTEMP_BUCKET bucket = &MemoryManager->Buckets[i];
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+        bucket->AgeMark = bucket->Generation;
+        TempUnlockBucket(bucket, oldIrql);
+    }
+}
+
+// Compresses or spills a cold chunk from the snapshot in ReclaimBuffer and swaps it
+// in if the chunk was not touched meanwhile. Returns the bytes given back.
+static ULONG64 TempReclaimChunk(PTEMP_MEMORY_MANAGER MemoryManager, PTEMP_BUCKET Bucket, ULONG Slot, ULONG64 ChunkNumber, PTEMP_CHUNK Original, LONG64 Generation)
+{
+    PUCHAR snapshot = MemoryManager->ReclaimBuffer;
+    PUCHAR compressed = snapshot + MemoryManager->ChunkSize;
+    PVOID workspace = compressed + MemoryManager->ChunkSize;
+    ULONG compressedLength = 0;
+    PTEMP_CHUNK stub;
+
+    // Compression has to save at least an eighth of the chunk to be worth keeping
+    if (MemoryManager->PressurePolicy & TEMP_PRESSURE_COMPRESS)
+    {
+        compressedLength = TempCompressBuffer(
+            snapshot,
+            MemoryManager->ChunkSize,
+            compressed,
+            MemoryManager->ChunkSize - MemoryManager->ChunkSize / 8,
+            workspace);
+    }
+
+    if (compressedLength)
+    {
+        stub = (PTEMP_CHUNK)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            FIELD_OFFSET(TEMP_CHUNK, Data) + compressedLength,
+            TEMP_CHUNK_TAG);
+
+        if (!stub)
+        {
+            InterlockedIncrement64(&MemoryManager->AllocationFailures);
+            return 0;
+        }
+
+        stub->State = TEMP_CHUNK_COMPRESSED;
+        stub->StoredLength = compressedLength;
+        RtlCopyMemory(stub->Data, compressed, compressedLength);
+    }
+    else if (MemoryManager->PressurePolicy & TEMP_PRESSURE_SPILL)
+    {
+        stub = (PTEMP_CHUNK)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            sizeof(TEMP_CHUNK),
+            TEMP_CHUNK_TAG);
+
+        if (!stub)
+        {
+            InterlockedIncrement64(&MemoryManager->AllocationFailures);
+            return 0;
+        }
+
+        // Each chunk has a fixed home in the spill file at its own disk offset
+        NTSTATUS status = MemoryManager->SpillRoutine(
+            MemoryManager->SpillContext,
+            TRUE,
+            ChunkNumber << MemoryManager->ChunkShift,
+            snapshot,
+            MemoryManager->ChunkSize);
+
+        if (!NT_SUCCESS(status))
+        {
+            ExFreePool(stub);
+            return 0;
+        }
+
+        stub->State = TEMP_CHUNK_SPILLED;
+    }
+    else
+    {
+        return 0;
+    }
+
+    ULONG64 reclaimed = 0;
+
+    KIRQL oldIrql;
+    TempLockBucket(MemoryManager, Bucket, &oldIrql);
+
+    // Any access bumps the generation, and a freed and reallocated chunk gets a new one
+    if (Bucket->Chunks[Slot] == Original && Original->Generation == Generation)
+    {
+        stub->Generation = Generation;
+        stub->UsedMask = Original->UsedMask;
+        Bucket->Chunks[Slot] = stub;
+        Bucket->EvictionCount++;
+        ExFreePool(Original);
+        TempUnchargeMemory(MemoryManager, MemoryManager->ChunkSize);
+
+        if (stub->State == TEMP_CHUNK_COMPRESSED)
+        {
+            TempChargeMemory(MemoryManager, compressedLength, TRUE);
+            InterlockedIncrement64(&MemoryManager->CompressedChunks);
+            InterlockedAdd64(&MemoryManager->CompressedBytes, compressedLength);
+            reclaimed = MemoryManager->ChunkSize - compressedLength;
+        }
+        else
+        {
+            InterlockedIncrement64(&MemoryManager->SpilledChunks);
+            reclaimed = MemoryManager->ChunkSize;
+        }
+
+        stub = NULL;
+    }
+
+    TempUnlockBucket(Bucket, oldIrql);
+
+    if (stub)
+    {
+        ExFreePool(stub);
+    }
+
+    return reclaimed;
+}
+
+// Gives memory back according to the pressure policy, continuing from where the
+// previous call stopped. Returns the bytes reclaimed.
+ULONG64 TempReclaimMemory(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 TargetBytes)
+{
+    if (!MemoryManager || !MemoryManager->PressurePolicy)
+    {
+        return 0;
+    }
+
+    ULONG policy = MemoryManager->PressurePolicy;
+    ULONG64 totalChunks = (MemoryManager->MaxSize + MemoryManager->ChunkSize - 1) >> MemoryManager->ChunkShift;
+    ULONG64 chunksPerStripe = 1ULL << MemoryManager->StripeChunkShift;
+    ULONG64 reclaimed = 0;
+    ULONG64 scanned = 0;
+
+    // Cold chunks in stripes the heatmap shows busy are likely to be wanted again
+    // soon; they are only compressed or spilled once a full pass over the rest fell short
+    ULONG hotHeat = MemoryManager->HotStripeHeat;
+    BOOLEAN spareHot = hotHeat != 0;
+
+    while (reclaimed < TargetBytes)
+    {
+        if (scanned >= totalChunks)
+        {
+            if (!spareHot)
+            {
+                break;
+            }
+
+            spareHot = FALSE;
+            scanned = 0;
+        }
+
+        if (MemoryManager->ReclaimCursor >= totalChunks)
+        {
+            MemoryManager->ReclaimCursor = 0;
+        }
+
+        ULONG64 chunkNumber = MemoryManager->ReclaimCursor;
+        ULONG64 stripeEnd = (chunkNumber & ~(chunksPerStripe - 1)) + chunksPerStripe;
+        if (stripeEnd > totalChunks)
+        {
+            stripeEnd = totalChunks;
+        }
+
+        ULONG slot;
+        PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, chunkNumber, &slot);
+        PTEMP_CHUNK candidate = NULL;
+        LONG64 generation = 0;
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        PTEMP_STRIPE_HEAT heat = &bucket->Heat[slot >> MemoryManager->StripeChunkShift];
+        BOOLEAN hot = spareHot && (ULONG64)heat->Reads + heat->Writes >= hotHeat;
+
+        for (; chunkNumber < stripeEnd; chunkNumber++, slot++)
+        {
+            PTEMP_CHUNK chunk = TempSlotChunk(MemoryManager, bucket, slot);
+            scanned++;
+
+            if (!chunk || chunk->State != TEMP_CHUNK_RESIDENT)
+            {
+                continue;
+            }
+
+            // Unmapped slots already read back as zeros
+            if ((policy & TEMP_PRESSURE_RELEASE_ZERO) && TempIsZeroChunk(chunk->Data, MemoryManager->ChunkSize))
+            {
+                TempFreeChunk(MemoryManager, bucket, slot);
+                bucket->EvictionCount++;
+                reclaimed += MemoryManager->ChunkSize;
+                continue;
+            }
+
+            if ((policy & (TEMP_PRESSURE_COMPRESS | TEMP_PRESSURE_SPILL)) && !hot && chunk->Generation <= bucket->AgeMark)
+            {
+                RtlCopyMemory(MemoryManager->ReclaimBuffer, chunk->Data, MemoryManager->ChunkSize);
+                candidate = chunk;
+                generation = chunk->Generation;
+                break;
+            }
+        }
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        if (candidate)
+        {
+            reclaimed += TempReclaimChunk(MemoryManager, bucket, slot, chunkNumber, candidate, generation);
+            chunkNumber++;
+        }
+
+        MemoryManager->ReclaimCursor = chunkNumber;
+    }
+
+    InterlockedAdd64(&MemoryManager->BytesReclaimed, (LONG64)reclaimed);
+    return reclaimed;
+}
+
+// Brings compressed and spilled chunks back into memory once pressure has eased.
+// Returns the bytes of chunk data made resident again.
+ULONG64 TempRestoreMemory(PTEMP_MEMORY_MANAGER MemoryManager, ULONG64 TargetBytes)
+{
+    if (!MemoryManager ||
+        (MemoryManager->CompressedChunks == 0 && MemoryManager->SpilledChunks == 0))
+    {
+        return 0;
+    }
+
+    ULONG64 totalChunks = (MemoryManager->MaxSize + MemoryManager->ChunkSize - 1) >> MemoryManager->ChunkShift;
+    ULONG64 restored = 0;
+    ULONG64 scanned = 0;
+
+    // Restore stops short of where the budget would start reclaiming again
+    while (scanned < totalChunks && restored < TargetBytes &&
+           TempBudgetHasRoom(MemoryManager, MemoryManager->ChunkSize, TEMP_BUDGET_RESTORE_PERCENT))
+    {
+        if (MemoryManager->RestoreCursor >= totalChunks)
+        {
+            MemoryManager->RestoreCursor = 0;
+        }
+
+        ULONG64 chunkNumber = MemoryManager->RestoreCursor++;
+        scanned++;
+
+        ULONG slot;
+        PTEMP_BUCKET bucket = TempMapChunk(MemoryManager, chunkNumber, &slot);
+        PTEMP_CHUNK chunk;
+        NTSTATUS status;
+
+        KIRQL oldIrql;
+        TempLockBucket(MemoryManager, bucket, &oldIrql);
+
+        chunk = TempSlotChunk(MemoryManager, bucket, slot);
+        BOOLEAN present = chunk && (chunk->State == TEMP_CHUNK_COMPRESSED || chunk->State == TEMP_CHUNK_SPILLED);
+        status = TempResolveChunk(MemoryManager, bucket, slot, FALSE, &chunk);
+
+        TempUnlockBucket(bucket, oldIrql);
+
+        if (status == STATUS_PENDING)
+        {
+            status = TempFaultInChunk(MemoryManager, chunkNumber, FALSE);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            // Memory is tight again; try later
+            break;
+        }
+
+        if (present)
+        {
+            restored += MemoryManager->ChunkSize;
+        }
+    }
+
+    return restored;
+}
@@ -0,0 +1,240 @@
+#ifndef TEMP_PORTABLE_H
+#define TEMP_PORTABLE_H
+
+// User-mode stand-ins for the kernel primitives used by the memory manager.
+// Included by temp_core.h when TEMP_PORTABLE is defined so temp_memory.c can be
+// built without the WDK: on Linux for benchmarks and tools, and on Linux or
+// Windows user mode for the embeddable block store library (src/lib).
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+// windows.h already supplies the basic types, Interlocked* and the Rtl* memory macros
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+#ifndef MAXULONG
+#define MAXULONG 0xffffffffU
+#endif
+#ifndef MAXULONG64
+#define MAXULONG64 0xffffffffffffffffULL
+#endif
+#ifndef MAXLONG64
+#define MAXLONG64 0x7fffffffffffffffLL
+#endif
+
+// Status codes winnt.h leaves out
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED ((NTSTATUS)0xC0000002L)
+#define STATUS_NO_SUCH_DEVICE ((NTSTATUS)0xC000000EL)
+#define STATUS_DATA_ERROR ((NTSTATUS)0xC000003EL)
+#define STATUS_DEVICE_NOT_READY ((NTSTATUS)0xC00000A3L)
+#define STATUS_DEVICE_BUSY ((NTSTATUS)0x80000011L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#ifndef STATUS_PENDING
+#define STATUS_PENDING ((NTSTATUS)0x00000103L)
+#endif
+#ifndef STATUS_INVALID_PARAMETER
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#endif
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+// Spin locks map to slim reader/writer locks taken exclusively
+typedef SRWLOCK KSPIN_LOCK, *PKSPIN_LOCK;
+
+#define KeInitializeSpinLock(Lock) InitializeSRWLock(Lock)
+#define TEMP_SPIN_LOCK_INIT SRWLOCK_INIT // A statically initialized spin lock
+#define KeAcquireSpinLock(Lock, OldIrql) (*(OldIrql) = 0, AcquireSRWLockExclusive(Lock))
+#define KeReleaseSpinLock(Lock, OldIrql) ((void)(OldIrql), ReleaseSRWLockExclusive(Lock))
+#define KeTryToAcquireSpinLockAtDpcLevel(Lock) (TryAcquireSRWLockExclusive(Lock) != 0)
+#define KeAcquireSpinLockAtDpcLevel(Lock) AcquireSRWLockExclusive(Lock)
+#define KeReleaseSpinLockFromDpcLevel(Lock) ReleaseSRWLockExclusive(Lock)
+
+static __inline LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+
+    if (PerformanceFrequency)
+    {
+        QueryPerformanceFrequency(PerformanceFrequency);
+    }
+
+    return counter;
+}
+
+#define KeQueryActiveProcessorCountEx(GroupNumber) GetActiveProcessorCount(GroupNumber)
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Basic types
+typedef void VOID, *PVOID;
+typedef uint8_t UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef char CHAR, *PCHAR;
+typedef uint16_t USHORT, *PUSHORT, WCHAR, *PWCHAR;
+typedef uint32_t ULONG, *PULONG;
+typedef int32_t LONG, *PLONG;
+typedef int64_t LONG64, *PLONG64, LONGLONG;
+typedef uint64_t ULONG64, *PULONG64, ULONGLONG;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef int32_t NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define TRUE 1
+#define FALSE 0
+#define ANYSIZE_ARRAY 1
+#define MAX_PATH 260
+#define MAXULONG 0xffffffffU
+#define MAXULONG64 0xffffffffffffffffULL
+#define MAXLONG64 0x7fffffffffffffffLL
+#define PAGE_SIZE 4096
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define FIELD_OFFSET(Type, Field) ((LONG)offsetof(Type, Field))
+#define ARRAYSIZE(A) (sizeof(A) / sizeof((A)[0]))
+
+// Status codes
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING ((NTSTATUS)0x00000103L)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE ((NTSTATUS)0xC000000EL)
+#define STATUS_DATA_ERROR ((NTSTATUS)0xC000003EL)
+#define STATUS_DEVICE_NOT_READY ((NTSTATUS)0xC00000A3L)
+#define STATUS_DEVICE_BUSY ((NTSTATUS)0x80000011L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+// Spin locks map to mutexes; user-mode threads can be preempted while holding them
+typedef pthread_mutex_t KSPIN_LOCK, *PKSPIN_LOCK;
+
+#define KeInitializeSpinLock(Lock) pthread_mutex_init((Lock), NULL)
+#define TEMP_SPIN_LOCK_INIT PTHREAD_MUTEX_INITIALIZER // A statically initialized spin lock
+#define KeAcquireSpinLock(Lock, OldIrql) (*(OldIrql) = 0, pthread_mutex_lock(Lock))
+#define KeReleaseSpinLock(Lock, OldIrql) ((void)(OldIrql), pthread_mutex_unlock(Lock))
+#define KeTryToAcquireSpinLockAtDpcLevel(Lock) (pthread_mutex_trylock(Lock) == 0)
+#define KeAcquireSpinLockAtDpcLevel(Lock) pthread_mutex_lock(Lock)
+#define KeReleaseSpinLockFromDpcLevel(Lock) pthread_mutex_unlock(Lock)
+
+// Interlocked operations
+#define InterlockedIncrement(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target) __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(Target) __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedAdd(Target, Value) __atomic_add_fetch((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(Target, Value) __atomic_add_fetch((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(Target, Value) __atomic_fetch_add((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+
+static inline LONG InterlockedCompareExchange(volatile LONG *Destination, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+static inline LONG64 InterlockedCompareExchange64(volatile LONG64 *Destination, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+// The performance counter runs in nanoseconds
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+static inline LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+    struct timespec ts;
+    LARGE_INTEGER counter;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter.QuadPart = (LONGLONG)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    if (PerformanceFrequency)
+    {
+        PerformanceFrequency->QuadPart = 1000000000LL;
+    }
+
+    return counter;
+}
+
+// Processor topology
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+static inline ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    (void)GroupNumber;
+    return count > 0 ? (ULONG)count : 1;
+}
+
+#endif // _WIN32
+
+// Pool allocations; ExAllocatePool2 zeroes memory like the kernel version
+#define POOL_FLAG_NON_PAGED 0x0000000000000040ULL
+#define POOL_FLAG_UNINITIALIZED 0x0000000000000002ULL
+
+static inline PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    (void)Tag;
+    return (Flags & POOL_FLAG_UNINITIALIZED) ? malloc(NumberOfBytes) : calloc(1, NumberOfBytes);
+}
+
+#define ExFreePool(P) free(P)
+#define ExFreePoolWithTag(P, Tag) free(P)
+
+#ifndef RtlZeroMemory
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+
+// Volatile stores are not dropped as dead, so key material really is wiped
+static inline PVOID RtlSecureZeroMemory(PVOID Destination, SIZE_T Length)
+{
+    volatile UCHAR *bytes = (volatile UCHAR *)Destination;
+
+    while (Length--)
+    {
+        *bytes++ = 0;
+    }
+
+    return Destination;
+}
+#endif
+
+// There is no IRQL in user mode
+#define PASSIVE_LEVEL 0
+#define DISPATCH_LEVEL 2
+#define KeRaiseIrql(NewIrql, OldIrql) (*(OldIrql) = 0)
+#define KeLowerIrql(NewIrql) ((void)(NewIrql))
+
+#endif // TEMP_PORTABLE_H
@@ -0,0 +1,166 @@
+#include "temp_core.h"
+
+// Per-processor request trace rings. Writers on a processor claim positions with a
+// compare-exchange on that processor's Head and publish each slot through its
+// Sequence, so recording takes no lock and rarely shares a cache line with another
+// processor. A single reader at a time drains the rings and advances Tail.
+
+#define TEMP_POOL_TAG 'pmeT' // 'Temp' backwards
+
+NTSTATUS TempInitializeTraceBuffer(PTEMP_TRACE_BUFFER Trace, ULONG ProcessorCount, ULONG RecordsPerProcessor)
+{
+    if (!Trace || ProcessorCount == 0 || RecordsPerProcessor == 0 || RecordsPerProcessor > TEMP_TRACE_MAX_RECORDS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Positions map to slots with a mask
+    ULONG capacity = 1;
+    while (capacity < RecordsPerProcessor)
+    {
+        capacity <<= 1;
+    }
+
+    RtlZeroMemory(Trace, sizeof(TEMP_TRACE_BUFFER));
+
+    Trace->Rings = (PTEMP_TRACE_RING)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)ProcessorCount * sizeof(TEMP_TRACE_RING),
+        TEMP_POOL_TAG);
+
+    if (!Trace->Rings)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Trace->ProcessorCount = ProcessorCount;
+    Trace->Capacity = capacity;
+
+    for (ULONG i = 0; i < ProcessorCount; i++)
+    {
+        // Zeroed slots read as unpublished for every position but their first use,
+        // which is position 0 with Sequence 1
+        Trace->Rings[i].Slots = (PTEMP_TRACE_SLOT)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (SIZE_T)capacity * sizeof(TEMP_TRACE_SLOT),
+            TEMP_POOL_TAG);
+
+        if (!Trace->Rings[i].Slots)
+        {
+            TempCleanupTraceBuffer(Trace);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID TempCleanupTraceBuffer(PTEMP_TRACE_BUFFER Trace)
+{
+    if (!Trace || !Trace->Rings)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < Trace->ProcessorCount; i++)
+    {
+        if (Trace->Rings[i].Slots)
+        {
+            ExFreePool(Trace->Rings[i].Slots);
+        }
+    }
+
+    ExFreePool(Trace->Rings);
+    RtlZeroMemory(Trace, sizeof(TEMP_TRACE_BUFFER));
+}
+
+// Returns FALSE when the ring is full and the record was dropped
+BOOLEAN TempWriteTraceRecord(PTEMP_TRACE_BUFFER Trace, ULONG Processor, const TEMP_TRACE_RECORD *Record)
+{
+    if (!Trace || !Trace->Rings || !Record)
+    {
+        return FALSE;
+    }
+
+    PTEMP_TRACE_RING ring = &Trace->Rings[Processor % Trace->ProcessorCount];
+    LONG64 position = ring->Head;
+
+    for (;;)
+    {
+        // A stale Tail only makes the ring look fuller than it is
+        if (position - ring->Tail >= (LONG64)Trace->Capacity)
+        {
+            InterlockedIncrement64(&ring->Dropped);
+            return FALSE;
+        }
+
+        LONG64 previous = InterlockedCompareExchange64(&ring->Head, position + 1, position);
+        if (previous == position)
+        {
+            break;
+        }
+        position = previous;
+    }
+
+    PTEMP_TRACE_SLOT slot = &ring->Slots[position & (Trace->Capacity - 1)];
+    slot->Record = *Record;
+    InterlockedExchange64(&slot->Sequence, position + 1);
+
+    return TRUE;
+}
+
+// Copies up to MaxRecords published records out of the rings. Only one caller at a
+// time; a slot still being written stops its ring until the next read.
+ULONG TempReadTraceRecords(PTEMP_TRACE_BUFFER Trace, PTEMP_TRACE_RECORD Records, ULONG MaxRecords)
+{
+    ULONG count = 0;
+
+    if (!Trace || !Trace->Rings || !Records)
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < Trace->ProcessorCount && count < MaxRecords; i++)
+    {
+        ULONG ringIndex = (Trace->NextRing + i) % Trace->ProcessorCount;
+        PTEMP_TRACE_RING ring = &Trace->Rings[ringIndex];
+        LONG64 position = ring->Tail;
+
+        while (count < MaxRecords)
+        {
+            PTEMP_TRACE_SLOT slot = &ring->Slots[position & (Trace->Capacity - 1)];
+
+            if (InterlockedCompareExchange64(&slot->Sequence, 0, 0) != position + 1)
+            {
+                break;
+            }
+
+            Records[count++] = slot->Record;
+            position++;
+        }
+
+        // Hand the slots back to the writers only after the copies are done
+        InterlockedExchange64(&ring->Tail, position);
+    }
+
+    Trace->NextRing = (Trace->NextRing + 1) % Trace->ProcessorCount;
+
+    return count;
+}
+
+ULONG64 TempQueryTraceDropped(PTEMP_TRACE_BUFFER Trace)
+{
+    ULONG64 dropped = 0;
+
+    if (!Trace || !Trace->Rings)
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < Trace->ProcessorCount; i++)
+    {
+        dropped += Trace->Rings[i].Dropped;
+    }
+
+    return dropped;
+}
@@ -1,5 +1,8 @@
 #include "../core/temp_core.h"
 #include <ntstrsafe.h>
+#include <ntdddisk.h>
+#include <ntddstor.h>
+#include <bcrypt.h>
 
 // Pool tag for memory allocation tracking
 #define TEMP_POOL_TAG 'pmeT' // 'Temp' backwards
@@ -9,12 +12,20 @@ PDRIVER_OBJECT g_DriverObject = NULL;
 PDEVICE_OBJECT g_ControlDeviceObject = NULL;
 KSPIN_LOCK g_DeviceListLock;
 PTEMP_DEVICE_EXTENSION g_DeviceList[TEMP_MAX_DEVICES] = {NULL};
+FAST_MUTEX g_ResizeMutex; // Serializes TempResizeDevice
+LARGE_INTEGER g_PerformanceFrequency;
 
 // Function prototypes
 NTSTATUS TempCreateControlDevice(PDRIVER_OBJECT DriverObject);
 VOID TempDeleteControlDevice(VOID);
-PTEMP_DEVICE_EXTENSION TempFindDevice(ULONG DeviceNumber);
 NTSTATUS TempCompleteRequest(PIRP Irp, NTSTATUS Status, ULONG_PTR Information);
+NTSTATUS TempDispatchDiskControl(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, PIO_STACK_LOCATION IoStack, PULONG_PTR Information);
+NTSTATUS TempQueryStorageProperty(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, PIO_STACK_LOCATION IoStack, PULONG_PTR Information);
+NTSTATUS TempManageDataSet(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, PIO_STACK_LOCATION IoStack);
+VOID TempFillDiskGeometry(PTEMP_DEVICE_EXTENSION DeviceExtension, PDISK_GEOMETRY Geometry);
+ULONG64 TempElapsedNanoseconds(LARGE_INTEGER Start);
+ULONG64 TempTicksToNanoseconds(ULONG64 Ticks);
+VOID TempStopTrace(PTEMP_DEVICE_EXTENSION DeviceExtension);
 
 NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
 {
@@ -25,6 +36,11 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
     // Initialize global variables
     g_DriverObject = DriverObject;
     KeInitializeSpinLock(&g_DeviceListLock);
+    ExInitializeFastMutex(&g_ResizeMutex);
+    KeQueryPerformanceCounter(&g_PerformanceFrequency);
+    TempInitializeSharedStats();
+    TempInitializeMemoryBudget();
+    TempInitializeQos();
 
     // Set up driver dispatch routines
     DriverObject->DriverUnload = TempUnloadDriver;
@@ -42,6 +58,20 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
         return status;
     }
 
+    // Devices keep working without pressure handling if the monitor cannot start
+    status = TempStartPressureMonitor();
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("TEMP: memory pressure monitor unavailable (0x%08X)\n", status));
+    }
+
+    // Without the worker a removal frees the device's memory before it returns
+    status = TempStartRetireWorker();
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("TEMP: background memory release unavailable (0x%08X)\n", status));
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -49,26 +79,17 @@ VOID TempUnloadDriver(PDRIVER_OBJECT DriverObject)
 {
     UNREFERENCED_PARAMETER(DriverObject);
 
-    // Remove all devices
-    KIRQL oldIrql;
-    KeAcquireSpinLock(&g_DeviceListLock, &oldIrql);
+    TempStopPressureMonitor();
+    TempStopSharedStats();
 
+    // Remove all devices; TempRemoveDevice takes each off the list itself
     for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
     {
-        if (g_DeviceList[i] != NULL)
-        {
-            PTEMP_DEVICE_EXTENSION deviceExtension = g_DeviceList[i];
-            g_DeviceList[i] = NULL;
-            KeReleaseSpinLock(&g_DeviceListLock, oldIrql);
-
-            // Remove device
-            TempRemoveDevice(deviceExtension->DeviceNumber);
-
-            KeAcquireSpinLock(&g_DeviceListLock, &oldIrql);
-        }
+        TempRemoveDevice(i);
     }
 
-    KeReleaseSpinLock(&g_DeviceListLock, oldIrql);
+    // Their memory is freed before the driver goes
+    TempStopRetireWorker();
 
     // Delete control device
     TempDeleteControlDevice();
@@ -124,7 +145,23 @@ VOID TempDeleteControlDevice(VOID)
     }
 }
 
-NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateData)
+// Draws the key of a new encrypted device. It exists only inside the memory manager,
+// so the data cannot be read back once the device is removed.
+static NTSTATUS TempEnableEncryption(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    UCHAR key[TEMP_XTS_KEY_SIZE];
+
+    NTSTATUS status = BCryptGenRandom(NULL, key, sizeof(key), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (NT_SUCCESS(status))
+    {
+        status = TempSetEncryption(MemoryManager, key);
+    }
+
+    RtlSecureZeroMemory(key, sizeof(key));
+    return status;
+}
+
+NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateData, KPROCESSOR_MODE RequestorMode)
 {
     NTSTATUS status;
     PDEVICE_OBJECT deviceObject = NULL;
@@ -139,6 +176,39 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
         return STATUS_INVALID_PARAMETER;
     }
 
+    ULONG chunkSize = CreateData->ChunkSize ? CreateData->ChunkSize : TEMP_DEFAULT_CHUNK_SIZE;
+
+    // Sector and chunk sizes must be powers of two so offsets can be split with shifts
+    if (CreateData->SectorSize < TEMP_MIN_SECTOR_SIZE ||
+        CreateData->SectorSize > TEMP_MAX_SECTOR_SIZE ||
+        (CreateData->SectorSize & (CreateData->SectorSize - 1)) != 0 ||
+        chunkSize < TEMP_MIN_CHUNK_SIZE ||
+        chunkSize > TEMP_MAX_CHUNK_SIZE ||
+        (chunkSize & (chunkSize - 1)) != 0 ||
+        CreateData->DiskSize < CreateData->SectorSize ||
+        CreateData->DiskSize > TEMP_MAX_DISK_SIZE ||
+        (CreateData->PressurePolicy & ~TEMP_PRESSURE_POLICY_MASK) != 0 ||
+        CreateData->Encryption > TEMP_ENCRYPTION_AES_XTS ||
+        CreateData->ImageMode > TEMP_IMAGE_MAPPED ||
+        (CreateData->MemoryMaximum && CreateData->MemoryMaximum < CreateData->MemoryMinimum))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CreateData->SpillFileName[MAX_PATH - 1] = L'\0';
+    CreateData->FileName[MAX_PATH - 1] = L'\0';
+
+    // A mapped image keeps nothing in memory to compress, spill or encrypt
+    if (CreateData->ImageMode == TEMP_IMAGE_MAPPED &&
+        (CreateData->FileName[0] == L'\0' || CreateData->PressurePolicy || CreateData->Encryption))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if ((CreateData->PressurePolicy & TEMP_PRESSURE_SPILL) && CreateData->SpillFileName[0] == L'\0')
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
     // Check if device already exists
     KIRQL oldIrql;
     KeAcquireSpinLock(&g_DeviceListLock, &oldIrql);
@@ -166,10 +236,10 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
 
     RtlInitUnicodeString(&deviceName, deviceNameBuffer);
 
-    // Create device object
+    // Create device object; the request rundown follows the extension
     status = IoCreateDevice(
         DriverObject,
-        sizeof(TEMP_DEVICE_EXTENSION),
+        (ULONG)(sizeof(TEMP_DEVICE_EXTENSION) + ExSizeOfRundownProtectionCacheAware()),
         &deviceName,
         CreateData->CdRomType ? FILE_DEVICE_CD_ROM : FILE_DEVICE_DISK,
         CreateData->RemovableMedia ? FILE_REMOVABLE_MEDIA : 0,
@@ -186,15 +256,19 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
 
     // Initialize device extension
     deviceExtension->DeviceNumber = CreateData->DeviceNumber;
-    deviceExtension->DiskSize = CreateData->DiskSize;
     deviceExtension->SectorSize = CreateData->SectorSize;
+    deviceExtension->SectorShift = TempLog2(CreateData->SectorSize);
+    deviceExtension->DiskSize = CreateData->DiskSize & ~((ULONG64)CreateData->SectorSize - 1);
+    deviceExtension->ChunkSize = chunkSize;
     deviceExtension->DriveLetter = CreateData->DriveLetter;
     deviceExtension->RemovableMedia = CreateData->RemovableMedia;
     deviceExtension->CdRomType = CreateData->CdRomType;
     deviceExtension->DeviceObject = deviceObject;
-    deviceExtension->ReferenceCount = 1;
+    deviceExtension->IoRundown = (PEX_RUNDOWN_REF_CACHE_AWARE)(deviceExtension + 1);
 
+    ExInitializeRundownProtectionCacheAware(deviceExtension->IoRundown, ExSizeOfRundownProtectionCacheAware());
     KeInitializeEvent(&deviceExtension->RemoveEvent, NotificationEvent, FALSE);
+    ExInitializeFastMutex(&deviceExtension->TraceMutex);
 
     // Allocate memory manager
     deviceExtension->MemoryManager = (PTEMP_MEMORY_MANAGER)ExAllocatePool2(
@@ -209,9 +283,61 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
     }
 
     // Initialize memory manager
-    status = TempInitializeMemoryManager(deviceExtension->MemoryManager, CreateData->DiskSize);
+    status = TempInitializeMemoryManager(deviceExtension->MemoryManager, deviceExtension->DiskSize, chunkSize);
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePool(deviceExtension->MemoryManager);
+        IoDeleteDevice(deviceObject);
+        return status;
+    }
+
+    // Reserve the device's guaranteed share of the global memory budget
+    status = TempJoinMemoryBudget(deviceExtension, CreateData->MemoryMinimum, CreateData->MemoryMaximum);
+
+    if (NT_SUCCESS(status))
+    {
+        status = TempSetDeviceQos(deviceExtension, CreateData->IopsLimit, CreateData->BandwidthLimit, CreateData->QosWeight);
+    }
+
+    // Apply the memory pressure policy, opening the spill file it may need
+    if (NT_SUCCESS(status) && (CreateData->PressurePolicy & TEMP_PRESSURE_SPILL))
+    {
+        status = TempOpenSpillFile(deviceExtension, CreateData->SpillFileName, RequestorMode);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = TempSetPressurePolicy(
+            deviceExtension->MemoryManager,
+            CreateData->PressurePolicy,
+            deviceExtension->SpillFileHandle ? TempSpillTransfer : NULL,
+            deviceExtension);
+    }
+
+    if (NT_SUCCESS(status) && CreateData->Encryption == TEMP_ENCRYPTION_AES_XTS)
+    {
+        status = TempEnableEncryption(deviceExtension->MemoryManager);
+    }
+
+    // A device restored from an image is usable before any of it has been read
+    if (NT_SUCCESS(status) && CreateData->FileName[0] != L'\0')
+    {
+        status = CreateData->ImageMode == TEMP_IMAGE_MAPPED ? TempMapImage(deviceExtension, CreateData->FileName, RequestorMode)
+                                                            : TempOpenImage(deviceExtension, CreateData->FileName, RequestorMode);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = TempInitializeIoHistograms(&deviceExtension->IoHistograms,
+                                            KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    }
+
     if (!NT_SUCCESS(status))
     {
+        TempCleanupIoHistograms(&deviceExtension->IoHistograms);
+        TempCloseImage(deviceExtension);
+        TempCloseSpillFile(deviceExtension);
+        TempCleanupMemoryManager(deviceExtension->MemoryManager);
         ExFreePool(deviceExtension->MemoryManager);
         IoDeleteDevice(deviceObject);
         return status;
@@ -227,6 +353,9 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
 
     if (!deviceExtension->DeviceName.Buffer)
     {
+        TempCleanupIoHistograms(&deviceExtension->IoHistograms);
+        TempCloseImage(deviceExtension);
+        TempCloseSpillFile(deviceExtension);
         TempCleanupMemoryManager(deviceExtension->MemoryManager);
         ExFreePool(deviceExtension->MemoryManager);
         IoDeleteDevice(deviceObject);
@@ -264,8 +393,11 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
         }
     }
 
-    // Set device characteristics
-    deviceObject->Characteristics |= FILE_READ_ONLY_DEVICE;
+    // Set device characteristics (CD-ROM media and mapped images are write protected)
+    if (CreateData->CdRomType || deviceExtension->ReadOnly)
+    {
+        deviceObject->Characteristics |= FILE_READ_ONLY_DEVICE;
+    }
 
     if (CreateData->RemovableMedia)
     {
@@ -275,6 +407,15 @@ NTSTATUS TempCreateDevice(PDRIVER_OBJECT DriverObject, PTEMP_CREATE_DATA CreateD
     deviceObject->Flags |= DO_DIRECT_IO;
     deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
 
+    // The device works without its per-second history if the ring cannot be allocated
+    status = TempStartHistory(deviceExtension);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("TEMP: device %u has no history (0x%08X)\n", CreateData->DeviceNumber, status));
+    }
+
+    TempStartImagePrefetch(deviceExtension);
+
     // Add to device list
     KeAcquireSpinLock(&g_DeviceListLock, &oldIrql);
     g_DeviceList[CreateData->DeviceNumber] = deviceExtension;
@@ -303,16 +444,16 @@ NTSTATUS TempRemoveDevice(ULONG DeviceNumber)
     g_DeviceList[DeviceNumber] = NULL;
     KeReleaseSpinLock(&g_DeviceListLock, oldIrql);
 
-    // Signal removal and wait for reference count to reach zero
+    // Wake requests held back by QoS, then wait for every request and reference
+    // still inside the device. Requests arriving from here on fail at the rundown.
     KeSetEvent(&deviceExtension->RemoveEvent, IO_NO_INCREMENT, FALSE);
+    ExWaitForRundownProtectionReleaseCacheAware(deviceExtension->IoRundown);
 
-    // Wait for all references to be released
-    while (InterlockedCompareExchange(&deviceExtension->ReferenceCount, 0, 0) > 0)
-    {
-        LARGE_INTEGER interval;
-        interval.QuadPart = -100000; // 10ms
-        KeDelayExecutionThread(KernelMode, FALSE, &interval);
-    }
+    // The history DPC reads the memory manager and histograms freed below
+    TempStopHistory(deviceExtension);
+
+    // So does the image prefetcher, and late faults still use the image file
+    TempCloseImage(deviceExtension);
 
     // Delete symbolic link
     if (deviceExtension->SymbolicLinkName.Buffer)
@@ -321,11 +462,19 @@ NTSTATUS TempRemoveDevice(ULONG DeviceNumber)
         ExFreePool(deviceExtension->SymbolicLinkName.Buffer);
     }
 
-    // Cleanup memory manager
-    if (deviceExtension->MemoryManager)
+    // The chunks are freed in the background, so the removal does not wait on the
+    // size of the disk
+    TempRetireMemoryManager(deviceExtension->MemoryManager);
+    deviceExtension->MemoryManager = NULL;
+
+    TempCloseSpillFile(deviceExtension);
+    TempCleanupIoHistograms(&deviceExtension->IoHistograms);
+
+    // No request is left to record, so the rings can go without waiting on the rundown
+    TempCleanupTraceBuffer(&deviceExtension->Trace);
+    if (deviceExtension->TraceRundown)
     {
-        TempCleanupMemoryManager(deviceExtension->MemoryManager);
-        ExFreePool(deviceExtension->MemoryManager);
+        ExFreeCacheAwareRundownProtection(deviceExtension->TraceRundown);
     }
 
     // Free device name
@@ -340,6 +489,217 @@ NTSTATUS TempRemoveDevice(ULONG DeviceNumber)
     return STATUS_SUCCESS;
 }
 
+// Changes the capacity of a live device. NewSize is rounded down to a whole number
+// of sectors and the size actually applied is returned through it. Growing is
+// visible to the file system once it is extended (FSCTL_EXTEND_VOLUME); shrinking
+// discards everything past the new end.
+NTSTATUS TempResizeDevice(ULONG DeviceNumber, PULONG64 NewSize)
+{
+    NTSTATUS status;
+
+    if (!NewSize)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(DeviceNumber);
+    if (!deviceExtension)
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    ULONG64 newSize = *NewSize & ~((ULONG64)deviceExtension->SectorSize - 1);
+
+    if (deviceExtension->CdRomType || deviceExtension->ReadOnly)
+    {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else if (newSize < deviceExtension->SectorSize || newSize > TEMP_MAX_DISK_SIZE)
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        ExAcquireFastMutex(&g_ResizeMutex);
+
+        ULONG64 oldSize = deviceExtension->DiskSize;
+
+        if (newSize != oldSize && deviceExtension->MemoryManager &&
+            deviceExtension->MemoryManager->ImagePendingChunks > 0)
+        {
+            // Refused by the memory manager too, but I/O past a new end must not fail meanwhile
+            status = STATUS_DEVICE_BUSY;
+        }
+        else if (newSize < oldSize)
+        {
+            // Stop admitting I/O past the new end before its memory goes away
+            InterlockedExchange64((volatile LONG64 *)&deviceExtension->DiskSize, (LONG64)newSize);
+            status = TempResizeMemoryManager(deviceExtension->MemoryManager, newSize);
+            if (!NT_SUCCESS(status))
+            {
+                InterlockedExchange64((volatile LONG64 *)&deviceExtension->DiskSize, (LONG64)oldSize);
+            }
+        }
+        else if (newSize > oldSize)
+        {
+            // The memory manager must cover the new range before I/O can reach it
+            status = TempResizeMemoryManager(deviceExtension->MemoryManager, newSize);
+            if (NT_SUCCESS(status))
+            {
+                InterlockedExchange64((volatile LONG64 *)&deviceExtension->DiskSize, (LONG64)newSize);
+            }
+        }
+        else
+        {
+            status = STATUS_SUCCESS;
+        }
+
+        ExReleaseFastMutex(&g_ResizeMutex);
+
+        if (NT_SUCCESS(status))
+        {
+            KdPrint(("TEMP: device %u resized from %I64u to %I64u bytes\n", DeviceNumber, oldSize, newSize));
+            *NewSize = newSize;
+        }
+    }
+
+    TempDereferenceDevice(deviceExtension);
+
+    return status;
+}
+
+// Starts or stops request tracing on a device. Starting an active trace discards
+// whatever was not read yet and begins again with freshly sized rings.
+NTSTATUS TempSetTrace(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_TRACE_CONTROL Control)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!DeviceExtension || !Control)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG records = Control->RecordsPerProcessor ? Control->RecordsPerProcessor : TEMP_TRACE_DEFAULT_RECORDS;
+    if (Control->Enable && records > TEMP_TRACE_MAX_RECORDS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&DeviceExtension->TraceMutex);
+
+    TempStopTrace(DeviceExtension);
+
+    if (Control->Enable)
+    {
+        // Writers only look at the rundown once TraceEnabled is set, and it then
+        // lives as long as the device
+        if (!DeviceExtension->TraceRundown)
+        {
+            DeviceExtension->TraceRundown = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, TEMP_POOL_TAG);
+        }
+
+        if (!DeviceExtension->TraceRundown)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        else
+        {
+            TempCleanupTraceBuffer(&DeviceExtension->Trace);
+            status = TempInitializeTraceBuffer(&DeviceExtension->Trace,
+                                               KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+                                               records);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            DeviceExtension->TraceStart = KeQueryPerformanceCounter(NULL);
+            InterlockedExchange(&DeviceExtension->TraceEnabled, 1);
+        }
+    }
+
+    ExReleaseFastMutex(&DeviceExtension->TraceMutex);
+
+    return status;
+}
+
+// Stops recording and waits out writers still inside the rings. The rings stay
+// allocated so the records they hold can be read. Called with TraceMutex held.
+VOID TempStopTrace(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    if (!InterlockedExchange(&DeviceExtension->TraceEnabled, 0))
+    {
+        return;
+    }
+
+    ExWaitForRundownProtectionReleaseCacheAware(DeviceExtension->TraceRundown);
+    ExReInitializeRundownProtectionCacheAware(DeviceExtension->TraceRundown);
+}
+
+NTSTATUS TempReadTrace(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_TRACE_DATA Data, ULONG OutputLength, PULONG_PTR Information)
+{
+    if (!DeviceExtension || !Data || OutputLength < FIELD_OFFSET(TEMP_TRACE_DATA, Records))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    ULONG maxRecords = (OutputLength - FIELD_OFFSET(TEMP_TRACE_DATA, Records)) / sizeof(TEMP_TRACE_RECORD);
+
+    ExAcquireFastMutex(&DeviceExtension->TraceMutex);
+
+    Data->RecordCount = TempReadTraceRecords(&DeviceExtension->Trace, Data->Records, maxRecords);
+    Data->Active = DeviceExtension->TraceEnabled ? 1 : 0;
+    Data->DroppedRecords = TempQueryTraceDropped(&DeviceExtension->Trace);
+
+    // A stopped trace that has been read to the end has nothing more to give
+    if (!Data->Active && Data->RecordCount < maxRecords)
+    {
+        TempCleanupTraceBuffer(&DeviceExtension->Trace);
+    }
+
+    ExReleaseFastMutex(&DeviceExtension->TraceMutex);
+
+    *Information = FIELD_OFFSET(TEMP_TRACE_DATA, Records) + (ULONG_PTR)Data->RecordCount * sizeof(TEMP_TRACE_RECORD);
+
+    return STATUS_SUCCESS;
+}
+
+// Records one completed request while tracing is on. Start is the request's arrival
+// as read from KeQueryPerformanceCounter, Latency its service time in nanoseconds.
+VOID TempTraceRequest(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG Operation, LARGE_INTEGER Start, ULONG64 Offset, ULONG64 Length, ULONG64 Latency, NTSTATUS Status)
+{
+    // The common case: a single read of a flag nobody writes
+    if (!DeviceExtension->TraceEnabled)
+    {
+        return;
+    }
+
+    if (!ExAcquireRundownProtectionCacheAware(DeviceExtension->TraceRundown))
+    {
+        return;
+    }
+
+    // Tracing may have stopped and the rundown been re-armed since the check above
+    if (DeviceExtension->TraceEnabled)
+    {
+        TEMP_TRACE_RECORD record;
+        LONG64 sinceStart = Start.QuadPart - DeviceExtension->TraceStart.QuadPart;
+
+        record.Timestamp = sinceStart > 0 ? TempTicksToNanoseconds((ULONG64)sinceStart) : 0;
+        record.Offset = (ULONG)(Offset >> TEMP_TRACE_OFFSET_SHIFT);
+        record.Length = Length < MAXULONG ? (ULONG)Length : MAXULONG;
+        record.Latency = Latency < MAXULONG ? (ULONG)Latency : MAXULONG;
+        record.Operation = (UCHAR)Operation;
+        record.Flags = NT_SUCCESS(Status) ? 0 : TEMP_TRACE_FLAG_FAILED;
+
+        ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+        record.Processor = (USHORT)processor;
+
+        TempWriteTraceRecord(&DeviceExtension->Trace, processor, &record);
+    }
+
+    ExReleaseRundownProtectionCacheAware(DeviceExtension->TraceRundown);
+}
+
 PTEMP_DEVICE_EXTENSION TempFindDevice(ULONG DeviceNumber)
 {
     if (DeviceNumber >= TEMP_MAX_DEVICES)
@@ -350,10 +710,11 @@ PTEMP_DEVICE_EXTENSION TempFindDevice(ULONG DeviceNumber)
     KIRQL oldIrql;
     KeAcquireSpinLock(&g_DeviceListLock, &oldIrql);
 
+    // A device on the list has not started its rundown yet
     PTEMP_DEVICE_EXTENSION deviceExtension = g_DeviceList[DeviceNumber];
-    if (deviceExtension)
+    if (deviceExtension && !ExAcquireRundownProtectionCacheAware(deviceExtension->IoRundown))
     {
-        InterlockedIncrement(&deviceExtension->ReferenceCount);
+        deviceExtension = NULL;
     }
 
     KeReleaseSpinLock(&g_DeviceListLock, oldIrql);
@@ -361,6 +722,84 @@ PTEMP_DEVICE_EXTENSION TempFindDevice(ULONG DeviceNumber)
     return deviceExtension;
 }
 
+// Releases a reference taken by TempFindDevice
+VOID TempDereferenceDevice(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension)
+    {
+        ExReleaseRundownProtectionCacheAware(DeviceExtension->IoRundown);
+    }
+}
+
+// The counters returned by TEMP_IOCTL_GET_STATISTICS
+static VOID TempQueryDeviceStatistics(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_STATISTICS Statistics)
+{
+    RtlZeroMemory(Statistics, sizeof(TEMP_STATISTICS));
+    Statistics->DeviceNumber = DeviceExtension->DeviceNumber;
+    Statistics->DiskSize = DeviceExtension->DiskSize;
+    Statistics->BytesRead = DeviceExtension->BytesRead;
+    Statistics->BytesWritten = DeviceExtension->BytesWritten;
+    TempQueryMemoryStatistics(DeviceExtension->MemoryManager, Statistics);
+}
+
+// Configuration and statistics of one device, for the device list and the shared page
+VOID TempQueryDeviceInfo(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_DEVICE_INFO Info)
+{
+    RtlZeroMemory(Info, sizeof(TEMP_DEVICE_INFO));
+    Info->DeviceNumber = DeviceExtension->DeviceNumber;
+    Info->SectorSize = DeviceExtension->SectorSize;
+    Info->ChunkSize = DeviceExtension->ChunkSize;
+    Info->PressurePolicy = DeviceExtension->MemoryManager->PressurePolicy;
+    Info->Encryption = DeviceExtension->MemoryManager->Cipher ? TEMP_ENCRYPTION_AES_XTS : TEMP_ENCRYPTION_NONE;
+    Info->RemovableMedia = DeviceExtension->RemovableMedia;
+    Info->CdRomType = DeviceExtension->CdRomType;
+
+    // Only letters that got a symbolic link are reported
+    if (DeviceExtension->SymbolicLinkName.Buffer)
+    {
+        Info->DriveLetter = DeviceExtension->DriveLetter;
+    }
+
+    TempQueryDeviceStatistics(DeviceExtension, &Info->Statistics);
+}
+
+// Fills List with every device in number order, as many as the output holds, so
+// callers need one request instead of opening each device in turn
+NTSTATUS TempListDevices(PTEMP_DEVICE_LIST List, ULONG OutputLength, PULONG_PTR Information)
+{
+    if (OutputLength < FIELD_OFFSET(TEMP_DEVICE_LIST, Devices))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    ULONG maxDevices = (OutputLength - FIELD_OFFSET(TEMP_DEVICE_LIST, Devices)) / sizeof(TEMP_DEVICE_INFO);
+
+    RtlZeroMemory(List, FIELD_OFFSET(TEMP_DEVICE_LIST, Devices));
+    List->Version = TEMP_DEVICE_LIST_VERSION;
+    List->Size = FIELD_OFFSET(TEMP_DEVICE_LIST, Devices);
+    List->EntrySize = sizeof(TEMP_DEVICE_INFO);
+
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+        if (!deviceExtension)
+        {
+            continue;
+        }
+
+        if (List->DevicesReturned < maxDevices)
+        {
+            TempQueryDeviceInfo(deviceExtension, &List->Devices[List->DevicesReturned++]);
+        }
+
+        List->DeviceCount++;
+        TempDereferenceDevice(deviceExtension);
+    }
+
+    *Information = FIELD_OFFSET(TEMP_DEVICE_LIST, Devices) + (ULONG_PTR)List->DevicesReturned * sizeof(TEMP_DEVICE_INFO);
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS TempCompleteRequest(PIRP Irp, NTSTATUS Status, ULONG_PTR Information)
 {
     Irp->IoStatus.Status = Status;
@@ -375,18 +814,44 @@ NTSTATUS TempDispatchCreateClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     return TempCompleteRequest(Irp, STATUS_SUCCESS, 0);
 }
 
-NTSTATUS TempDispatchReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+// Nanoseconds since Start, a KeQueryPerformanceCounter reading
+ULONG64 TempElapsedNanoseconds(LARGE_INTEGER Start)
+{
+    return TempTicksToNanoseconds((ULONG64)(KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart));
+}
+
+ULONG64 TempTicksToNanoseconds(ULONG64 Ticks)
+{
+    ULONG64 frequency = (ULONG64)g_PerformanceFrequency.QuadPart;
+
+    // Split the conversion so long intervals cannot overflow
+    return (Ticks / frequency) * 1000000000ULL + (Ticks % frequency) * 1000000000ULL / frequency;
+}
+
+// Requests on a disk device run under its rundown, which TempRemoveDevice waits on;
+// once removal has started they fail here instead of reaching a device being torn down
+static BOOLEAN TempEnterDevice(PDEVICE_OBJECT DeviceObject)
+{
+    PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    return ExAcquireRundownProtectionCacheAware(deviceExtension->IoRundown);
+}
+
+static VOID TempLeaveDevice(PDEVICE_OBJECT DeviceObject)
 {
+    PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    ExReleaseRundownProtectionCacheAware(deviceExtension->IoRundown);
+}
+
+static NTSTATUS TempReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+    LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
     PIO_STACK_LOCATION ioStack = IoGetCurrentIrpStackLocation(Irp);
     PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
     NTSTATUS status = STATUS_SUCCESS;
     ULONG_PTR bytesTransferred = 0;
 
-    if (DeviceObject == g_ControlDeviceObject)
-    {
-        return TempCompleteRequest(Irp, STATUS_INVALID_DEVICE_REQUEST, 0);
-    }
-
     if (!deviceExtension || !deviceExtension->MemoryManager)
     {
         return TempCompleteRequest(Irp, STATUS_NO_SUCH_DEVICE, 0);
@@ -396,6 +861,24 @@ NTSTATUS TempDispatchReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     ULONG length = ioStack->Parameters.Read.Length;
     PVOID buffer = NULL;
 
+    // Check bounds and sector alignment
+    ULONG sectorMask = deviceExtension->SectorSize - 1;
+    if (startOffset + length > deviceExtension->DiskSize ||
+        (startOffset & sectorMask) != 0 ||
+        (length & sectorMask) != 0)
+    {
+        return TempCompleteRequest(Irp, STATUS_INVALID_PARAMETER, 0);
+    }
+
+    if (length == 0)
+    {
+        return TempCompleteRequest(Irp, STATUS_SUCCESS, 0);
+    }
+
+    // Requests over the device's QoS limits, and low-priority ones while others are
+    // active, wait here; the wait counts toward their latency
+    TempThrottleRequest(deviceExtension, Irp, start, length);
+
     if (Irp->MdlAddress)
     {
         buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
@@ -406,25 +889,26 @@ NTSTATUS TempDispatchReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
         return TempCompleteRequest(Irp, STATUS_INSUFFICIENT_RESOURCES, 0);
     }
 
-    // Check bounds
-    if (startOffset + length > deviceExtension->DiskSize)
-    {
-        return TempCompleteRequest(Irp, STATUS_INVALID_PARAMETER, 0);
-    }
-
-    ULONG64 startSector = startOffset / deviceExtension->SectorSize;
-    ULONG sectorCount = (length + deviceExtension->SectorSize - 1) / deviceExtension->SectorSize;
+    ULONG64 startSector = startOffset >> deviceExtension->SectorShift;
+    ULONG sectorCount = length >> deviceExtension->SectorShift;
 
     if (ioStack->MajorFunction == IRP_MJ_READ)
     {
         InterlockedIncrement64(&deviceExtension->ReadRequests);
 
-        status = TempReadSectors(
-            deviceExtension->MemoryManager,
-            startSector,
-            sectorCount,
-            buffer,
-            deviceExtension->SectorSize);
+        if (deviceExtension->ReadOnly)
+        {
+            status = TempReadMappedImage(deviceExtension, startOffset, buffer, length);
+        }
+        else
+        {
+            status = TempReadSectors(
+                deviceExtension->MemoryManager,
+                startSector,
+                sectorCount,
+                buffer,
+                deviceExtension->SectorSize);
+        }
 
         if (NT_SUCCESS(status))
         {
@@ -432,6 +916,11 @@ NTSTATUS TempDispatchReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             InterlockedAdd64(&deviceExtension->BytesRead, bytesTransferred);
         }
     }
+    else if (ioStack->MajorFunction == IRP_MJ_WRITE && deviceExtension->ReadOnly)
+    {
+        InterlockedIncrement64(&deviceExtension->WriteRequests);
+        status = STATUS_MEDIA_WRITE_PROTECTED;
+    }
     else if (ioStack->MajorFunction == IRP_MJ_WRITE)
     {
         InterlockedIncrement64(&deviceExtension->WriteRequests);
@@ -450,11 +939,36 @@ NTSTATUS TempDispatchReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
         }
     }
 
+    ULONG operation = ioStack->MajorFunction == IRP_MJ_READ ? TEMP_OPERATION_READ : TEMP_OPERATION_WRITE;
+    ULONG64 latency = TempElapsedNanoseconds(start);
+
+    TempRecordOperation(&deviceExtension->IoHistograms, KeGetCurrentProcessorNumberEx(NULL), operation, latency, length);
+    TempTraceRequest(deviceExtension, operation, start, startOffset, length, latency, status);
+
     return TempCompleteRequest(Irp, status, bytesTransferred);
 }
 
-NTSTATUS TempDispatchDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+NTSTATUS TempDispatchReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+    if (DeviceObject == g_ControlDeviceObject)
+    {
+        return TempCompleteRequest(Irp, STATUS_INVALID_DEVICE_REQUEST, 0);
+    }
+
+    if (!TempEnterDevice(DeviceObject))
+    {
+        return TempCompleteRequest(Irp, STATUS_NO_SUCH_DEVICE, 0);
+    }
+
+    NTSTATUS status = TempReadWrite(DeviceObject, Irp);
+    TempLeaveDevice(DeviceObject);
+
+    return status;
+}
+
+static NTSTATUS TempDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
+    LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
     PIO_STACK_LOCATION ioStack = IoGetCurrentIrpStackLocation(Irp);
     ULONG ioControlCode = ioStack->Parameters.DeviceIoControl.IoControlCode;
     NTSTATUS status = STATUS_INVALID_DEVICE_REQUEST;
@@ -469,7 +983,7 @@ NTSTATUS TempDispatchDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
         {
 
             PTEMP_CREATE_DATA createData = (PTEMP_CREATE_DATA)Irp->AssociatedIrp.SystemBuffer;
-            status = TempCreateDevice(g_DriverObject, createData);
+            status = TempCreateDevice(g_DriverObject, createData, Irp->RequestorMode);
         }
         break;
     }
@@ -486,6 +1000,103 @@ NTSTATUS TempDispatchDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
         break;
     }
 
+    case TEMP_IOCTL_FORMAT_DEVICE:
+    {
+        if (DeviceObject == g_ControlDeviceObject &&
+            ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(ULONG))
+        {
+            PULONG deviceNumber = (PULONG)Irp->AssociatedIrp.SystemBuffer;
+            status = TempFormatDevice(*deviceNumber);
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_COPY_RANGE:
+    {
+        if (DeviceObject == g_ControlDeviceObject &&
+            ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(TEMP_COPY_DATA) &&
+            ioStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(TEMP_COPY_DATA))
+        {
+            PTEMP_COPY_DATA copyData = (PTEMP_COPY_DATA)Irp->AssociatedIrp.SystemBuffer;
+            status = TempCopyDevice(copyData, Irp->RequestorMode);
+            if (NT_SUCCESS(status))
+            {
+                information = sizeof(TEMP_COPY_DATA);
+            }
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_RESIZE_DEVICE:
+    {
+        if (DeviceObject == g_ControlDeviceObject &&
+            ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(TEMP_RESIZE_DATA) &&
+            ioStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(TEMP_RESIZE_DATA))
+        {
+
+            PTEMP_RESIZE_DATA resizeData = (PTEMP_RESIZE_DATA)Irp->AssociatedIrp.SystemBuffer;
+            status = TempResizeDevice(resizeData->DeviceNumber, &resizeData->NewSize);
+            if (NT_SUCCESS(status))
+            {
+                information = sizeof(TEMP_RESIZE_DATA);
+            }
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_LIST_DEVICES:
+    {
+        if (DeviceObject == g_ControlDeviceObject)
+        {
+            status = TempListDevices(
+                (PTEMP_DEVICE_LIST)Irp->AssociatedIrp.SystemBuffer,
+                ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                &information);
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_SET_SHARED_STATS:
+    {
+        if (DeviceObject == g_ControlDeviceObject &&
+            ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(ULONG))
+        {
+            // Interval in milliseconds, 0 to stop refreshing and remove the section
+            status = TempSetSharedStats(*(PULONG)Irp->AssociatedIrp.SystemBuffer);
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_MEMORY_BUDGET:
+    case TEMP_IOCTL_SET_MEMORY_BUDGET:
+    {
+        if (DeviceObject == g_ControlDeviceObject)
+        {
+            status = TempControlMemoryBudget(
+                Irp->AssociatedIrp.SystemBuffer,
+                ioStack->Parameters.DeviceIoControl.InputBufferLength,
+                ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                ioControlCode == TEMP_IOCTL_SET_MEMORY_BUDGET,
+                &information);
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_QOS:
+    case TEMP_IOCTL_SET_QOS:
+    {
+        if (DeviceObject == g_ControlDeviceObject)
+        {
+            status = TempControlQos(
+                Irp->AssociatedIrp.SystemBuffer,
+                ioStack->Parameters.DeviceIoControl.InputBufferLength,
+                ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                ioControlCode == TEMP_IOCTL_SET_QOS,
+                &information);
+        }
+        break;
+    }
+
     case TEMP_IOCTL_GET_VERSION:
     {
         if (ioStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(ULONG))
@@ -509,15 +1120,7 @@ NTSTATUS TempDispatchDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
             if (deviceExtension && deviceExtension->MemoryManager)
             {
-                RtlZeroMemory(stats, sizeof(TEMP_STATISTICS));
-                stats->DeviceNumber = deviceExtension->DeviceNumber;
-                stats->DiskSize = deviceExtension->DiskSize;
-                stats->BytesRead = deviceExtension->BytesRead;
-                stats->BytesWritten = deviceExtension->BytesWritten;
-                stats->TotalReads = deviceExtension->MemoryManager->TotalReads;
-                stats->TotalWrites = deviceExtension->MemoryManager->TotalWrites;
-                stats->CacheHits = deviceExtension->MemoryManager->TotalHits;
-                stats->CacheMisses = deviceExtension->MemoryManager->TotalMisses;
+                TempQueryDeviceStatistics(deviceExtension, stats);
 
                 information = sizeof(TEMP_STATISTICS);
                 status = STATUS_SUCCESS;
@@ -526,14 +1129,842 @@ NTSTATUS TempDispatchDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
         break;
     }
 
+    case TEMP_IOCTL_GET_MEMORY_STATISTICS:
+    {
+        ULONG outputLength = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+        // Callers built against an older, shorter structure get its prefix; Version
+        // and Size are always returned so newer ones can tell which fields are valid
+        if (DeviceObject != g_ControlDeviceObject &&
+            outputLength >= FIELD_OFFSET(TEMP_MEMORY_STATISTICS, DeviceNumber))
+        {
+
+            PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+            if (deviceExtension && deviceExtension->MemoryManager)
+            {
+                TEMP_MEMORY_STATISTICS usage;
+                TempQueryMemoryUsage(deviceExtension->MemoryManager, &usage);
+                usage.DeviceNumber = deviceExtension->DeviceNumber;
+
+                information = min(outputLength, sizeof(TEMP_MEMORY_STATISTICS));
+                RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, &usage, information);
+                status = STATUS_SUCCESS;
+            }
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_GET_LATENCY_STATISTICS:
+    {
+        ULONG outputLength = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+        if (DeviceObject != g_ControlDeviceObject &&
+            outputLength >= FIELD_OFFSET(TEMP_LATENCY_STATISTICS, DeviceNumber))
+        {
+
+            PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+            // About 12KB; too large for the kernel stack
+            PTEMP_LATENCY_STATISTICS latency = (PTEMP_LATENCY_STATISTICS)ExAllocatePool2(
+                POOL_FLAG_NON_PAGED,
+                sizeof(TEMP_LATENCY_STATISTICS),
+                TEMP_POOL_TAG);
+
+            if (!latency)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+            }
+            else if (deviceExtension)
+            {
+                TempQueryIoHistograms(&deviceExtension->IoHistograms, latency);
+                latency->DeviceNumber = deviceExtension->DeviceNumber;
+
+                information = min(outputLength, sizeof(TEMP_LATENCY_STATISTICS));
+                RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, latency, information);
+                status = STATUS_SUCCESS;
+            }
+
+            if (latency)
+            {
+                ExFreePool(latency);
+            }
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_SET_LOCK_PROFILING:
+    {
+        if (DeviceObject != g_ControlDeviceObject &&
+            ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(ULONG))
+        {
+
+            PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+            if (deviceExtension && deviceExtension->MemoryManager)
+            {
+                TempSetLockProfiling(deviceExtension->MemoryManager, *(PULONG)Irp->AssociatedIrp.SystemBuffer != 0);
+                status = STATUS_SUCCESS;
+            }
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_GET_LOCK_CONTENTION:
+    {
+        ULONG outputLength = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+        if (DeviceObject != g_ControlDeviceObject &&
+            outputLength >= FIELD_OFFSET(TEMP_LOCK_CONTENTION, DeviceNumber))
+        {
+            PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+            ULONG topCount = TEMP_LOCK_CONTENTION_DEFAULT_TOP;
+
+            // The input shares the system buffer with the output; read it first
+            if (ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(ULONG))
+            {
+                topCount = *(PULONG)Irp->AssociatedIrp.SystemBuffer;
+            }
+
+            // About 3.5KB; too large for the kernel stack
+            PTEMP_LOCK_CONTENTION contention = (PTEMP_LOCK_CONTENTION)ExAllocatePool2(
+                POOL_FLAG_NON_PAGED,
+                sizeof(TEMP_LOCK_CONTENTION),
+                TEMP_POOL_TAG);
+
+            if (!contention)
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+            }
+            else if (deviceExtension && deviceExtension->MemoryManager)
+            {
+                TempQueryLockContention(deviceExtension->MemoryManager, contention, topCount);
+                contention->DeviceNumber = deviceExtension->DeviceNumber;
+
+                information = min(outputLength, sizeof(TEMP_LOCK_CONTENTION));
+                RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, contention, information);
+                status = STATUS_SUCCESS;
+            }
+
+            if (contention)
+            {
+                ExFreePool(contention);
+            }
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_GET_HEATMAP:
+    {
+        ULONG outputLength = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+        PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+        if (DeviceObject != g_ControlDeviceObject &&
+            deviceExtension && deviceExtension->MemoryManager &&
+            outputLength >= FIELD_OFFSET(TEMP_HEATMAP, Regions))
+        {
+            TEMP_HEATMAP_QUERY query = {0, 0};
+
+            // The input shares the system buffer with the output; read it first
+            if (ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(TEMP_HEATMAP_QUERY))
+            {
+                query = *(PTEMP_HEATMAP_QUERY)Irp->AssociatedIrp.SystemBuffer;
+            }
+
+            if (query.RegionShift > TEMP_HEATMAP_MAX_REGION_SHIFT)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            PTEMP_HEATMAP heatmap = (PTEMP_HEATMAP)Irp->AssociatedIrp.SystemBuffer;
+            ULONG maxRegions = (outputLength - FIELD_OFFSET(TEMP_HEATMAP, Regions)) / sizeof(TEMP_HEATMAP_REGION);
+
+            TempQueryHeatmap(deviceExtension->MemoryManager, heatmap, query.FirstRegion, query.RegionShift, maxRegions);
+            heatmap->DeviceNumber = deviceExtension->DeviceNumber;
+
+            information = FIELD_OFFSET(TEMP_HEATMAP, Regions) + (ULONG_PTR)heatmap->RegionsReturned * sizeof(TEMP_HEATMAP_REGION);
+            status = STATUS_SUCCESS;
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_SET_TRACE:
+    {
+        if (DeviceObject != g_ControlDeviceObject &&
+            DeviceObject->DeviceExtension &&
+            ioStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(TEMP_TRACE_CONTROL))
+        {
+            status = TempSetTrace(
+                (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension,
+                (PTEMP_TRACE_CONTROL)Irp->AssociatedIrp.SystemBuffer);
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_READ_TRACE:
+    {
+        if (DeviceObject != g_ControlDeviceObject && DeviceObject->DeviceExtension)
+        {
+            status = TempReadTrace(
+                (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension,
+                (PTEMP_TRACE_DATA)Irp->AssociatedIrp.SystemBuffer,
+                ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                &information);
+        }
+        break;
+    }
+
+    case TEMP_IOCTL_GET_HISTORY:
+    {
+        if (DeviceObject != g_ControlDeviceObject && DeviceObject->DeviceExtension)
+        {
+            status = TempReadHistory(
+                (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension,
+                (PTEMP_HISTORY)Irp->AssociatedIrp.SystemBuffer,
+                ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                &information);
+        }
+        break;
+    }
+
     default:
-        status = STATUS_INVALID_DEVICE_REQUEST;
+        if (DeviceObject != g_ControlDeviceObject && DeviceObject->DeviceExtension)
+        {
+            // Standard disk and storage requests issued by the I/O stack above us
+            status = TempDispatchDiskControl(
+                (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension,
+                Irp,
+                ioStack,
+                &information);
+        }
+        else
+        {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+        }
         break;
     }
 
+    if (DeviceObject != g_ControlDeviceObject && DeviceObject->DeviceExtension)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeviceObject->DeviceExtension;
+        ULONG64 latency = TempElapsedNanoseconds(start);
+        ULONG64 bytes = ioStack->Parameters.DeviceIoControl.InputBufferLength + information;
+
+        TempRecordOperation(&deviceExtension->IoHistograms, KeGetCurrentProcessorNumberEx(NULL), TEMP_OPERATION_IOCTL, latency, bytes);
+
+        // Draining a trace would otherwise fill it with its own reads
+        if (ioControlCode != TEMP_IOCTL_SET_TRACE && ioControlCode != TEMP_IOCTL_READ_TRACE)
+        {
+            TempTraceRequest(deviceExtension, TEMP_OPERATION_IOCTL, start, 0, bytes, latency, status);
+        }
+    }
+
     return TempCompleteRequest(Irp, status, information);
 }
 
+NTSTATUS TempDispatchDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+    if (DeviceObject == g_ControlDeviceObject)
+    {
+        return TempDeviceControl(DeviceObject, Irp);
+    }
+
+    if (!TempEnterDevice(DeviceObject))
+    {
+        return TempCompleteRequest(Irp, STATUS_NO_SUCH_DEVICE, 0);
+    }
+
+    NTSTATUS status = TempDeviceControl(DeviceObject, Irp);
+    TempLeaveDevice(DeviceObject);
+
+    return status;
+}
+
+VOID TempFillDiskGeometry(PTEMP_DEVICE_EXTENSION DeviceExtension, PDISK_GEOMETRY Geometry)
+{
+    // Synthetic CHS layout; only BytesPerSector and the total size matter to a RAM disk
+    Geometry->MediaType = DeviceExtension->RemovableMedia ? RemovableMedia : FixedMedia;
+    Geometry->TracksPerCylinder = 2;
+    Geometry->SectorsPerTrack = 32;
+    Geometry->BytesPerSector = DeviceExtension->SectorSize;
+    Geometry->Cylinders.QuadPart = (LONGLONG)(DeviceExtension->DiskSize /
+                                              ((ULONG64)DeviceExtension->SectorSize *
+                                               Geometry->SectorsPerTrack *
+                                               Geometry->TracksPerCylinder));
+}
+
+NTSTATUS TempDispatchDiskControl(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, PIO_STACK_LOCATION IoStack, PULONG_PTR Information)
+{
+    ULONG inputLength = IoStack->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG outputLength = IoStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID buffer = Irp->AssociatedIrp.SystemBuffer;
+
+    if (!DeviceExtension->MemoryManager)
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    switch (IoStack->Parameters.DeviceIoControl.IoControlCode)
+    {
+    case IOCTL_DISK_GET_DRIVE_GEOMETRY:
+    case IOCTL_DISK_GET_MEDIA_TYPES:
+    case IOCTL_STORAGE_GET_MEDIA_TYPES:
+    {
+        if (outputLength < sizeof(DISK_GEOMETRY))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TempFillDiskGeometry(DeviceExtension, (PDISK_GEOMETRY)buffer);
+        *Information = sizeof(DISK_GEOMETRY);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_GET_DRIVE_GEOMETRY_EX:
+    {
+        if (outputLength < FIELD_OFFSET(DISK_GEOMETRY_EX, Data))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        PDISK_GEOMETRY_EX geometryEx = (PDISK_GEOMETRY_EX)buffer;
+        RtlZeroMemory(geometryEx, FIELD_OFFSET(DISK_GEOMETRY_EX, Data));
+        TempFillDiskGeometry(DeviceExtension, &geometryEx->Geometry);
+        geometryEx->DiskSize.QuadPart = (LONGLONG)DeviceExtension->DiskSize;
+        *Information = FIELD_OFFSET(DISK_GEOMETRY_EX, Data);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_GET_LENGTH_INFO:
+    {
+        if (outputLength < sizeof(GET_LENGTH_INFORMATION))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        ((PGET_LENGTH_INFORMATION)buffer)->Length.QuadPart = (LONGLONG)DeviceExtension->DiskSize;
+        *Information = sizeof(GET_LENGTH_INFORMATION);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_GET_PARTITION_INFO:
+    {
+        if (outputLength < sizeof(PARTITION_INFORMATION))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        // The whole device is presented as a single unpartitioned volume
+        PPARTITION_INFORMATION partition = (PPARTITION_INFORMATION)buffer;
+        RtlZeroMemory(partition, sizeof(PARTITION_INFORMATION));
+        partition->StartingOffset.QuadPart = 0;
+        partition->PartitionLength.QuadPart = (LONGLONG)DeviceExtension->DiskSize;
+        partition->HiddenSectors = 0;
+        partition->PartitionNumber = 1;
+        partition->PartitionType = PARTITION_IFS;
+        partition->BootIndicator = FALSE;
+        partition->RecognizedPartition = TRUE;
+        partition->RewritePartition = FALSE;
+        *Information = sizeof(PARTITION_INFORMATION);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_GET_PARTITION_INFO_EX:
+    {
+        if (outputLength < sizeof(PARTITION_INFORMATION_EX))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        PPARTITION_INFORMATION_EX partitionEx = (PPARTITION_INFORMATION_EX)buffer;
+        RtlZeroMemory(partitionEx, sizeof(PARTITION_INFORMATION_EX));
+        partitionEx->PartitionStyle = PARTITION_STYLE_MBR;
+        partitionEx->StartingOffset.QuadPart = 0;
+        partitionEx->PartitionLength.QuadPart = (LONGLONG)DeviceExtension->DiskSize;
+        partitionEx->PartitionNumber = 1;
+        partitionEx->RewritePartition = FALSE;
+        partitionEx->Mbr.PartitionType = PARTITION_IFS;
+        partitionEx->Mbr.BootIndicator = FALSE;
+        partitionEx->Mbr.RecognizedPartition = TRUE;
+        partitionEx->Mbr.HiddenSectors = 0;
+        *Information = sizeof(PARTITION_INFORMATION_EX);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_SET_PARTITION_INFO:
+    {
+        // Partition type changes from format.exe are accepted and ignored
+        if (inputLength < sizeof(SET_PARTITION_INFORMATION))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_VERIFY:
+    {
+        if (inputLength < sizeof(VERIFY_INFORMATION))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        PVERIFY_INFORMATION verify = (PVERIFY_INFORMATION)buffer;
+        if (verify->StartingOffset.QuadPart < 0 ||
+            (ULONG64)verify->StartingOffset.QuadPart + verify->Length > DeviceExtension->DiskSize)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        *Information = verify->Length;
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_DISK_UPDATE_PROPERTIES:
+        // Sent after a resize; geometry and length are always reported from DiskSize
+        return STATUS_SUCCESS;
+
+    case IOCTL_DISK_IS_WRITABLE:
+        return DeviceExtension->CdRomType || DeviceExtension->ReadOnly ? STATUS_MEDIA_WRITE_PROTECTED : STATUS_SUCCESS;
+
+    case IOCTL_DISK_CHECK_VERIFY:
+    case IOCTL_STORAGE_CHECK_VERIFY:
+    case IOCTL_STORAGE_CHECK_VERIFY2:
+    {
+        // Media never changes underneath a RAM disk
+        if (outputLength >= sizeof(ULONG))
+        {
+            *(PULONG)buffer = 0;
+            *Information = sizeof(ULONG);
+        }
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_STORAGE_GET_HOTPLUG_INFO:
+    {
+        if (outputLength < sizeof(STORAGE_HOTPLUG_INFO))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        PSTORAGE_HOTPLUG_INFO hotplug = (PSTORAGE_HOTPLUG_INFO)buffer;
+        RtlZeroMemory(hotplug, sizeof(STORAGE_HOTPLUG_INFO));
+        hotplug->Size = sizeof(STORAGE_HOTPLUG_INFO);
+        hotplug->MediaRemovable = DeviceExtension->RemovableMedia;
+        hotplug->MediaHotplug = DeviceExtension->RemovableMedia;
+        hotplug->DeviceHotplug = TRUE;
+        hotplug->WriteCacheEnableOverride = FALSE;
+        *Information = sizeof(STORAGE_HOTPLUG_INFO);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_STORAGE_GET_DEVICE_NUMBER:
+    {
+        if (outputLength < sizeof(STORAGE_DEVICE_NUMBER))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        PSTORAGE_DEVICE_NUMBER deviceNumber = (PSTORAGE_DEVICE_NUMBER)buffer;
+        deviceNumber->DeviceType = DeviceExtension->DeviceObject->DeviceType;
+        deviceNumber->DeviceNumber = DeviceExtension->DeviceNumber;
+        deviceNumber->PartitionNumber = (ULONG)-1; // Not partitionable
+        *Information = sizeof(STORAGE_DEVICE_NUMBER);
+        return STATUS_SUCCESS;
+    }
+
+    case IOCTL_STORAGE_QUERY_PROPERTY:
+        return TempQueryStorageProperty(DeviceExtension, Irp, IoStack, Information);
+
+    case IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES:
+        return TempManageDataSet(DeviceExtension, Irp, IoStack);
+
+    default:
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+}
+
+NTSTATUS TempQueryStorageProperty(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, PIO_STACK_LOCATION IoStack, PULONG_PTR Information)
+{
+    ULONG outputLength = IoStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PSTORAGE_PROPERTY_QUERY query = (PSTORAGE_PROPERTY_QUERY)Irp->AssociatedIrp.SystemBuffer;
+    PUCHAR buffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+    ULONG descriptorSize;
+    ULONG descriptorVersion; // sizeof the descriptor structure, without trailing strings
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    switch (query->PropertyId)
+    {
+    case StorageDeviceProperty:
+        descriptorVersion = sizeof(STORAGE_DEVICE_DESCRIPTOR);
+        descriptorSize = sizeof(STORAGE_DEVICE_DESCRIPTOR) +
+                         sizeof(TEMP_VENDOR_ID) + sizeof(TEMP_PRODUCT_ID) + sizeof(TEMP_PRODUCT_REVISION);
+        break;
+    case StorageAdapterProperty:
+        descriptorVersion = descriptorSize = sizeof(STORAGE_ADAPTER_DESCRIPTOR);
+        break;
+    case StorageAccessAlignmentProperty:
+        descriptorVersion = descriptorSize = sizeof(STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR);
+        break;
+    case StorageDeviceSeekPenaltyProperty:
+        descriptorVersion = descriptorSize = sizeof(DEVICE_SEEK_PENALTY_DESCRIPTOR);
+        break;
+    case StorageDeviceTrimProperty:
+        descriptorVersion = descriptorSize = sizeof(DEVICE_TRIM_DESCRIPTOR);
+        break;
+    default:
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (query->QueryType == PropertyExistsQuery)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (query->QueryType != PropertyStandardQuery)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (outputLength < sizeof(STORAGE_DESCRIPTOR_HEADER))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // Callers commonly probe with just a header to learn the full descriptor size
+    if (outputLength < descriptorSize)
+    {
+        PSTORAGE_DESCRIPTOR_HEADER header = (PSTORAGE_DESCRIPTOR_HEADER)buffer;
+        header->Version = descriptorVersion;
+        header->Size = descriptorSize;
+        *Information = sizeof(STORAGE_DESCRIPTOR_HEADER);
+        return STATUS_SUCCESS;
+    }
+
+    // The query lives in the same system buffer, so capture the id before zeroing it
+    STORAGE_PROPERTY_ID propertyId = query->PropertyId;
+    RtlZeroMemory(buffer, descriptorSize);
+
+    switch (propertyId)
+    {
+    case StorageDeviceProperty:
+    {
+        PSTORAGE_DEVICE_DESCRIPTOR device = (PSTORAGE_DEVICE_DESCRIPTOR)buffer;
+        ULONG offset = sizeof(STORAGE_DEVICE_DESCRIPTOR);
+
+        device->Version = sizeof(STORAGE_DEVICE_DESCRIPTOR);
+        device->Size = descriptorSize;
+        device->DeviceType = DeviceExtension->CdRomType ? 0x05 : 0x00; // SCSI CD-ROM or direct access
+        device->DeviceTypeModifier = 0;
+        device->RemovableMedia = DeviceExtension->RemovableMedia;
+        device->CommandQueueing = TRUE;
+        device->BusType = BusTypeVirtual;
+
+        device->VendorIdOffset = offset;
+        RtlCopyMemory(buffer + offset, TEMP_VENDOR_ID, sizeof(TEMP_VENDOR_ID));
+        offset += sizeof(TEMP_VENDOR_ID);
+
+        device->ProductIdOffset = offset;
+        RtlCopyMemory(buffer + offset, TEMP_PRODUCT_ID, sizeof(TEMP_PRODUCT_ID));
+        offset += sizeof(TEMP_PRODUCT_ID);
+
+        device->ProductRevisionOffset = offset;
+        RtlCopyMemory(buffer + offset, TEMP_PRODUCT_REVISION, sizeof(TEMP_PRODUCT_REVISION));
+
+        device->SerialNumberOffset = 0;
+        break;
+    }
+
+    case StorageAdapterProperty:
+    {
+        PSTORAGE_ADAPTER_DESCRIPTOR adapter = (PSTORAGE_ADAPTER_DESCRIPTOR)buffer;
+        adapter->Version = sizeof(STORAGE_ADAPTER_DESCRIPTOR);
+        adapter->Size = sizeof(STORAGE_ADAPTER_DESCRIPTOR);
+        adapter->MaximumTransferLength = TEMP_MAX_TRANSFER_LENGTH;
+        adapter->MaximumPhysicalPages = TEMP_MAX_TRANSFER_LENGTH / PAGE_SIZE;
+        adapter->AlignmentMask = 0; // Any buffer alignment, data is copied with RtlCopyMemory
+        adapter->AdapterUsesPio = FALSE;
+        adapter->AdapterScansDown = FALSE;
+        adapter->CommandQueueing = TRUE;
+        adapter->AcceleratedTransfer = TRUE;
+        adapter->BusType = BusTypeVirtual;
+        break;
+    }
+
+    case StorageAccessAlignmentProperty:
+    {
+        // Report a page-sized physical sector so filesystems pick page-aligned clusters
+        PSTORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment = (PSTORAGE_ACCESS_ALIGNMENT_DESCRIPTOR)buffer;
+        alignment->Version = sizeof(STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR);
+        alignment->Size = sizeof(STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR);
+        alignment->BytesPerCacheLine = SYSTEM_CACHE_ALIGNMENT_SIZE;
+        alignment->BytesOffsetForCacheAlignment = 0;
+        alignment->BytesPerLogicalSector = DeviceExtension->SectorSize;
+        alignment->BytesPerPhysicalSector = max(DeviceExtension->SectorSize, PAGE_SIZE);
+        alignment->BytesOffsetForSectorAlignment = 0;
+        break;
+    }
+
+    case StorageDeviceSeekPenaltyProperty:
+    {
+        PDEVICE_SEEK_PENALTY_DESCRIPTOR seekPenalty = (PDEVICE_SEEK_PENALTY_DESCRIPTOR)buffer;
+        seekPenalty->Version = sizeof(DEVICE_SEEK_PENALTY_DESCRIPTOR);
+        seekPenalty->Size = sizeof(DEVICE_SEEK_PENALTY_DESCRIPTOR);
+        seekPenalty->IncursSeekPenalty = FALSE;
+        break;
+    }
+
+    case StorageDeviceTrimProperty:
+    {
+        PDEVICE_TRIM_DESCRIPTOR trim = (PDEVICE_TRIM_DESCRIPTOR)buffer;
+        trim->Version = sizeof(DEVICE_TRIM_DESCRIPTOR);
+        trim->Size = sizeof(DEVICE_TRIM_DESCRIPTOR);
+        trim->TrimEnabled = !DeviceExtension->CdRomType && !DeviceExtension->ReadOnly;
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    *Information = descriptorSize;
+    return STATUS_SUCCESS;
+}
+
+// Trace records hold 32-bit lengths, so a long trimmed or copied range becomes
+// several records
+static VOID TempTraceRange(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG Operation, LARGE_INTEGER Start, ULONG64 Offset, ULONG64 Length, NTSTATUS Status)
+{
+    ULONG64 latency = TempElapsedNanoseconds(Start);
+    const ULONG64 piece = 1ULL << 30;
+
+    while (Length > 0 && DeviceExtension->TraceEnabled)
+    {
+        ULONG64 length = Length < piece ? Length : piece;
+
+        TempTraceRequest(DeviceExtension, Operation, Start, Offset, length, latency, Status);
+        Offset += length;
+        Length -= length;
+    }
+}
+
+NTSTATUS TempManageDataSet(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, PIO_STACK_LOCATION IoStack)
+{
+    ULONG inputLength = IoStack->Parameters.DeviceIoControl.InputBufferLength;
+    PDEVICE_MANAGE_DATA_SET_ATTRIBUTES attributes = (PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)Irp->AssociatedIrp.SystemBuffer;
+    ULONG sectorSize = DeviceExtension->SectorSize;
+
+    if (inputLength < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES) ||
+        attributes->Size < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (attributes->Action != DeviceDsmAction_Trim)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (DeviceExtension->CdRomType || DeviceExtension->ReadOnly)
+    {
+        return STATUS_MEDIA_WRITE_PROTECTED;
+    }
+
+    if (attributes->Flags & DEVICE_DSM_FLAG_ENTIRE_DATA_SET_RANGE)
+    {
+        LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+        ULONG64 diskSize = DeviceExtension->DiskSize;
+        NTSTATUS status = TempTrimSectors(DeviceExtension->MemoryManager, 0, diskSize >> DeviceExtension->SectorShift, sectorSize);
+
+        TempTraceRange(DeviceExtension, TEMP_TRACE_OPERATION_TRIM, start, 0, diskSize, status);
+        return status;
+    }
+
+    if (attributes->DataSetRangesOffset < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES) ||
+        attributes->DataSetRangesOffset > inputLength ||
+        attributes->DataSetRangesLength > inputLength - attributes->DataSetRangesOffset)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PDEVICE_DATA_SET_RANGE ranges = (PDEVICE_DATA_SET_RANGE)((PUCHAR)attributes + attributes->DataSetRangesOffset);
+    ULONG rangeCount = attributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+
+    for (ULONG i = 0; i < rangeCount; i++)
+    {
+        ULONG64 start = (ULONG64)ranges[i].StartingOffset;
+        ULONG64 length = ranges[i].LengthInBytes;
+
+        if (ranges[i].StartingOffset < 0 ||
+            start > DeviceExtension->DiskSize ||
+            length > DeviceExtension->DiskSize - start)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        // Only whole sectors inside the range are discarded
+        ULONG64 firstSector = (start + sectorSize - 1) >> DeviceExtension->SectorShift;
+        ULONG64 endSector = (start + length) >> DeviceExtension->SectorShift;
+
+        if (endSector > firstSector)
+        {
+            LARGE_INTEGER trimStart = KeQueryPerformanceCounter(NULL);
+            NTSTATUS status = TempTrimSectors(DeviceExtension->MemoryManager, firstSector, endSector - firstSector, sectorSize);
+
+            TempTraceRange(DeviceExtension, TEMP_TRACE_OPERATION_TRIM, trimStart, firstSector << DeviceExtension->SectorShift,
+                           (endSector - firstSector) << DeviceExtension->SectorShift, status);
+
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Discards everything on a live device at once: the disk reads back as zeros as
+// soon as this returns, and its memory is freed as requests touch the chunks or the
+// pressure monitor sweeps them. A file system mounted on it has to be dismounted first.
+NTSTATUS TempFormatDevice(ULONG DeviceNumber)
+{
+    PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(DeviceNumber);
+    NTSTATUS status;
+
+    if (!deviceExtension)
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    if (deviceExtension->CdRomType || deviceExtension->ReadOnly)
+    {
+        status = STATUS_MEDIA_WRITE_PROTECTED;
+    }
+    else
+    {
+        LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+        status = TempFormatDisk(deviceExtension->MemoryManager, deviceExtension->DiskSize, deviceExtension->SectorSize);
+
+        TempTraceRange(deviceExtension, TEMP_TRACE_OPERATION_TRIM, start, 0, deviceExtension->DiskSize, status);
+    }
+
+    TempDereferenceDevice(deviceExtension);
+
+    return status;
+}
+
+// Copies a read-only mounted image's range into another device. The view can fault,
+// so it is read into a buffer first rather than copied under a bucket lock.
+static NTSTATUS TempCopyMappedImage(PTEMP_DEVICE_EXTENSION Source, ULONG64 SourceOffset, PTEMP_DEVICE_EXTENSION Target, ULONG64 TargetOffset, ULONG64 Length)
+{
+    ULONG bufferSize = Target->ChunkSize;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PUCHAR buffer = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, bufferSize, TEMP_POOL_TAG);
+    if (!buffer)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    while (Length > 0 && NT_SUCCESS(status))
+    {
+        ULONG span = Length < bufferSize ? (ULONG)Length : bufferSize;
+
+        status = TempReadMappedImage(Source, SourceOffset, buffer, span);
+        if (NT_SUCCESS(status))
+        {
+            status = TempWriteSectors(Target->MemoryManager, TargetOffset >> Target->SectorShift,
+                                      span >> Target->SectorShift, buffer, Target->SectorSize);
+        }
+
+        SourceOffset += span;
+        TargetOffset += span;
+        Length -= span;
+    }
+
+    ExFreePool(buffer);
+    return status;
+}
+
+// Copies a range from one device to another, or within one, without the data
+// passing through the caller. Whole chunks are shared copy-on-write where the
+// memory managers allow it (TempCopyRange). A file system mounted on the target
+// has to be dismounted first, and the source range should not change meanwhile.
+// The copy goes around the security of any file system on either device, so user
+// callers need the volume maintenance privilege, and data kept encrypted is never
+// copied to a device that keeps it in the clear.
+NTSTATUS TempCopyDevice(PTEMP_COPY_DATA Copy, KPROCESSOR_MODE RequestorMode)
+{
+    Copy->SharedLength = 0;
+
+    if (RequestorMode != KernelMode &&
+        !SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), RequestorMode))
+    {
+        return STATUS_PRIVILEGE_NOT_HELD;
+    }
+
+    PTEMP_DEVICE_EXTENSION source = TempFindDevice(Copy->SourceDevice);
+    PTEMP_DEVICE_EXTENSION target = TempFindDevice(Copy->TargetDevice);
+    NTSTATUS status;
+
+    if (!source || !target)
+    {
+        status = STATUS_NO_SUCH_DEVICE;
+    }
+    else if (target->CdRomType || target->ReadOnly)
+    {
+        status = STATUS_MEDIA_WRITE_PROTECTED;
+    }
+    else if (source->MemoryManager->Cipher && !target->MemoryManager->Cipher)
+    {
+        status = STATUS_ACCESS_DENIED;
+    }
+    else
+    {
+        ULONG sectorSize = source->SectorSize > target->SectorSize ? source->SectorSize : target->SectorSize;
+
+        if (((Copy->SourceOffset | Copy->TargetOffset | Copy->Length) & (sectorSize - 1)) != 0 ||
+            Copy->SourceOffset > source->DiskSize || Copy->Length > source->DiskSize - Copy->SourceOffset ||
+            Copy->TargetOffset > target->DiskSize || Copy->Length > target->DiskSize - Copy->TargetOffset)
+        {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else if (source == target &&
+                 Copy->SourceOffset < Copy->TargetOffset + Copy->Length &&
+                 Copy->TargetOffset < Copy->SourceOffset + Copy->Length)
+        {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        else
+        {
+            LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+
+            if (source->ReadOnly)
+            {
+                status = TempCopyMappedImage(source, Copy->SourceOffset, target, Copy->TargetOffset, Copy->Length);
+            }
+            else
+            {
+                status = TempCopyRange(source->MemoryManager, Copy->SourceOffset, target->MemoryManager,
+                                       Copy->TargetOffset, Copy->Length, &Copy->SharedLength);
+            }
+
+            TempTraceRange(source, TEMP_OPERATION_READ, start, Copy->SourceOffset, Copy->Length, status);
+            TempTraceRange(target, TEMP_OPERATION_WRITE, start, Copy->TargetOffset, Copy->Length, status);
+        }
+    }
+
+    TempDereferenceDevice(source);
+    TempDereferenceDevice(target);
+
+    return status;
+}
+
 NTSTATUS TempDispatchPnP(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
     UNREFERENCED_PARAMETER(DeviceObject);
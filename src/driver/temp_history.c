@@ -0,0 +1,174 @@
+#include <ntifs.h> // Before temp_core.h: ntifs.h includes ntddk.h itself
+#include "../core/temp_core.h"
+
+// Per-second history. Every device has a ring of the last TEMP_HISTORY_SECONDS
+// one-second samples, closed by a periodic timer DPC. Each sample is the difference
+// between the counters the DPC reads now and the ones it read a second ago, so
+// bursts shorter than a polling tool's interval still show up, and tools can
+// fetch ten minutes of history in one TEMP_IOCTL_GET_HISTORY request.
+
+#define TEMP_HISTORY_POOL_TAG 'tHmT' // 'TmHt' backwards
+
+// Percentile stored in every sample, in hundredths of a percent
+#define TEMP_HISTORY_PERCENTILE 9900
+
+static ULONG64 TempHistoryDelta(ULONG64 *Last, ULONG64 Current)
+{
+    // Counters only grow; a smaller value means the source was reset
+    ULONG64 delta = Current >= *Last ? Current - *Last : Current;
+
+    *Last = Current;
+    return delta;
+}
+
+// Turns the operation's cumulative latency buckets into this second's and returns
+// how many requests completed in it. Caller holds the ring lock.
+static ULONG64 TempHistoryLatency(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_HISTORY_RING Ring, ULONG Operation, PULONG64 Percentile)
+{
+    PULONG64 last = Ring->LastLatency[Operation];
+    ULONG64 count = 0;
+
+    TempSumLatencyHistogram(&DeviceExtension->IoHistograms, Operation, Ring->Latency);
+
+    for (ULONG i = 0; i < TEMP_HISTOGRAM_BUCKETS; i++)
+    {
+        Ring->Latency[i] = TempHistoryDelta(&last[i], Ring->Latency[i]);
+        count += Ring->Latency[i];
+    }
+
+    *Percentile = TempHistogramPercentile(Ring->Latency, count, TEMP_HISTORY_PERCENTILE);
+    return count;
+}
+
+static VOID TempHistoryDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)DeferredContext;
+    PTEMP_HISTORY_RING ring = deviceExtension->History;
+    TEMP_HISTORY_SAMPLE sample;
+    TEMP_STATISTICS statistics;
+    LARGE_INTEGER now;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    RtlZeroMemory(&statistics, sizeof(statistics));
+    RtlZeroMemory(&sample, sizeof(sample));
+
+    // The lock also keeps a late run from overlapping the next one
+    KeAcquireSpinLockAtDpcLevel(&ring->Lock);
+
+    KeQuerySystemTime(&now);
+    TempQueryMemoryStatistics(deviceExtension->MemoryManager, &statistics);
+
+    sample.Time = (ULONG64)now.QuadPart;
+    sample.ElapsedMs = (ULONG)((now.QuadPart - ring->LastTime.QuadPart) / 10000);
+    ring->LastTime = now;
+
+    sample.Reads = TempHistoryLatency(deviceExtension, ring, TEMP_OPERATION_READ, &sample.ReadLatencyP99);
+    sample.Writes = TempHistoryLatency(deviceExtension, ring, TEMP_OPERATION_WRITE, &sample.WriteLatencyP99);
+    sample.BytesRead = TempHistoryDelta(&ring->LastBytesRead, (ULONG64)deviceExtension->BytesRead);
+    sample.BytesWritten = TempHistoryDelta(&ring->LastBytesWritten, (ULONG64)deviceExtension->BytesWritten);
+    sample.CacheHits = TempHistoryDelta(&ring->LastCacheHits, statistics.CacheHits);
+    sample.CacheMisses = TempHistoryDelta(&ring->LastCacheMisses, statistics.CacheMisses);
+    sample.MemoryUsed = statistics.MemoryUsed;
+
+    ring->Samples[ring->TotalSamples % TEMP_HISTORY_SECONDS] = sample;
+    ring->TotalSamples++;
+
+    KeReleaseSpinLockFromDpcLevel(&ring->Lock);
+}
+
+// Starts sampling a device that is fully initialized but not yet visible. Without
+// the memory for the ring the device simply has no history.
+NTSTATUS TempStartHistory(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    PTEMP_HISTORY_RING ring = (PTEMP_HISTORY_RING)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(TEMP_HISTORY_RING),
+        TEMP_HISTORY_POOL_TAG);
+
+    if (!ring)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(ring, sizeof(TEMP_HISTORY_RING));
+    KeInitializeSpinLock(&ring->Lock);
+    KeInitializeTimerEx(&ring->Timer, NotificationTimer);
+    KeInitializeDpc(&ring->Dpc, TempHistoryDpc, DeviceExtension);
+    KeQuerySystemTime(&ring->LastTime);
+
+    DeviceExtension->History = ring;
+
+    // Coalescing lets the tick share a wakeup with other timers; each sample
+    // records how long its interval really was
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -10000LL * TEMP_HISTORY_INTERVAL_MS;
+    KeSetCoalescableTimer(&ring->Timer, dueTime, TEMP_HISTORY_INTERVAL_MS, TEMP_HISTORY_TOLERANCE_MS, &ring->Dpc);
+
+    return STATUS_SUCCESS;
+}
+
+// Stops sampling before the device's memory manager and histograms go away
+VOID TempStopHistory(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    PTEMP_HISTORY_RING ring = DeviceExtension->History;
+
+    if (!ring)
+    {
+        return;
+    }
+
+    KeCancelTimer(&ring->Timer);
+    KeFlushQueuedDpcs();
+
+    DeviceExtension->History = NULL;
+    ExFreePool(ring);
+}
+
+// TEMP_IOCTL_GET_HISTORY: the newest samples that fit the output, oldest first
+NTSTATUS TempReadHistory(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_HISTORY History, ULONG OutputLength, PULONG_PTR Information)
+{
+    PTEMP_HISTORY_RING ring = DeviceExtension->History;
+
+    if (!ring)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (OutputLength < FIELD_OFFSET(TEMP_HISTORY, Samples))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    ULONG maxSamples = (OutputLength - FIELD_OFFSET(TEMP_HISTORY, Samples)) / sizeof(TEMP_HISTORY_SAMPLE);
+    KIRQL oldIrql;
+
+    RtlZeroMemory(History, FIELD_OFFSET(TEMP_HISTORY, Samples));
+    History->Version = TEMP_HISTORY_VERSION;
+    History->Size = FIELD_OFFSET(TEMP_HISTORY, Samples);
+    History->SampleSize = sizeof(TEMP_HISTORY_SAMPLE);
+    History->Capacity = TEMP_HISTORY_SECONDS;
+    History->IntervalMs = TEMP_HISTORY_INTERVAL_MS;
+
+    KeAcquireSpinLock(&ring->Lock, &oldIrql);
+
+    ULONG64 total = ring->TotalSamples;
+    ULONG available = total < TEMP_HISTORY_SECONDS ? (ULONG)total : TEMP_HISTORY_SECONDS;
+    ULONG count = available < maxSamples ? available : maxSamples;
+    ULONG first = (ULONG)((total - count) % TEMP_HISTORY_SECONDS);
+
+    // At most two runs: up to the end of the ring, then from its start
+    ULONG run = TEMP_HISTORY_SECONDS - first < count ? TEMP_HISTORY_SECONDS - first : count;
+    RtlCopyMemory(History->Samples, &ring->Samples[first], (SIZE_T)run * sizeof(TEMP_HISTORY_SAMPLE));
+    RtlCopyMemory(&History->Samples[run], ring->Samples, (SIZE_T)(count - run) * sizeof(TEMP_HISTORY_SAMPLE));
+
+    KeReleaseSpinLock(&ring->Lock, oldIrql);
+
+    History->SamplesReturned = count;
+    History->TotalSamples = total;
+
+    *Information = FIELD_OFFSET(TEMP_HISTORY, Samples) + (ULONG_PTR)count * sizeof(TEMP_HISTORY_SAMPLE);
+    return STATUS_SUCCESS;
+}
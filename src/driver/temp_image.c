@@ -0,0 +1,520 @@
+#include <ntifs.h> // Before temp_core.h: ntifs.h includes ntddk.h itself
+#include "../core/temp_core.h"
+
+// Lazy restore from an image file. The device is created empty with every chunk
+// marked as still in the image, so it is usable as soon as the file is open,
+// whatever the image's size. A request that touches a chunk not loaded yet reads it
+// from the image first; meanwhile a system thread loads the rest, the stripes that
+// were hottest when the image was saved first, then whatever is left in disk order.
+// Once nothing is left to load the file is closed.
+//
+// A mapped image (TEMP_IMAGE_MAPPED) is never copied: the device is read-only and
+// serves reads straight from a view of the file.
+
+#define TEMP_IMAGE_POOL_TAG 'gImT' // 'TmIg' backwards
+
+// Heat entries read from the image per request
+#define TEMP_IMAGE_HEAT_BATCH 16384
+
+// PTEMP_SPILL_ROUTINE of a device created from an image. Reads past the end of the
+// file return zeros, so a raw image may be shorter than the disk.
+static NTSTATUS TempImageTransfer(PVOID Context, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length)
+{
+    PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)Context;
+    PTEMP_IMAGE image = deviceExtension ? deviceExtension->Image : NULL;
+    ULONG transferred = 0;
+    NTSTATUS status;
+
+    if (!image || Write)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Fails once the file is being closed; by then the chunk was loaded by someone else
+    if (!ExAcquireRundownProtection(&image->Rundown))
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    status = TempTransferFile(deviceExtension, image->FileHandle, FALSE, image->DataOffset + Offset, Buffer, Length, &transferred);
+
+    ExReleaseRundownProtection(&image->Rundown);
+
+    if (status == STATUS_END_OF_FILE)
+    {
+        status = STATUS_SUCCESS;
+        transferred = 0;
+    }
+
+    if (NT_SUCCESS(status) && transferred < Length)
+    {
+        RtlZeroMemory((PUCHAR)Buffer + transferred, Length - transferred);
+    }
+
+    return status;
+}
+
+// Faults that already took the routine finish their reads before the handle goes
+static VOID TempCloseImageFile(PTEMP_IMAGE Image)
+{
+    if (Image->FileHandle)
+    {
+        ExWaitForRundownProtectionRelease(&Image->Rundown);
+        ZwClose(Image->FileHandle);
+        Image->FileHandle = NULL;
+    }
+}
+
+// Sorts Count keys in descending order (heapsort: no recursion, no extra memory)
+static VOID TempSortDescending(PULONG64 Keys, ULONG64 Count)
+{
+    // A min-heap whose smallest key is moved behind the heap each round
+    for (ULONG64 start = Count / 2; start-- > 0;)
+    {
+        for (ULONG64 parent = start, child; (child = parent * 2 + 1) < Count; parent = child)
+        {
+            if (child + 1 < Count && Keys[child + 1] < Keys[child])
+            {
+                child++;
+            }
+            if (Keys[parent] <= Keys[child])
+            {
+                break;
+            }
+            ULONG64 swap = Keys[parent];
+            Keys[parent] = Keys[child];
+            Keys[child] = swap;
+        }
+    }
+
+    for (ULONG64 end = Count; end-- > 1;)
+    {
+        ULONG64 smallest = Keys[0];
+        Keys[0] = Keys[end];
+        Keys[end] = smallest;
+
+        for (ULONG64 parent = 0, child; (child = parent * 2 + 1) < end; parent = child)
+        {
+            if (child + 1 < end && Keys[child + 1] < Keys[child])
+            {
+                child++;
+            }
+            if (Keys[parent] <= Keys[child])
+            {
+                break;
+            }
+            ULONG64 swap = Keys[parent];
+            Keys[parent] = Keys[child];
+            Keys[child] = swap;
+        }
+    }
+}
+
+// The image's stripes on the disk, hottest first and in disk order among equals.
+// Each key holds the heat above the complement of the stripe number. Returns NULL
+// for raw images and when the heat cannot be read.
+static PULONG64 TempReadHeatOrder(PTEMP_DEVICE_EXTENSION DeviceExtension, PTEMP_IMAGE Image, PULONG64 Count)
+{
+    ULONG64 diskStripes = (DeviceExtension->DiskSize + Image->StripeSize - 1) / (Image->StripeSize ? Image->StripeSize : 1);
+    ULONG64 count = Image->StripeCount < diskStripes ? Image->StripeCount : diskStripes;
+    PULONG heat = NULL;
+    PULONG64 keys = NULL;
+    ULONG transferred;
+
+    *Count = 0;
+
+    if (count == 0 || count > MAXULONG)
+    {
+        return NULL;
+    }
+
+    heat = (PULONG)ExAllocatePool2(POOL_FLAG_PAGED, TEMP_IMAGE_HEAT_BATCH * sizeof(ULONG), TEMP_IMAGE_POOL_TAG);
+    keys = (PULONG64)ExAllocatePool2(POOL_FLAG_PAGED, (SIZE_T)count * sizeof(ULONG64), TEMP_IMAGE_POOL_TAG);
+
+    if (!heat || !keys)
+    {
+        if (heat)
+        {
+            ExFreePool(heat);
+        }
+        if (keys)
+        {
+            ExFreePool(keys);
+        }
+        return NULL;
+    }
+
+    for (ULONG64 first = 0; first < count; first += TEMP_IMAGE_HEAT_BATCH)
+    {
+        ULONG batch = count - first < TEMP_IMAGE_HEAT_BATCH ? (ULONG)(count - first) : TEMP_IMAGE_HEAT_BATCH;
+        NTSTATUS status = TempTransferFile(DeviceExtension, Image->FileHandle, FALSE,
+                                           sizeof(TEMP_IMAGE_FILE_HEADER) + first * sizeof(ULONG),
+                                           heat, batch * sizeof(ULONG), &transferred);
+
+        if (!NT_SUCCESS(status) || transferred != batch * sizeof(ULONG))
+        {
+            ExFreePool(heat);
+            ExFreePool(keys);
+            return NULL;
+        }
+
+        for (ULONG i = 0; i < batch; i++)
+        {
+            keys[first + i] = ((ULONG64)heat[i] << 32) | (MAXULONG - (ULONG)(first + i));
+        }
+    }
+
+    ExFreePool(heat);
+    TempSortDescending(keys, count);
+
+    *Count = count;
+    return keys;
+}
+
+static VOID TempImagePrefetchThread(PVOID Context)
+{
+    PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)Context;
+    PTEMP_IMAGE image = deviceExtension->Image;
+    PTEMP_MEMORY_MANAGER memoryManager = deviceExtension->MemoryManager;
+    ULONG chunkShift = memoryManager->ChunkShift;
+    ULONG64 totalChunks = (deviceExtension->DiskSize + deviceExtension->ChunkSize - 1) >> chunkShift;
+    ULONG64 failures = 0;
+    ULONG64 stripes;
+
+    // Requests that need a chunk load it themselves; the rest can wait for idle time
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+    // The hottest stripes first; a stripe smaller than a chunk loads the whole chunk
+    PULONG64 order = TempReadHeatOrder(deviceExtension, image, &stripes);
+    if (order)
+    {
+        for (ULONG64 i = 0; i < stripes && !KeReadStateEvent(&image->StopEvent); i++)
+        {
+            ULONG64 stripe = MAXULONG - (ULONG)order[i];
+            ULONG64 chunk = (stripe * image->StripeSize) >> chunkShift;
+            ULONG64 end = (((stripe + 1) * image->StripeSize - 1) >> chunkShift) + 1;
+
+            for (; chunk < end && chunk < totalChunks; chunk++)
+            {
+                if (!NT_SUCCESS(TempLoadImageChunk(memoryManager, chunk)))
+                {
+                    failures++;
+                }
+            }
+        }
+
+        ExFreePool(order);
+    }
+
+    // Whatever the heat did not cover, and every chunk of a raw image. Chunks loaded
+    // already cost one look at their slot.
+    for (ULONG64 chunk = 0; chunk < totalChunks && memoryManager->ImagePendingChunks > 0; chunk++)
+    {
+        if (KeReadStateEvent(&image->StopEvent))
+        {
+            break;
+        }
+
+        if (!NT_SUCCESS(TempLoadImageChunk(memoryManager, chunk)))
+        {
+            failures++;
+        }
+    }
+
+    // Chunks that failed to load stay in the image and are tried again on access
+    if (memoryManager->ImagePendingChunks == 0)
+    {
+        LARGE_INTEGER now;
+        KeQuerySystemTime(&now);
+
+        TempEndImageSource(memoryManager);
+        TempCloseImageFile(image);
+
+        KdPrint(("TEMP: device %u loaded its image in %I64u ms, %I64u chunks on demand\n",
+                 deviceExtension->DeviceNumber, (ULONG64)(now.QuadPart - image->StartTime.QuadPart) / 10000,
+                 (ULONG64)memoryManager->ImageDemandLoads));
+    }
+    else if (failures)
+    {
+        KdPrint(("TEMP: device %u could not prefetch %I64u image chunks\n", deviceExtension->DeviceNumber, failures));
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Opens a new device's image and reads its header into DeviceExtension->Image. A
+// file that does not start with a TEMP_IMAGE_FILE_HEADER is a raw image of the disk.
+static NTSTATUS TempAttachImage(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode)
+{
+    UNICODE_STRING fileName;
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    TEMP_IMAGE_FILE_HEADER header;
+    ULONG transferred = 0;
+    NTSTATUS status;
+
+    if (!DeviceExtension || !FileName || FileName[0] == L'\0')
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PTEMP_IMAGE image = (PTEMP_IMAGE)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(TEMP_IMAGE), TEMP_IMAGE_POOL_TAG);
+    if (!image)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExInitializeRundownProtection(&image->Rundown);
+    KeInitializeEvent(&image->StopEvent, NotificationEvent, FALSE);
+    KeQuerySystemTime(&image->StartTime);
+
+    // A user-mode caller may only mount a file it could read itself
+    RtlInitUnicodeString(&fileName, FileName);
+    InitializeObjectAttributes(
+        &attributes,
+        &fileName,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE | (RequestorMode == UserMode ? OBJ_FORCE_ACCESS_CHECK : 0),
+        NULL,
+        NULL);
+
+    // Others may keep reading the image, nobody may change it under the device
+    status = ZwCreateFile(
+        &image->FileHandle,
+        GENERIC_READ | SYNCHRONIZE,
+        &attributes,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ,
+        FILE_OPEN,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
+        NULL,
+        0);
+
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePool(image);
+        return status;
+    }
+
+    DeviceExtension->Image = image;
+
+    RtlZeroMemory(&header, sizeof(header));
+    status = TempTransferFile(DeviceExtension, image->FileHandle, FALSE, 0, &header, sizeof(header), &transferred);
+    if (status == STATUS_END_OF_FILE)
+    {
+        status = STATUS_SUCCESS;
+    }
+
+    if (NT_SUCCESS(status) && transferred == sizeof(header) && header.Magic == TEMP_IMAGE_FILE_MAGIC)
+    {
+        if (header.Version != TEMP_IMAGE_FILE_VERSION ||
+            header.HeaderSize != sizeof(TEMP_IMAGE_FILE_HEADER) ||
+            header.DataOffset < sizeof(TEMP_IMAGE_FILE_HEADER) ||
+            header.DataOffset % TEMP_IMAGE_DATA_ALIGNMENT != 0 ||
+            header.StripeCount > (header.DataOffset - sizeof(TEMP_IMAGE_FILE_HEADER)) / sizeof(ULONG) ||
+            (header.StripeCount && (header.StripeSize < TEMP_MIN_SECTOR_SIZE ||
+                                    (header.StripeSize & (header.StripeSize - 1)) != 0)))
+        {
+            status = STATUS_INVALID_IMAGE_FORMAT;
+        }
+        else
+        {
+            image->DataOffset = header.DataOffset;
+            image->StripeSize = header.StripeSize;
+            image->StripeCount = header.StripeCount;
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        TempCloseImage(DeviceExtension);
+    }
+
+    return status;
+}
+
+// TEMP_IMAGE_RESTORE: marks every chunk of the new device as still in the image
+NTSTATUS TempOpenImage(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode)
+{
+    NTSTATUS status = TempAttachImage(DeviceExtension, FileName, RequestorMode);
+
+    if (NT_SUCCESS(status))
+    {
+        status = TempSetImageSource(DeviceExtension->MemoryManager, TempImageTransfer, DeviceExtension);
+        if (!NT_SUCCESS(status))
+        {
+            TempCloseImage(DeviceExtension);
+        }
+    }
+
+    return status;
+}
+
+// TEMP_IMAGE_MAPPED: maps the whole image read-only in system space and serves every
+// read from the view, so nothing is copied into chunks. The pages belong to the
+// file's cache, which keeps the hot ones and shares them with every device and
+// process that maps the same file.
+NTSTATUS TempMapImage(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode)
+{
+    FILE_STANDARD_INFORMATION information;
+    IO_STATUS_BLOCK ioStatus;
+    OBJECT_ATTRIBUTES attributes;
+    HANDLE sectionHandle;
+    PVOID sectionObject;
+    SIZE_T viewSize = 0;
+
+    NTSTATUS status = TempAttachImage(DeviceExtension, FileName, RequestorMode);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    PTEMP_IMAGE image = DeviceExtension->Image;
+
+    status = ZwQueryInformationFile(image->FileHandle, &ioStatus, &information, sizeof(information), FileStandardInformation);
+
+    // An empty file has nothing to map; such a disk would read as zeros throughout
+    if (NT_SUCCESS(status) && (ULONG64)information.EndOfFile.QuadPart <= image->DataOffset)
+    {
+        status = STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+        status = ZwCreateSection(&sectionHandle, SECTION_MAP_READ | SECTION_QUERY, &attributes, NULL,
+                                 PAGE_READONLY, SEC_COMMIT, image->FileHandle);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = ObReferenceObjectByHandle(sectionHandle, SECTION_MAP_READ, NULL, KernelMode, &sectionObject, NULL);
+        if (NT_SUCCESS(status))
+        {
+            // The view keeps the section alive; the file handle keeps writers out
+            status = MmMapViewInSystemSpace(sectionObject, &image->View, &viewSize);
+            ObDereferenceObject(sectionObject);
+        }
+
+        ZwClose(sectionHandle);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        image->View = NULL;
+        TempCloseImage(DeviceExtension);
+        return status;
+    }
+
+    image->ViewSize = (ULONG64)information.EndOfFile.QuadPart < viewSize ? (ULONG64)information.EndOfFile.QuadPart : viewSize;
+    DeviceExtension->ReadOnly = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+// Reads of a mapped image. The disk past the end of the file reads as zeros. A page
+// the cache cannot bring in raises an exception in the copy, which fails the request.
+NTSTATUS TempReadMappedImage(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 Offset, PVOID Buffer, ULONG Length)
+{
+    PTEMP_IMAGE image = DeviceExtension->Image;
+    ULONG64 fileOffset = image->DataOffset + Offset;
+    ULONG copied = 0;
+
+    if (fileOffset < image->ViewSize)
+    {
+        copied = image->ViewSize - fileOffset < Length ? (ULONG)(image->ViewSize - fileOffset) : Length;
+    }
+
+    __try
+    {
+        RtlCopyMemory(Buffer, (PUCHAR)image->View + fileOffset, copied);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_IN_PAGE_ERROR;
+    }
+
+    RtlZeroMemory((PUCHAR)Buffer + copied, Length - copied);
+    return STATUS_SUCCESS;
+}
+
+// Starts loading the rest of the image in the background once the device is fully
+// initialized. Without the thread chunks are still loaded on first access.
+VOID TempStartImagePrefetch(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    PTEMP_IMAGE image = DeviceExtension->Image;
+    OBJECT_ATTRIBUTES attributes;
+    HANDLE threadHandle;
+
+    // A mapped image is never copied in
+    if (!image || image->View)
+    {
+        return;
+    }
+
+    // This runs in the context of the process that created the device; keep the
+    // thread handle out of its handle table
+    InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    NTSTATUS status = PsCreateSystemThread(
+        &threadHandle,
+        THREAD_ALL_ACCESS,
+        &attributes,
+        NULL,
+        NULL,
+        TempImagePrefetchThread,
+        DeviceExtension);
+
+    if (NT_SUCCESS(status))
+    {
+        status = ObReferenceObjectByHandle(threadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, &image->Thread, NULL);
+        if (!NT_SUCCESS(status))
+        {
+            // The thread runs regardless; stop it the only way left and wait via the handle
+            KeSetEvent(&image->StopEvent, IO_NO_INCREMENT, FALSE);
+            ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+            image->Thread = NULL;
+        }
+
+        ZwClose(threadHandle);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("TEMP: device %u loads its image on demand only (0x%08X)\n", DeviceExtension->DeviceNumber, status));
+    }
+}
+
+// Stops the prefetcher and closes the image before the device's memory manager goes
+VOID TempCloseImage(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    PTEMP_IMAGE image = DeviceExtension ? DeviceExtension->Image : NULL;
+
+    if (!image)
+    {
+        return;
+    }
+
+    if (image->Thread)
+    {
+        KeSetEvent(&image->StopEvent, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(image->Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(image->Thread);
+        image->Thread = NULL;
+    }
+
+    TempEndImageSource(DeviceExtension->MemoryManager);
+
+    // No request is left to read the view
+    if (image->View)
+    {
+        MmUnmapViewInSystemSpace(image->View);
+        image->View = NULL;
+    }
+
+    TempCloseImageFile(image);
+
+    DeviceExtension->Image = NULL;
+    ExFreePool(image);
+}
@@ -0,0 +1,559 @@
+#include <ntifs.h> // Before temp_core.h: ntifs.h includes ntddk.h itself
+#include "../core/temp_core.h"
+
+// Memory pressure monitor. A system thread watches the kernel's low and high
+// memory condition events and applies each device's pressure policy: under low
+// memory it reclaims chunks, once memory is plentiful again it brings compressed
+// and spilled chunks back. It also ages every device's access heatmap, frees the
+// chunks a format left behind and keeps the devices within the global memory
+// budget and the I/O QoS ceiling divided among the busy ones.
+
+static KEVENT g_PressureStopEvent;
+static PKEVENT g_LowMemoryEvent = NULL;
+static PKEVENT g_HighMemoryEvent = NULL;
+static HANDLE g_LowMemoryHandle = NULL;
+static HANDLE g_HighMemoryHandle = NULL;
+static PVOID g_PressureThread = NULL;
+static TEMP_MEMORY_POOL g_MemoryPool; // Every device's chunk data is charged here
+
+typedef struct _TEMP_FILE_REQUEST
+{
+    HANDLE FileHandle;
+    BOOLEAN Write;
+    ULONG64 Offset;
+    PVOID Buffer;
+    ULONG Length;
+    ULONG Transferred;
+    NTSTATUS Status;
+    KEVENT Done;
+} TEMP_FILE_REQUEST, *PTEMP_FILE_REQUEST;
+
+static VOID TempPressureScan(BOOLEAN NewEvent, BOOLEAN LowMemory, BOOLEAN HighMemory, BOOLEAN Age, BOOLEAN Decay)
+{
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+        if (!deviceExtension)
+        {
+            continue;
+        }
+
+        PTEMP_MEMORY_MANAGER memoryManager = deviceExtension->MemoryManager;
+
+        if (NewEvent)
+        {
+            InterlockedIncrement64(&memoryManager->PressureEvents);
+        }
+
+        if (Decay)
+        {
+            TempDecayHeatmap(memoryManager);
+        }
+
+        TempSweepFormattedChunks(memoryManager, TEMP_FORMAT_SWEEP_CHUNKS);
+
+        if (memoryManager->PressurePolicy)
+        {
+            if (Age)
+            {
+                TempAgeMemory(memoryManager);
+            }
+
+            if (LowMemory)
+            {
+                ULONG64 reclaimed = TempReclaimMemory(memoryManager, TEMP_PRESSURE_RECLAIM_STEP);
+                if (reclaimed)
+                {
+                    KdPrint(("TEMP: device %u reclaimed %I64u bytes under memory pressure\n",
+                             deviceExtension->DeviceNumber, reclaimed));
+                }
+            }
+            else if (HighMemory)
+            {
+                TempRestoreMemory(memoryManager, TEMP_PRESSURE_RESTORE_STEP);
+            }
+        }
+
+        TempDereferenceDevice(deviceExtension);
+    }
+}
+
+FORCEINLINE LONG64 TempBudgetBurst(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    return MemoryManager->ChargedBytes - (LONG64)MemoryManager->BudgetMinimum;
+}
+
+// Devices holding more than their maximum give the excess back, and when the pool's
+// room for bursting runs short the devices furthest past their minimums give back
+// the shortfall, largest first. Only devices with a pressure policy can give memory
+// back; the others are held to the budget by refused allocations alone.
+static VOID TempBalanceMemoryBudget(VOID)
+{
+    PTEMP_DEVICE_EXTENSION devices[TEMP_MAX_DEVICES];
+    ULONG count = 0;
+    ULONG64 shortfall = TempQueryPoolShortfall(&g_MemoryPool);
+
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+        if (!deviceExtension)
+        {
+            continue;
+        }
+
+        PTEMP_MEMORY_MANAGER memoryManager = deviceExtension->MemoryManager;
+
+        if (!memoryManager->PressurePolicy)
+        {
+            TempDereferenceDevice(deviceExtension);
+            continue;
+        }
+
+        ULONG64 excess = TempQueryBudgetExcess(memoryManager);
+        if (excess)
+        {
+            ULONG64 reclaimed = TempReclaimMemory(memoryManager, min(excess, TEMP_PRESSURE_RECLAIM_STEP));
+            shortfall -= min(reclaimed, shortfall);
+        }
+
+        devices[count++] = deviceExtension;
+    }
+
+    while (shortfall > 0 && count > 0)
+    {
+        ULONG largest = 0;
+
+        for (ULONG i = 1; i < count; i++)
+        {
+            if (TempBudgetBurst(devices[i]->MemoryManager) > TempBudgetBurst(devices[largest]->MemoryManager))
+            {
+                largest = i;
+            }
+        }
+
+        PTEMP_DEVICE_EXTENSION deviceExtension = devices[largest];
+        LONG64 burst = TempBudgetBurst(deviceExtension->MemoryManager);
+
+        if (burst <= 0)
+        {
+            break;
+        }
+
+        ULONG64 target = min(min((ULONG64)burst, shortfall), TEMP_PRESSURE_RECLAIM_STEP);
+        ULONG64 reclaimed = TempReclaimMemory(deviceExtension->MemoryManager, target);
+        if (reclaimed)
+        {
+            KdPrint(("TEMP: device %u gave %I64u bytes back to the memory budget\n",
+                     deviceExtension->DeviceNumber, reclaimed));
+        }
+
+        shortfall -= min(reclaimed, shortfall);
+
+        // One pass per device and scan; the rest waits for the next scan
+        devices[largest] = devices[--count];
+        TempDereferenceDevice(deviceExtension);
+    }
+
+    while (count > 0)
+    {
+        TempDereferenceDevice(devices[--count]);
+    }
+}
+
+static VOID TempPressureMonitorThread(PVOID Context)
+{
+    PVOID waitObjects[2] = {&g_PressureStopEvent, g_LowMemoryEvent};
+    BOOLEAN underPressure = FALSE;
+    ULONG scans = 0;
+    ULONG decayScans = 0;
+    LARGE_INTEGER interval;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    interval.QuadPart = -10000LL * TEMP_PRESSURE_SCAN_INTERVAL_MS;
+
+    for (;;)
+    {
+        // The low memory event stays signalled for as long as the condition lasts, so
+        // only let it cut the wait short while we are not already reclaiming
+        NTSTATUS status = KeWaitForMultipleObjects(
+            underPressure ? 1 : 2,
+            waitObjects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            &interval,
+            NULL);
+
+        if (status == STATUS_WAIT_0)
+        {
+            break;
+        }
+
+        BOOLEAN lowMemory = KeReadStateEvent(g_LowMemoryEvent) != 0;
+        BOOLEAN highMemory = KeReadStateEvent(g_HighMemoryEvent) != 0;
+        BOOLEAN newEvent = lowMemory && !underPressure;
+
+        if (newEvent)
+        {
+            KdPrint(("TEMP: low memory condition signalled\n"));
+        }
+
+        // Chunks untouched for TEMP_PRESSURE_COLD_AGE_SCANS scans count as cold
+        BOOLEAN age = ++scans >= TEMP_PRESSURE_COLD_AGE_SCANS;
+        if (age)
+        {
+            scans = 0;
+        }
+
+        BOOLEAN decay = ++decayScans >= TEMP_HEATMAP_DECAY_SCANS;
+        if (decay)
+        {
+            decayScans = 0;
+        }
+
+        TempPressureScan(newEvent, lowMemory, highMemory, age, decay);
+        TempBalanceMemoryBudget();
+        TempBalanceQos();
+        underPressure = lowMemory;
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+VOID TempInitializeMemoryBudget(VOID)
+{
+    TempInitializeMemoryPool(&g_MemoryPool);
+}
+
+// Reserves a new device's minimum in the global pool before any I/O reaches it
+NTSTATUS TempJoinMemoryBudget(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 Minimum, ULONG64 Maximum)
+{
+    return TempAttachMemoryPool(DeviceExtension->MemoryManager, &g_MemoryPool, Minimum, Maximum);
+}
+
+// TEMP_IOCTL_MEMORY_BUDGET and TEMP_IOCTL_SET_MEMORY_BUDGET. Applies the
+// TEMP_BUDGET_CONTROL in Buffer if there is one, then reports the budget in Buffer if
+// the output holds a TEMP_MEMORY_BUDGET. Only the set code, which needs a handle opened
+// for writing, may change anything.
+NTSTATUS TempControlMemoryBudget(PVOID Buffer, ULONG InputLength, ULONG OutputLength, BOOLEAN AllowChanges, PULONG_PTR Information)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (InputLength >= sizeof(TEMP_BUDGET_CONTROL))
+    {
+        // The report overwrites the same buffer
+        TEMP_BUDGET_CONTROL control = *(PTEMP_BUDGET_CONTROL)Buffer;
+
+        if ((control.Flags & ~(TEMP_BUDGET_SET_POOL | TEMP_BUDGET_SET_DEVICE)) != 0)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (control.Flags && !AllowChanges)
+        {
+            return STATUS_ACCESS_DENIED;
+        }
+
+        // A larger pool has to be in place before a device's minimum can grow into it,
+        // and a smaller one only fits once the minimums have shrunk
+        BOOLEAN poolFirst = control.PoolLimit == 0 ||
+                            (g_MemoryPool.Limit != 0 && control.PoolLimit >= (ULONG64)g_MemoryPool.Limit);
+
+        if ((control.Flags & TEMP_BUDGET_SET_POOL) && poolFirst)
+        {
+            status = TempSetMemoryPoolLimit(&g_MemoryPool, control.PoolLimit);
+        }
+
+        if (NT_SUCCESS(status) && (control.Flags & TEMP_BUDGET_SET_DEVICE))
+        {
+            PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(control.DeviceNumber);
+            if (!deviceExtension)
+            {
+                return STATUS_NO_SUCH_DEVICE;
+            }
+
+            status = TempSetMemoryBudget(deviceExtension->MemoryManager, control.Minimum, control.Maximum);
+            TempDereferenceDevice(deviceExtension);
+        }
+
+        if (NT_SUCCESS(status) && (control.Flags & TEMP_BUDGET_SET_POOL) && !poolFirst)
+        {
+            status = TempSetMemoryPoolLimit(&g_MemoryPool, control.PoolLimit);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+    else if (OutputLength < sizeof(TEMP_MEMORY_BUDGET))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (OutputLength < sizeof(TEMP_MEMORY_BUDGET))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    PTEMP_MEMORY_BUDGET budget = (PTEMP_MEMORY_BUDGET)Buffer;
+
+    RtlZeroMemory(budget, sizeof(TEMP_MEMORY_BUDGET));
+    budget->Version = TEMP_MEMORY_BUDGET_VERSION;
+    budget->Size = sizeof(TEMP_MEMORY_BUDGET);
+    budget->PoolLimit = g_MemoryPool.Limit;
+    budget->Guaranteed = g_MemoryPool.Guaranteed;
+    budget->Charged = g_MemoryPool.Charged;
+    budget->Burst = g_MemoryPool.Burst;
+    budget->Denials = g_MemoryPool.Denials;
+
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+        if (!deviceExtension)
+        {
+            continue;
+        }
+
+        PTEMP_MEMORY_MANAGER memoryManager = deviceExtension->MemoryManager;
+        PTEMP_DEVICE_BUDGET entry = &budget->Devices[budget->DevicesReturned++];
+
+        entry->DeviceNumber = i;
+        entry->PressurePolicy = memoryManager->PressurePolicy;
+        entry->Minimum = memoryManager->BudgetMinimum;
+        entry->Maximum = memoryManager->BudgetMaximum;
+        entry->Charged = memoryManager->ChargedBytes;
+        entry->Denials = memoryManager->BudgetDenials;
+
+        TempDereferenceDevice(deviceExtension);
+    }
+
+    *Information = sizeof(TEMP_MEMORY_BUDGET);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS TempStartPressureMonitor(VOID)
+{
+    UNICODE_STRING eventName;
+    HANDLE threadHandle;
+    NTSTATUS status;
+
+    KeInitializeEvent(&g_PressureStopEvent, NotificationEvent, FALSE);
+
+    RtlInitUnicodeString(&eventName, L"\\KernelObjects\\LowMemoryCondition");
+    g_LowMemoryEvent = IoCreateNotificationEvent(&eventName, &g_LowMemoryHandle);
+
+    RtlInitUnicodeString(&eventName, L"\\KernelObjects\\HighMemoryCondition");
+    g_HighMemoryEvent = IoCreateNotificationEvent(&eventName, &g_HighMemoryHandle);
+
+    if (!g_LowMemoryEvent || !g_HighMemoryEvent)
+    {
+        TempStopPressureMonitor();
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = PsCreateSystemThread(
+        &threadHandle,
+        THREAD_ALL_ACCESS,
+        NULL,
+        NULL,
+        NULL,
+        TempPressureMonitorThread,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        TempStopPressureMonitor();
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, &g_PressureThread, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        // The thread runs regardless; stop it the only way left and wait via the handle
+        KeSetEvent(&g_PressureStopEvent, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+        ZwClose(threadHandle);
+        TempStopPressureMonitor();
+        return status;
+    }
+
+    ZwClose(threadHandle);
+
+    return STATUS_SUCCESS;
+}
+
+VOID TempStopPressureMonitor(VOID)
+{
+    if (g_PressureThread)
+    {
+        KeSetEvent(&g_PressureStopEvent, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(g_PressureThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(g_PressureThread);
+        g_PressureThread = NULL;
+    }
+
+    if (g_LowMemoryHandle)
+    {
+        ZwClose(g_LowMemoryHandle);
+        g_LowMemoryHandle = NULL;
+        g_LowMemoryEvent = NULL;
+    }
+
+    if (g_HighMemoryHandle)
+    {
+        ZwClose(g_HighMemoryHandle);
+        g_HighMemoryHandle = NULL;
+        g_HighMemoryEvent = NULL;
+    }
+}
+
+NTSTATUS TempOpenSpillFile(PTEMP_DEVICE_EXTENSION DeviceExtension, PCWSTR FileName, KPROCESSOR_MODE RequestorMode)
+{
+    UNICODE_STRING fileName;
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    NTSTATUS status;
+
+    if (!DeviceExtension || !FileName || FileName[0] == L'\0')
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The name comes from the caller, so a user-mode caller must be able to create and
+    // delete the file itself; the driver's own rights must not open it on their behalf
+    RtlInitUnicodeString(&fileName, FileName);
+    InitializeObjectAttributes(
+        &attributes,
+        &fileName,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE | (RequestorMode == UserMode ? OBJ_FORCE_ACCESS_CHECK : 0),
+        NULL,
+        NULL);
+
+    // Spilled data is only meaningful while the device exists
+    status = ZwCreateFile(
+        &DeviceExtension->SpillFileHandle,
+        GENERIC_READ | GENERIC_WRITE | DELETE | SYNCHRONIZE,
+        &attributes,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_TEMPORARY,
+        0,
+        FILE_OVERWRITE_IF,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE | FILE_DELETE_ON_CLOSE,
+        NULL,
+        0);
+
+    if (!NT_SUCCESS(status))
+    {
+        DeviceExtension->SpillFileHandle = NULL;
+        return status;
+    }
+
+    // Chunks are written at their own disk offsets; a sparse file only occupies
+    // space for what was actually spilled. Not every file system supports it.
+    ZwFsControlFile(DeviceExtension->SpillFileHandle, NULL, NULL, NULL, &ioStatus,
+                    FSCTL_SET_SPARSE, NULL, 0, NULL, 0);
+
+    return STATUS_SUCCESS;
+}
+
+VOID TempCloseSpillFile(PTEMP_DEVICE_EXTENSION DeviceExtension)
+{
+    if (DeviceExtension && DeviceExtension->SpillFileHandle)
+    {
+        ZwClose(DeviceExtension->SpillFileHandle);
+        DeviceExtension->SpillFileHandle = NULL;
+    }
+}
+
+static NTSTATUS TempFileIo(HANDLE FileHandle, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length, PULONG Transferred)
+{
+    IO_STATUS_BLOCK ioStatus;
+    LARGE_INTEGER byteOffset;
+    NTSTATUS status;
+
+    byteOffset.QuadPart = (LONGLONG)Offset;
+    ioStatus.Information = 0;
+
+    if (Write)
+    {
+        status = ZwWriteFile(FileHandle, NULL, NULL, NULL, &ioStatus,
+                             Buffer, Length, &byteOffset, NULL);
+    }
+    else
+    {
+        status = ZwReadFile(FileHandle, NULL, NULL, NULL, &ioStatus,
+                            Buffer, Length, &byteOffset, NULL);
+    }
+
+    *Transferred = NT_SUCCESS(status) ? (ULONG)ioStatus.Information : 0;
+    return status;
+}
+
+static VOID TempFileWorkItem(PDEVICE_OBJECT DeviceObject, PVOID Context)
+{
+    PTEMP_FILE_REQUEST request = (PTEMP_FILE_REQUEST)Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    request->Status = TempFileIo(request->FileHandle, request->Write, request->Offset, request->Buffer,
+                                 request->Length, &request->Transferred);
+    KeSetEvent(&request->Done, IO_NO_INCREMENT, FALSE);
+}
+
+// Reads or writes one of the device's files at Offset. File I/O needs PASSIVE_LEVEL;
+// paging requests arrive at APC_LEVEL and are handed to a worker.
+NTSTATUS TempTransferFile(PTEMP_DEVICE_EXTENSION DeviceExtension, HANDLE FileHandle, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length, PULONG Transferred)
+{
+    if (KeGetCurrentIrql() == PASSIVE_LEVEL)
+    {
+        return TempFileIo(FileHandle, Write, Offset, Buffer, Length, Transferred);
+    }
+
+    PIO_WORKITEM workItem = IoAllocateWorkItem(DeviceExtension->DeviceObject);
+    if (!workItem)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    TEMP_FILE_REQUEST request;
+    request.FileHandle = FileHandle;
+    request.Write = Write;
+    request.Offset = Offset;
+    request.Buffer = Buffer;
+    request.Length = Length;
+    request.Transferred = 0;
+    request.Status = STATUS_UNSUCCESSFUL;
+    KeInitializeEvent(&request.Done, NotificationEvent, FALSE);
+
+    IoQueueWorkItem(workItem, TempFileWorkItem, DelayedWorkQueue, &request);
+    KeWaitForSingleObject(&request.Done, Executive, KernelMode, FALSE, NULL);
+    IoFreeWorkItem(workItem);
+
+    *Transferred = request.Transferred;
+    return request.Status;
+}
+
+// PTEMP_SPILL_ROUTINE for devices created with TEMP_PRESSURE_SPILL
+NTSTATUS TempSpillTransfer(PVOID Context, BOOLEAN Write, ULONG64 Offset, PVOID Buffer, ULONG Length)
+{
+    PTEMP_DEVICE_EXTENSION deviceExtension = (PTEMP_DEVICE_EXTENSION)Context;
+    ULONG transferred;
+
+    if (!deviceExtension || !deviceExtension->SpillFileHandle)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    NTSTATUS status = TempTransferFile(deviceExtension, deviceExtension->SpillFileHandle, Write, Offset, Buffer, Length, &transferred);
+
+    if (NT_SUCCESS(status) && transferred != Length)
+    {
+        status = STATUS_DATA_ERROR;
+    }
+
+    return status;
+}
@@ -0,0 +1,375 @@
+#include <ntifs.h> // Before temp_core.h: ntifs.h includes ntddk.h itself
+#include "../core/temp_core.h"
+
+// I/O QoS and priority. Reads and writes are served in the caller's thread, so a
+// request over its device's limits simply waits there before it is served; nothing
+// is queued. Each device has a requests-per-second and a bytes-per-second bucket.
+// An optional driver-wide ceiling is divided among the devices that were busy in
+// the last second in proportion to their weights, once a second by the pressure
+// monitor and whenever a setting changes. The OS I/O priority of a request decides
+// how it is treated:
+// - low and very low priority requests first wait until no request of normal or
+//   higher priority arrived on any device for the idle interval, at most
+//   TEMP_QOS_STARVATION_MS;
+// - normal priority requests wait for their buckets;
+// - high priority and paging requests never wait, but still use up tokens, so the
+//   requests after them wait in their place.
+
+#define TEMP_QOS_STAMP_MS 1 // Granularity of the last normal-priority arrival time
+
+// A synchronization event rather than a fast mutex, like the shared statistics lock
+static KEVENT g_QosLock;
+static LARGE_INTEGER g_QosFrequency;
+static ULONG64 g_QosTotalIops = 0;
+static ULONG64 g_QosTotalBandwidth = 0;
+static ULONG64 g_QosBusyWeight = 0; // Weights of the devices busy at the last division
+static volatile ULONG g_QosIdleInterval = TEMP_QOS_IDLE_INTERVAL_MS;
+
+// Performance counter reading of the latest normal or higher priority arrival, kept
+// to TEMP_QOS_STAMP_MS so busy devices do not all write it on every request
+static volatile LONG64 g_QosLastArrival = 0;
+
+FORCEINLINE LONG64 TempQosMillisecondsToTicks(ULONG Milliseconds)
+{
+    return (LONG64)Milliseconds * g_QosFrequency.QuadPart / 1000;
+}
+
+static ULONG64 TempQosNanoseconds(ULONG64 Ticks)
+{
+    ULONG64 frequency = (ULONG64)g_QosFrequency.QuadPart;
+
+    return (Ticks / frequency) * 1000000000ULL + (Ticks % frequency) * 1000000000ULL / frequency;
+}
+
+// Rate in force for one bucket: the device's limit, or its weighted share of the
+// ceiling if that is lower. Weights counts this device whether it was busy or not,
+// so a device starting up is not held to nothing until the next division.
+static LONG64 TempQosRate(ULONG64 Limit, ULONG64 Total, ULONG Weight, ULONG64 Weights)
+{
+    if (!Total)
+    {
+        return (LONG64)Limit;
+    }
+
+    // Split so large ceilings cannot overflow
+    ULONG64 share = Total / Weights * Weight + Total % Weights * Weight / Weights;
+    if (share == 0)
+    {
+        share = 1;
+    }
+
+    return (LONG64)(Limit && Limit < share ? Limit : share);
+}
+
+// Caller holds g_QosLock
+static VOID TempApplyQos(PTEMP_QOS Qos)
+{
+    ULONG64 weights = g_QosBusyWeight + (Qos->Busy ? 0 : Qos->Weight);
+
+    InterlockedExchange64(&Qos->IopsRate, TempQosRate(Qos->IopsLimit, g_QosTotalIops, Qos->Weight, weights));
+    InterlockedExchange64(&Qos->BandwidthRate, TempQosRate(Qos->BandwidthLimit, g_QosTotalBandwidth, Qos->Weight, weights));
+}
+
+// Redivides the ceiling. Sample takes a new look at which devices were busy since
+// the last sample; settings changes keep the last one. Caller holds g_QosLock.
+static VOID TempDivideQos(BOOLEAN Sample)
+{
+    PTEMP_DEVICE_EXTENSION devices[TEMP_MAX_DEVICES];
+    ULONG count = 0;
+    ULONG64 busyWeight = 0;
+
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+        if (!deviceExtension)
+        {
+            continue;
+        }
+
+        PTEMP_QOS qos = &deviceExtension->Qos;
+
+        if (Sample)
+        {
+            ULONG64 requests = (ULONG64)deviceExtension->ReadRequests + (ULONG64)deviceExtension->WriteRequests;
+
+            qos->Busy = requests != qos->LastRequests;
+            qos->LastRequests = requests;
+        }
+
+        if (qos->Busy)
+        {
+            busyWeight += qos->Weight;
+        }
+
+        devices[count++] = deviceExtension;
+    }
+
+    g_QosBusyWeight = busyWeight;
+
+    while (count > 0)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = devices[--count];
+
+        TempApplyQos(&deviceExtension->Qos);
+        TempDereferenceDevice(deviceExtension);
+    }
+}
+
+FORCEINLINE VOID TempAcquireQosLock(VOID)
+{
+    KeEnterCriticalRegion();
+    KeWaitForSingleObject(&g_QosLock, Executive, KernelMode, FALSE, NULL);
+}
+
+FORCEINLINE VOID TempReleaseQosLock(VOID)
+{
+    KeSetEvent(&g_QosLock, IO_NO_INCREMENT, FALSE);
+    KeLeaveCriticalRegion();
+}
+
+// Takes Cost tokens from a bucket kept as the time, in nanoseconds, up to which its
+// tokens are spoken for. Returns how long the caller has to wait for them, which is
+// 0 or less while the bucket still holds TEMP_QOS_BURST_MS worth.
+static LONG64 TempQosTake(volatile LONG64 *Due, LONG64 Rate, ULONG64 Cost, LONG64 Now)
+{
+    LONG64 cost = (LONG64)(Cost * 1000000000ULL / (ULONG64)Rate);
+    LONG64 due;
+    LONG64 next;
+
+    do
+    {
+        due = *Due;
+        next = (due > Now ? due : Now) + cost;
+    } while (InterlockedCompareExchange64(Due, next, due) != due);
+
+    return next - Now - TEMP_QOS_BURST_MS * 1000000LL;
+}
+
+// Waits Nanoseconds, or until the device is being removed. Returns how long it
+// actually waited: at least one timer tick.
+static ULONG64 TempQosWait(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 Nanoseconds)
+{
+    LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+    LARGE_INTEGER timeout;
+
+    timeout.QuadPart = -(LONG64)(Nanoseconds / 100);
+    if (timeout.QuadPart == 0)
+    {
+        timeout.QuadPart = -1;
+    }
+
+    KeWaitForSingleObject(&DeviceExtension->RemoveEvent, Executive, KernelMode, FALSE, &timeout);
+
+    return TempQosNanoseconds((ULONG64)(KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart));
+}
+
+// Called for every read and write before it is served, with the performance counter
+// reading taken when it arrived
+VOID TempThrottleRequest(PTEMP_DEVICE_EXTENSION DeviceExtension, PIRP Irp, LARGE_INTEGER Start, ULONG Length)
+{
+    PTEMP_QOS qos = &DeviceExtension->Qos;
+    IO_PRIORITY_HINT priority = IoGetIoPriorityHint(Irp);
+    LONG64 iopsRate = qos->IopsRate;
+    LONG64 bandwidthRate = qos->BandwidthRate;
+    BOOLEAN mayWait = priority < IoPriorityHigh && !(Irp->Flags & IRP_PAGING_IO) && KeGetCurrentIrql() <= APC_LEVEL;
+    LARGE_INTEGER now = Start;
+
+    if (priority >= IoPriorityNormal)
+    {
+        if (Start.QuadPart - g_QosLastArrival >= TempQosMillisecondsToTicks(TEMP_QOS_STAMP_MS))
+        {
+            g_QosLastArrival = Start.QuadPart;
+        }
+    }
+    else if (mayWait && g_QosIdleInterval)
+    {
+        LONG64 idle = TempQosMillisecondsToTicks(g_QosIdleInterval);
+        LONG64 deadline = Start.QuadPart + TempQosMillisecondsToTicks(TEMP_QOS_STARVATION_MS);
+        ULONG64 waited = 0;
+
+        while (!KeReadStateEvent(&DeviceExtension->RemoveEvent))
+        {
+            LONG64 quiet = g_QosLastArrival + idle;
+            LONG64 until = quiet < deadline ? quiet : deadline;
+
+            if (until <= now.QuadPart)
+            {
+                break;
+            }
+
+            waited += TempQosWait(DeviceExtension, TempQosNanoseconds((ULONG64)(until - now.QuadPart)));
+            now = KeQueryPerformanceCounter(NULL);
+        }
+
+        if (waited)
+        {
+            InterlockedIncrement64(&qos->DeferredRequests);
+            InterlockedAdd64(&qos->DeferredTime, (LONG64)waited);
+        }
+    }
+
+    if (!iopsRate && !bandwidthRate)
+    {
+        return;
+    }
+
+    LONG64 nanoseconds = (LONG64)TempQosNanoseconds((ULONG64)now.QuadPart);
+    LONG64 wait = iopsRate ? TempQosTake(&qos->IopsDue, iopsRate, 1, nanoseconds) : 0;
+
+    if (bandwidthRate)
+    {
+        LONG64 bandwidthWait = TempQosTake(&qos->BandwidthDue, bandwidthRate, Length, nanoseconds);
+        wait = bandwidthWait > wait ? bandwidthWait : wait;
+    }
+
+    if (wait > 0 && mayWait)
+    {
+        ULONG64 waited = TempQosWait(DeviceExtension, (ULONG64)wait);
+
+        InterlockedIncrement64(&qos->ThrottledRequests);
+        InterlockedAdd64(&qos->ThrottledTime, (LONG64)waited);
+    }
+}
+
+VOID TempInitializeQos(VOID)
+{
+    KeInitializeEvent(&g_QosLock, SynchronizationEvent, TRUE);
+    KeQueryPerformanceCounter(&g_QosFrequency);
+}
+
+// Limits of 0 remove them; a weight of 0 selects TEMP_QOS_DEFAULT_WEIGHT. Also used
+// at creation, before the device is listed. PASSIVE_LEVEL.
+NTSTATUS TempSetDeviceQos(PTEMP_DEVICE_EXTENSION DeviceExtension, ULONG64 IopsLimit, ULONG64 BandwidthLimit, ULONG Weight)
+{
+    if (Weight > TEMP_QOS_MAX_WEIGHT || IopsLimit > MAXLONG64 || BandwidthLimit > MAXLONG64)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PTEMP_QOS qos = &DeviceExtension->Qos;
+
+    TempAcquireQosLock();
+
+    qos->IopsLimit = IopsLimit;
+    qos->BandwidthLimit = BandwidthLimit;
+    qos->Weight = Weight ? Weight : TEMP_QOS_DEFAULT_WEIGHT;
+
+    // A busy device's new weight changes everyone's share
+    TempDivideQos(FALSE);
+    TempApplyQos(qos);
+
+    TempReleaseQosLock();
+
+    return STATUS_SUCCESS;
+}
+
+// Called by the pressure monitor once a scan
+VOID TempBalanceQos(VOID)
+{
+    TempAcquireQosLock();
+    TempDivideQos(TRUE);
+    TempReleaseQosLock();
+}
+
+// TEMP_IOCTL_QOS and TEMP_IOCTL_SET_QOS. Applies the TEMP_QOS_CONTROL in Buffer if
+// there is one, then reports the settings in Buffer if the output holds a
+// TEMP_QOS_REPORT. Only the set code, which needs a handle opened for writing, may
+// change anything.
+NTSTATUS TempControlQos(PVOID Buffer, ULONG InputLength, ULONG OutputLength, BOOLEAN AllowChanges, PULONG_PTR Information)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (InputLength >= sizeof(TEMP_QOS_CONTROL))
+    {
+        // The report overwrites the same buffer
+        TEMP_QOS_CONTROL control = *(PTEMP_QOS_CONTROL)Buffer;
+
+        if ((control.Flags & ~(TEMP_QOS_SET_DRIVER | TEMP_QOS_SET_DEVICE)) != 0 ||
+            ((control.Flags & TEMP_QOS_SET_DRIVER) &&
+             (control.IdleIntervalMs > TEMP_QOS_MAX_IDLE_INTERVAL_MS ||
+              control.TotalIops > MAXLONG64 || control.TotalBandwidth > MAXLONG64)))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (control.Flags && !AllowChanges)
+        {
+            return STATUS_ACCESS_DENIED;
+        }
+
+        if (control.Flags & TEMP_QOS_SET_DEVICE)
+        {
+            PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(control.DeviceNumber);
+            if (!deviceExtension)
+            {
+                return STATUS_NO_SUCH_DEVICE;
+            }
+
+            status = TempSetDeviceQos(deviceExtension, control.IopsLimit, control.BandwidthLimit, control.Weight);
+            TempDereferenceDevice(deviceExtension);
+
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+        }
+
+        if (control.Flags & TEMP_QOS_SET_DRIVER)
+        {
+            TempAcquireQosLock();
+
+            g_QosTotalIops = control.TotalIops;
+            g_QosTotalBandwidth = control.TotalBandwidth;
+            g_QosIdleInterval = control.IdleIntervalMs;
+            TempDivideQos(FALSE);
+
+            TempReleaseQosLock();
+        }
+    }
+    else if (OutputLength < sizeof(TEMP_QOS_REPORT))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (OutputLength < sizeof(TEMP_QOS_REPORT))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    PTEMP_QOS_REPORT report = (PTEMP_QOS_REPORT)Buffer;
+
+    RtlZeroMemory(report, sizeof(TEMP_QOS_REPORT));
+    report->Version = TEMP_QOS_VERSION;
+    report->Size = sizeof(TEMP_QOS_REPORT);
+    report->IdleIntervalMs = g_QosIdleInterval;
+    report->TotalIops = g_QosTotalIops;
+    report->TotalBandwidth = g_QosTotalBandwidth;
+
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+        if (!deviceExtension)
+        {
+            continue;
+        }
+
+        PTEMP_QOS qos = &deviceExtension->Qos;
+        PTEMP_DEVICE_QOS entry = &report->Devices[report->DevicesReturned++];
+
+        entry->DeviceNumber = i;
+        entry->Weight = qos->Weight;
+        entry->IopsLimit = qos->IopsLimit;
+        entry->BandwidthLimit = qos->BandwidthLimit;
+        entry->IopsRate = qos->IopsRate;
+        entry->BandwidthRate = qos->BandwidthRate;
+        entry->ThrottledRequests = qos->ThrottledRequests;
+        entry->ThrottledTime = qos->ThrottledTime;
+        entry->DeferredRequests = qos->DeferredRequests;
+        entry->DeferredTime = qos->DeferredTime;
+
+        TempDereferenceDevice(deviceExtension);
+    }
+
+    *Information = sizeof(TEMP_QOS_REPORT);
+    return STATUS_SUCCESS;
+}
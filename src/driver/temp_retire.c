@@ -0,0 +1,153 @@
+#include <ntifs.h> // Before temp_core.h: ntifs.h includes ntddk.h itself
+#include "../core/temp_core.h"
+
+// Retired memory. A removed device hands its memory manager over instead of freeing
+// every chunk before the removal returns: a low-priority system thread drains the
+// retired managers a step at a time, outside any bucket lock, and frees each once it
+// is empty. Their chunk data stays charged to the memory budget until it is freed.
+
+#define TEMP_RETIRE_POOL_TAG 'tRmT' // 'TmRt' backwards
+#define TEMP_RETIRE_STEP_SLOTS 4096 // Chunk slots freed between checks for a stop
+
+typedef struct _TEMP_RETIRED_MANAGER
+{
+    LIST_ENTRY Link;
+    PTEMP_MEMORY_MANAGER MemoryManager;
+} TEMP_RETIRED_MANAGER, *PTEMP_RETIRED_MANAGER;
+
+static LIST_ENTRY g_RetiredList;
+static KSPIN_LOCK g_RetiredLock;
+static KEVENT g_RetiredEvent; // Set whenever a manager is queued
+static KEVENT g_RetireStopEvent;
+static PVOID g_RetireThread = NULL;
+static KPRIORITY g_RetirePriority; // The worker's priority before it lowered its own
+
+// Frees a pool-allocated manager whole, draining it first so no bucket lock is held
+// while its chunks go
+static VOID TempFreeRetiredManager(PTEMP_MEMORY_MANAGER MemoryManager, ULONG StepSlots)
+{
+    while (!TempDrainMemoryManager(MemoryManager, StepSlots))
+    {
+        // Unload waits for the rest; stop deferring to other threads
+        if (StepSlots != MAXULONG && KeReadStateEvent(&g_RetireStopEvent))
+        {
+            KeSetPriorityThread(KeGetCurrentThread(), g_RetirePriority);
+            StepSlots = MAXULONG;
+        }
+    }
+
+    TempCleanupMemoryManager(MemoryManager);
+    ExFreePool(MemoryManager);
+}
+
+static VOID TempRetireThread(PVOID Context)
+{
+    PVOID waitObjects[2] = {&g_RetireStopEvent, &g_RetiredEvent};
+
+    UNREFERENCED_PARAMETER(Context);
+
+    // Nobody waits for this memory but the budget; every other thread goes first
+    g_RetirePriority = KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+    for (;;)
+    {
+        NTSTATUS status = KeWaitForMultipleObjects(2, waitObjects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+        PLIST_ENTRY entry;
+
+        // Managers queued before a stop are still freed
+        while ((entry = ExInterlockedRemoveHeadList(&g_RetiredList, &g_RetiredLock)) != NULL)
+        {
+            PTEMP_RETIRED_MANAGER retired = CONTAINING_RECORD(entry, TEMP_RETIRED_MANAGER, Link);
+
+            TempFreeRetiredManager(retired->MemoryManager, TEMP_RETIRE_STEP_SLOTS);
+            ExFreePool(retired);
+        }
+
+        if (status == STATUS_WAIT_0)
+        {
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Takes a pool-allocated memory manager nothing references any more and frees it in
+// the background. Without the worker the caller frees it before returning.
+VOID TempRetireMemoryManager(PTEMP_MEMORY_MANAGER MemoryManager)
+{
+    PTEMP_RETIRED_MANAGER retired = NULL;
+
+    if (!MemoryManager)
+    {
+        return;
+    }
+
+    if (g_RetireThread)
+    {
+        retired = (PTEMP_RETIRED_MANAGER)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            sizeof(TEMP_RETIRED_MANAGER),
+            TEMP_RETIRE_POOL_TAG);
+    }
+
+    if (!retired)
+    {
+        TempFreeRetiredManager(MemoryManager, MAXULONG);
+        return;
+    }
+
+    retired->MemoryManager = MemoryManager;
+    ExInterlockedInsertTailList(&g_RetiredList, &retired->Link, &g_RetiredLock);
+    KeSetEvent(&g_RetiredEvent, IO_NO_INCREMENT, FALSE);
+}
+
+NTSTATUS TempStartRetireWorker(VOID)
+{
+    HANDLE threadHandle;
+    NTSTATUS status;
+
+    InitializeListHead(&g_RetiredList);
+    KeInitializeSpinLock(&g_RetiredLock);
+    KeInitializeEvent(&g_RetiredEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&g_RetireStopEvent, NotificationEvent, FALSE);
+
+    status = PsCreateSystemThread(
+        &threadHandle,
+        THREAD_ALL_ACCESS,
+        NULL,
+        NULL,
+        NULL,
+        TempRetireThread,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, &g_RetireThread, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        // The thread runs regardless; stop it the only way left and wait via the handle
+        KeSetEvent(&g_RetireStopEvent, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+        g_RetireThread = NULL;
+    }
+
+    ZwClose(threadHandle);
+
+    return status;
+}
+
+// Returns once every retired manager has been freed
+VOID TempStopRetireWorker(VOID)
+{
+    if (g_RetireThread)
+    {
+        KeSetEvent(&g_RetireStopEvent, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(g_RetireThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(g_RetireThread);
+        g_RetireThread = NULL;
+    }
+}
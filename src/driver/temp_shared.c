@@ -0,0 +1,298 @@
+#include <ntifs.h> // Before temp_core.h: ntifs.h includes ntddk.h itself
+#include "../core/temp_core.h"
+
+// Shared statistics page. A named, pagefile-backed section that everyone may map
+// read-only; a system thread copies every device's TEMP_DEVICE_INFO into it at a
+// fixed interval. Monitoring tools then poll memory instead of issuing IOCTLs.
+// The I/O path is not involved: its counters stay per bucket and are summed here,
+// the same way TEMP_IOCTL_GET_STATISTICS does.
+
+#define TEMP_SHARED_POOL_TAG 'hSmT' // 'TmSh' backwards
+
+// A synchronization event rather than a fast mutex: section and thread creation
+// must run at PASSIVE_LEVEL
+static KEVENT g_SharedStatsLock;
+static KEVENT g_SharedStatsStopEvent;
+static HANDLE g_SharedStatsSection = NULL;
+static PVOID g_SharedStatsView = NULL;
+static PVOID g_SharedStatsThread = NULL;
+static volatile ULONG g_SharedStatsInterval = 0;
+
+static VOID TempPublishSharedStats(PTEMP_SHARED_STATS Shared)
+{
+    LARGE_INTEGER now;
+
+    for (ULONG i = 0; i < TEMP_MAX_DEVICES; i++)
+    {
+        PTEMP_SHARED_DEVICE_STATS slot = &Shared->Devices[i];
+        PTEMP_DEVICE_EXTENSION deviceExtension = TempFindDevice(i);
+
+        // Slots of absent devices are cleared once and then left alone
+        if (!deviceExtension && !slot->Present)
+        {
+            continue;
+        }
+
+        InterlockedIncrement(&slot->Sequence);
+
+        if (deviceExtension)
+        {
+            TempQueryDeviceInfo(deviceExtension, &slot->Info);
+            slot->Present = TRUE;
+            TempDereferenceDevice(deviceExtension);
+        }
+        else
+        {
+            RtlZeroMemory(&slot->Info, sizeof(slot->Info));
+            slot->Present = FALSE;
+        }
+
+        InterlockedIncrement(&slot->Sequence);
+    }
+
+    KeQuerySystemTime(&now);
+    InterlockedExchange64(&Shared->UpdateTime, now.QuadPart);
+    InterlockedIncrement64(&Shared->UpdateCount);
+}
+
+static VOID TempSharedStatsThread(PVOID Context)
+{
+    PTEMP_SHARED_STATS shared = (PTEMP_SHARED_STATS)Context;
+    LARGE_INTEGER interval;
+
+    for (;;)
+    {
+        TempPublishSharedStats(shared);
+
+        // Re-read each time so a new interval applies without restarting the thread
+        interval.QuadPart = -10000LL * g_SharedStatsInterval;
+
+        if (KeWaitForSingleObject(&g_SharedStatsStopEvent, Executive, KernelMode, FALSE, &interval) == STATUS_WAIT_0)
+        {
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Everyone may map the section for reading; only the system may change it
+static NTSTATUS TempBuildSharedStatsSecurity(PSECURITY_DESCRIPTOR SecurityDescriptor, PACL *Dacl)
+{
+    ULONG aclLength = sizeof(ACL) +
+                      3 * FIELD_OFFSET(ACCESS_ALLOWED_ACE, SidStart) +
+                      RtlLengthSid(SeExports->SeWorldSid) +
+                      RtlLengthSid(SeExports->SeAliasAdminsSid) +
+                      RtlLengthSid(SeExports->SeLocalSystemSid);
+    PACL acl;
+    NTSTATUS status;
+
+    acl = (PACL)ExAllocatePool2(POOL_FLAG_PAGED, aclLength, TEMP_SHARED_POOL_TAG);
+    if (!acl)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = RtlCreateAcl(acl, aclLength, ACL_REVISION);
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_MAP_READ | SECTION_QUERY, SeExports->SeWorldSid);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_MAP_READ | SECTION_QUERY, SeExports->SeAliasAdminsSid);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_ALL_ACCESS, SeExports->SeLocalSystemSid);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = RtlCreateSecurityDescriptor(SecurityDescriptor, SECURITY_DESCRIPTOR_REVISION);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = RtlSetDaclSecurityDescriptor(SecurityDescriptor, TRUE, acl, FALSE);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePool(acl);
+        return status;
+    }
+
+    *Dacl = acl;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS TempCreateSharedStats(VOID)
+{
+    UNICODE_STRING sectionName;
+    OBJECT_ATTRIBUTES attributes;
+    SECURITY_DESCRIPTOR securityDescriptor;
+    LARGE_INTEGER maximumSize;
+    PVOID sectionObject = NULL;
+    SIZE_T viewSize = 0;
+    PACL dacl = NULL;
+    HANDLE threadHandle;
+    NTSTATUS status;
+
+    status = TempBuildSharedStatsSecurity(&securityDescriptor, &dacl);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    RtlInitUnicodeString(&sectionName, TEMP_SHARED_STATS_NAME);
+    InitializeObjectAttributes(&attributes, &sectionName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, &securityDescriptor);
+    maximumSize.QuadPart = sizeof(TEMP_SHARED_STATS);
+
+    status = ZwCreateSection(&g_SharedStatsSection, SECTION_ALL_ACCESS, &attributes, &maximumSize,
+                             PAGE_READWRITE, SEC_COMMIT, NULL);
+    ExFreePool(dacl);
+
+    if (!NT_SUCCESS(status))
+    {
+        g_SharedStatsSection = NULL;
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(g_SharedStatsSection, SECTION_MAP_WRITE, NULL, KernelMode, &sectionObject, NULL);
+    if (NT_SUCCESS(status))
+    {
+        // The view keeps the section alive; the handle keeps its name
+        status = MmMapViewInSystemSpace(sectionObject, &g_SharedStatsView, &viewSize);
+        ObDereferenceObject(sectionObject);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        g_SharedStatsView = NULL;
+        ZwClose(g_SharedStatsSection);
+        g_SharedStatsSection = NULL;
+        return status;
+    }
+
+    PTEMP_SHARED_STATS shared = (PTEMP_SHARED_STATS)g_SharedStatsView;
+    RtlZeroMemory(shared, sizeof(TEMP_SHARED_STATS));
+    shared->Version = TEMP_SHARED_STATS_VERSION;
+    shared->Size = sizeof(TEMP_SHARED_STATS);
+    shared->EntrySize = sizeof(TEMP_SHARED_DEVICE_STATS);
+    shared->DeviceSlots = TEMP_MAX_DEVICES;
+    shared->IntervalMs = g_SharedStatsInterval;
+
+    KeClearEvent(&g_SharedStatsStopEvent);
+
+    // This runs in the context of the process that sent the request; keep the thread
+    // handle out of its handle table
+    InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = PsCreateSystemThread(
+        &threadHandle,
+        THREAD_ALL_ACCESS,
+        &attributes,
+        NULL,
+        NULL,
+        TempSharedStatsThread,
+        shared);
+
+    if (NT_SUCCESS(status))
+    {
+        status = ObReferenceObjectByHandle(threadHandle, SYNCHRONIZE, *PsThreadType, KernelMode, &g_SharedStatsThread, NULL);
+        if (!NT_SUCCESS(status))
+        {
+            // The thread runs regardless; stop it the only way left and wait via the handle
+            KeSetEvent(&g_SharedStatsStopEvent, IO_NO_INCREMENT, FALSE);
+            ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+            g_SharedStatsThread = NULL;
+        }
+
+        ZwClose(threadHandle);
+    }
+
+    return status;
+}
+
+// Caller holds g_SharedStatsLock
+static VOID TempDestroySharedStats(VOID)
+{
+    if (g_SharedStatsThread)
+    {
+        KeSetEvent(&g_SharedStatsStopEvent, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(g_SharedStatsThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(g_SharedStatsThread);
+        g_SharedStatsThread = NULL;
+    }
+
+    if (g_SharedStatsView)
+    {
+        // Readers that still have the page mapped see that refreshing stopped
+        ((PTEMP_SHARED_STATS)g_SharedStatsView)->IntervalMs = 0;
+        MmUnmapViewInSystemSpace(g_SharedStatsView);
+        g_SharedStatsView = NULL;
+    }
+
+    if (g_SharedStatsSection)
+    {
+        ZwClose(g_SharedStatsSection);
+        g_SharedStatsSection = NULL;
+    }
+
+    g_SharedStatsInterval = 0;
+}
+
+VOID TempInitializeSharedStats(VOID)
+{
+    KeInitializeEvent(&g_SharedStatsLock, SynchronizationEvent, TRUE);
+    KeInitializeEvent(&g_SharedStatsStopEvent, NotificationEvent, FALSE);
+}
+
+// TEMP_IOCTL_SET_SHARED_STATS: a nonzero interval creates the page or changes how
+// often it is refreshed, zero removes it
+NTSTATUS TempSetSharedStats(ULONG IntervalMs)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (IntervalMs != 0 &&
+        (IntervalMs < TEMP_SHARED_STATS_MIN_INTERVAL_MS || IntervalMs > TEMP_SHARED_STATS_MAX_INTERVAL_MS))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeEnterCriticalRegion();
+    KeWaitForSingleObject(&g_SharedStatsLock, Executive, KernelMode, FALSE, NULL);
+
+    if (IntervalMs == 0)
+    {
+        TempDestroySharedStats();
+    }
+    else if (g_SharedStatsView)
+    {
+        // The running thread picks the new interval up after its current wait
+        g_SharedStatsInterval = IntervalMs;
+        ((PTEMP_SHARED_STATS)g_SharedStatsView)->IntervalMs = IntervalMs;
+    }
+    else
+    {
+        g_SharedStatsInterval = IntervalMs;
+        status = TempCreateSharedStats();
+        if (!NT_SUCCESS(status))
+        {
+            TempDestroySharedStats();
+        }
+    }
+
+    KeSetEvent(&g_SharedStatsLock, IO_NO_INCREMENT, FALSE);
+    KeLeaveCriticalRegion();
+
+    return status;
+}
+
+VOID TempStopSharedStats(VOID)
+{
+    KeEnterCriticalRegion();
+    KeWaitForSingleObject(&g_SharedStatsLock, Executive, KernelMode, FALSE, NULL);
+    TempDestroySharedStats();
+    KeSetEvent(&g_SharedStatsLock, IO_NO_INCREMENT, FALSE);
+    KeLeaveCriticalRegion();
+}
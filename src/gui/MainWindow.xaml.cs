@@ -50,9 +50,12 @@ namespace TempRamDiskGUI
         private const uint FILE_SHARE_READ = 0x00000001;
         private const uint FILE_SHARE_WRITE = 0x00000002;
         private const uint OPEN_EXISTING = 3;
-        private const uint TEMP_IOCTL_CREATE_DEVICE = 0x83000800;
-        private const uint TEMP_IOCTL_REMOVE_DEVICE = 0x83000801;
-        private const uint TEMP_IOCTL_GET_STATISTICS = 0x83000804;
+        // CTL_CODE(FILE_DEVICE_DISK, function, METHOD_BUFFERED, access), as in src/core/temp_ioctl.h.
+        // Removing a device needs FILE_WRITE_ACCESS (2 << 14), the rest FILE_ANY_ACCESS.
+        private const uint TEMP_IOCTL_CREATE_DEVICE = (0x7 << 16) | (0x800 << 2);
+        private const uint TEMP_IOCTL_REMOVE_DEVICE = (0x7 << 16) | (0x2 << 14) | (0x801 << 2);
+        private const uint TEMP_IOCTL_LIST_DEVICES = (0x7 << 16) | (0x802 << 2);
+        private const uint TEMP_IOCTL_GET_STATISTICS = (0x7 << 16) | (0x804 << 2);
         private const IntPtr INVALID_HANDLE_VALUE = (IntPtr)(-1);
 
         // Memory status structure
@@ -82,6 +85,17 @@ namespace TempRamDiskGUI
             public bool CdRomType;
             [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 260)]
             public string FileName;
+            public uint ChunkSize;
+            public uint PressurePolicy;
+            [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 260)]
+            public string SpillFileName;
+            public uint Encryption;
+            public uint ImageMode;
+            public ulong MemoryMinimum;
+            public ulong MemoryMaximum;
+            public ulong IopsLimit;
+            public ulong BandwidthLimit;
+            public uint QosWeight;
         }
 
         [StructLayout(LayoutKind.Sequential)]
@@ -97,8 +111,34 @@ namespace TempRamDiskGUI
             public ulong CacheHits;
             public ulong CacheMisses;
             public ulong EvictionCount;
+            public ulong PressureEvents;
+            public ulong BytesReclaimed;
+            public ulong CompressedChunks;
+            public ulong CompressedBytes;
+            public ulong SpilledChunks;
         }
 
+        // One entry of TEMP_IOCTL_LIST_DEVICES output
+        [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
+        public struct TempDeviceInfo
+        {
+            public uint DeviceNumber;
+            public uint SectorSize;
+            public uint ChunkSize;
+            public uint PressurePolicy;
+            public char DriveLetter;
+            [MarshalAs(UnmanagedType.U1)]
+            public bool RemovableMedia;
+            [MarshalAs(UnmanagedType.U1)]
+            public bool CdRomType;
+            public uint Encryption;
+            public TempStatistics Statistics;
+        }
+
+        // TEMP_DEVICE_LIST header; entries follow at Size, EntrySize apart
+        private const int TempDeviceListHeaderSize = 24;
+        private const int TempMaxDevices = 32;
+
         // RAM disk info class for data binding
         public class RamDiskInfo
         {
@@ -227,13 +267,9 @@ namespace TempRamDiskGUI
             {
                 RamDisks.Clear();
 
-                for (int i = 0; i < 32; i++)
+                foreach (var device in ListDevices())
                 {
-                    var ramDisk = GetRamDiskInfo(i);
-                    if (ramDisk != null)
-                    {
-                        RamDisks.Add(ramDisk);
-                    }
+                    RamDisks.Add(GetRamDiskInfo(device));
                 }
 
                 StatusText.Text = $"Found {RamDisks.Count} active RAM disks";
@@ -244,73 +280,74 @@ namespace TempRamDiskGUI
             }
         }
 
-        private RamDiskInfo GetRamDiskInfo(int deviceNumber)
+        // Every device's configuration and statistics with one request to the control device
+        private List<TempDeviceInfo> ListDevices()
         {
-            try
-            {
-                var devicePath = $@"\\.\TempRamDisk{deviceNumber}";
-                var handle = CreateFile(
-                    devicePath,
-                    GENERIC_READ,
-                    FILE_SHARE_READ | FILE_SHARE_WRITE,
-                    IntPtr.Zero,
-                    OPEN_EXISTING,
-                    0,
-                    IntPtr.Zero);
+            var devices = new List<TempDeviceInfo>();
+            var handle = CreateFile(
+                @"\\.\TempRamDiskControl",
+                GENERIC_READ,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                IntPtr.Zero,
+                OPEN_EXISTING,
+                0,
+                IntPtr.Zero);
 
-                if (handle == INVALID_HANDLE_VALUE)
-                    return null;
+            if (handle == INVALID_HANDLE_VALUE)
+                return devices;
 
-                var stats = new TempStatistics();
-                var size = Marshal.SizeOf<TempStatistics>();
-                var ptr = Marshal.AllocHGlobal(size);
+            var entrySize = Marshal.SizeOf<TempDeviceInfo>();
+            var size = TempDeviceListHeaderSize + TempMaxDevices * entrySize;
+            var ptr = Marshal.AllocHGlobal(size);
 
-                try
+            try
+            {
+                if (DeviceIoControl(handle, TEMP_IOCTL_LIST_DEVICES, IntPtr.Zero, 0, ptr, (uint)size, out uint bytesReturned, IntPtr.Zero) &&
+                    bytesReturned >= TempDeviceListHeaderSize)
                 {
-                    if (DeviceIoControl(handle, TEMP_IOCTL_GET_STATISTICS, IntPtr.Zero, 0, ptr, (uint)size, out uint bytesReturned, IntPtr.Zero))
-                    {
-                        stats = Marshal.PtrToStructure<TempStatistics>(ptr);
-                        
-                        var hitRatio = stats.CacheHits + stats.CacheMisses > 0 
-                            ? (double)stats.CacheHits / (stats.CacheHits + stats.CacheMisses) * 100.0 
-                            : 0.0;
+                    int headerSize = Marshal.ReadInt32(ptr, 4);
+                    int driverEntrySize = Marshal.ReadInt32(ptr, 8);
+                    int returned = Marshal.ReadInt32(ptr, 16);
 
-                        return new RamDiskInfo
+                    // Entries are read at the driver's stride; a shorter entry from an older
+                    // driver would not hold a whole TempDeviceInfo
+                    if (driverEntrySize >= entrySize)
+                    {
+                        for (int i = 0; i < returned && headerSize + (long)(i + 1) * driverEntrySize <= bytesReturned; i++)
                         {
-                            DeviceNumber = deviceNumber,
-                            DriveLetter = GetDriveLetterForDevice(deviceNumber),
-                            SizeFormatted = FormatBytes(stats.DiskSize),
-                            DeviceType = "RAM Disk",
-                            MemoryUsedFormatted = FormatBytes(stats.MemoryUsed),
-                            CacheHitRatio = $"{hitRatio:F1}%",
-                            ReadWriteInfo = $"{FormatBytes(stats.BytesRead)} / {FormatBytes(stats.BytesWritten)}",
-                            DiskSize = stats.DiskSize
-                        };
+                            devices.Add(Marshal.PtrToStructure<TempDeviceInfo>(ptr + headerSize + i * driverEntrySize));
+                        }
                     }
                 }
-                finally
-                {
-                    Marshal.FreeHGlobal(ptr);
-                    CloseHandle(handle);
-                }
             }
-            catch { }
+            finally
+            {
+                Marshal.FreeHGlobal(ptr);
+                CloseHandle(handle);
+            }
 
-            return null;
+            return devices;
         }
 
-        private string GetDriveLetterForDevice(int deviceNumber)
+        private RamDiskInfo GetRamDiskInfo(TempDeviceInfo device)
         {
-            try
-            {
-                var drives = DriveInfo.GetDrives();
-                // This is a simplified approach - in reality, you'd need to map device numbers to drive letters
-                return "N/A";
-            }
-            catch
+            var stats = device.Statistics;
+            var hitRatio = stats.CacheHits + stats.CacheMisses > 0
+                ? (double)stats.CacheHits / (stats.CacheHits + stats.CacheMisses) * 100.0
+                : 0.0;
+
+            return new RamDiskInfo
             {
-                return "N/A";
-            }
+                DeviceNumber = (int)device.DeviceNumber,
+                DriveLetter = device.DriveLetter != '\0' ? $"{device.DriveLetter}:" : "N/A",
+                SizeFormatted = FormatBytes(stats.DiskSize),
+                DeviceType = (device.CdRomType ? "CD-ROM" : device.RemovableMedia ? "Removable" : "Fixed") +
+                             (device.Encryption != 0 ? ", encrypted" : ""),
+                MemoryUsedFormatted = FormatBytes(stats.MemoryUsed),
+                CacheHitRatio = $"{hitRatio:F1}%",
+                ReadWriteInfo = $"{FormatBytes(stats.BytesRead)} / {FormatBytes(stats.BytesWritten)}",
+                DiskSize = stats.DiskSize
+            };
         }
 
         private string FormatBytes(ulong bytes)
@@ -360,7 +397,17 @@ namespace TempRamDiskGUI
                     DriveLetter = driveLetter,
                     RemovableMedia = RemovableCheckBox.IsChecked ?? false,
                     CdRomType = CdRomCheckBox.IsChecked ?? false,
-                    FileName = ""
+                    FileName = "",
+                    ChunkSize = 0,
+                    PressurePolicy = 0,
+                    SpillFileName = "",
+                    Encryption = 0,
+                    ImageMode = 0,
+                    MemoryMinimum = 0,
+                    MemoryMaximum = 0,
+                    IopsLimit = 0,
+                    BandwidthLimit = 0,
+                    QosWeight = 0
                 };
 
                 await Task.Run(() => CreateRamDisk(createData));
@@ -31,7 +31,8 @@ namespace TempRamDiskGUI
         private const uint FILE_SHARE_READ = 0x00000001;
         private const uint FILE_SHARE_WRITE = 0x00000002;
         private const uint OPEN_EXISTING = 3;
-        private const uint TEMP_IOCTL_GET_STATISTICS = 0x83000804;
+        // CTL_CODE(FILE_DEVICE_DISK, function, METHOD_BUFFERED, FILE_ANY_ACCESS), as in src/core/temp_ioctl.h
+        private const uint TEMP_IOCTL_GET_STATISTICS = (0x7 << 16) | (0x804 << 2);
         private const IntPtr INVALID_HANDLE_VALUE = (IntPtr)(-1);
 
         [StructLayout(LayoutKind.Sequential)]
@@ -47,6 +48,11 @@ namespace TempRamDiskGUI
             public ulong CacheHits;
             public ulong CacheMisses;
             public ulong EvictionCount;
+            public ulong PressureEvents;
+            public ulong BytesReclaimed;
+            public ulong CompressedChunks;
+            public ulong CompressedBytes;
+            public ulong SpilledChunks;
         }
 
         // Properties for binding
@@ -62,6 +68,8 @@ namespace TempRamDiskGUI
         public string CacheMisses { get; private set; }
         public string HitRatio { get; private set; }
         public string EvictionCount { get; private set; }
+        public string PressureEvents { get; private set; }
+        public string BytesReclaimedFormatted { get; private set; }
 
         public StatsWindow(int deviceNumber)
         {
@@ -128,6 +136,8 @@ namespace TempRamDiskGUI
             CacheHits = stats.CacheHits.ToString("N0");
             CacheMisses = stats.CacheMisses.ToString("N0");
             EvictionCount = stats.EvictionCount.ToString("N0");
+            PressureEvents = stats.PressureEvents.ToString("N0");
+            BytesReclaimedFormatted = FormatBytes(stats.BytesReclaimed);
 
             var totalAccess = stats.CacheHits + stats.CacheMisses;
             if (totalAccess > 0)
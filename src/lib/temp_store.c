@@ -0,0 +1,228 @@
+// TEMP block store library.
+// Wraps the driver's memory manager, built against temp_portable.h, behind the
+// plain C interface in temp_store.h. The manager does its own per-bucket
+// locking, so the wrapper only validates requests and keeps byte counters.
+
+#include "../core/temp_core.h"
+#include "temp_store.h"
+
+#define TEMP_STORE_POOL_TAG 'SpmT' // 'TmpS' backwards
+
+// Largest piece handed to the manager at once so the sector count fits a ULONG
+#define TEMP_STORE_MAX_TRANSFER (1ULL << 30)
+
+struct _TEMP_STORE
+{
+    TEMP_MEMORY_MANAGER MemoryManager;
+    ULONG64 Size;
+    ULONG SectorSize;
+    ULONG SectorShift;
+    volatile LONG64 Reads;
+    volatile LONG64 Writes;
+    volatile LONG64 Trims;
+    volatile LONG64 BytesRead;
+    volatile LONG64 BytesWritten;
+};
+
+static int TempStoreResult(NTSTATUS Status)
+{
+    if (NT_SUCCESS(Status))
+    {
+        return TEMP_STORE_OK;
+    }
+
+    switch (Status)
+    {
+    case STATUS_INVALID_PARAMETER:
+        return TEMP_STORE_INVALID_PARAMETER;
+    case STATUS_INSUFFICIENT_RESOURCES:
+        return TEMP_STORE_NO_MEMORY;
+    default:
+        return TEMP_STORE_ERROR;
+    }
+}
+
+// Requests must be sector aligned and lie entirely inside the store
+static BOOLEAN TempStoreCheckRange(TEMP_STORE *Store, ULONG64 Offset, ULONG64 Length)
+{
+    ULONG64 mask = Store->SectorSize - 1;
+
+    return (Offset & mask) == 0 && (Length & mask) == 0 &&
+           Offset <= Store->Size && Length <= Store->Size - Offset;
+}
+
+int TempStoreCreate(const TEMP_STORE_CONFIG *Config, TEMP_STORE **Store)
+{
+    if (!Config || !Store)
+    {
+        return TEMP_STORE_INVALID_PARAMETER;
+    }
+
+    *Store = NULL;
+
+    ULONG sectorSize = Config->SectorSize ? Config->SectorSize : 512;
+    ULONG chunkSize = Config->ChunkSize ? Config->ChunkSize : TEMP_DEFAULT_CHUNK_SIZE;
+
+    if ((sectorSize != 512 && sectorSize != 4096) ||
+        Config->Size == 0 || (Config->Size & (sectorSize - 1)) != 0)
+    {
+        return TEMP_STORE_INVALID_PARAMETER;
+    }
+
+    TEMP_STORE *store = (TEMP_STORE *)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(TEMP_STORE), TEMP_STORE_POOL_TAG);
+    if (!store)
+    {
+        return TEMP_STORE_NO_MEMORY;
+    }
+
+    NTSTATUS status = TempInitializeMemoryManager(&store->MemoryManager, Config->Size, chunkSize);
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePool(store);
+        return TempStoreResult(status);
+    }
+
+    store->Size = Config->Size;
+    store->SectorSize = sectorSize;
+    store->SectorShift = TempLog2(sectorSize);
+
+    *Store = store;
+    return TEMP_STORE_OK;
+}
+
+void TempStoreDestroy(TEMP_STORE *Store)
+{
+    if (!Store)
+    {
+        return;
+    }
+
+    TempCleanupMemoryManager(&Store->MemoryManager);
+    ExFreePool(Store);
+}
+
+int TempStoreRead(TEMP_STORE *Store, uint64_t Offset, void *Buffer, size_t Length)
+{
+    if (!Store || !Buffer || !TempStoreCheckRange(Store, Offset, Length))
+    {
+        return TEMP_STORE_INVALID_PARAMETER;
+    }
+
+    PUCHAR bufferPtr = (PUCHAR)Buffer;
+    ULONG64 remaining = Length;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    InterlockedIncrement64(&Store->Reads);
+
+    while (remaining > 0 && NT_SUCCESS(status))
+    {
+        ULONG64 transfer = remaining < TEMP_STORE_MAX_TRANSFER ? remaining : TEMP_STORE_MAX_TRANSFER;
+
+        status = TempReadSectors(&Store->MemoryManager,
+                                 Offset >> Store->SectorShift,
+                                 (ULONG)(transfer >> Store->SectorShift),
+                                 bufferPtr,
+                                 Store->SectorSize);
+
+        Offset += transfer;
+        bufferPtr += transfer;
+        remaining -= transfer;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        InterlockedAdd64(&Store->BytesRead, (LONG64)Length);
+    }
+
+    return TempStoreResult(status);
+}
+
+int TempStoreWrite(TEMP_STORE *Store, uint64_t Offset, const void *Buffer, size_t Length)
+{
+    if (!Store || !Buffer || !TempStoreCheckRange(Store, Offset, Length))
+    {
+        return TEMP_STORE_INVALID_PARAMETER;
+    }
+
+    // The manager only reads from the buffer on writes
+    PUCHAR bufferPtr = (PUCHAR)Buffer;
+    ULONG64 remaining = Length;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    InterlockedIncrement64(&Store->Writes);
+
+    while (remaining > 0 && NT_SUCCESS(status))
+    {
+        ULONG64 transfer = remaining < TEMP_STORE_MAX_TRANSFER ? remaining : TEMP_STORE_MAX_TRANSFER;
+
+        status = TempWriteSectors(&Store->MemoryManager,
+                                  Offset >> Store->SectorShift,
+                                  (ULONG)(transfer >> Store->SectorShift),
+                                  bufferPtr,
+                                  Store->SectorSize);
+
+        Offset += transfer;
+        bufferPtr += transfer;
+        remaining -= transfer;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        InterlockedAdd64(&Store->BytesWritten, (LONG64)Length);
+    }
+
+    return TempStoreResult(status);
+}
+
+int TempStoreTrim(TEMP_STORE *Store, uint64_t Offset, uint64_t Length)
+{
+    if (!Store || !TempStoreCheckRange(Store, Offset, Length))
+    {
+        return TEMP_STORE_INVALID_PARAMETER;
+    }
+
+    if (Length == 0)
+    {
+        return TEMP_STORE_OK;
+    }
+
+    InterlockedIncrement64(&Store->Trims);
+
+    return TempStoreResult(TempTrimSectors(&Store->MemoryManager,
+                                           Offset >> Store->SectorShift,
+                                           Length >> Store->SectorShift,
+                                           Store->SectorSize));
+}
+
+int TempStoreGetStats(TEMP_STORE *Store, TEMP_STORE_STATS *Stats)
+{
+    if (!Store || !Stats || Stats->Size < FIELD_OFFSET(TEMP_STORE_STATS, StoreSize))
+    {
+        return TEMP_STORE_INVALID_PARAMETER;
+    }
+
+    TEMP_MEMORY_STATISTICS usage;
+    TEMP_STORE_STATS stats;
+
+    TempQueryMemoryUsage(&Store->MemoryManager, &usage);
+
+    RtlZeroMemory(&stats, sizeof(stats));
+    stats.Version = TEMP_STORE_STATS_VERSION;
+    stats.Size = Stats->Size < sizeof(stats) ? Stats->Size : (uint32_t)sizeof(stats);
+    stats.StoreSize = Store->Size;
+    stats.Reads = (uint64_t)Store->Reads;
+    stats.Writes = (uint64_t)Store->Writes;
+    stats.Trims = (uint64_t)Store->Trims;
+    stats.BytesRead = (uint64_t)Store->BytesRead;
+    stats.BytesWritten = (uint64_t)Store->BytesWritten;
+    stats.AllocatedChunks = usage.AllocatedChunks;
+    stats.ResidentBytes = usage.ResidentDataBytes + usage.CompressedDataBytes;
+    stats.InUseBytes = usage.InUseDataBytes;
+    stats.MetadataBytes = usage.MetadataBytes;
+    stats.AllocationFailures = usage.AllocationFailures;
+    stats.ChunkSize = usage.ChunkSize;
+    stats.BucketCount = usage.BucketCount;
+
+    RtlCopyMemory(Stats, &stats, stats.Size);
+    return TEMP_STORE_OK;
+}
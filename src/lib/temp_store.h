@@ -0,0 +1,84 @@
+#ifndef TEMP_STORE_H
+#define TEMP_STORE_H
+
+// TEMP block store library: the driver's memory manager as an in-process,
+// thread-safe block store for Linux and Windows user mode. The header is
+// self-contained so callers never see the driver's types.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#if defined(_WIN32) && defined(TEMP_STORE_DLL)
+#ifdef TEMP_STORE_BUILD
+#define TEMP_STORE_API __declspec(dllexport)
+#else
+#define TEMP_STORE_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define TEMP_STORE_API __attribute__((visibility("default")))
+#else
+#define TEMP_STORE_API
+#endif
+
+// Result codes
+#define TEMP_STORE_OK 0
+#define TEMP_STORE_INVALID_PARAMETER (-1) // Bad argument, misaligned or out of range
+#define TEMP_STORE_NO_MEMORY (-2)         // Chunk or metadata allocation failed
+#define TEMP_STORE_ERROR (-3)             // Any other memory manager failure
+
+#define TEMP_STORE_STATS_VERSION 1
+
+    typedef struct _TEMP_STORE TEMP_STORE;
+
+    typedef struct _TEMP_STORE_CONFIG
+    {
+        uint64_t Size;       // Store size in bytes, a multiple of SectorSize
+        uint32_t SectorSize; // 512 or 4096; 0 selects 512
+        uint32_t ChunkSize;  // Power of two from 16KB to 2MB; 0 selects 64KB
+    } TEMP_STORE_CONFIG;
+
+    // The caller sets Size to sizeof its structure before calling TempStoreGetStats;
+    // later versions only append fields and fill as much as the caller's Size holds.
+    typedef struct _TEMP_STORE_STATS
+    {
+        uint32_t Version; // TEMP_STORE_STATS_VERSION
+        uint32_t Size;
+        uint64_t StoreSize;
+        uint64_t Reads;
+        uint64_t Writes;
+        uint64_t Trims;
+        uint64_t BytesRead;
+        uint64_t BytesWritten;
+        uint64_t AllocatedChunks;
+        uint64_t ResidentBytes;  // Chunk data held in memory
+        uint64_t InUseBytes;     // Written, untrimmed bytes
+        uint64_t MetadataBytes;  // Buckets, slot arrays and chunk headers
+        uint64_t AllocationFailures;
+        uint32_t ChunkSize;
+        uint32_t BucketCount;
+    } TEMP_STORE_STATS;
+
+    // Creates a zero-filled store. Memory is only committed as blocks are written.
+    TEMP_STORE_API int TempStoreCreate(const TEMP_STORE_CONFIG *Config, TEMP_STORE **Store);
+    TEMP_STORE_API void TempStoreDestroy(TEMP_STORE *Store);
+
+    // Offset and Length must be multiples of the sector size and stay inside the
+    // store. Any number of threads may call these concurrently.
+    TEMP_STORE_API int TempStoreRead(TEMP_STORE *Store, uint64_t Offset, void *Buffer, size_t Length);
+    TEMP_STORE_API int TempStoreWrite(TEMP_STORE *Store, uint64_t Offset, const void *Buffer, size_t Length);
+
+    // Discards a range; it reads back as zeros and whole chunks are freed
+    TEMP_STORE_API int TempStoreTrim(TEMP_STORE *Store, uint64_t Offset, uint64_t Length);
+
+    TEMP_STORE_API int TempStoreGetStats(TEMP_STORE *Store, TEMP_STORE_STATS *Stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TEMP_STORE_H
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Compares temp_nbd attached as /dev/nbdX with the kernel's brd RAM disk and a
+# file on tmpfs, running the same fio jobs against each on this machine.
+# Needs root, fio, nbd-client and the nbd and brd modules.
+#
+# Usage: nbd_bench.sh [path/to/temp_nbd]
+# Environment: SIZE_MB (default 1024), RUNTIME seconds per job (default 10),
+# CONNECTIONS to the NBD server (default 4), NBD_DEVICE (default /dev/nbd0).
+
+set -eu
+
+TEMP_NBD=${1:-build/linux/temp_nbd}
+SIZE_MB=${SIZE_MB:-1024}
+RUNTIME=${RUNTIME:-10}
+CONNECTIONS=${CONNECTIONS:-4}
+NBD_DEVICE=${NBD_DEVICE:-/dev/nbd0}
+WORK=$(mktemp -d /tmp/temp_nbd_bench.XXXXXX)
+SOCKET=$WORK/temp.sock
+SERVER_PID=
+
+for tool in fio nbd-client python3; do
+    command -v $tool >/dev/null || { echo "$tool is required" >&2; exit 1; }
+done
+[ "$(id -u)" -eq 0 ] || { echo "run as root" >&2; exit 1; }
+
+cleanup() {
+    nbd-client -d "$NBD_DEVICE" >/dev/null 2>&1 || true
+    [ -n "$SERVER_PID" ] && kill -INT "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null || true
+    umount "$WORK/tmpfs" 2>/dev/null || true
+    rmmod brd 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# Targets: brd, a tmpfs file and the NBD device
+modprobe nbd
+modprobe brd rd_nr=1 rd_size=$((SIZE_MB * 1024))
+mkdir -p "$WORK/tmpfs"
+mount -t tmpfs -o size=$((SIZE_MB + 64))m tmpfs "$WORK/tmpfs"
+fallocate -l ${SIZE_MB}M "$WORK/tmpfs/file"
+
+"$TEMP_NBD" --socket "$SOCKET" --size ${SIZE_MB}M --max-connections "$CONNECTIONS" >"$WORK/server.log" &
+SERVER_PID=$!
+while [ ! -S "$SOCKET" ]; do
+    kill -0 "$SERVER_PID" 2>/dev/null || { cat "$WORK/server.log" >&2; exit 1; }
+    sleep 0.1
+done
+nbd-client -unix "$SOCKET" "$NBD_DEVICE" -N temp -b 4096 -C "$CONNECTIONS"
+
+# name:rw:bs:iodepth:jobs
+JOBS="randread-4k:randread:4k:32:4 randwrite-4k:randwrite:4k:32:4 read-1m:read:1m:8:1 write-1m:write:1m:8:1"
+
+printf '%-8s %-14s %12s %10s %10s\n' target job IOPS MB/s p99_us
+for target in brd:/dev/ram0 tmpfs:$WORK/tmpfs/file nbd:$NBD_DEVICE; do
+    name=${target%%:*}
+    path=${target#*:}
+    # tmpfs has no O_DIRECT on older kernels; its page cache is the RAM store anyway
+    direct=1
+    [ "$name" = tmpfs ] && direct=0
+
+    for job in $JOBS; do
+        IFS=: read -r label rw bs depth jobs <<EOF
+$job
+EOF
+        fio --name="$label" --filename="$path" --rw="$rw" --bs="$bs" --iodepth="$depth" \
+            --numjobs="$jobs" --ioengine=libaio --direct=$direct --size=${SIZE_MB}M \
+            --time_based --runtime="$RUNTIME" --group_reporting --output-format=json \
+            >"$WORK/fio.json"
+        python3 - "$name" "$label" "$WORK/fio.json" <<'EOF'
+import json, sys
+job = json.load(open(sys.argv[3]))["jobs"][0]
+side = job["read"] if job["read"]["io_bytes"] else job["write"]
+p99 = side["clat_ns"]["percentile"].get("99.000000", 0) / 1000
+print("%-8s %-14s %12.0f %10.1f %10.1f" % (sys.argv[1], sys.argv[2], side["iops"], side["bw_bytes"] / 1048576, p99))
+EOF
+    done
+done
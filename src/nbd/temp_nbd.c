@@ -0,0 +1,1015 @@
+// NBD server frontend for the TEMP memory manager.
+// Serves one block store (src/lib) over the Network Block Device protocol on a
+// Unix socket or a TCP port, so nbd-client can attach it as /dev/nbdX and Linux
+// hosts run the same RAM engine as the Windows driver. Handshake is fixed
+// newstyle with NBD_OPT_GO; transmission uses simple replies.
+//
+// Every connection has a receive thread that parses requests as fast as they
+// arrive and a few workers that serve them, so requests are pipelined and may
+// complete out of order. All connections share the store, whose per-bucket locks
+// make that safe, and a write is in memory before it is acknowledged, so FLUSH
+// has nothing left to do and the export can advertise multi-connection support.
+
+#include "../lib/temp_store.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Handshake
+#define NBD_INIT_MAGIC 0x4e42444d41474943ULL  // "NBDMAGIC"
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL  // "IHAVEOPT"
+#define NBD_REP_MAGIC 0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE 0x0001
+#define NBD_FLAG_NO_ZEROES 0x0002
+#define NBD_FLAG_C_NO_ZEROES 0x00000002
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001U
+#define NBD_REP_ERR_INVALID 0x80000003U
+#define NBD_REP_ERR_UNKNOWN 0x80000006U
+
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_NAME 1
+#define NBD_INFO_BLOCK_SIZE 3
+
+// Transmission
+#define NBD_REQUEST_MAGIC 0x25609513U
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698U
+
+#define NBD_FLAG_HAS_FLAGS 0x0001
+#define NBD_FLAG_SEND_FLUSH 0x0004
+#define NBD_FLAG_SEND_FUA 0x0008
+#define NBD_FLAG_SEND_TRIM 0x0020
+#define NBD_FLAG_SEND_WRITE_ZEROES 0x0040
+#define NBD_FLAG_CAN_MULTI_CONN 0x0100
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+#define NBD_CMD_WRITE_ZEROES 6
+
+#define NBD_EIO 5
+#define NBD_ENOMEM 12
+#define NBD_EINVAL 22
+#define NBD_ENOSPC 28
+
+#define NBD_DEFAULT_PORT "10809"
+#define NBD_MAX_OPTION_LENGTH 4096
+#define NBD_MAX_REQUEST_LENGTH (32U * 1024 * 1024)
+#define NBD_PREFERRED_BLOCK_SIZE 4096
+#define NBD_MAX_WORKERS 64
+#define NBD_MAX_QUEUE_DEPTH 1024
+
+typedef struct
+{
+    uint64_t Size;
+    uint32_t SectorSize;
+    uint32_t ChunkSize;
+    const char *SocketPath; // Unix socket when set, TCP otherwise
+    const char *Host;
+    const char *Port;
+    const char *ExportName;
+    uint32_t Workers;
+    uint32_t QueueDepth;
+    uint32_t MaxConnections;
+} NBD_OPTIONS;
+
+typedef struct _NBD_CONNECTION NBD_CONNECTION;
+
+typedef struct
+{
+    const NBD_OPTIONS *Options;
+    TEMP_STORE *Store;
+    int Listener;
+    pthread_mutex_t Lock;
+    pthread_cond_t Idle;         // Signalled when the last connection ends
+    NBD_CONNECTION *Connections; // Open connections, so shutdown can end them
+    uint32_t ConnectionCount;
+} NBD_SERVER;
+
+typedef struct _NBD_REQUEST
+{
+    struct _NBD_REQUEST *Next;
+    uint16_t Flags;
+    uint16_t Type;
+    uint64_t Handle; // Opaque cookie echoed in the reply
+    uint64_t Offset;
+    uint32_t Length;
+    uint8_t *Data;   // Write payload, or the read buffer once served
+} NBD_REQUEST;
+
+struct _NBD_CONNECTION
+{
+    NBD_CONNECTION *Next;
+    NBD_CONNECTION *Previous;
+    NBD_SERVER *Server;
+    int Socket;
+    pthread_mutex_t Lock;
+    pthread_cond_t Ready; // Requests queued or closing
+    pthread_cond_t Space; // Queue dropped below the depth limit
+    NBD_REQUEST *Head;
+    NBD_REQUEST *Tail;
+    uint32_t Queued;
+    int Closing;
+    pthread_mutex_t SendLock; // Keeps each reply's header and data together
+    int SendFailed;
+    uint32_t WorkerCount;
+    pthread_t Workers[NBD_MAX_WORKERS];
+};
+
+static volatile sig_atomic_t NbdStopping;
+
+static uint64_t NbdParseSize(const char *Text)
+{
+    char *end;
+    uint64_t value = strtoull(Text, &end, 10);
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value <<= 10;
+        break;
+    case 'm':
+    case 'M':
+        value <<= 20;
+        break;
+    case 'g':
+    case 'G':
+        value <<= 30;
+        break;
+    }
+
+    return value;
+}
+
+static int NbdRecvAll(int Socket, void *Buffer, size_t Length)
+{
+    uint8_t *p = (uint8_t *)Buffer;
+
+    while (Length > 0)
+    {
+        ssize_t received = recv(Socket, p, Length, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return -1;
+        }
+
+        p += received;
+        Length -= (size_t)received;
+    }
+
+    return 0;
+}
+
+static int NbdSendVector(int Socket, struct iovec *Vector, int Count)
+{
+    while (Count > 0)
+    {
+        struct msghdr message = {0};
+        message.msg_iov = Vector;
+        message.msg_iovlen = (size_t)Count;
+
+        ssize_t sent = sendmsg(Socket, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+
+        // Skip whatever was fully sent and trim a partially sent entry
+        while (Count > 0 && (size_t)sent >= Vector->iov_len)
+        {
+            sent -= (ssize_t)Vector->iov_len;
+            Vector++;
+            Count--;
+        }
+        if (Count > 0)
+        {
+            Vector->iov_base = (uint8_t *)Vector->iov_base + sent;
+            Vector->iov_len -= (size_t)sent;
+        }
+    }
+
+    return 0;
+}
+
+static int NbdSendAll(int Socket, const void *Buffer, size_t Length)
+{
+    struct iovec vector = {(void *)Buffer, Length};
+    return NbdSendVector(Socket, &vector, 1);
+}
+
+static void NbdPut16(uint8_t *p, uint16_t Value)
+{
+    Value = htobe16(Value);
+    memcpy(p, &Value, sizeof(Value));
+}
+
+static void NbdPut32(uint8_t *p, uint32_t Value)
+{
+    Value = htobe32(Value);
+    memcpy(p, &Value, sizeof(Value));
+}
+
+static void NbdPut64(uint8_t *p, uint64_t Value)
+{
+    Value = htobe64(Value);
+    memcpy(p, &Value, sizeof(Value));
+}
+
+static uint16_t NbdGet16(const uint8_t *p)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return be16toh(value);
+}
+
+static uint32_t NbdGet32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return be32toh(value);
+}
+
+static uint64_t NbdGet64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return be64toh(value);
+}
+
+static uint16_t NbdTransmissionFlags(void)
+{
+    return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+           NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN;
+}
+
+static int NbdSendOptionReply(int Socket, uint32_t Option, uint32_t Type, const void *Data, uint32_t Length)
+{
+    uint8_t header[20];
+    NbdPut64(header, NBD_REP_MAGIC);
+    NbdPut32(header + 8, Option);
+    NbdPut32(header + 12, Type);
+    NbdPut32(header + 16, Length);
+
+    struct iovec vector[2] = {{header, sizeof(header)}, {(void *)Data, Length}};
+    return NbdSendVector(Socket, vector, Length ? 2 : 1);
+}
+
+static int NbdNameMatches(const NBD_OPTIONS *Options, const uint8_t *Name, uint32_t Length)
+{
+    // An empty name selects the default export
+    return Length == 0 ||
+           (Length == strlen(Options->ExportName) && memcmp(Name, Options->ExportName, Length) == 0);
+}
+
+// Answers NBD_OPT_INFO and NBD_OPT_GO. Returns 1 when GO succeeded and the
+// connection moves to transmission, 0 to keep negotiating, -1 on a broken client.
+static int NbdReplyInfo(NBD_CONNECTION *Connection, uint32_t Option, const uint8_t *Data, uint32_t Length)
+{
+    const NBD_OPTIONS *options = Connection->Server->Options;
+    int socket = Connection->Socket;
+    uint8_t info[14];
+
+    if (Length < 6 || NbdGet32(Data) > Length - 6 ||
+        (uint64_t)NbdGet32(Data) + 6 + 2ULL * NbdGet16(Data + 4 + NbdGet32(Data)) != Length)
+    {
+        return NbdSendOptionReply(socket, Option, NBD_REP_ERR_INVALID, NULL, 0) ? -1 : 0;
+    }
+
+    uint32_t nameLength = NbdGet32(Data);
+    const uint8_t *name = Data + 4;
+    uint16_t requestCount = NbdGet16(Data + 4 + nameLength);
+    const uint8_t *requests = Data + 6 + nameLength;
+
+    if (!NbdNameMatches(options, name, nameLength))
+    {
+        return NbdSendOptionReply(socket, Option, NBD_REP_ERR_UNKNOWN, NULL, 0) ? -1 : 0;
+    }
+
+    // The block sizes go out whether or not the client asked: the store refuses
+    // requests that are not whole sectors, and a client that knows never sends them
+    NbdPut16(info, NBD_INFO_BLOCK_SIZE);
+    NbdPut32(info + 2, options->SectorSize);
+    NbdPut32(info + 6, options->SectorSize > NBD_PREFERRED_BLOCK_SIZE ? options->SectorSize : NBD_PREFERRED_BLOCK_SIZE);
+    NbdPut32(info + 10, NBD_MAX_REQUEST_LENGTH);
+    if (NbdSendOptionReply(socket, Option, NBD_REP_INFO, info, 14))
+    {
+        return -1;
+    }
+
+    // The client's requested information next, then the mandatory export info
+    for (uint16_t i = 0; i < requestCount; i++)
+    {
+        uint16_t type = NbdGet16(requests + 2 * i);
+
+        if (type == NBD_INFO_NAME)
+        {
+            uint8_t reply[2 + NBD_MAX_OPTION_LENGTH];
+            size_t exportLength = strlen(options->ExportName);
+
+            NbdPut16(reply, NBD_INFO_NAME);
+            memcpy(reply + 2, options->ExportName, exportLength);
+            if (NbdSendOptionReply(socket, Option, NBD_REP_INFO, reply, (uint32_t)(2 + exportLength)))
+            {
+                return -1;
+            }
+        }
+    }
+
+    NbdPut16(info, NBD_INFO_EXPORT);
+    NbdPut64(info + 2, options->Size);
+    NbdPut16(info + 10, NbdTransmissionFlags());
+
+    if (NbdSendOptionReply(socket, Option, NBD_REP_INFO, info, 12) ||
+        NbdSendOptionReply(socket, Option, NBD_REP_ACK, NULL, 0))
+    {
+        return -1;
+    }
+
+    return Option == NBD_OPT_GO ? 1 : 0;
+}
+
+// Fixed newstyle negotiation. Returns 0 once the client entered transmission.
+static int NbdNegotiate(NBD_CONNECTION *Connection)
+{
+    const NBD_OPTIONS *options = Connection->Server->Options;
+    int socket = Connection->Socket;
+    uint8_t greeting[18];
+    uint8_t clientFlags[4];
+    uint8_t data[NBD_MAX_OPTION_LENGTH];
+
+    NbdPut64(greeting, NBD_INIT_MAGIC);
+    NbdPut64(greeting + 8, NBD_OPTS_MAGIC);
+    NbdPut16(greeting + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+
+    if (NbdSendAll(socket, greeting, sizeof(greeting)) || NbdRecvAll(socket, clientFlags, sizeof(clientFlags)))
+    {
+        return -1;
+    }
+
+    int noZeroes = (NbdGet32(clientFlags) & NBD_FLAG_C_NO_ZEROES) != 0;
+
+    for (;;)
+    {
+        uint8_t header[16];
+
+        if (NbdRecvAll(socket, header, sizeof(header)) || NbdGet64(header) != NBD_OPTS_MAGIC)
+        {
+            return -1;
+        }
+
+        uint32_t option = NbdGet32(header + 8);
+        uint32_t length = NbdGet32(header + 12);
+
+        if (length > sizeof(data) || NbdRecvAll(socket, data, length))
+        {
+            return -1;
+        }
+
+        switch (option)
+        {
+        case NBD_OPT_EXPORT_NAME:
+        {
+            // The old way in has no error reply; an unknown name just ends the connection
+            uint8_t reply[10 + 124] = {0};
+
+            if (!NbdNameMatches(options, data, length))
+            {
+                return -1;
+            }
+
+            NbdPut64(reply, options->Size);
+            NbdPut16(reply + 8, NbdTransmissionFlags());
+            return NbdSendAll(socket, reply, noZeroes ? 10 : sizeof(reply));
+        }
+
+        case NBD_OPT_ABORT:
+            NbdSendOptionReply(socket, option, NBD_REP_ACK, NULL, 0);
+            return -1;
+
+        case NBD_OPT_LIST:
+        {
+            uint8_t reply[4 + NBD_MAX_OPTION_LENGTH];
+            size_t exportLength = strlen(options->ExportName);
+
+            NbdPut32(reply, (uint32_t)exportLength);
+            memcpy(reply + 4, options->ExportName, exportLength);
+            if (NbdSendOptionReply(socket, option, NBD_REP_SERVER, reply, (uint32_t)(4 + exportLength)) ||
+                NbdSendOptionReply(socket, option, NBD_REP_ACK, NULL, 0))
+            {
+                return -1;
+            }
+            break;
+        }
+
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+        {
+            int result = NbdReplyInfo(Connection, option, data, length);
+            if (result != 0)
+            {
+                return result > 0 ? 0 : -1;
+            }
+            break;
+        }
+
+        default:
+            // Structured replies, metadata contexts and TLS are not offered
+            if (NbdSendOptionReply(socket, option, NBD_REP_ERR_UNSUP, NULL, 0))
+            {
+                return -1;
+            }
+            break;
+        }
+    }
+}
+
+// Writes and trims past the end are answered with NBD_ENOSPC before they reach the
+// store, so an invalid parameter here is a request that is not whole sectors
+static uint32_t NbdError(int Result)
+{
+    switch (Result)
+    {
+    case TEMP_STORE_OK:
+        return 0;
+    case TEMP_STORE_INVALID_PARAMETER:
+        return NBD_EINVAL;
+    case TEMP_STORE_NO_MEMORY:
+        return NBD_ENOMEM;
+    default:
+        return NBD_EIO;
+    }
+}
+
+// Serves one request and sends its reply. A failed send ends the connection.
+static void NbdServeRequest(NBD_CONNECTION *Connection, NBD_REQUEST *Request)
+{
+    NBD_SERVER *server = Connection->Server;
+    uint64_t size = server->Options->Size;
+    uint32_t error = 0;
+
+    switch (Request->Type)
+    {
+    case NBD_CMD_READ:
+        if (Request->Length > NBD_MAX_REQUEST_LENGTH)
+        {
+            error = NBD_EINVAL;
+        }
+        else if (!(Request->Data = (uint8_t *)malloc(Request->Length ? Request->Length : 1)))
+        {
+            error = NBD_ENOMEM;
+        }
+        else
+        {
+            error = NbdError(TempStoreRead(server->Store, Request->Offset, Request->Data, Request->Length));
+        }
+        break;
+
+    case NBD_CMD_WRITE:
+        // FUA needs nothing extra: the data is in the store before the reply goes out
+        if (Request->Offset > size || Request->Length > size - Request->Offset)
+        {
+            error = NBD_ENOSPC;
+        }
+        else
+        {
+            error = NbdError(TempStoreWrite(server->Store, Request->Offset, Request->Data, Request->Length));
+        }
+        break;
+
+    case NBD_CMD_FLUSH:
+        break;
+
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+        // Trimmed ranges read back as zeros, so both drop the range's chunks
+        if (Request->Offset > size || Request->Length > size - Request->Offset)
+        {
+            error = NBD_ENOSPC;
+        }
+        else
+        {
+            error = NbdError(TempStoreTrim(server->Store, Request->Offset, Request->Length));
+        }
+        break;
+
+    default:
+        error = NBD_EINVAL;
+        break;
+    }
+
+    uint8_t reply[16];
+    NbdPut32(reply, NBD_SIMPLE_REPLY_MAGIC);
+    NbdPut32(reply + 4, error);
+    NbdPut64(reply + 8, Request->Handle);
+
+    struct iovec vector[2] = {{reply, sizeof(reply)}, {Request->Data, Request->Length}};
+    int count = Request->Type == NBD_CMD_READ && error == 0 ? 2 : 1;
+
+    pthread_mutex_lock(&Connection->SendLock);
+    if (!Connection->SendFailed && NbdSendVector(Connection->Socket, vector, count))
+    {
+        // Wake the receive thread so the connection winds down
+        Connection->SendFailed = 1;
+        shutdown(Connection->Socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&Connection->SendLock);
+}
+
+static void *NbdWorker(void *Context)
+{
+    NBD_CONNECTION *connection = (NBD_CONNECTION *)Context;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&connection->Lock);
+        while (!connection->Head && !connection->Closing)
+        {
+            pthread_cond_wait(&connection->Ready, &connection->Lock);
+        }
+
+        // Requests already received are still served after a disconnect
+        NBD_REQUEST *request = connection->Head;
+        if (!request)
+        {
+            pthread_mutex_unlock(&connection->Lock);
+            return NULL;
+        }
+
+        connection->Head = request->Next;
+        if (!connection->Head)
+        {
+            connection->Tail = NULL;
+        }
+        connection->Queued--;
+        pthread_cond_signal(&connection->Space);
+        pthread_mutex_unlock(&connection->Lock);
+
+        NbdServeRequest(connection, request);
+        free(request->Data);
+        free(request);
+    }
+}
+
+static void NbdQueueRequest(NBD_CONNECTION *Connection, NBD_REQUEST *Request)
+{
+    pthread_mutex_lock(&Connection->Lock);
+    while (Connection->Queued >= Connection->Server->Options->QueueDepth)
+    {
+        pthread_cond_wait(&Connection->Space, &Connection->Lock);
+    }
+
+    if (Connection->Tail)
+    {
+        Connection->Tail->Next = Request;
+    }
+    else
+    {
+        Connection->Head = Request;
+    }
+    Connection->Tail = Request;
+    Connection->Queued++;
+    pthread_cond_signal(&Connection->Ready);
+    pthread_mutex_unlock(&Connection->Lock);
+}
+
+// Receives requests until the client disconnects or breaks the protocol
+static void NbdReceiveRequests(NBD_CONNECTION *Connection)
+{
+    for (;;)
+    {
+        uint8_t header[28];
+
+        if (NbdRecvAll(Connection->Socket, header, sizeof(header)) || NbdGet32(header) != NBD_REQUEST_MAGIC)
+        {
+            return;
+        }
+
+        NBD_REQUEST *request = (NBD_REQUEST *)calloc(1, sizeof(NBD_REQUEST));
+        if (!request)
+        {
+            return;
+        }
+
+        request->Flags = NbdGet16(header + 4);
+        request->Type = NbdGet16(header + 6);
+        request->Handle = NbdGet64(header + 8);
+        request->Offset = NbdGet64(header + 16);
+        request->Length = NbdGet32(header + 24);
+
+        if (request->Type == NBD_CMD_DISC)
+        {
+            free(request);
+            return;
+        }
+
+        if (request->Type == NBD_CMD_WRITE)
+        {
+            // The payload has to be drained to find the next request, so an
+            // oversized one ends the connection
+            if (request->Length > NBD_MAX_REQUEST_LENGTH ||
+                !(request->Data = (uint8_t *)malloc(request->Length ? request->Length : 1)) ||
+                NbdRecvAll(Connection->Socket, request->Data, request->Length))
+            {
+                free(request->Data);
+                free(request);
+                return;
+            }
+        }
+
+        NbdQueueRequest(Connection, request);
+    }
+}
+
+static NBD_CONNECTION *NbdAddConnection(NBD_SERVER *Server, int Socket)
+{
+    NBD_CONNECTION *connection = (NBD_CONNECTION *)calloc(1, sizeof(NBD_CONNECTION));
+    if (!connection)
+    {
+        return NULL;
+    }
+
+    connection->Server = Server;
+    connection->Socket = Socket;
+    pthread_mutex_init(&connection->Lock, NULL);
+    pthread_mutex_init(&connection->SendLock, NULL);
+    pthread_cond_init(&connection->Ready, NULL);
+    pthread_cond_init(&connection->Space, NULL);
+
+    pthread_mutex_lock(&Server->Lock);
+    connection->Next = Server->Connections;
+    if (Server->Connections)
+    {
+        Server->Connections->Previous = connection;
+    }
+    Server->Connections = connection;
+    Server->ConnectionCount++;
+    pthread_mutex_unlock(&Server->Lock);
+
+    return connection;
+}
+
+static void NbdRemoveConnection(NBD_CONNECTION *Connection)
+{
+    NBD_SERVER *server = Connection->Server;
+
+    pthread_mutex_lock(&server->Lock);
+    if (Connection->Previous)
+    {
+        Connection->Previous->Next = Connection->Next;
+    }
+    else
+    {
+        server->Connections = Connection->Next;
+    }
+    if (Connection->Next)
+    {
+        Connection->Next->Previous = Connection->Previous;
+    }
+    if (--server->ConnectionCount == 0)
+    {
+        pthread_cond_broadcast(&server->Idle);
+    }
+    pthread_mutex_unlock(&server->Lock);
+}
+
+static void *NbdConnectionThread(void *Context)
+{
+    NBD_CONNECTION *connection = (NBD_CONNECTION *)Context;
+    const NBD_OPTIONS *options = connection->Server->Options;
+
+    if (NbdNegotiate(connection) == 0)
+    {
+        for (uint32_t i = 0; i < options->Workers; i++)
+        {
+            if (pthread_create(&connection->Workers[i], NULL, NbdWorker, connection) != 0)
+            {
+                break;
+            }
+            connection->WorkerCount++;
+        }
+
+        if (connection->WorkerCount > 0)
+        {
+            NbdReceiveRequests(connection);
+        }
+
+        pthread_mutex_lock(&connection->Lock);
+        connection->Closing = 1;
+        pthread_cond_broadcast(&connection->Ready);
+        pthread_mutex_unlock(&connection->Lock);
+
+        for (uint32_t i = 0; i < connection->WorkerCount; i++)
+        {
+            pthread_join(connection->Workers[i], NULL);
+        }
+    }
+
+    NbdRemoveConnection(connection);
+    close(connection->Socket);
+    pthread_mutex_destroy(&connection->Lock);
+    pthread_mutex_destroy(&connection->SendLock);
+    pthread_cond_destroy(&connection->Ready);
+    pthread_cond_destroy(&connection->Space);
+    free(connection);
+    return NULL;
+}
+
+static int NbdListen(const NBD_OPTIONS *Options)
+{
+    int listener;
+
+    if (Options->SocketPath)
+    {
+        struct sockaddr_un address = {0};
+
+        if (strlen(Options->SocketPath) >= sizeof(address.sun_path))
+        {
+            fprintf(stderr, "Socket path too long: %s\n", Options->SocketPath);
+            return -1;
+        }
+
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, Options->SocketPath);
+        unlink(Options->SocketPath);
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, 16))
+        {
+            perror("unix socket");
+            return -1;
+        }
+
+        return listener;
+    }
+
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int error = getaddrinfo(Options->Host, Options->Port, &hints, &result);
+    if (error)
+    {
+        fprintf(stderr, "%s:%s: %s\n", Options->Host, Options->Port, gai_strerror(error));
+        return -1;
+    }
+
+    int reuse = 1;
+    listener = socket(result->ai_family, SOCK_STREAM, 0);
+    if (listener < 0 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ||
+        bind(listener, result->ai_addr, result->ai_addrlen) || listen(listener, 16))
+    {
+        perror("tcp socket");
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    freeaddrinfo(result);
+    return listener;
+}
+
+static void NbdStop(int Signal)
+{
+    (void)Signal;
+    NbdStopping = 1;
+}
+
+static void NbdUsage(const char *Program)
+{
+    printf("Usage: %s [options]\n", Program);
+    printf("  --size <size>          Export size (default: 1G)\n");
+    printf("  --chunk-size <size>    Chunk size (default: 64K)\n");
+    printf("  --sector-size <n>      Minimum block size, 512 or 4096 (default: 512)\n");
+    printf("  --socket <path>        Listen on a Unix socket\n");
+    printf("  --listen [host:]port   Listen on TCP (default: 127.0.0.1:%s)\n", NBD_DEFAULT_PORT);
+    printf("  --name <export>        Export name (default: temp)\n");
+    printf("  --workers <n>          Threads serving each connection, 1 to %d (default: 4)\n", NBD_MAX_WORKERS);
+    printf("  --queue-depth <n>      Requests queued per connection, 1 to %d (default: 128)\n", NBD_MAX_QUEUE_DEPTH);
+    printf("  --max-connections <n>  Concurrent connections (default: 16)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    NBD_OPTIONS options = {0};
+    char hostBuffer[256];
+
+    options.Size = 1ULL << 30;
+    options.SectorSize = 512;
+    options.Host = "127.0.0.1";
+    options.Port = NBD_DEFAULT_PORT;
+    options.ExportName = "temp";
+    options.Workers = 4;
+    options.QueueDepth = 128;
+    options.MaxConnections = 16;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            options.Size = NbdParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc)
+        {
+            options.ChunkSize = (uint32_t)NbdParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sector-size") == 0 && i + 1 < argc)
+        {
+            options.SectorSize = (uint32_t)NbdParseSize(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+        {
+            options.SocketPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+        {
+            const char *colon = strrchr(argv[++i], ':');
+
+            if (colon && (size_t)(colon - argv[i]) < sizeof(hostBuffer))
+            {
+                memcpy(hostBuffer, argv[i], (size_t)(colon - argv[i]));
+                hostBuffer[colon - argv[i]] = '\0';
+                options.Host = hostBuffer;
+                options.Port = colon + 1;
+            }
+            else
+            {
+                options.Port = argv[i];
+            }
+        }
+        else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+        {
+            options.ExportName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+        {
+            options.Workers = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc)
+        {
+            options.QueueDepth = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc)
+        {
+            options.MaxConnections = (uint32_t)atoi(argv[++i]);
+        }
+        else
+        {
+            NbdUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.Workers == 0 || options.Workers > NBD_MAX_WORKERS ||
+        options.QueueDepth == 0 || options.QueueDepth > NBD_MAX_QUEUE_DEPTH ||
+        options.MaxConnections == 0 || strlen(options.ExportName) > NBD_MAX_OPTION_LENGTH - 4)
+    {
+        printf("Invalid worker count, queue depth, connection limit or export name\n");
+        return 1;
+    }
+
+    TEMP_STORE_CONFIG config = {options.Size, options.SectorSize, options.ChunkSize};
+    NBD_SERVER server = {0};
+
+    server.Options = &options;
+    pthread_mutex_init(&server.Lock, NULL);
+    pthread_cond_init(&server.Idle, NULL);
+    if (TempStoreCreate(&config, &server.Store) != TEMP_STORE_OK)
+    {
+        printf("Failed to create a %llu byte store\n", (unsigned long long)options.Size);
+        return 1;
+    }
+
+    server.Listener = NbdListen(&options);
+    if (server.Listener < 0)
+    {
+        TempStoreDestroy(server.Store);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept
+    struct sigaction action = {0};
+    action.sa_handler = NbdStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (options.SocketPath)
+    {
+        printf("Serving %llu bytes as '%s' on %s\n", (unsigned long long)options.Size, options.ExportName, options.SocketPath);
+    }
+    else
+    {
+        printf("Serving %llu bytes as '%s' on %s:%s\n", (unsigned long long)options.Size, options.ExportName, options.Host, options.Port);
+    }
+    fflush(stdout);
+
+    while (!NbdStopping)
+    {
+        int socket = accept(server.Listener, NULL, NULL);
+        if (socket < 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&server.Lock);
+        int full = server.ConnectionCount >= options.MaxConnections;
+        pthread_mutex_unlock(&server.Lock);
+
+        if (full)
+        {
+            close(socket);
+            continue;
+        }
+
+        if (!options.SocketPath)
+        {
+            int noDelay = 1;
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+
+        NBD_CONNECTION *connection = NbdAddConnection(&server, socket);
+        pthread_t thread;
+
+        if (!connection)
+        {
+            close(socket);
+            continue;
+        }
+
+        if (pthread_create(&thread, NULL, NbdConnectionThread, connection) != 0)
+        {
+            NbdRemoveConnection(connection);
+            close(socket);
+            free(connection);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    close(server.Listener);
+    if (options.SocketPath)
+    {
+        unlink(options.SocketPath);
+    }
+
+    // End the remaining connections; requests already received are still served
+    pthread_mutex_lock(&server.Lock);
+    for (NBD_CONNECTION *connection = server.Connections; connection; connection = connection->Next)
+    {
+        shutdown(connection->Socket, SHUT_RD);
+    }
+    while (server.ConnectionCount > 0)
+    {
+        pthread_cond_wait(&server.Idle, &server.Lock);
+    }
+    pthread_mutex_unlock(&server.Lock);
+
+    TEMP_STORE_STATS stats;
+    stats.Size = sizeof(stats);
+    if (TempStoreGetStats(server.Store, &stats) == TEMP_STORE_OK)
+    {
+        printf("%llu reads (%llu bytes), %llu writes (%llu bytes), %llu trims; %llu chunks allocated\n",
+               (unsigned long long)stats.Reads, (unsigned long long)stats.BytesRead,
+               (unsigned long long)stats.Writes, (unsigned long long)stats.BytesWritten,
+               (unsigned long long)stats.Trims, (unsigned long long)stats.AllocatedChunks);
+    }
+
+    TempStoreDestroy(server.Store);
+    return 0;
+}